@@ -0,0 +1,185 @@
+#include "assigner.h"
+#include "math.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace sketch {
+
+/****************************************
+ *   c[ROWS x NR] += a[ROWS x kc] * b[kc x NR]
+ *
+ *   a rows are lda apart, b is a packed panel slice, c rows are ldc apart.
+ */
+template <uint64_t ROWS, uint64_t NR>
+static inline void micro_kernel(uint64_t kc, const float* a, uint64_t lda, const float* b, float* c, uint64_t ldc) {
+    float acc[ROWS][NR] = {};
+
+    for (uint64_t p = 0; p < kc; p++) {
+        const float* bp = b + p * NR;
+        for (uint64_t i = 0; i < ROWS; i++) {
+            const float av = a[i * lda + p];
+            for (uint64_t j = 0; j < NR; j++) {
+                acc[i][j] += av * bp[j];
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < ROWS; i++) {
+        for (uint64_t j = 0; j < NR; j++) {
+            c[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+Ret CentroidAssigner::init(DatasetType type, uint64_t dim, const uint8_t* centroids, uint64_t centroid_size, uint64_t count) {
+    if (!centroids || count == 0 || dim == 0) {
+        return "Invalid centroids for assignment";
+    }
+
+    if (count > std::numeric_limits<uint32_t>::max()) {
+        return "Too many centroids for assignment";
+    }
+
+    type_ = type;
+    dim_ = dim;
+    count_ = count;
+    centroids_ = centroids;
+    centroid_size_ = centroid_size;
+    panels_count_ = (count + NR - 1) / NR;
+
+    // Padding centroids are zero vectors with an infinite norm, so they never win the argmin.
+    packed_.assign(panels_count_ * dim_ * NR, 0.0f);
+    norms_.assign(panels_count_ * NR, std::numeric_limits<float>::infinity());
+
+    std::vector<float> centroid(dim_);
+    for (uint64_t i = 0; i < count_; i++) {
+        convert_to_float(type_, get_centroid(i), centroid.data(), dim_);
+
+        double norm = 0.0;
+        float* panel = packed_.data() + (i / NR) * dim_ * NR;
+        for (uint64_t d = 0; d < dim_; d++) {
+            panel[d * NR + i % NR] = centroid[d];
+            norm += static_cast<double>(centroid[d]) * centroid[d];
+        }
+        norms_[i] = static_cast<float>(norm);
+    }
+
+    return 0;
+}
+
+uint32_t CentroidAssigner::refine(const uint8_t* record, uint32_t best, uint32_t second) const {
+    if (second >= count_) {
+        return best;
+    }
+
+    const double best_dist = distance_L2_square(type_, record, get_centroid(best), dim_);
+    const double second_dist = distance_L2_square(type_, record, get_centroid(second), dim_);
+    if (second_dist < best_dist || (second_dist == best_dist && second < best)) {
+        return second;
+    }
+
+    return best;
+}
+
+uint32_t CentroidAssigner::find_nearest(const uint8_t* record) const {
+    // Called for every record LOAD adds to an index, the converted record reuses the buffer of the thread.
+    static thread_local std::vector<float> x;
+    x.resize(dim_);
+    convert_to_float(type_, record, x.data(), dim_);
+
+    float best_score = std::numeric_limits<float>::infinity();
+    float second_score = std::numeric_limits<float>::infinity();
+    uint32_t best = 0;
+    uint32_t second = std::numeric_limits<uint32_t>::max();
+
+    float dots[NR];
+    for (uint64_t panel = 0; panel < panels_count_; panel++) {
+        memset(dots, 0, sizeof(dots));
+        const float* b = packed_.data() + panel * dim_ * NR;
+        for (uint64_t k0 = 0; k0 < dim_; k0 += KC) {
+            const uint64_t kc = std::min(KC, dim_ - k0);
+            micro_kernel<1, NR>(kc, x.data() + k0, dim_, b + k0 * NR, dots, NR);
+        }
+
+        for (uint64_t j = 0; j < NR; j++) {
+            const uint32_t index = panel * NR + j;
+            const float score = norms_[index] - 2.0f * dots[j];
+            if (score < best_score) {
+                second_score = best_score;
+                second = best;
+                best_score = score;
+                best = index;
+            } else if (score < second_score) {
+                second_score = score;
+                second = index;
+            }
+        }
+    }
+
+    return refine(record, best, second);
+}
+
+void CentroidAssigner::find_nearest(const uint8_t* const* records, uint64_t count, uint32_t* cluster_ids) const {
+    const uint64_t padded_count = panels_count_ * NR;
+
+    std::vector<float> a(MC * dim_);
+    std::vector<float> c(MC * NC);
+    std::vector<float> best_score(MC);
+    std::vector<float> second_score(MC);
+    std::vector<uint32_t> best(MC);
+    std::vector<uint32_t> second(MC);
+
+    for (uint64_t m0 = 0; m0 < count; m0 += MC) {
+        const uint64_t mc = std::min(MC, count - m0);
+        const uint64_t mc_padded = (mc + MR - 1) / MR * MR;
+
+        for (uint64_t i = 0; i < mc; i++) {
+            convert_to_float(type_, records[m0 + i], a.data() + i * dim_, dim_);
+        }
+        std::fill(a.begin() + mc * dim_, a.begin() + mc_padded * dim_, 0.0f);
+
+        std::fill(best_score.begin(), best_score.end(), std::numeric_limits<float>::infinity());
+        std::fill(second_score.begin(), second_score.end(), std::numeric_limits<float>::infinity());
+        std::fill(best.begin(), best.end(), 0);
+        std::fill(second.begin(), second.end(), std::numeric_limits<uint32_t>::max());
+
+        for (uint64_t n0 = 0; n0 < padded_count; n0 += NC) {
+            const uint64_t nc = std::min(NC, padded_count - n0);
+            std::fill(c.begin(), c.end(), 0.0f);
+
+            for (uint64_t k0 = 0; k0 < dim_; k0 += KC) {
+                const uint64_t kc = std::min(KC, dim_ - k0);
+                for (uint64_t j0 = 0; j0 < nc; j0 += NR) {
+                    const float* b = packed_.data() + ((n0 + j0) / NR * dim_ + k0) * NR;
+                    for (uint64_t i0 = 0; i0 < mc_padded; i0 += MR) {
+                        micro_kernel<MR, NR>(kc, a.data() + i0 * dim_ + k0, dim_, b, c.data() + i0 * NC + j0, NC);
+                    }
+                }
+            }
+
+            for (uint64_t i = 0; i < mc; i++) {
+                const float* row = c.data() + i * NC;
+                for (uint64_t j = 0; j < nc; j++) {
+                    const uint32_t index = n0 + j;
+                    const float score = norms_[index] - 2.0f * row[j];
+                    if (score < best_score[i]) {
+                        second_score[i] = best_score[i];
+                        second[i] = best[i];
+                        best_score[i] = score;
+                        best[i] = index;
+                    } else if (score < second_score[i]) {
+                        second_score[i] = score;
+                        second[i] = index;
+                    }
+                }
+            }
+        }
+
+        for (uint64_t i = 0; i < mc; i++) {
+            cluster_ids[m0 + i] = refine(records[m0 + i], best[i], second[i]);
+        }
+    }
+}
+
+} // namespace sketch
@@ -0,0 +1,58 @@
+#pragma once
+#include "shared_types.h"
+#include <cstdint>
+#include <vector>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Blocked nearest-centroid assignment.
+ *
+ *   |x - c|^2 = |x|^2 - 2 x.c + |c|^2
+ *
+ *   Centroid norms are computed once, dot products for a tile of records against a tile of
+ *   centroids are computed by a register-blocked SGEMM micro-kernel, and argmin is taken per row.
+ *   |x|^2 does not affect the argmin, so it is never computed.
+ *
+ *   The float decomposition loses precision when |x| is much larger than |x - c|, so the two best
+ *   candidates of every row are re-ranked with the exact distance_L2_square().
+ *
+ *   Centroids layout (packed_):
+ *   |------------------+------------------+-----|
+ *     panel 0: dim x NR  panel 1: dim x NR  ...
+ */
+class CentroidAssigner {
+public:
+    Ret init(DatasetType type, uint64_t dim, const uint8_t* centroids, uint64_t centroid_size, uint64_t count);
+
+    uint64_t centroids_count() const { return count_; }
+
+    uint32_t find_nearest(const uint8_t* record) const;
+    void find_nearest(const uint8_t* const* records, uint64_t count, uint32_t* cluster_ids) const;
+
+private:
+    static constexpr uint64_t MR = 4;    // Records per micro-tile.
+    static constexpr uint64_t NR = 16;   // Centroids per panel.
+    static constexpr uint64_t KC = 256;  // Dimensions per k-block.
+    static constexpr uint64_t MC = 64;   // Records per block.
+    static constexpr uint64_t NC = 256;  // Centroids per block.
+
+    static_assert(MC % MR == 0 && NC % NR == 0);
+
+private:
+    DatasetType type_ = DatasetType::f32;
+    uint64_t dim_ = 0;
+    uint64_t count_ = 0;
+    uint64_t panels_count_ = 0;
+    const uint8_t* centroids_ = nullptr;
+    uint64_t centroid_size_ = 0;
+    std::vector<float> packed_;
+    std::vector<float> norms_;
+
+private:
+    const uint8_t* get_centroid(uint64_t index) const { return centroids_ + index * centroid_size_; }
+    uint32_t refine(const uint8_t* record, uint32_t best, uint32_t second) const;
+};
+
+} // namespace sketch
@@ -0,0 +1,170 @@
+#include "binary_codes.h"
+#include <algorithm>
+#include <cstring>
+#include <experimental/scope>
+#include <format>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+namespace sketch {
+
+static constexpr uint64_t MagicNumber = 0x42494E43;
+static constexpr uint64_t HeaderCount = 3;
+
+template <typename T>
+static void encode_signs(const T* data, uint64_t dim, uint64_t* code) {
+    for (uint64_t i = 0; i < dim; i++) {
+        if (static_cast<float>(data[i]) > 0.0f) {
+            code[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+//static
+void BinaryCodes::encode(DatasetType type, uint64_t dim, const uint8_t* data, uint64_t* code) {
+    std::fill(code, code + words_count(dim), 0);
+
+    switch (type) {
+        case DatasetType::f32: encode_signs(reinterpret_cast<const float*>(data), dim, code); break;
+        case DatasetType::f16: encode_signs(reinterpret_cast<const float16_t*>(data), dim, code); break;
+        case DatasetType::u8: encode_signs(data, dim, code); break;
+    }
+}
+
+void BinaryCodes::init(uint64_t dim) {
+    dim_ = dim;
+    words_ = words_count(dim);
+    count_ = 0;
+    chunks_.clear();
+    changed_.clear();
+}
+
+uint64_t BinaryCodes::chunk_count(uint64_t chunk_index) const {
+    return std::min(ChunkRecords, count_ - chunk_index * ChunkRecords);
+}
+
+void BinaryCodes::set(uint64_t record_id, DatasetType type, const uint8_t* data) {
+    const uint64_t chunk_index = record_id / ChunkRecords;
+    while (chunks_.size() <= chunk_index) {
+        chunks_.push_back(std::make_shared<Chunk>(ChunkRecords * words_, 0));
+        changed_.push_back(true);
+    }
+
+    // Only the owner changes its codes, a chunk still shared with a copy is cloned first.
+    auto& chunk = chunks_[chunk_index];
+    if (chunk.use_count() > 1) {
+        chunk = std::make_shared<Chunk>(*chunk);
+    }
+    changed_[chunk_index] = true;
+    count_ = std::max(count_, record_id + 1);
+
+    encode(type, dim_, data, chunk->data() + (record_id % ChunkRecords) * words_);
+}
+
+Ret BinaryCodes::read(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return std::format("Failed to open file '{}'", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    uint64_t header[HeaderCount] = { 0, 0, 0 };
+    if (fread(header, sizeof(uint64_t), HeaderCount, f) != HeaderCount || header[0] != MagicNumber) {
+        return std::format("Invalid binary codes file '{}'", path);
+    }
+
+    init(header[1]);
+    count_ = header[2];
+    const uint64_t chunks_count = (count_ + ChunkRecords - 1) / ChunkRecords;
+    for (uint64_t chunk_index = 0; chunk_index < chunks_count; chunk_index++) {
+        auto chunk = std::make_shared<Chunk>(ChunkRecords * words_, 0);
+        const uint64_t size = chunk_count(chunk_index) * words_;
+        if (fread(chunk->data(), sizeof(uint64_t), size, f) != size) {
+            init(dim_);
+            return std::format("Failed to read binary codes from file '{}'", path);
+        }
+        chunks_.push_back(std::move(chunk));
+    }
+    changed_.assign(chunks_.size(), false);
+
+    return 0;
+}
+
+Ret BinaryCodes::write(const std::string& path) {
+    const std::string temp_path = path + ".tmp";
+    FILE* f = fopen(temp_path.c_str(), "w");
+    if (!f) {
+        return std::format("Failed to open file '{}' for writing", temp_path);
+    }
+
+    const uint64_t header[HeaderCount] = { MagicNumber, dim_, count_ };
+    bool written = fwrite(header, sizeof(uint64_t), HeaderCount, f) == HeaderCount;
+    for (uint64_t chunk_index = 0; written && chunk_index < chunks_.size(); chunk_index++) {
+        const uint64_t size = chunk_count(chunk_index) * words_;
+        written = fwrite(chunks_[chunk_index]->data(), sizeof(uint64_t), size, f) == size;
+    }
+    if (fclose(f) != 0 || !written) {
+        remove(temp_path.c_str());
+        return std::format("Failed to write binary codes to file '{}'", path);
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        return std::format("Failed to rename binary codes file '{}'", temp_path);
+    }
+
+    changed_.assign(chunks_.size(), false);
+    return 0;
+}
+
+static bool write_at(int fd, const void* data, uint64_t size, uint64_t offset) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    uint64_t written = 0;
+    while (written < size) {
+        const ssize_t ret = pwrite(fd, bytes + written, size - written, offset + written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += ret;
+    }
+
+    return true;
+}
+
+Ret BinaryCodes::write_changes(const std::string& path) {
+    const int fd = open(path.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return write(path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        close(fd);
+    });
+
+    // A failed write leaves the chunks marked, the next write retries them.
+    for (uint64_t chunk_index = 0; chunk_index < chunks_.size(); chunk_index++) {
+        if (!changed_[chunk_index]) {
+            continue;
+        }
+
+        const uint64_t offset = (HeaderCount + chunk_index * ChunkRecords * words_) * sizeof(uint64_t);
+        if (!write_at(fd, chunks_[chunk_index]->data(), chunk_count(chunk_index) * words_ * sizeof(uint64_t), offset)) {
+            return std::format("Failed to write binary codes to file '{}': {}", path, strerror(errno));
+        }
+    }
+
+    const uint64_t header[HeaderCount] = { MagicNumber, dim_, count_ };
+    if (!write_at(fd, header, sizeof(header), 0)) {
+        return std::format("Failed to write binary codes header to file '{}': {}", path, strerror(errno));
+    }
+
+    changed_.assign(chunks_.size(), false);
+    return 0;
+}
+
+} // namespace sketch
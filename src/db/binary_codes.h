@@ -0,0 +1,61 @@
+#pragma once
+#include "shared_types.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   1-bit sign codes of the records of a node, bit i of a code is set when dimension i is positive.
+ *   Codes are scanned by Hamming distance to pick the candidates of an exact re-rank, at 1/32 of
+ *   the bytes of f32 records.
+ *
+ *   File layout:
+ *   |-------+-----+-------+------------------------------------------|
+ *     magic   dim   count   codes[count] (words_count() u64 words each)
+ *
+ *   Codes are indexed by record id, a deleted record keeps its code until the id is reused.
+ *   They are kept in chunks of ChunkRecords codes shared between copies, a copy clones a chunk
+ *   on its first change, so LOAD copies only the chunks it writes while queries scan the published
+ *   codes. The changed chunks are tracked and write_changes() writes only them.
+ */
+class BinaryCodes {
+public:
+    static constexpr uint64_t ChunkRecords = 4096;
+
+    void init(uint64_t dim);
+    Ret read(const std::string& path);
+    // Writes all codes aside and renames the file, so that a failed write keeps the previous codes.
+    Ret write(const std::string& path);
+    // Writes the chunks changed since the last write in place and the header last.
+    Ret write_changes(const std::string& path);
+
+    static uint64_t words_count(uint64_t dim) { return (dim + 63) / 64; }
+    static void encode(DatasetType type, uint64_t dim, const uint8_t* data, uint64_t* code);
+
+    uint64_t dim() const { return dim_; }
+    uint64_t count() const { return count_; }
+    uint64_t words() const { return words_; }
+
+    const uint64_t* get(uint64_t record_id) const {
+        return chunks_[record_id / ChunkRecords]->data() + (record_id % ChunkRecords) * words_;
+    }
+    void set(uint64_t record_id, DatasetType type, const uint8_t* data);
+
+private:
+    using Chunk = std::vector<uint64_t>;
+
+    uint64_t dim_ = 0;
+    uint64_t words_ = 0;
+    uint64_t count_ = 0;
+    std::vector<std::shared_ptr<Chunk>> chunks_;
+    std::vector<bool> changed_;
+
+private:
+    uint64_t chunk_count(uint64_t chunk_index) const;
+};
+
+} // namespace sketch
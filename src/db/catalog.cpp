@@ -46,7 +46,7 @@ Ret Catalog::remove() {
     return 0;
 }
 
-Ret Catalog::init() {
+Ret Catalog::init(ThreadPool* thread_pool) {
     std::filesystem::path db_path = std::filesystem::path(config_.data_path) / name_;
 
     try {
@@ -58,7 +58,7 @@ Ret Catalog::init() {
             if (entry.is_directory()) {
                 const std::string dataset_name = entry.path().filename().string();
                 auto dataset = std::make_shared<Dataset>(dataset_name, entry.path().string());
-                if (dataset->init() != 0) {
+                if (dataset->init(thread_pool) != 0) {
                     return make_error(std::format("Failed to initialize dataset '{}' in catalog '{}'", dataset_name, name_));
                 }
                 datasets_[dataset_name] = dataset;
@@ -136,4 +136,10 @@ DatasetPtr Catalog::find_dataset(const std::string_view& dataset_name) {
     return nullptr;
 }
 
+void Catalog::wait_builds() {
+    for (auto& [dataset_name, dataset] : datasets_) {
+        auto _ = dataset->wait_build();
+    }
+}
+
 } // namespace sketch
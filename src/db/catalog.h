@@ -19,13 +19,16 @@ public:
     Ret create();
     Ret remove();
 
-    Ret init();
+    // Datasets open their nodes on thread_pool.
+    Ret init(ThreadPool* thread_pool = nullptr);
 
     Ret create_dataset(const std::string_view& dataset_name, const DatasetMetadata& metadata);
     Ret drop_dataset(const std::string_view& dataset_name);
     Ret list_datasets();
 
     DatasetPtr find_dataset(const std::string_view& dataset_name);
+    // Waits for the background index builds of the datasets.
+    void wait_builds();
 
 private:
     const Config& config_;
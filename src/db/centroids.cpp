@@ -1,6 +1,8 @@
 #include "centroids.h"
 #include "ivf_builder.h"
 #include "math.h"
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <format>
@@ -16,6 +18,17 @@ namespace sketch {
 
 static constexpr uint64_t MagicNumber = 0xDEADBEEF;
 
+/****************************************
+ *   Centroids file:
+ *   |-------+---------------+-------+--------------------------|
+ *     magic   centroid_size   count   centroids[count]
+ *
+ *   Coarse file of the two-level quantizer is a centroids file followed by
+ *   (count + 1) uint32 offsets into the fine centroids, which are ordered by coarse cell:
+ *   |----------------------+-------------------------|
+ *     coarse centroids file  offsets[count + 1]
+ */
+
 Ret Centroids::init(const uint8_t* ptr, size_t memory_size) {
     if (!ptr) {
         return "Invalid centroids pointer";
@@ -78,6 +91,10 @@ void Centroids::uninit() {
         munmap(const_cast<uint8_t*>(ptr_), memory_size_);
     }
     ptr_ = nullptr;
+    assigner_ = CentroidAssigner();
+    coarse_.reset();
+    coarse_offsets_.clear();
+    hnsw_.reset();
 }
 
 const uint8_t* Centroids::operator[](size_t index) const {
@@ -91,17 +108,8 @@ const uint8_t* Centroids::get_centroid(size_t index) const {
     return ptr_ + sizeof(uint64_t) * 3 + index * centroid_size_;
 }
 
-//static
-Ret Centroids::write_centroids(const std::string& path, const IvfBuilder& builder) {
-    FILE* f = fopen(path.c_str(), "w");
-    if (!f) {
-        return std::format("Failed to open file '{}' for writing", path);
-    }
-    const std::experimental::scope_exit closer([&] {
-        fclose(f);
-    });
-
-    const uint64_t centroid_size = builder.centroids_size();
+static Ret write_centroids_data(FILE* f, const std::string& path, const IvfBuilder& builder) {
+    const uint64_t centroid_size = builder.vector_size();
     const uint64_t count = builder.centroids_count();
 
     fwrite(&MagicNumber, sizeof(MagicNumber), 1, f);
@@ -116,15 +124,156 @@ Ret Centroids::write_centroids(const std::string& path, const IvfBuilder& builde
         }
     }
 
+    return 0;
+}
+
+//static
+Ret Centroids::write_centroids(const std::string& path, const IvfBuilder& builder) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        return std::format("Failed to open file '{}' for writing", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    auto ret = write_centroids_data(f, path, builder);
+    CHECK(ret)
+
+    fflush(f);
+
+    return 0;
+}
+
+//static
+Ret Centroids::write_coarse(const std::string& path, const IvfBuilder& builder, const std::vector<uint32_t>& offsets) {
+    if (offsets.size() != builder.centroids_count() + 1) {
+        return "Invalid coarse offsets count";
+    }
+
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        return std::format("Failed to open file '{}' for writing", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    auto ret = write_centroids_data(f, path, builder);
+    CHECK(ret)
+
+    if (fwrite(offsets.data(), sizeof(uint32_t), offsets.size(), f) != offsets.size()) {
+        return std::format("Failed to write coarse offsets to file '{}'", path);
+    }
+
     fflush(f);
 
     return 0;
 }
 
-uint16_t Centroids::find_nearest_centroid(const uint8_t* data, const DatasetType type, const uint16_t dim) const {
-    uint16_t nearest_centroid = 0;
+Ret Centroids::init_coarse(const std::string& path) {
+    if (!ptr_) {
+        return "Centroids not initialized";
+    }
+
+    auto coarse = std::make_unique<Centroids>();
+    auto ret = coarse->init(path);
+    CHECK(ret)
+
+    const uint64_t count = coarse->centroids_count();
+    const uint64_t offsets_pos = sizeof(uint64_t) * 3 + count * coarse->centroid_size();
+    if (coarse->memory_size_ < offsets_pos + (count + 1) * sizeof(uint32_t)) {
+        return std::format("Invalid coarse offsets size in file '{}'", path);
+    }
+
+    std::vector<uint32_t> offsets(count + 1);
+    memcpy(offsets.data(), coarse->ptr_ + offsets_pos, offsets.size() * sizeof(uint32_t));
+    if (count == 0 || offsets.front() != 0 || offsets.back() != size_ || !std::is_sorted(offsets.begin(), offsets.end())) {
+        return std::format("Invalid coarse offsets in file '{}'", path);
+    }
+
+    coarse_ = std::move(coarse);
+    coarse_offsets_ = std::move(offsets);
+
+    return 0;
+}
+
+//static
+Ret Centroids::write_hnsw(const std::string& path, const IvfBuilder& builder, ThreadPool* thread_pool) {
+    const HnswVectors vectors {
+        .data = builder.get_centroid(0),
+        .stride = builder.vector_size(),
+        .count = builder.centroids_count(),
+    };
+
+    std::vector<uint32_t> ids(vectors.count);
+    for (uint32_t i = 0; i < ids.size(); i++) {
+        ids[i] = i;
+    }
+
+    return Hnsw::build(path, builder.type(), builder.dim(), vectors, ids, HnswParams(), thread_pool);
+}
+
+Ret Centroids::init_hnsw(const std::string& path) {
+    if (!ptr_) {
+        return "Centroids not initialized";
+    }
+
+    auto hnsw = std::make_unique<Hnsw>();
+    auto ret = hnsw->init(path);
+    CHECK(ret)
+
+    if (hnsw->count() != size_) {
+        return std::format("HNSW graph in file '{}' does not match centroids", path);
+    }
+
+    hnsw_ = std::move(hnsw);
+    return 0;
+}
+
+Ret Centroids::init_assigner(const DatasetType type, const uint16_t dim) {
+    if (!ptr_) {
+        return "Centroids not initialized";
+    }
+
+    // Fine centroids of a two-level quantizer are only searched within the nearest coarse cells.
+    if (coarse_) {
+        return 0;
+    }
+
+    return assigner_.init(type, dim, get_centroid(0), centroid_size_, size_);
+}
+
+void Centroids::find_nearest_cells(const uint8_t* data, const DatasetType type, const uint16_t dim,
+        std::vector<uint32_t>& cells, uint64_t nprobes) const {
+    coarse_->find_nearest_clusters(data, type, dim, cells, std::min<uint64_t>(nprobes, coarse_->centroids_count()));
+}
+
+uint32_t Centroids::find_nearest_centroid(const uint8_t* data, const DatasetType type, const uint16_t dim) const {
+    if (assigner_.centroids_count() > 0) {
+        return assigner_.find_nearest(data);
+    }
+
+    uint32_t nearest_centroid = 0;
     double min_dist = std::numeric_limits<double>::max();
 
+    if (coarse_) {
+        std::vector<uint32_t> cells;
+        find_nearest_cells(data, type, dim, cells, CoarseAssignProbes);
+
+        for (const auto cell : cells) {
+            for (uint64_t i = coarse_offsets_[cell]; i < coarse_offsets_[cell + 1]; i++) {
+                double dist = distance_L2_square(type, data, get_centroid(i), dim);
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    nearest_centroid = i;
+                }
+            }
+        }
+
+        return nearest_centroid;
+    }
+
     for (uint64_t i = 0; i < size_; i++) {
         double dist = distance_L2_square(type, data, get_centroid(i), dim);
         if (dist < min_dist) {
@@ -136,13 +285,41 @@ uint16_t Centroids::find_nearest_centroid(const uint8_t* data, const DatasetType
     return nearest_centroid;       
 }
 
+void Centroids::find_nearest_centroids(const uint8_t* const* data, uint64_t count, uint32_t* cluster_ids,
+        const DatasetType type, const uint16_t dim) const {
+    if (assigner_.centroids_count() > 0) {
+        assigner_.find_nearest(data, count, cluster_ids);
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        cluster_ids[i] = find_nearest_centroid(data[i], type, dim);
+    }
+}
+
 void Centroids::find_nearest_clusters(const uint8_t* data, const DatasetType type, const uint16_t dim,
-        std::vector<uint16_t>& cluster_ids, uint64_t nprobes) const {
+        std::vector<uint32_t>& cluster_ids, uint64_t nprobes) const {
 
     cluster_ids.clear();
+
+    if (hnsw_) {
+        const HnswVectors vectors {
+            .data = get_centroid(0),
+            .stride = centroid_size_,
+            .count = size_,
+        };
+
+        std::vector<DistItem> items;
+        hnsw_->search(data, type, dim, vectors, nprobes, std::max(nprobes, HnswSearchEf), items);
+        for (const auto& item : items) {
+            cluster_ids.push_back(item.record_id);
+        }
+        return;
+    }
+
     std::priority_queue<DistItem> pq;
 
-    for (uint64_t i = 0; i < size_; i++) {
+    auto probe = [&](uint64_t i) {
         DistItem di;
         di.record_id = i;
         di.dist = distance_L2_square(type, data, get_centroid(i), dim);
@@ -151,7 +328,25 @@ void Centroids::find_nearest_clusters(const uint8_t* data, const DatasetType typ
         if (pq.size() > nprobes) {
             pq.pop();
         }
+    };
+
+    if (coarse_) {
+        // Visit enough coarse cells to cover nprobes fine clusters twice over on average.
+        const uint64_t coarse_count = coarse_->centroids_count();
+        const uint64_t cells_count = std::max(CoarseAssignProbes, 2 * ((nprobes * coarse_count + size_ - 1) / size_));
 
+        std::vector<uint32_t> cells;
+        find_nearest_cells(data, type, dim, cells, cells_count);
+
+        for (const auto cell : cells) {
+            for (uint64_t i = coarse_offsets_[cell]; i < coarse_offsets_[cell + 1]; i++) {
+                probe(i);
+            }
+        }
+    } else {
+        for (uint64_t i = 0; i < size_; i++) {
+            probe(i);
+        }
     }
 
     while (!pq.empty()) {
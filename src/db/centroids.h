@@ -1,12 +1,17 @@
 #pragma once
+#include "assigner.h"
+#include "hnsw.h"
 #include "shared_types.h"
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
 
 namespace sketch {
 
 class IvfBuilder;
+class ThreadPool;
 
 class Centroids {
 public:
@@ -22,10 +27,25 @@ public:
     const uint8_t* get_centroid(size_t index) const;
 
     static Ret write_centroids(const std::string& path, const IvfBuilder& builder);
+    static Ret write_coarse(const std::string& path, const IvfBuilder& builder, const std::vector<uint32_t>& offsets);
+    static Ret write_hnsw(const std::string& path, const IvfBuilder& builder, ThreadPool* thread_pool = nullptr);
 
-    uint16_t find_nearest_centroid(const uint8_t* data, const DatasetType type, const uint16_t dim) const;
+    Ret init_coarse(const std::string& path);
+    bool is_two_level() const { return coarse_ != nullptr; }
+    size_t coarse_count() const { return coarse_ ? coarse_->centroids_count() : 0; }
+
+    Ret init_hnsw(const std::string& path);
+    bool has_hnsw() const { return hnsw_ != nullptr; }
+
+    // HNSW graph over the centroids is built starting from this number of centroids.
+    static constexpr uint64_t HnswMinCentroids = 4096;
+
+    Ret init_assigner(const DatasetType type, const uint16_t dim);
+    uint32_t find_nearest_centroid(const uint8_t* data, const DatasetType type, const uint16_t dim) const;
+    void find_nearest_centroids(const uint8_t* const* data, uint64_t count, uint32_t* cluster_ids,
+            const DatasetType type, const uint16_t dim) const;
     void find_nearest_clusters(const uint8_t* data, const DatasetType type, const uint16_t dim,
-            std::vector<uint16_t>& cluster_ids, uint64_t nprobes) const;
+            std::vector<uint32_t>& cluster_ids, uint64_t nprobes) const;
 
 private:
     const uint8_t* ptr_ = nullptr;
@@ -33,7 +53,22 @@ private:
     size_t size_ = 0;
     size_t centroid_size_ = 0;
     bool mapped_file_ = false;
+    CentroidAssigner assigner_;
+
+    // Two-level quantizer: fine centroids of coarse cell i are [coarse_offsets_[i], coarse_offsets_[i+1]).
+    std::unique_ptr<Centroids> coarse_;
+    std::vector<uint32_t> coarse_offsets_;
 
+    // Coarse cells visited when a record is assigned to a fine centroid.
+    static constexpr uint64_t CoarseAssignProbes = 4;
+
+    // Graph used to select the probed clusters, assignment of records stays exact.
+    std::unique_ptr<Hnsw> hnsw_;
+    static constexpr uint64_t HnswSearchEf = 64;
+
+private:
+    void find_nearest_cells(const uint8_t* data, const DatasetType type, const uint16_t dim,
+            std::vector<uint32_t>& cells, uint64_t nprobes) const;
 };
 
 template <typename T>
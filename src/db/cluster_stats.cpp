@@ -0,0 +1,155 @@
+#include "cluster_stats.h"
+#include <algorithm>
+#include <cmath>
+#include <experimental/scope>
+#include <format>
+#include <numeric>
+#include <sstream>
+#include <stdio.h>
+
+namespace sketch {
+
+static constexpr uint64_t MagicNumber = 0x43535441;
+static constexpr uint64_t HeaderCount = 2;
+
+void ClusterStats::init(uint64_t clusters_count) {
+    sizes_.assign(clusters_count, 0);
+    error_sums_.assign(clusters_count, 0.0);
+    radii_.assign(clusters_count, 0.0f);
+}
+
+void ClusterStats::add(uint32_t cluster_id, double dist_square) {
+    sizes_[cluster_id]++;
+    error_sums_[cluster_id] += dist_square;
+    radii_[cluster_id] = std::max(radii_[cluster_id], static_cast<float>(std::sqrt(dist_square)));
+}
+
+Ret ClusterStats::merge(const ClusterStats& other) {
+    if (sizes_.empty()) {
+        init(other.clusters_count());
+    }
+
+    if (other.clusters_count() != clusters_count()) {
+        return std::format("Cluster statistics of {} and {} clusters cannot be merged", clusters_count(), other.clusters_count());
+    }
+
+    for (uint64_t i = 0; i < clusters_count(); i++) {
+        sizes_[i] += other.sizes_[i];
+        error_sums_[i] += other.error_sums_[i];
+        radii_[i] = std::max(radii_[i], other.radii_[i]);
+    }
+
+    return 0;
+}
+
+Ret ClusterStats::read(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return std::format("Failed to open file '{}'", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    uint64_t header[HeaderCount] = { 0, 0 };
+    if (fread(header, sizeof(uint64_t), HeaderCount, f) != HeaderCount || header[0] != MagicNumber) {
+        return std::format("Invalid cluster statistics file '{}'", path);
+    }
+
+    init(header[1]);
+    if (fread(sizes_.data(), sizeof(uint64_t), sizes_.size(), f) != sizes_.size() ||
+        fread(error_sums_.data(), sizeof(double), error_sums_.size(), f) != error_sums_.size() ||
+        fread(radii_.data(), sizeof(float), radii_.size(), f) != radii_.size()) {
+        init(0);
+        return std::format("Failed to read cluster statistics from file '{}'", path);
+    }
+
+    return 0;
+}
+
+Ret ClusterStats::write(const std::string& path) const {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        return std::format("Failed to open file '{}' for writing", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    const uint64_t header[HeaderCount] = { MagicNumber, clusters_count() };
+    if (fwrite(header, sizeof(uint64_t), HeaderCount, f) != HeaderCount ||
+        fwrite(sizes_.data(), sizeof(uint64_t), sizes_.size(), f) != sizes_.size() ||
+        fwrite(error_sums_.data(), sizeof(double), error_sums_.size(), f) != error_sums_.size() ||
+        fwrite(radii_.data(), sizeof(float), radii_.size(), f) != radii_.size()) {
+        return std::format("Failed to write cluster statistics to file '{}'", path);
+    }
+
+    return 0;
+}
+
+uint64_t ClusterStats::records_count() const {
+    return std::accumulate(sizes_.begin(), sizes_.end(), uint64_t(0));
+}
+
+double ClusterStats::imbalance_factor() const {
+    const double total = static_cast<double>(records_count());
+    if (total == 0.0) {
+        return 0.0;
+    }
+
+    double sum_square = 0.0;
+    for (const auto size : sizes_) {
+        sum_square += static_cast<double>(size) * size;
+    }
+    return clusters_count() * sum_square / (total * total);
+}
+
+double ClusterStats::quantization_mse() const {
+    const uint64_t total = records_count();
+    if (total == 0) {
+        return 0.0;
+    }
+
+    return std::accumulate(error_sums_.begin(), error_sums_.end(), 0.0) / total;
+}
+
+std::string ClusterStats::report(uint64_t largest_count) const {
+    std::stringstream sstream;
+    sstream << "clusters: " << clusters_count() << "\n";
+    sstream << "records: " << records_count() << "\n";
+    sstream << "imbalance factor: " << imbalance_factor() << "\n";
+    sstream << "quantization mse: " << quantization_mse() << "\n";
+
+    if (clusters_count() == 0) {
+        return sstream.str();
+    }
+
+    std::vector<uint64_t> sorted(sizes_);
+    std::sort(sorted.begin(), sorted.end());
+    const uint64_t empty_count = std::count(sorted.begin(), sorted.end(), 0);
+    sstream << "list size: min " << sorted.front() << ", median " << sorted[sorted.size() / 2]
+            << ", p99 " << sorted[sorted.size() * 99 / 100] << ", max " << sorted.back()
+            << ", empty " << empty_count << "\n";
+
+    const float max_radius = *std::max_element(radii_.begin(), radii_.end());
+    const double mean_radius = std::accumulate(radii_.begin(), radii_.end(), 0.0) / radii_.size();
+    sstream << "radius: mean " << mean_radius << ", max " << max_radius << "\n";
+
+    std::vector<uint32_t> order(clusters_count());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        return sizes_[a] > sizes_[b];
+    });
+
+    sstream << "largest lists:\n";
+    for (uint64_t i = 0; i < order.size() && i < largest_count; i++) {
+        const uint32_t cluster_id = order[i];
+        const double mse = sizes_[cluster_id] ? error_sums_[cluster_id] / sizes_[cluster_id] : 0.0;
+        sstream << "  cluster " << cluster_id << ": size " << sizes_[cluster_id]
+                << ", radius " << radii_[cluster_id] << ", mse " << mse << "\n";
+    }
+
+    return sstream.str();
+}
+
+} // namespace sketch
@@ -0,0 +1,49 @@
+#pragma once
+#include "shared_types.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Statistics of the posting lists of an IVF index, written next to the lists of every node and
+ *   merged over the nodes into index_N/cluster_stats of the dataset.
+ *
+ *   File layout:
+ *   |-------+----------------+------------------------+-----------------------------+------------------------|
+ *     magic   clusters_count   sizes[clusters] (u64)    error_sums[clusters] (f64)    radii[clusters] (f32)
+ *
+ *   error_sums[i] is the sum of the squared distances of the records of cluster i to its centroid,
+ *   radii[i] is the largest of these distances.
+ */
+class ClusterStats {
+public:
+    void init(uint64_t clusters_count);
+    void add(uint32_t cluster_id, double dist_square);
+    Ret merge(const ClusterStats& other);
+
+    Ret read(const std::string& path);
+    Ret write(const std::string& path) const;
+
+    uint64_t clusters_count() const { return sizes_.size(); }
+    uint64_t size(uint32_t cluster_id) const { return sizes_[cluster_id]; }
+    float radius(uint32_t cluster_id) const { return radii_[cluster_id]; }
+    double error_sum(uint32_t cluster_id) const { return error_sums_[cluster_id]; }
+
+    uint64_t records_count() const;
+    // clusters_count x sum(size^2) / records_count^2, 1.0 for lists of equal size.
+    double imbalance_factor() const;
+    // Mean squared distance of a record to its centroid.
+    double quantization_mse() const;
+
+    std::string report(uint64_t largest_count) const;
+
+private:
+    std::vector<uint64_t> sizes_;
+    std::vector<double> error_sums_;
+    std::vector<float> radii_;
+};
+
+} // namespace sketch
@@ -35,7 +35,7 @@ Ret CommandRouter::init() {
     return 0;
 }
 
-Ret CommandRouter::process_command(Commands& commands) {
+Ret CommandRouter::process_command(Commands& commands, QueryContext* context) {
     if (commands.empty()) {
         return "Invalid empty command.";
     }
@@ -64,16 +64,16 @@ Ret CommandRouter::process_command(Commands& commands) {
     if (ddl_commands_.find(commands[0]) != ddl_commands_.end()) {
         return ddl_command_processor_->process_command(commands, is_help);
     } else if (data_commands_.find(commands[0]) != data_commands_.end()) {
-        return data_command_processor_->process_command(commands, is_help);
+        return data_command_processor_->process_command(commands, is_help, context);
     }
 
     return std::string("Unknown command: ") + std::string(commands[0]);
 }
 
-Ret CommandRouter::process_command(const std::string& cmd) {
+Ret CommandRouter::process_command(const std::string& cmd, QueryContext* context) {
     Commands commands;
     parse_command(cmd, commands);
-    return process_command(commands);
+    return process_command(commands, context);
 }
 
 
@@ -8,6 +8,7 @@ namespace sketch {
 class Engine;
 class DDLCommandProcessor;
 class DataCommandProcessor;
+class QueryContext;
 
 class CommandRouter {
 public:
@@ -15,8 +16,9 @@ public:
     CommandRouter(CommandRouter&& another);
     ~CommandRouter();
     Ret init();
-    Ret process_command(Commands& commands);
-    Ret process_command(const std::string& cmd);
+    // KNN and ANN stop at the deadline of context, or when it is cancelled, with partial results.
+    Ret process_command(Commands& commands, QueryContext* context = nullptr);
+    Ret process_command(const std::string& cmd, QueryContext* context = nullptr);
 
     // For testing purposes
     DataCommandProcessor& dcp() { return *data_command_processor_; }
@@ -6,11 +6,68 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cctype>
+#include <cstring>
 #include <string>
 #include <experimental/scope>
 
 namespace sketch {
 
+int parse_cpu_list(const char* val, std::vector<int>& cpus) {
+    cpus.clear();
+
+    std::vector<std::string_view> ranges;
+    split_string(val, ',', ranges);
+    for (const auto& range : ranges) {
+        const std::string item(range);
+        char* end = nullptr;
+        const long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (end == item.c_str()) {
+            return -1;
+        }
+        if (*end == '-') {
+            const char* last_str = end + 1;
+            last = std::strtol(last_str, &end, 10);
+            if (end == last_str) {
+                return -1;
+            }
+        }
+        if (*end != '\0' || first < 0 || last < first) {
+            return -1;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+
+    return 0;
+}
+
+static int parse_pool_key(const char* key, const char* val, const char* name, PoolConfig& pool, bool& found) {
+    const std::string prefix = std::string(name) + "_pool_";
+    if (strncmp(key, prefix.c_str(), prefix.size()) != 0) {
+        return 0;
+    }
+
+    const char* param = key + prefix.size();
+    found = true;
+    if (strcmp(param, "size") == 0) {
+        pool.size = static_cast<size_t>(std::strtoul(val, nullptr, 10));
+    } else if (strcmp(param, "cpus") == 0) {
+        if (parse_cpu_list(val, pool.cpus) != 0) {
+            LOG_ERROR << "Invalid CPU list for " << key << ": " << val;
+            return -1;
+        }
+    } else if (strcmp(param, "nice") == 0) {
+        pool.nice = static_cast<int>(std::strtol(val, nullptr, 10));
+    } else {
+        found = false;
+    }
+
+    return 0;
+}
+
 int parse_config(const std::string& cfg_file, Config& cfg) {
     FILE* f = fopen(cfg_file.c_str(), "r");
     if (!f) {
@@ -61,11 +118,30 @@ int parse_config(const std::string& cfg_file, Config& cfg) {
                 LOG_ERROR << "Unknown config key in [data]: " << key;
             }
         } else if (strcmp(section, "threading") == 0) {
+            bool found = false;
+            if (parse_pool_key(key, val, "query", cfg.query_pool, found) != 0 ||
+                parse_pool_key(key, val, "build", cfg.build_pool, found) != 0 ||
+                parse_pool_key(key, val, "load", cfg.load_pool, found) != 0) {
+                return -1;
+            }
+
             if (strcmp(key, "thread_pool_size") == 0) {
                 cfg.thread_pool_size = static_cast<size_t>(std::strtoul(val, nullptr, 10));
-            } else {
+            } else if (strcmp(key, "numa") == 0) {
+                cfg.numa = strcmp(val, "on") == 0 || strcmp(val, "true") == 0 || strcmp(val, "1") == 0;
+            } else if (!found) {
                 LOG_ERROR << "Unknown config key in [threading]: " << key;
             }
+        } else if (strcmp(section, "query") == 0) {
+            if (strcmp(key, "timeout_ms") == 0) {
+                cfg.query_timeout_ms = std::strtoull(val, nullptr, 10);
+            } else if (strcmp(key, "batch_window_us") == 0) {
+                cfg.query_batch_window_us = std::strtoull(val, nullptr, 10);
+            } else if (strcmp(key, "batch_max") == 0) {
+                cfg.query_batch_max = static_cast<size_t>(std::strtoul(val, nullptr, 10));
+            } else {
+                LOG_ERROR << "Unknown config key in [query]: " << key;
+            }
         } else {
             LOG_ERROR << "Unknown config section: " << section;
             return -1;
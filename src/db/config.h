@@ -1,13 +1,31 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace sketch {
 
+// [threading] settings of one named pool, keys <name>_pool_size, <name>_pool_cpus and <name>_pool_nice.
+struct PoolConfig {
+    size_t size = 0;            // 0 falls back to thread_pool_size
+    std::vector<int> cpus;      // Affinity of the workers, "0-7,16" in the config file, empty for all CPUs
+    int nice = 0;               // Nice value added to the workers, positive is lower priority
+};
+
 struct Config {
     std::string data_path;
     size_t thread_pool_size = 0;
+    PoolConfig query_pool;
+    PoolConfig build_pool;
+    PoolConfig load_pool;
+    bool numa = false;          // [threading] numa: workers split by NUMA node, dataset nodes placed on them
+    uint64_t query_timeout_ms = 0;  // [query] timeout_ms: deadline of a KNN or ANN request, 0 for none
+    uint64_t query_batch_window_us = 0; // [query] batch_window_us: concurrent exact KNN requests share a scan, 0 for off
+    size_t query_batch_max = 64;        // [query] batch_max: requests of one shared scan
 };
 
+int parse_cpu_list(const char* val, std::vector<int>& cpus);
+
 int parse_config(const std::string& cfg_file, Config& cfg);
 const Config& get_global_config();
 
@@ -1,5 +1,6 @@
 #include "data_command_processor.h"
 #include "engine.h"
+#include "hnsw.h"
 #include "input_data.h"
 #include "string_utils.h"
 #include "log.h"
@@ -11,9 +12,9 @@
 namespace sketch {
 
 static CommandNames supported_commands = { "USE", "GENERATE", "LOAD", "DUMP", "FIND", "KNN",
-                                           "SAMPLE", "KMEANS++", "MAKE_CENTROIDS", "MAKE_IVF",
-                                           "ANN", "GC", "DUMP_IVF", "MAKE_RESIDUAL", "MAKE_PQ_CENTROIDS",
-                                           "MOCK_IVF" };
+                                           "SAMPLE", "KMEANS++", "MAKE_CENTROIDS", "MAKE_IVF", "MAKE_IVF_2L",
+                                           "ANN", "GC", "DUMP_IVF", "IVF_STATS", "MAKE_RESIDUAL", "MAKE_PQ_CENTROIDS",
+                                           "MOCK_IVF", "MAKE_HNSW", "ANN_HNSW", "BUILD_STATUS" };
 
 DataCommandProcessor::DataCommandProcessor(Engine& engine)
   : engine_(engine) {
@@ -28,7 +29,7 @@ const CommandNames& DataCommandProcessor::get_supported_commands() const {
     return supported_commands;
 }
 
-Ret DataCommandProcessor::process_command(Commands& commands, bool is_help) {
+Ret DataCommandProcessor::process_command(Commands& commands, bool is_help, QueryContext* context) {
     if (commands.empty()) {
         return "No command to process";
     }
@@ -51,7 +52,7 @@ Ret DataCommandProcessor::process_command(Commands& commands, bool is_help) {
         } else if (cmd_type == "FIND") {
             return process_find_cmd(commands, is_help);
         } else if (cmd_type == "KNN") {
-            return process_knn_cmd(commands, is_help);
+            return process_knn_cmd(commands, is_help, context);
         } else if (cmd_type == "SAMPLE") {
             return process_sample_cmd(commands, is_help);
         } else if (cmd_type == "KMEANS++") {
@@ -60,10 +61,14 @@ Ret DataCommandProcessor::process_command(Commands& commands, bool is_help) {
             return process_make_centroids_cmd(commands, is_help);
         } else if (cmd_type == "MAKE_IVF") {
             return process_make_ivf_cmd(commands, is_help);
+        } else if (cmd_type == "MAKE_IVF_2L") {
+            return process_make_ivf_2l_cmd(commands, is_help);
         } else if (cmd_type == "DUMP_IVF") {
             return process_dump_ivf_cmd(commands, is_help);
+        } else if (cmd_type == "IVF_STATS") {
+            return process_ivf_stats_cmd(commands, is_help);
         } else if (cmd_type == "ANN") {
-            return process_ann_cmd(commands, is_help);
+            return process_ann_cmd(commands, is_help, context);
         } else if (cmd_type == "GC") {
             return process_gc_cmd(commands, is_help);
         } else if (cmd_type == "MAKE_RESIDUAL") {
@@ -72,6 +77,12 @@ Ret DataCommandProcessor::process_command(Commands& commands, bool is_help) {
             return process_make_pq_centroids_cmd(commands, is_help);
         } else if (cmd_type == "MOCK_IVF") {
             return process_mock_ivf_centroids_cmd(commands, is_help);
+        } else if (cmd_type == "MAKE_HNSW") {
+            return process_make_hnsw_cmd(commands, is_help);
+        } else if (cmd_type == "ANN_HNSW") {
+            return process_ann_hnsw_cmd(commands, is_help, context);
+        } else if (cmd_type == "BUILD_STATUS") {
+            return process_build_status_cmd(commands, is_help);
         }
     }
 
@@ -157,7 +168,7 @@ Ret DataCommandProcessor::process_load_cmd(Commands& commands, bool is_help) {
     const auto& input_path = commands[1];
 
     LoadReport report;
-    auto ret = current_dataset_->load(input_path, report /*, engine_.thread_pool()*/);
+    auto ret = current_dataset_->load(input_path, report, engine_.thread_pool(PoolKind::load));
     CHECK(ret)
 
     LOG_DEBUG << "input_count=" << report.input_count.load();
@@ -189,7 +200,7 @@ Ret DataCommandProcessor::process_dump_cmd(Commands& commands, bool is_help) {
         path = commands[1];
     }
 
-    return current_dataset_->dump(path, engine_.thread_pool());
+    return current_dataset_->dump(path, engine_.thread_pool(PoolKind::load));
 }
 
 Ret DataCommandProcessor::process_find_cmd(Commands& commands, bool is_help) {
@@ -206,7 +217,7 @@ Ret DataCommandProcessor::process_find_cmd(Commands& commands, bool is_help) {
 
     if (command_type == "TAG") {
         PARAMS(tag, command_param);
-        return current_dataset_->find_tag(tag, engine_.thread_pool());
+        return current_dataset_->find_tag(tag, engine_.thread_pool(PoolKind::query));
     }
 
     if (command_type == "DATA") {
@@ -234,15 +245,15 @@ Ret DataCommandProcessor::process_find_cmd(Commands& commands, bool is_help) {
             return "Failed to parse get test data.";
         }
 
-        return current_dataset_->find_data(data, engine_.thread_pool());
+        return current_dataset_->find_data(data, engine_.thread_pool(PoolKind::query));
     }
 
     return "Invalid FIND command";
 }
 
-Ret DataCommandProcessor::process_knn_cmd(Commands& commands, bool is_help) {
+Ret DataCommandProcessor::process_knn_cmd(Commands& commands, bool is_help, QueryContext* context) {
     if (is_help) {
-        return Ret(0, "KNN command help: KNN L1|L2|COS <count> #<id> path");
+        return Ret(0, "KNN command help: KNN L1|L2|COS <count> #<id> path [BQ]");
     }
 
     if (commands.size() < 5) {
@@ -284,7 +295,22 @@ Ret DataCommandProcessor::process_knn_cmd(Commands& commands, bool is_help) {
         return "Failed to parse get test data.";
     }
 
-    return current_dataset_->knn(type, count, data, tag, engine_.thread_pool());
+    bool binary = false;
+    if (commands.size() > 5) {
+        if (commands[5] == "BQ") {
+            binary = true;
+        } else {
+            return "Invalid KNN mode, expected BQ";
+        }
+    }
+
+    // Exact scans of concurrent connections share one pass over the records.
+    if (!binary && engine_.query_batcher()) {
+        return engine_.query_batcher()->knn(*current_dataset_, type, count, data, tag, engine_.thread_pool(PoolKind::query),
+                                            context);
+    }
+
+    return current_dataset_->knn(type, count, data, tag, engine_.thread_pool(PoolKind::query), binary, context);
 }
 
 Ret DataCommandProcessor::process_sample_cmd(Commands& commands, bool is_help) {
@@ -306,7 +332,7 @@ Ret DataCommandProcessor::process_sample_cmd(Commands& commands, bool is_help) {
         return ret;
     }
 
-    ret = current_dataset_->sample_records(builder, engine_.thread_pool());
+    ret = current_dataset_->sample_records(builder, engine_.thread_pool(PoolKind::build));
     if (ret != 0) {
         return ret;
     }
@@ -336,7 +362,7 @@ Ret DataCommandProcessor::process_kmeanspp_cmd(Commands& commands, bool is_help)
         return ret;
     }
 
-    ret = current_dataset_->init_centroids_kmeans_plus_plus(builder, engine_.thread_pool());
+    ret = current_dataset_->init_centroids_kmeans_plus_plus(builder, engine_.thread_pool(PoolKind::build));
     if (ret != 0) {
         return ret;
     }
@@ -372,13 +398,13 @@ Ret DataCommandProcessor::process_make_centroids_cmd(Commands& commands, bool is
         return ret;
     }
 
-    ret = current_dataset_->init_centroids_kmeans_plus_plus(builder, engine_.thread_pool());
+    ret = current_dataset_->init_centroids_kmeans_plus_plus(builder, engine_.thread_pool(PoolKind::build));
     if (ret != 0) {
         return ret;
     }
 
     for (uint64_t i = 0; i < recalc_count/2 + 1; i++) {
-        ret = builder.recalc_centroids();
+        ret = builder.recalc_centroids(engine_.thread_pool(PoolKind::build));
         if (ret != 0) {
             return ret;
         }
@@ -392,7 +418,9 @@ Ret DataCommandProcessor::process_make_centroids_cmd(Commands& commands, bool is
 
 Ret DataCommandProcessor::process_make_ivf_cmd(Commands& commands, bool is_help) {
     if (is_help) {
-        return Ret(0, "MAKE_IVF command help: MAKE_IVF <centroids_count> <sample_size> <recalc_count>");
+        return Ret(0, "MAKE_IVF command help: MAKE_IVF <centroids_count> <sample_size> <recalc_count> [FULL|MINIBATCH] [ASYNC]\n"
+                      "  MINIBATCH: sample_size is the batch size, recalc_count is the number of batches\n"
+                      "  ASYNC: the index is built in the background, see BUILD_STATUS");
     }
 
     if (commands.size() < 4) {
@@ -403,31 +431,119 @@ Ret DataCommandProcessor::process_make_ivf_cmd(Commands& commands, bool is_help)
     PARAM(2, sample_size);
     PARAM(3, recalc_count);
 
-    DatasetHolder holder(*current_dataset_);
-    if (holder.is_shutting_down()) {
-        return "Dataset is shutting down";
+    bool minibatch = false;
+    bool async = false;
+    for (size_t i = 4; i < commands.size(); i++) {
+        if (commands[i] == "MINIBATCH") {
+            minibatch = true;
+        } else if (commands[i] == "ASYNC") {
+            async = true;
+        } else if (commands[i] != "FULL") {
+            return "Invalid MAKE_IVF mode, expected FULL, MINIBATCH or ASYNC";
+        }
     }
 
-    const auto& md = current_dataset_->metadata();
-    IvfBuilder builder(md.type, md.dim, centroids_count, sample_size);
-    auto ret = builder.init();
-    if (ret != 0) {
-        return ret;
+    // The build refers to the dataset and not to the current one of the session, the dataset waits for it.
+    Dataset* dataset = current_dataset_.get();
+    ThreadPool* thread_pool = engine_.thread_pool(PoolKind::build);
+    auto build = [dataset, thread_pool, centroids_count, sample_size, recalc_count, minibatch]() -> Ret {
+        DatasetHolder holder(*dataset);
+        if (holder.is_shutting_down()) {
+            return "Dataset is shutting down";
+        }
+
+        const auto& md = dataset->metadata();
+        IvfBuilder builder(md.type, md.dim, centroids_count, sample_size);
+        auto ret = builder.init();
+        if (ret != 0) {
+            return ret;
+        }
+
+        if (minibatch) {
+            ret = dataset->train_centroids_minibatch(builder, recalc_count, thread_pool);
+            if (ret != 0) {
+                return ret;
+            }
+
+            return dataset->write_index(builder, thread_pool);
+        }
+
+        ret = dataset->init_centroids_kmeans_plus_plus(builder, thread_pool);
+        if (ret != 0) {
+            return ret;
+        }
+
+        const uint64_t iterations_count = recalc_count / 2 + 1;
+        dataset->build_progress().set_stage("k-means", iterations_count);
+        for (uint64_t i = 0; i < iterations_count; i++) {
+            ret = dataset->build_checkpoint();
+            if (ret != 0) {
+                return ret;
+            }
+
+            ret = builder.recalc_centroids(thread_pool);
+            if (ret != 0) {
+                return ret;
+            }
+            dataset->build_progress().step_done();
+        }
+
+        return dataset->write_index(builder, thread_pool);
+    };
+
+    return current_dataset_->run_build("MAKE_IVF", std::move(build), async);
+}
+
+Ret DataCommandProcessor::process_make_ivf_2l_cmd(Commands& commands, bool is_help) {
+    if (is_help) {
+        return Ret(0, "MAKE_IVF_2L command help: MAKE_IVF_2L <coarse_count> <sub_count> <sample_size> <recalc_count> [ASYNC]");
     }
 
-    ret = current_dataset_->init_centroids_kmeans_plus_plus(builder, engine_.thread_pool());
-    if (ret != 0) {
-        return ret;
+    if (commands.size() < 5) {
+        return "MAKE_IVF_2L command requires additional parameters";
+    }
+
+    PARAM(1, coarse_count);
+    PARAM(2, sub_count);
+    PARAM(3, sample_size);
+    PARAM(4, recalc_count);
+
+    bool async = false;
+    if (commands.size() > 5) {
+        if (commands[5] == "ASYNC") {
+            async = true;
+        } else {
+            return "Invalid MAKE_IVF_2L mode, expected ASYNC";
+        }
     }
 
-    for (uint64_t i = 0; i < recalc_count / 2 + 1; i++) {
-        ret = builder.recalc_centroids();
+    Dataset* dataset = current_dataset_.get();
+    ThreadPool* thread_pool = engine_.thread_pool(PoolKind::build);
+    auto build = [dataset, thread_pool, coarse_count, sub_count, sample_size, recalc_count] {
+        return dataset->make_two_level_ivf(coarse_count, sub_count, sample_size, recalc_count, thread_pool);
+    };
+
+    return current_dataset_->run_build("MAKE_IVF_2L", std::move(build), async);
+}
+
+Ret DataCommandProcessor::process_build_status_cmd(Commands& commands, bool is_help) {
+    if (is_help) {
+        return Ret(0, "BUILD_STATUS command help: BUILD_STATUS [WAIT]\n"
+                      "  WAIT: waits for the background index build to finish");
+    }
+
+    if (commands.size() > 1) {
+        if (commands[1] != "WAIT") {
+            return "Invalid BUILD_STATUS mode, expected WAIT";
+        }
+
+        auto ret = current_dataset_->wait_build();
         if (ret != 0) {
             return ret;
         }
     }
 
-    return current_dataset_->write_index(builder, engine_.thread_pool());
+    return current_dataset_->build_status();
 }
 
 Ret DataCommandProcessor::process_dump_ivf_cmd(Commands& commands, bool is_help) {
@@ -442,10 +558,23 @@ Ret DataCommandProcessor::process_dump_ivf_cmd(Commands& commands, bool is_help)
     return current_dataset_->dump_ivf();
 }
 
+Ret DataCommandProcessor::process_ivf_stats_cmd(Commands& commands, bool is_help) {
+    if (is_help) {
+        return Ret(0, "IVF_STATS command help: IVF_STATS");
+    }
+
+    if (commands.size() != 1) {
+        return "IVF_STATS command does not require additional parameters";
+    }
+
+    return current_dataset_->ivf_stats();
+}
+
 
-Ret DataCommandProcessor::process_ann_cmd(Commands& commands, bool is_help) {
+Ret DataCommandProcessor::process_ann_cmd(Commands& commands, bool is_help, QueryContext* context) {
     if (is_help) {
-        return Ret(0, "ANN command help: ANN <count> nprobes #<id> path");
+        return Ret(0, "ANN command help: ANN <count> nprobes #<id> path [ADAPTIVE]\n"
+                      "  ADAPTIVE: nprobes is the upper bound, lists are probed nearest first until they cannot improve the result");
     }
 
     if (commands.size() < 5) {
@@ -475,7 +604,16 @@ Ret DataCommandProcessor::process_ann_cmd(Commands& commands, bool is_help) {
         return "Failed to parse get test data.";
     }
 
-    return current_dataset_->ann(count, nprobes, data, tag, engine_.thread_pool());
+    bool adaptive = false;
+    if (commands.size() > 5) {
+        if (commands[5] == "ADAPTIVE") {
+            adaptive = true;
+        } else {
+            return "Invalid ANN mode, expected ADAPTIVE";
+        }
+    }
+
+    return current_dataset_->ann(count, nprobes, data, tag, engine_.thread_pool(PoolKind::query), adaptive, context);
 }
 
 Ret DataCommandProcessor::process_gc_cmd(Commands& commands, bool is_help) {
@@ -501,12 +639,18 @@ Ret DataCommandProcessor::process_make_residual_cmd(Commands& commands, bool is_
 
     PARAM(1, count);
 
-    return current_dataset_->make_residuals(count, engine_.thread_pool());
+    Dataset* dataset = current_dataset_.get();
+    ThreadPool* thread_pool = engine_.thread_pool(PoolKind::build);
+    auto build = [dataset, thread_pool, count] {
+        return dataset->make_residuals(count, thread_pool);
+    };
+
+    return current_dataset_->run_build("MAKE_RESIDUAL", std::move(build), false);
 }
 
 Ret DataCommandProcessor::process_make_pq_centroids_cmd(Commands& commands, bool is_help) {
     if (is_help) {
-        return Ret(0, "MAKE_PQ_CENTROIDS command help: MAKE_PQ_CENTROIDS <count>");
+        return Ret(0, "MAKE_PQ_CENTROIDS command help: MAKE_PQ_CENTROIDS <count> [OPQ]");
     }
 
     if (commands.size() < 2) {
@@ -515,8 +659,23 @@ Ret DataCommandProcessor::process_make_pq_centroids_cmd(Commands& commands, bool
 
     PARAM(1, count);
 
+    bool opq = false;
+    if (commands.size() > 2) {
+        if (commands[2] == "OPQ") {
+            opq = true;
+        } else {
+            return "Invalid MAKE_PQ_CENTROIDS mode, expected OPQ";
+        }
+    }
+
     const uint64_t pq_centroids_count = 256;
-    return current_dataset_->make_pq_centroids(count, pq_centroids_count, engine_.thread_pool());
+    Dataset* dataset = current_dataset_.get();
+    ThreadPool* thread_pool = engine_.thread_pool(PoolKind::build);
+    auto build = [dataset, thread_pool, count, opq] {
+        return dataset->make_pq_centroids(count, pq_centroids_count, thread_pool, opq);
+    };
+
+    return current_dataset_->run_build("MAKE_PQ_CENTROIDS", std::move(build), false);
 }
 
 Ret DataCommandProcessor::process_mock_ivf_centroids_cmd(Commands& commands, bool is_help) {
@@ -533,7 +692,71 @@ Ret DataCommandProcessor::process_mock_ivf_centroids_cmd(Commands& commands, boo
     PARAM(3, chunk_count);
     PARAM(4, pq_centroids_count);
 
-    return current_dataset_->mock_ivf(centroids_count, residuals_count, chunk_count, pq_centroids_count);
+    Dataset* dataset = current_dataset_.get();
+    auto build = [dataset, centroids_count, residuals_count, chunk_count, pq_centroids_count] {
+        return dataset->mock_ivf(centroids_count, residuals_count, chunk_count, pq_centroids_count);
+    };
+
+    return current_dataset_->run_build("MOCK_IVF", std::move(build), false);
+}
+
+Ret DataCommandProcessor::process_make_hnsw_cmd(Commands& commands, bool is_help) {
+    if (is_help) {
+        return Ret(0, "MAKE_HNSW command help: MAKE_HNSW [M] [ef_construction]");
+    }
+
+    HnswParams params;
+    if (commands.size() > 1) {
+        PARAM(1, m);
+        params.M = m;
+    }
+    if (commands.size() > 2) {
+        PARAM(2, ef_construction);
+        params.ef_construction = ef_construction;
+    }
+
+    Dataset* dataset = current_dataset_.get();
+    ThreadPool* thread_pool = engine_.thread_pool(PoolKind::build);
+    auto build = [dataset, thread_pool, params] {
+        return dataset->make_hnsw(params, thread_pool);
+    };
+
+    return current_dataset_->run_build("MAKE_HNSW", std::move(build), false);
+}
+
+Ret DataCommandProcessor::process_ann_hnsw_cmd(Commands& commands, bool is_help, QueryContext* context) {
+    if (is_help) {
+        return Ret(0, "ANN_HNSW command help: ANN_HNSW <count> <ef> #<id> path");
+    }
+
+    if (commands.size() < 5) {
+        return "ANN_HNSW command requires additional parameters";
+    }
+
+    PARAM(1, count);
+    PARAM(2, ef);
+
+    const std::string_view& id_param = commands[3];
+    if (id_param.size() < 2 || id_param[0] != '#') {
+        return "Invalid test data reference";
+    }
+
+    PARAMS(index, std::string_view(id_param.data()+1, id_param.size()-1));
+
+    const std::string_view& path = commands[4];
+    auto input_data = std::make_unique<InputData>();
+    if (input_data->init(path) != 0) {
+        return "Failed to initialize test data";
+    }
+
+    uint64_t tag;
+    std::vector<uint8_t> data;
+    auto ret = input_data->get(index, current_dataset_->metadata(), tag, data);
+    if (ret != 0) {
+        return "Failed to parse get test data.";
+    }
+
+    return current_dataset_->ann_hnsw(count, ef, data, tag, engine_.thread_pool(PoolKind::query), context);
 }
 
 } // namespace sketch
\ No newline at end of file
@@ -8,6 +8,7 @@ namespace sketch {
 
 class Engine;
 class Dataset;
+class QueryContext;
 
 using DatasetPtr = std::shared_ptr<Dataset>;
 
@@ -21,7 +22,7 @@ public:
     DataCommandProcessor(Engine& engine);
     ~DataCommandProcessor();
 
-    Ret process_command(Commands& commands, bool is_help);
+    Ret process_command(Commands& commands, bool is_help, QueryContext* context = nullptr);
     const CommandNames& get_supported_commands() const;
 
     // For testing purposes
@@ -37,17 +38,22 @@ private:
     Ret process_load_cmd(Commands& commands, bool is_help);
     Ret process_dump_cmd(Commands& commands, bool is_help);
     Ret process_find_cmd(Commands& commands, bool is_help);
-    Ret process_knn_cmd(Commands& commands, bool is_help);
+    Ret process_knn_cmd(Commands& commands, bool is_help, QueryContext* context);
     Ret process_sample_cmd(Commands& commands, bool is_help);
     Ret process_kmeanspp_cmd(Commands& commands, bool is_help);
     Ret process_make_centroids_cmd(Commands& commands, bool is_help);
     Ret process_make_ivf_cmd(Commands& commands, bool is_help);
+    Ret process_make_ivf_2l_cmd(Commands& commands, bool is_help);
     Ret process_dump_ivf_cmd(Commands& commands, bool is_help);
-    Ret process_ann_cmd(Commands& commands, bool is_help);
+    Ret process_ivf_stats_cmd(Commands& commands, bool is_help);
+    Ret process_ann_cmd(Commands& commands, bool is_help, QueryContext* context);
     Ret process_gc_cmd(Commands& commands, bool is_help);
     Ret process_make_residual_cmd(Commands& commands, bool is_help);
     Ret process_make_pq_centroids_cmd(Commands& commands, bool is_help);
     Ret process_mock_ivf_centroids_cmd(Commands& commands, bool is_help);
+    Ret process_make_hnsw_cmd(Commands& commands, bool is_help);
+    Ret process_ann_hnsw_cmd(Commands& commands, bool is_help, QueryContext* context);
+    Ret process_build_status_cmd(Commands& commands, bool is_help);
 
 };
 
@@ -4,15 +4,19 @@
 #include "math.h"
 #include "string_utils.h"
 #include "input_data.h"
+#include "query_context.h"
 #include "thread_pool.h"
 #include "log.h"
 
+#include <algorithm>
+#include <cmath>
 #include <experimental/scope>
 #include <filesystem>
 #include <format>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <unordered_set>
 
 #include <assert.h>
 #include <sys/types.h>
@@ -28,6 +32,11 @@ static Ret make_error(const std::string& message) {
     return message;
 }
 
+Dataset::~Dataset() {
+    // A background build refers to the dataset until it finishes
+    auto _ = wait_build();
+}
+
 Ret Dataset::create(const DatasetMetadata& metadata) {
     metadata_ = metadata;
     nodes_.resize(metadata_.nodes_count);
@@ -64,6 +73,9 @@ Ret Dataset::create(const DatasetMetadata& metadata) {
 }
 
 Ret Dataset::remove() {
+    cancel_build();
+    auto _ = wait_build();
+
     try {
         if (!std::filesystem::exists(path_)) {
             return std::format("Dataset directory '{}' doesn't exist", path_);
@@ -77,7 +89,7 @@ Ret Dataset::remove() {
     return 0;
 }
 
-Ret Dataset::init() {
+Ret Dataset::init(ThreadPool* thread_pool) {
     try {
         auto ret = read_metadata();
         CHECK(ret)
@@ -87,28 +99,44 @@ Ret Dataset::init() {
         return make_error("Invalid value in metadata file");
     }
 
-    nodes_.resize(metadata_.nodes_count);
-
     std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id);
     std::string centroids_path = index_path + "/centroids";
     if (std::filesystem::exists(centroids_path)) {
-        centroids_ = std::make_unique<Centroids>();
-        auto ret = centroids_->init(centroids_path);
+        std::unique_ptr<Centroids> centroids;
+        auto ret = load_centroids(index_path, centroids);
         CHECK(ret)
+        centroids_ = std::move(centroids);
     }
 
-    auto ret = load_pq_centroids();
+    auto ret = load_cluster_stats(index_path, cluster_stats_);
     CHECK(ret)
 
-    return 0;
+    ret = load_pq_centroids();
+    CHECK(ret)
+
+    // All nodes are opened here, queries never open a node.
+    std::vector<DatasetNodePtr> nodes;
+    ret = open_nodes(nodes, thread_pool);
+    CHECK(ret)
+
+    nodes_ = std::move(nodes);
+    return publish_snapshot();
 }
 
 Ret Dataset::uninit() {
     shutting_down_ = true;
+    cancel_build();
+    auto _ = wait_build();
+
     for (size_t attempts=0; attempts < 100; attempts++) {
         if (in_use_count_ == 0) break;
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+
+    // Queries don't count themselves in in_use_count_, the write lock waits for them.
+    const WriteGuard guard(rw_lock_);
+    snapshot_.store(nullptr);
+    current_snapshot_.reset();
     nodes_.clear();
     return 0;
 }
@@ -183,22 +211,97 @@ Ret Dataset::read_metadata() {
 
 DatasetNodePtr Dataset::get_node(size_t node_index) {
     assert(node_index < nodes_.size());
+    return nodes_[node_index];
+}
 
-    if (!nodes_[node_index]) {
-        nodes_[node_index] = std::make_shared<DatasetNode>(node_index, path_);
-        int ret = nodes_[node_index]->init(metadata_);
-        if (ret != 0) {
-            nodes_[node_index] = nullptr;
-            LOG_ERROR << std::format("Failed to initialize dataset node {}", node_index);
-            return nullptr;
+Ret Dataset::open_nodes(std::vector<DatasetNodePtr>& nodes, ThreadPool* thread_pool) {
+    nodes.assign(metadata_.nodes_count, nullptr);
+    std::vector<Ret> results(nodes.size(), Ret(0));
+
+    // Nodes of a new index share the records of the current ones. With NUMA worker groups the nodes are
+    // spread over the NUMA nodes, every node is opened by the workers of its own so that it is allocated there.
+    auto open_node = [this, &nodes, &results](size_t node_index, int numa_node) {
+        auto node = std::make_shared<DatasetNode>(node_index, path_);
+        results[node_index] = node_index < nodes_.size() ? node->init_index(*nodes_[node_index], metadata_.index_id)
+                                                         : node->init(metadata_, numa_node);
+        nodes[node_index] = std::move(node);
+    };
+
+    if (thread_pool) {
+        const size_t groups_count = thread_pool->groups_count();
+        TaskGroup group(*thread_pool);
+        for (size_t node_index = 0; node_index < nodes.size(); node_index++) {
+            const size_t home_group = groups_count > 1 ? node_index % groups_count : ThreadPool::AnyGroup;
+            const int numa_node = groups_count > 1 ? thread_pool->group_numa_node(home_group) : -1;
+            group.run([&open_node, node_index, numa_node] {
+                open_node(node_index, numa_node);
+            }, home_group);
+        }
+        group.wait();
+    } else {
+        for (size_t node_index = 0; node_index < nodes.size(); node_index++) {
+            open_node(node_index, -1);
         }
     }
 
-    return nodes_[node_index];
+    for (size_t node_index = 0; node_index < nodes.size(); node_index++) {
+        if (results[node_index] != 0) {
+            return make_error(std::format("Failed to initialize dataset node {}: {}", node_index, results[node_index].message()));
+        }
+    }
+
+    return 0;
+}
+
+const DatasetSnapshot* Dataset::pin_snapshot() const {
+    return snapshot_.load(std::memory_order_seq_cst);
+}
+
+DatasetSnapshotPtr Dataset::make_snapshot() const {
+    auto snapshot = std::make_shared<DatasetSnapshot>();
+    snapshot->index_id = metadata_.index_id;
+    snapshot->metadata = metadata_;
+    snapshot->centroids = centroids_;
+    snapshot->cluster_stats = cluster_stats_;
+    snapshot->pq_codebooks = pq_codebooks_;
+    for (const auto& node : nodes_) {
+        snapshot->nodes.push_back(node);
+        snapshot->node_snapshots.push_back(node->snapshot());
+    }
+
+    return snapshot;
+}
+
+Ret Dataset::publish_snapshot() {
+    DatasetSnapshotPtr previous;
+    {
+        const std::lock_guard<std::mutex> lock(snapshot_mutex_);
+        for (const auto& node : nodes_) {
+            node->publish_snapshot();
+        }
+        auto snapshot = make_snapshot();
+        snapshot_.store(snapshot.get(), std::memory_order_seq_cst);
+        previous = std::exchange(current_snapshot_, std::move(snapshot));
+    }
+
+    // Queries started before the store may still scan the slots of the records deleted by the load
+    rw_lock_.synchronize();
+    previous.reset();
+
+    for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        auto ret = get_node(node_index)->release_deleted();
+        CHECK(ret)
+    }
+
+    return 0;
 }
 
 Ret Dataset::load(const std::string_view& input_path, LoadReport& report, ThreadPool* thread_pool) {
-    WRITE_OP_HEADER
+    if (shutting_down_) return -1;
+    const InUseMarker in_use_marker(in_use_count_);
+
+    // Queries run on the published snapshot meanwhile, only index builds and other loads wait.
+    const WriteGuard ingest_guard(ingest_lock_);
 
     std::string load_path = path_ + "/load";
     if (std::filesystem::exists(load_path)) {
@@ -220,6 +323,25 @@ Ret Dataset::load(const std::string_view& input_path, LoadReport& report, Thread
     }
     report.input_count = input_data.count();
 
+    // Whatever the nodes wrote is published, LMDB has it committed already.
+    auto result = load_nodes(load_path, input_data, report, thread_pool);
+    auto publish_ret = publish_snapshot();
+    if (result != 0) {
+        return result;
+    }
+    CHECK(publish_ret)
+
+    // Rebalancing decides from the cluster sizes whether there is work at all, a rebalanced index is
+    // written beside the current one and switched through the snapshot like a build, queries keep running.
+    auto rebalance_ret = rebalance_ivf(thread_pool);
+    if (rebalance_ret != 0) {
+        return std::format("Data loaded, failed to rebalance IVF index: {}", rebalance_ret.message());
+    }
+
+    return result;
+}
+
+Ret Dataset::load_nodes(const std::string& load_path, const InputData& input_data, LoadReport& report, ThreadPool* thread_pool) {
     Ret result{0};
     if (thread_pool) {
         std::vector<std::future<Ret>> futures;
@@ -235,7 +357,7 @@ Ret Dataset::load(const std::string_view& input_path, LoadReport& report, Thread
             }
 
             std::string node_path = load_path + "/" + std::to_string(node_index);
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), node_path, nodes_count=nodes_.size(), &input_data, &report] {
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_path, nodes_count=nodes_.size(), &input_data, &report] {
                 return node_ptr->prepare_load(node_path, nodes_count, report, input_data);
             }));
         }
@@ -259,7 +381,7 @@ Ret Dataset::load(const std::string_view& input_path, LoadReport& report, Thread
             }
 
             std::string node_path = load_path + "/" + std::to_string(node_index);
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), node_path, md=metadata_, &input_data, &report, cents=centroids_.get()] {
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_path, md=metadata_, &input_data, &report, cents=centroids_.get()] {
                 return node_ptr->load(node_path, md, report, input_data, cents);
             }));
         }
@@ -295,6 +417,11 @@ Ret Dataset::load(const std::string_view& input_path, LoadReport& report, Thread
 Ret Dataset::dump(const std::string_view& output_path, ThreadPool* thread_pool) {
     READ_OP_HEADER
 
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
     std::string dump_path;
     if (!output_path.empty()) {
         dump_path = std::format("{}/{}", output_path, name_);
@@ -307,21 +434,19 @@ Ret Dataset::dump(const std::string_view& output_path, ThreadPool* thread_pool)
 
     if (thread_pool) {
         std::vector<std::future<Ret>> futures;
-        futures.reserve(nodes_.size());
+        futures.reserve(snapshot->nodes.size());
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), dump_path, md=metadata_] {
-                return node_ptr->dump(dump_path, md);
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_snapshot = node_snapshot.get(), dump_path, md=snapshot->metadata] {
+                return node_ptr->dump(*node_snapshot, dump_path, md);
             }));
         }
 
         Ret result_ret{0};
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
             Ret ret = futures[node_index].get();
             if (ret != 0) {
                 result_ret = ret;
@@ -331,13 +456,11 @@ Ret Dataset::dump(const std::string_view& output_path, ThreadPool* thread_pool)
         return result_ret;
 
     } else {
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            auto ret = node->dump(dump_path, metadata_);
+            auto ret = node->dump(*node_snapshot, dump_path, snapshot->metadata);
             if (ret != 0) {
                 return ret;
             }
@@ -350,23 +473,26 @@ Ret Dataset::dump(const std::string_view& output_path, ThreadPool* thread_pool)
 Ret Dataset::find_tag(uint64_t tag, ThreadPool* thread_pool) {
     READ_OP_HEADER
 
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
     if (thread_pool) {
         std::vector<std::future<Ret>> futures;
-        futures.reserve(nodes_.size());
+        futures.reserve(snapshot->nodes.size());
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), tag] {
-                return node_ptr->find_tag(tag);
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_snapshot = node_snapshot.get(), tag] {
+                return node_ptr->find_tag(*node_snapshot, tag);
             }));
         }
 
         Ret result_ret{-1};
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
             Ret ret = futures[node_index].get();
             if (ret == 0) {
                 if (result_ret != -1) {
@@ -379,13 +505,11 @@ Ret Dataset::find_tag(uint64_t tag, ThreadPool* thread_pool) {
         return result_ret;
 
     } else {
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            auto ret = node->find_tag(tag);
+            auto ret = node->find_tag(*node_snapshot, tag);
             if (ret == 0) {
                 return ret;
             }
@@ -398,23 +522,26 @@ Ret Dataset::find_tag(uint64_t tag, ThreadPool* thread_pool) {
 Ret Dataset::find_data(const std::vector<uint8_t>& data, ThreadPool* thread_pool) {
     READ_OP_HEADER
 
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
     if (thread_pool) {
         std::vector<std::future<Ret>> futures;
-        futures.reserve(nodes_.size());
+        futures.reserve(snapshot->nodes.size());
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), &data] {
-                return node_ptr->find_data(data);
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_snapshot = node_snapshot.get(), &data] {
+                return node_ptr->find_data(*node_snapshot, data);
             }));
         }
 
         Ret result_ret{-1, "Data not found"};
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
             Ret ret = futures[node_index].get();
             if (ret == 0) {
                 if (result_ret != -1) {
@@ -427,13 +554,11 @@ Ret Dataset::find_data(const std::vector<uint8_t>& data, ThreadPool* thread_pool
         return result_ret;
 
     } else {
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            auto ret = node->find_data(data);
+            auto ret = node->find_data(*node_snapshot, data);
             if (ret == 0) {
                 return ret;
             }
@@ -443,49 +568,96 @@ Ret Dataset::find_data(const std::vector<uint8_t>& data, ThreadPool* thread_pool
     return "Data not found";
 }
 
-Ret Dataset::knn(KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool) {
+Ret Dataset::knn(KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool,
+                 bool binary, QueryContext* context) {
     READ_OP_HEADER
 
-    std::priority_queue<DistItem> pq;
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
+    std::vector<DistItems> results(snapshot->nodes.size());
 
     if (thread_pool) {
-        std::vector<std::future<DistItems>> futures;
-        futures.reserve(nodes_.size());
+        // The calling thread runs node scans too while it waits for the group.
+        TaskGroup group(*thread_pool);
+
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
+
+            group.run([node_ptr = node.get(), node_snapshot = node_snapshot.get(), md = &snapshot->metadata, type, count, &data, skip_tag, binary, context,
+                       res = &results[node_index]] {
+                *res = binary ? node_ptr->knn_binary(*node_snapshot, *md, type, count, data, skip_tag, context)
+                              : node_ptr->knn(*node_snapshot, *md, type, count, data, skip_tag, context);
+            }, thread_pool->numa_node_group(node->numa_node()));
+        }
+        group.wait();
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+    } else {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), md=metadata_, type, count, &data, skip_tag] {
-                return node_ptr->knn(md, type, count, data, skip_tag);
-            }));
+            results[node_index] = binary ? node->knn_binary(*node_snapshot, snapshot->metadata, type, count, data, skip_tag, context)
+                                         : node->knn(*node_snapshot, snapshot->metadata, type, count, data, skip_tag, context);
         }
+    }
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto res = futures[node_index].get();
-            for (auto& item : res) {
-                pq.push(item);
-                if (pq.size() > count) {
-                    pq.pop();
-                }
-            }
+    return knn_result(results, count, context);
+}
+
+Ret Dataset::knn_batch(KnnType type, const std::vector<KnnQuery>& queries, std::vector<Ret>& results, ThreadPool* thread_pool) {
+    READ_OP_HEADER
+
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
+    std::vector<std::vector<DistItems>> node_results(snapshot->nodes.size());
+
+    if (thread_pool) {
+        TaskGroup group(*thread_pool);
+
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
+
+            group.run([node_ptr = node.get(), node_snapshot = node_snapshot.get(), md = &snapshot->metadata, type, &queries,
+                       res = &node_results[node_index]] {
+                *res = node_ptr->knn_batch(*node_snapshot, *md, type, queries);
+            }, thread_pool->numa_node_group(node->numa_node()));
         }
+        group.wait();
 
     } else {
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            node_results[node_index] = snapshot->nodes[node_index]->knn_batch(*snapshot->node_snapshots[node_index], snapshot->metadata,
+                                                                              type, queries);
+        }
+    }
 
-            auto res = node->knn(metadata_, type, count, data, skip_tag);
-            for (auto& item : res) {
-                pq.push(item);
-                if (pq.size() > count) {
-                    pq.pop();
-                }
+    results.clear();
+    std::vector<DistItems> query_results(snapshot->nodes.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            query_results[node_index] = std::move(node_results[node_index][i]);
+        }
+        results.push_back(knn_result(query_results, queries[i].count, queries[i].context));
+    }
+
+    return 0;
+}
+
+Ret Dataset::knn_result(const std::vector<DistItems>& node_results, uint64_t count, QueryContext* context) {
+    std::priority_queue<DistItem> pq;
+    for (const auto& res : node_results) {
+        for (auto& item : res) {
+            pq.push(item);
+            if (pq.size() > count) {
+                pq.pop();
             }
         }
     }
@@ -504,37 +676,147 @@ Ret Dataset::knn(KnnType type, uint64_t count, const std::vector<uint8_t>& data,
         sstream << tag << ", ";
     }
 
+    if (context && context->partial()) {
+        sstream << std::format("\npartial: {}", context->stop_reason());
+    }
+
     return Ret(0, sstream.str());
 }
 
-Ret Dataset::ann(uint64_t count, uint64_t nprobes, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool) {
+Ret Dataset::ann(uint64_t count, uint64_t nprobes, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool,
+                 bool adaptive, QueryContext* context) {
     READ_OP_HEADER
 
-    if (!centroids_) {
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
+    const auto& centroids = snapshot->centroids;
+    if (!centroids) {
         return "Centroids not initialized";
     };
 
-    std::vector<uint16_t> cluster_ids;
-    centroids_->find_nearest_clusters(data.data(), metadata_.type, metadata_.dim, cluster_ids, nprobes);
+    std::vector<uint32_t> cluster_ids;
+    centroids->find_nearest_clusters(data.data(), snapshot->metadata.type, snapshot->metadata.dim, cluster_ids, nprobes);
+
+    // Adaptive probing visits the clusters nearest first, nprobes is the upper bound.
+    std::vector<double> centroid_dists;
+    if (adaptive) {
+        std::vector<std::pair<double, uint32_t>> probes;
+        probes.reserve(cluster_ids.size());
+        for (const auto cluster_id : cluster_ids) {
+            const double dist = distance_L2_square(snapshot->metadata.type, data.data(), centroids->get_centroid(cluster_id), snapshot->metadata.dim);
+            probes.emplace_back(std::sqrt(dist), cluster_id);
+        }
+        std::sort(probes.begin(), probes.end());
+
+        for (size_t i = 0; i < probes.size(); i++) {
+            centroid_dists.push_back(probes[i].first);
+            cluster_ids[i] = probes[i].second;
+        }
+    }
+    const std::vector<double>* dists = adaptive ? &centroid_dists : nullptr;
 
     std::priority_queue<DistItem> pq;
+    std::vector<uint64_t> scanned_counts(snapshot->nodes.size(), 0);
 
-    if (thread_pool) {
-        std::vector<std::future<DistItems>> futures;
-        futures.reserve(nodes_.size());
+    // Small queries, by the list sizes of the index statistics, run on the calling thread.
+    const ClusterStats* cluster_stats = snapshot->cluster_stats.get();
+    const uint64_t predicted_records = predict_ann_records(cluster_stats, cluster_ids);
+    if (cluster_stats && predicted_records < AnnParallelMinRecords) {
+        thread_pool = nullptr;
+    }
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
+    if (thread_pool && !adaptive) {
+        // The (node, cluster) pairs are spread over the pool in units of similar posting list length,
+        // so that a single query uses every worker instead of one per node.
+        // A unit runs on the worker group of the NUMA node its dataset node is placed on.
+        struct WorkUnit {
+            DatasetNode* node = nullptr;
+            const NodeSnapshot* snapshot = nullptr;
+            std::size_t group = ThreadPool::AnyGroup;
+            std::vector<uint32_t> cluster_ids;
+        };
+
+        const auto& nodes = snapshot->nodes;
+        uint64_t total_size = 0;
+        for (const auto& node : nodes) {
+            for (const auto cluster_id : cluster_ids) {
+                total_size += node->cluster_size(cluster_id) + 1;
+            }
+        }
+
+        const uint64_t units_count = thread_pool->size() * AnnUnitsPerThread;
+        const uint64_t unit_size = total_size / units_count + 1;
+
+        std::vector<WorkUnit> units;
+        for (size_t node_index = 0; node_index < nodes.size(); node_index++) {
+            const auto& node = nodes[node_index];
+            const NodeSnapshot* node_snapshot = snapshot->node_snapshots[node_index].get();
+            const size_t home_group = thread_pool->numa_node_group(node->numa_node());
+            WorkUnit unit { .node = node.get(), .snapshot = node_snapshot, .group = home_group, .cluster_ids = {} };
+            uint64_t size = 0;
+            for (const auto cluster_id : cluster_ids) {
+                unit.cluster_ids.push_back(cluster_id);
+                size += node->cluster_size(cluster_id) + 1;
+                if (size >= unit_size) {
+                    units.push_back(std::move(unit));
+                    unit = WorkUnit { .node = node.get(), .snapshot = node_snapshot, .group = home_group, .cluster_ids = {} };
+                    size = 0;
+                }
+            }
+
+            if (!unit.cluster_ids.empty()) {
+                units.push_back(std::move(unit));
+            }
+        }
+
+        std::vector<DistItems> results(units.size());
+        TaskGroup group(*thread_pool);
+        for (size_t unit_index = 0; unit_index < units.size(); unit_index++) {
+            group.run([unit = &units[unit_index], count, &data, skip_tag, context, res = &results[unit_index]] {
+                *res = unit->node->ann(*unit->snapshot, unit->cluster_ids, count, data, skip_tag, nullptr, nullptr, context);
+            }, units[unit_index].group);
+        }
+        group.wait();
+
+        DistItems items;
+        for (const auto& res : results) {
+            items.insert(items.end(), res.begin(), res.end());
+        }
+
+        // A record moved to another cluster after the index was written may be found by two units.
+        std::sort(items.begin(), items.end(), [](const DistItem& a, const DistItem& b) {
+            return a.dist < b.dist;
+        });
+
+        std::unordered_set<uint64_t> found_tags;
+        for (const auto& item : items) {
+            if (pq.size() == count) {
+                break;
+            }
+
+            if (found_tags.insert(item.tag).second) {
+                pq.push(item);
             }
+        }
+
+    } else if (thread_pool) {
+        std::vector<std::future<DistItems>> futures;
+        futures.reserve(snapshot->nodes.size());
+
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), &cluster_ids, count, &data, skip_tag] {
-                return node_ptr->ann(cluster_ids, count, data, skip_tag);
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_snapshot = node_snapshot.get(), &cluster_ids, count, &data, skip_tag, dists,
+                                                   scanned_count = &scanned_counts[node_index], context] {
+                return node_ptr->ann(*node_snapshot, cluster_ids, count, data, skip_tag, dists, scanned_count, context);
             }));
         }
 
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
             auto res = futures[node_index].get();
             for (auto& item : res) {
                 pq.push(item);
@@ -545,13 +827,11 @@ Ret Dataset::ann(uint64_t count, uint64_t nprobes, const std::vector<uint8_t>& d
         }
 
     } else {
-        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            auto node = get_node(node_index);
-            if (!node) {
-                return -1;
-            }
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
 
-            auto res = node->ann(cluster_ids, count, data, skip_tag);
+            auto res = node->ann(*node_snapshot, cluster_ids, count, data, skip_tag, dists, &scanned_counts[node_index], context);
             for (auto& item : res) {
                 pq.push(item);
                 if (pq.size() > count) {
@@ -575,6 +855,21 @@ Ret Dataset::ann(uint64_t count, uint64_t nprobes, const std::vector<uint8_t>& d
         sstream << tag << ", ";
     }
 
+    if (adaptive) {
+        uint64_t scanned_count = 0;
+        for (const auto node_scanned_count : scanned_counts) {
+            scanned_count += node_scanned_count;
+        }
+        sstream << std::format("\nlists scanned: {} of {}", scanned_count, cluster_ids.size() * snapshot->nodes.size());
+        if (cluster_stats) {
+            sstream << std::format("\npredicted records: {}", predicted_records);
+        }
+    }
+
+    if (context && context->partial()) {
+        sstream << std::format("\npartial: {}", context->stop_reason());
+    }
+
     return Ret(0, sstream.str());
 }
 
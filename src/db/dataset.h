@@ -1,32 +1,91 @@
 #pragma once
 #include "dataset_node.h"
 #include "centroids.h"
+#include "cluster_stats.h"
+#include "opq.h"
 #include "rw_lock.h"
 #include "shared_types.h"
 #include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <string>
+#include <thread>
 #include <vector>
 
 namespace sketch {
 
+class InputData;
 class IvfBuilder;
+class QueryContext;
+class ResidualChunks;
 class ThreadPool;
 
 using MakeResidualsTestFunc = std::function<Ret(DatasetType type, uint64_t dim, uint64_t count, const uint8_t* data)>;
 using MakePqCentroidsTestFunc = std::function<Ret(const std::vector<std::unique_ptr<Centroids>>& pq_centroids)>;
-using MockIvfTestFunc = std::function<Ret(const std::unique_ptr<Centroids>& centroids)>;
+using MockIvfTestFunc = std::function<Ret(const std::shared_ptr<Centroids>& centroids)>;
+
+// PQ codebooks of the chunks of an index and its OPQ rotation, replaced as a whole.
+struct PqCodebooks {
+    std::vector<std::unique_ptr<Centroids>> centroids;
+    std::unique_ptr<OpqRotation> opq;
+};
+using PqCodebooksPtr = std::shared_ptr<const PqCodebooks>;
+
+// Snapshots of all nodes published together by LOAD. A query pins one for its whole run, LOAD reuses
+// the slots of deleted records only after the snapshot it replaced is no longer pinned.
+// An index switch publishes the nodes, centroids and statistics of the new index in one snapshot,
+// MAKE_PQ_CENTROIDS publishes the new codebooks the same way.
+struct DatasetSnapshot {
+    uint64_t index_id = 0;
+    // Queries read the metadata and the nodes of their snapshot only, an index switch rewrites the members.
+    DatasetMetadata metadata;
+    std::vector<DatasetNodePtr> nodes;
+    std::vector<NodeSnapshotPtr> node_snapshots;
+    std::shared_ptr<const Centroids> centroids;
+    std::shared_ptr<const ClusterStats> cluster_stats;
+    PqCodebooksPtr pq_codebooks;
+};
+using DatasetSnapshotPtr = std::shared_ptr<const DatasetSnapshot>;
+
+/****************************************
+ *
+ *   Progress of the index build of a dataset: the stage it is in and the steps of the stage done,
+ *   e.g. k-means iterations or nodes indexed. Updated by the build, read by BUILD_STATUS.
+ */
+class BuildProgress {
+public:
+    void start(const std::string& name);
+    void set_stage(const std::string& stage, uint64_t steps_count = 0);
+    void step_done() { steps_done_.fetch_add(1, std::memory_order_relaxed); }
+    void finish(const Ret& result);
+
+    bool running() const;
+    std::string report() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::string name_;
+    std::string stage_;
+    bool running_ = false;
+    bool finished_ = false;
+    Ret result_{0};
+    std::atomic<uint64_t> steps_done_{0};
+    std::atomic<uint64_t> steps_count_{0};
+};
 
 class Dataset {
     friend class DatasetHolder;
 public:
     Dataset(const std::string& name, const std::string& path) : name_(name), path_(path) {}
+    ~Dataset();
 
     Ret create(const DatasetMetadata& metadata);
     Ret remove();
     
-    Ret init();
+    // Opens every node, in parallel on thread_pool.
+    Ret init(ThreadPool* thread_pool = nullptr);
     Ret uninit();
 
     const DatasetMetadata& metadata() const { return metadata_; }
@@ -36,47 +95,144 @@ public:
 
     Ret find_tag(uint64_t tag, ThreadPool* thread_pool = nullptr);
     Ret find_data(const std::vector<uint8_t>& data, ThreadPool* thread_pool = nullptr);
-    Ret knn(KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool = nullptr);
+    // With a context the node scans stop at its deadline or when it is cancelled, the results found
+    // until then are returned and flagged partial.
+    Ret knn(KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool = nullptr,
+            bool binary = false, QueryContext* context = nullptr);
+    // Exact KNN of several requests in one pass over the records of every node, results[i] is the
+    // result of queries[i] as knn() returns it.
+    Ret knn_batch(KnnType type, const std::vector<KnnQuery>& queries, std::vector<Ret>& results, ThreadPool* thread_pool = nullptr);
 
     Ret sample_records(IvfBuilder& builder, ThreadPool* thread_pool = nullptr);
     Ret init_centroids_kmeans_plus_plus(IvfBuilder& builder, ThreadPool* thread_pool = nullptr);
+    Ret train_centroids_minibatch(IvfBuilder& builder, uint64_t batches_count, ThreadPool* thread_pool = nullptr);
     Ret write_index(IvfBuilder& builder, ThreadPool* thread_pool = nullptr);
-    Ret ann(uint64_t count, uint64_t nprobes, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool = nullptr);
+    Ret make_two_level_ivf(uint32_t coarse_count, uint32_t sub_count, uint32_t sample_size, uint64_t recalc_count,
+                           ThreadPool* thread_pool = nullptr);
+    Ret ann(uint64_t count, uint64_t nprobes, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool = nullptr,
+            bool adaptive = false, QueryContext* context = nullptr);
+    Ret make_hnsw(const HnswParams& params, ThreadPool* thread_pool = nullptr);
+    Ret ann_hnsw(uint64_t count, uint64_t ef, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool = nullptr,
+                 QueryContext* context = nullptr);
     Ret gc();
     Ret dump_ivf();
+    Ret ivf_stats();
     Ret make_residuals(uint64_t count, ThreadPool* thread_pool = nullptr);
-    Ret make_pq_centroids(uint64_t chunk_count, uint64_t pq_centroids_depth = 256, ThreadPool* thread_pool = nullptr);
+    Ret make_pq_centroids(uint64_t chunk_count, uint64_t pq_centroids_depth = 256, ThreadPool* thread_pool = nullptr,
+                          bool opq = false);
     Ret mock_ivf(uint64_t centroids_count, uint64_t sample_count, uint64_t chunk_count, uint64_t pq_centroids_depth=256);
     Ret write_pq_vectors(ThreadPool* thread_pool = nullptr);
 
+    // Runs an index build, on a background thread with async. One build runs at a time, queries keep
+    // running on the current index until the build switches to the next one.
+    Ret run_build(const std::string& name, std::function<Ret()> build, bool async);
+    // Waits for the background build and returns its result.
+    Ret wait_build();
+    Ret build_status() const;
+    BuildProgress& build_progress() { return build_progress_; }
+    // Stops the running build at its next step, the current index stays. remove() and uninit() cancel it.
+    void cancel_build() { build_cancelled_ = true; }
+    // Called by the builds between their steps and batches, fails once the build is cancelled.
+    Ret build_checkpoint() const;
+
+private:
+    // LOAD rebalances the IVF index when a cluster grows past RebalanceSplitRatio x the mean
+    // cluster size or shrinks below RebalanceMergeRatio x the mean cluster size.
+    static constexpr double RebalanceSplitRatio = 3.0;
+    static constexpr double RebalanceMergeRatio = 0.1;
+    static constexpr uint32_t RebalanceMaxSplitParts = 8;
+    static constexpr uint64_t RebalanceSampleSize = 16 * 1024;
+    static constexpr uint64_t RebalanceRecalcCount = 8;
+
+    // ANN work units per pool thread, a few per thread even out lists of different length.
+    static constexpr uint64_t AnnUnitsPerThread = 2;
+    // A query predicted to scan fewer records is not worth spreading over the pool.
+    static constexpr uint64_t AnnParallelMinRecords = 2048;
+    static constexpr uint64_t StatsLargestListsCount = 8;
+
+    // Residuals used to learn the OPQ rotation, the codebooks are then trained on all rotated residuals.
+    static constexpr uint64_t OpqSampleSize = 64 * 1024;
+
 private:
     struct InUseMarker {
     public:
-        InUseMarker(std::atomic<uint64_t>& in_use_count) : in_use_count_(in_use_count) {}
+        InUseMarker(std::atomic<uint64_t>& in_use_count) : in_use_count_(in_use_count) { in_use_count_.fetch_add(1); }
         ~InUseMarker() { in_use_count_.fetch_sub(1);  }
     private:
         std::atomic<uint64_t>& in_use_count_;
     };
+    // Holds build_running_ for a build step called outside run_build(), the steps of a build run by
+    // this thread pass through it.
+    struct BuildClaim {
+    public:
+        explicit BuildClaim(Dataset& dataset);
+        ~BuildClaim();
+        bool granted() const { return granted_; }
+    private:
+        Dataset& dataset_;
+        bool granted_ = false;
+        bool owned_ = false;
+    };
 private:
     const std::string name_;
     const std::string path_;
     DatasetMetadata metadata_;
+    // Opened by init() and replaced by an index switch. Queries reach the nodes through snapshot_.
     std::vector<DatasetNodePtr> nodes_;
+    // Loads and builds in progress, queries are waited for through rw_lock_.
     std::atomic<uint64_t> in_use_count_{0};
     std::atomic<bool> shutting_down_{false};
-    std::unique_ptr<Centroids> centroids_;
-    std::vector<std::unique_ptr<Centroids>> pq_centroids_;
-    RWLock rw_lock_;
+    // Of the current index, queries read the ones of their snapshot.
+    std::shared_ptr<Centroids> centroids_;
+    PqCodebooksPtr pq_codebooks_;
+    std::shared_ptr<ClusterStats> cluster_stats_;
+    std::atomic<uint64_t> residuals_count_{0};
+    std::atomic<uint64_t> residuals_index_id_{0};
+    // Read by queries under rw_lock_, current_snapshot_ owns it. A replaced snapshot is released
+    // after rw_lock_.synchronize().
+    std::atomic<const DatasetSnapshot*> snapshot_{nullptr};
+    DatasetSnapshotPtr current_snapshot_;
+    std::mutex snapshot_mutex_;
+    // Taken exclusively by LOAD and the other writers, shared by index builds. Always taken before rw_lock_.
+    RWLock ingest_lock_;
+    // Shared by queries, taken exclusively by writers.
+    ShardedRWLock rw_lock_;
+    // Set while a build runs, the other builds are refused until it finishes.
+    std::atomic<bool> build_running_{false};
+    std::atomic<bool> build_cancelled_{false};
+    std::thread build_thread_;
+    std::mutex build_thread_mutex_;
+    BuildProgress build_progress_;
 
 private:
     Ret write_metadata();
     Ret read_metadata();
     DatasetNodePtr get_node(uint64_t tag);
+    // Valid while the query holds rw_lock_.
+    const DatasetSnapshot* pin_snapshot() const;
+    DatasetSnapshotPtr make_snapshot() const;
+    Ret open_nodes(std::vector<DatasetNodePtr>& nodes, ThreadPool* thread_pool);
+    Ret publish_snapshot();
+    Ret load_nodes(const std::string& load_path, const InputData& input_data, LoadReport& report, ThreadPool* thread_pool);
 
-    Ret write_centroids(IvfBuilder& builder);
+    Ret write_centroids(IvfBuilder& builder, ThreadPool* thread_pool = nullptr);
+    Ret load_centroids(const std::string& index_path, std::unique_ptr<Centroids>& centroids) const;
+    Ret write_cluster_stats(uint64_t index_id);
+    // Leaves stats empty when the index has no statistics.
+    Ret load_cluster_stats(const std::string& index_path, std::shared_ptr<ClusterStats>& stats) const;
+    static uint64_t predict_ann_records(const ClusterStats* stats, const std::vector<uint32_t>& cluster_ids);
+    // Merges the node results of a KNN request into its response: the count nearest tags, ascending.
+    static Ret knn_result(const std::vector<DistItems>& node_results, uint64_t count, QueryContext* context);
     Ret write_index_internal(ThreadPool* thread_pool = nullptr);
-    Ret update_and_write_metadata();
+    Ret update_and_write_metadata(ThreadPool* thread_pool = nullptr);
+    Ret rebalance_ivf(ThreadPool* thread_pool = nullptr);
+    // Removes the files a failed or cancelled build wrote for index_id, unless the dataset switched to it.
+    void remove_partial_index(uint64_t index_id);
+    Ret compute_residuals(uint64_t count, ResidualChunks& residuals, ThreadPool* thread_pool = nullptr);
     Ret load_pq_centroids();
+    Ret link_pq_centroids(const std::string& next_index_path) const;
+    Ret write_hnsw(const HnswParams& params, ThreadPool* thread_pool);
+    Ret init_hnsw();
 
 
 public:
@@ -95,7 +251,7 @@ using Datasets = std::unordered_map<std::string, DatasetPtr>;
 class DatasetHolder {
 public:
     DatasetHolder(Dataset& dataset) : dataset_(dataset) {
-        guard_ = std::make_unique<ReadGuard>(dataset_.rw_lock_);
+        ingest_guard_ = std::make_unique<ReadGuard>(dataset_.ingest_lock_);
         marker_ = std::make_unique<Dataset::InUseMarker>(dataset_.in_use_count_);
     }
 
@@ -106,18 +262,28 @@ public:
     }
 private:
     Dataset& dataset_;
-    std::unique_ptr<ReadGuard> guard_;
+    std::unique_ptr<ReadGuard> ingest_guard_;
     std::unique_ptr<Dataset::InUseMarker> marker_;
 };
 
+// Queries write no shared cache line: shutting_down_ is only read and rw_lock_ is sharded per thread.
 #define READ_OP_HEADER \
     if (shutting_down_) return -1; \
+    const ShardedReadGuard guard(rw_lock_);
+
+// Index builds read the records of the nodes directly, they don't run along with LOAD. The writers
+// take ingest_lock_ first, so a build does not hold rw_lock_ and may switch the index itself.
+#define BUILD_OP_HEADER \
+    if (shutting_down_) return -1; \
+    const BuildClaim build_claim(*this); \
+    if (!build_claim.granted()) return "Another index build is running"; \
     const InUseMarker in_use_marker(in_use_count_); \
-    const ReadGuard guard(rw_lock_);
+    const ReadGuard ingest_guard(ingest_lock_);
 
 #define WRITE_OP_HEADER \
     if (shutting_down_) return -1; \
     const InUseMarker in_use_marker(in_use_count_); \
+    const WriteGuard ingest_guard(ingest_lock_); \
     const WriteGuard guard(rw_lock_);
 
 
@@ -0,0 +1,98 @@
+#include "dataset.h"
+#include "hnsw.h"
+#include "thread_pool.h"
+#include "log.h"
+
+#include <algorithm>
+#include <format>
+#include <sstream>
+
+namespace sketch {
+
+Ret Dataset::make_hnsw(const HnswParams& params, ThreadPool* thread_pool) {
+    auto ret = write_hnsw(params, thread_pool);
+    CHECK(ret)
+
+    return init_hnsw();
+}
+
+Ret Dataset::write_hnsw(const HnswParams& params, ThreadPool* thread_pool) {
+    BUILD_OP_HEADER
+
+    // Nodes are built one after another, each node spreads its inserts over the pool.
+    for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        auto node = get_node(node_index);
+        if (!node) {
+            return -1;
+        }
+
+        auto ret = node->write_hnsw(params, thread_pool);
+        CHECK(ret)
+    }
+
+    return 0;
+}
+
+Ret Dataset::init_hnsw() {
+    WRITE_OP_HEADER
+
+    for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        auto node = get_node(node_index);
+        if (!node) {
+            return -1;
+        }
+
+        auto ret = node->init_hnsw(metadata_.index_id);
+        CHECK(ret)
+    }
+
+    return 0;
+}
+
+Ret Dataset::ann_hnsw(uint64_t count, uint64_t ef, const std::vector<uint8_t>& data, uint64_t skip_tag, ThreadPool* thread_pool,
+                      QueryContext* context) {
+    READ_OP_HEADER
+
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
+    for (const auto& node : snapshot->nodes) {
+        if (!node->has_hnsw()) {
+            return "HNSW graph is not built, MAKE_HNSW is required";
+        }
+    }
+
+    std::vector<DistItems> node_results(snapshot->nodes.size());
+
+    if (thread_pool) {
+        std::vector<std::future<DistItems>> futures;
+        futures.reserve(snapshot->nodes.size());
+
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
+
+            futures.push_back(thread_pool->submit_to(thread_pool->numa_node_group(node->numa_node()), [node_ptr = node.get(), node_snapshot = node_snapshot.get(), count, ef, &data, skip_tag, context] {
+                return node_ptr->ann_hnsw(*node_snapshot, count, ef, data, skip_tag, context);
+            }));
+        }
+
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            node_results[node_index] = futures[node_index].get();
+        }
+
+    } else {
+        for (size_t node_index = 0; node_index < snapshot->nodes.size(); node_index++) {
+            const auto& node = snapshot->nodes[node_index];
+            const auto& node_snapshot = snapshot->node_snapshots[node_index];
+
+            node_results[node_index] = node->ann_hnsw(*node_snapshot, count, ef, data, skip_tag, context);
+        }
+    }
+
+    return knn_result(node_results, count, context);
+}
+
+} // namespace sketch
@@ -1,29 +1,160 @@
 #include "dataset.h"
 #include "centroids.h"
 #include "ivf_builder.h"
+#include "lmdb2.h"
 #include "math.h"
+#include "residual_chunks.h"
 #include "string_utils.h"
 #include "input_data.h"
 #include "thread_pool.h"
 #include "log.h"
 
 #include <algorithm>
-#include <experimental/scope>
 #include <filesystem>
 #include <format>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 
+#include <experimental/scope>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
 
 namespace sketch {
 
+// Set on the thread running a build of the dataset, the build steps it calls are not blocked by it.
+static thread_local const Dataset* building_dataset = nullptr;
+
+void BuildProgress::start(const std::string& name) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    name_ = name;
+    stage_ = "starting";
+    running_ = true;
+    finished_ = false;
+    result_ = Ret(0);
+    steps_done_ = 0;
+    steps_count_ = 0;
+}
+
+void BuildProgress::set_stage(const std::string& stage, uint64_t steps_count) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    stage_ = stage;
+    steps_done_ = 0;
+    steps_count_ = steps_count;
+}
+
+void BuildProgress::finish(const Ret& result) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    finished_ = true;
+    result_ = result;
+}
+
+bool BuildProgress::running() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return running_;
+}
+
+std::string BuildProgress::report() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_ && !finished_) {
+        return "No index build has run";
+    }
+
+    std::stringstream sstream;
+    sstream << "build: " << name_ << "\n";
+    if (running_) {
+        sstream << "stage: " << stage_;
+        if (steps_count_ > 0) {
+            sstream << std::format(" {} of {}", steps_done_.load(), steps_count_.load());
+        }
+    } else if (result_ == 0) {
+        sstream << "finished";
+    } else {
+        sstream << "failed: " << result_.message();
+    }
+
+    return sstream.str();
+}
+
+Ret Dataset::run_build(const std::string& name, std::function<Ret()> build, bool async) {
+    if (shutting_down_) return -1;
+
+    if (build_running_.exchange(true)) {
+        return "Another index build is running";
+    }
+    build_cancelled_ = false;
+    build_progress_.start(name);
+
+    auto run = [this, name, build = std::move(build)] {
+        building_dataset = this;
+        const Ret ret = build();
+        building_dataset = nullptr;
+
+        if (ret != 0) {
+            LOG_ERROR << std::format("Index build {} of dataset '{}' failed: {}", name, name_, ret.message());
+        }
+        build_progress_.finish(ret);
+        build_running_ = false;
+        return ret;
+    };
+
+    if (!async) {
+        return run();
+    }
+
+    // The thread of the previous build has finished, it set build_running_ last
+    const std::lock_guard<std::mutex> lock(build_thread_mutex_);
+    if (build_thread_.joinable()) {
+        build_thread_.join();
+    }
+    build_thread_ = std::thread([run = std::move(run)] {
+        auto _ = run();
+    });
+
+    return Ret(0, std::format("Index build {} started", name));
+}
+
+Ret Dataset::build_checkpoint() const {
+    if (build_cancelled_ || shutting_down_) {
+        return "Index build cancelled";
+    }
+
+    return 0;
+}
+
+Ret Dataset::wait_build() {
+    const std::lock_guard<std::mutex> lock(build_thread_mutex_);
+    if (build_thread_.joinable()) {
+        build_thread_.join();
+    }
+
+    return 0;
+}
+
+Ret Dataset::build_status() const {
+    return Ret(0, build_progress_.report());
+}
+
+Dataset::BuildClaim::BuildClaim(Dataset& dataset) : dataset_(dataset) {
+    if (building_dataset == &dataset_) {
+        granted_ = true;
+    } else if (!dataset_.build_running_.exchange(true)) {
+        granted_ = true;
+        owned_ = true;
+        building_dataset = &dataset_;
+    }
+}
+
+Dataset::BuildClaim::~BuildClaim() {
+    if (owned_) {
+        building_dataset = nullptr;
+        dataset_.build_running_ = false;
+    }
+}
+
 Ret Dataset::sample_records(IvfBuilder& builder, ThreadPool* thread_pool) {
     uint64_t per_node_count = builder.records_count() / nodes_.size();
     if (per_node_count * nodes_.size() != builder.records_count()) {
@@ -68,12 +199,13 @@ Ret Dataset::sample_records(IvfBuilder& builder, ThreadPool* thread_pool) {
 }
 
 Ret Dataset::init_centroids_kmeans_plus_plus(IvfBuilder& builder, ThreadPool* thread_pool) {
+    build_progress_.set_stage("k-means++ initialization");
     auto ret = sample_records(builder, thread_pool);
     if (ret != 0) {
         return ret;
     }
 
-    ret = builder.init_centroids_kmeans_plus_plus();
+    ret = builder.init_centroids_kmeans_plus_plus(thread_pool);
     if (ret != 0) {
         return ret;
     }
@@ -84,8 +216,46 @@ Ret Dataset::init_centroids_kmeans_plus_plus(IvfBuilder& builder, ThreadPool* th
     return Ret(0, sstream.str(), true);
 }
 
+Ret Dataset::train_centroids_minibatch(IvfBuilder& builder, uint64_t batches_count, ThreadPool* thread_pool) {
+    if (builder.records_count() < builder.centroids_count()) {
+        return "Mini-batch size must not be less than centroids count";
+    }
+
+    auto ret = init_centroids_kmeans_plus_plus(builder, thread_pool);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Every batch is a fresh sample, so only batch size pointers into the storages are ever held.
+    build_progress_.set_stage("mini-batch k-means", batches_count);
+    for (uint64_t i = 0; i < batches_count; i++) {
+        ret = build_checkpoint();
+        if (ret != 0) {
+            return ret;
+        }
+
+        ret = sample_records(builder, thread_pool);
+        if (ret != 0) {
+            return ret;
+        }
+
+        ret = builder.minibatch_update(thread_pool);
+        if (ret != 0) {
+            return ret;
+        }
+        build_progress_.step_done();
+    }
+
+    return 0;
+}
+
 Ret Dataset::write_index(IvfBuilder& builder, ThreadPool* thread_pool) {
-    auto ret = write_centroids(builder);
+    const std::experimental::scope_exit remover([this, next_index_id = metadata_.index_id + 1] {
+        remove_partial_index(next_index_id);
+    });
+
+    build_progress_.set_stage("writing centroids");
+    auto ret = write_centroids(builder, thread_pool);
     builder.uninit();
     if (ret != 0) {
         return ret;
@@ -96,10 +266,15 @@ Ret Dataset::write_index(IvfBuilder& builder, ThreadPool* thread_pool) {
         return ret;
     }
 
-    return update_and_write_metadata();
+    ret = build_checkpoint();
+    if (ret != 0) {
+        return ret;
+    }
+
+    return update_and_write_metadata(thread_pool);
 }
 
-Ret Dataset::write_centroids(IvfBuilder& builder) {
+Ret Dataset::write_centroids(IvfBuilder& builder, ThreadPool* thread_pool) {
     const uint64_t next_index_id = metadata_.index_id + 1;
     const std::string index_path = path_ + "/index_" + std::to_string(next_index_id);
     if (!std::filesystem::create_directory(index_path)) {
@@ -107,7 +282,161 @@ Ret Dataset::write_centroids(IvfBuilder& builder) {
     }
 
     const std::string centroids_path = index_path + "/centroids";
-    return Centroids::write_centroids(centroids_path, builder);
+    auto ret = Centroids::write_centroids(centroids_path, builder);
+    CHECK(ret)
+
+    if (builder.centroids_count() >= Centroids::HnswMinCentroids) {
+        ret = Centroids::write_hnsw(index_path + "/centroids.hnsw", builder, thread_pool);
+        CHECK(ret)
+    }
+
+    return 0;
+}
+
+Ret Dataset::load_centroids(const std::string& index_path, std::unique_ptr<Centroids>& centroids) const {
+    auto result = std::make_unique<Centroids>();
+    auto ret = result->init(index_path + "/centroids");
+    CHECK(ret)
+
+    const std::string coarse_path = index_path + "/coarse";
+    if (std::filesystem::exists(coarse_path)) {
+        ret = result->init_coarse(coarse_path);
+        CHECK(ret)
+    }
+
+    const std::string hnsw_path = index_path + "/centroids.hnsw";
+    if (std::filesystem::exists(hnsw_path)) {
+        ret = result->init_hnsw(hnsw_path);
+        CHECK(ret)
+    }
+
+    ret = result->init_assigner(metadata_.type, metadata_.dim);
+    CHECK(ret)
+
+    centroids = std::move(result);
+    return 0;
+}
+
+Ret Dataset::make_two_level_ivf(uint32_t coarse_count, uint32_t sub_count, uint32_t sample_size, uint64_t recalc_count,
+                                ThreadPool* thread_pool) {
+    BUILD_OP_HEADER
+
+    if (coarse_count == 0 || sub_count == 0) {
+        return "Two-level IVF requires coarse and sub centroids";
+    }
+
+    if (static_cast<uint64_t>(coarse_count) * sub_count >= InvalidClusterId) {
+        return std::format("Too many clusters: {} x {}", coarse_count, sub_count);
+    }
+
+    const auto type = metadata_.type;
+    const auto dim = metadata_.dim;
+
+    IvfBuilder coarse_builder(type, dim, coarse_count, sample_size);
+    CHECK(coarse_builder.init())
+    CHECK(init_centroids_kmeans_plus_plus(coarse_builder, thread_pool))
+    for (uint64_t i = 0; i < recalc_count / 2 + 1; i++) {
+        CHECK(build_checkpoint())
+        CHECK(coarse_builder.recalc_centroids(thread_pool))
+    }
+
+    // Split the sample by coarse cell, every cell is clustered on its own records only.
+    std::vector<const uint8_t*> records;
+    records.reserve(sample_size);
+    for (uint32_t i = 0; i < sample_size; i++) {
+        if (coarse_builder.get_record(i)) {
+            records.push_back(coarse_builder.get_record(i));
+        }
+    }
+
+    CentroidAssigner assigner;
+    CHECK(assigner.init(type, dim, coarse_builder.get_centroid(0), coarse_builder.vector_size(), coarse_count))
+
+    std::vector<uint32_t> cells(records.size());
+    assigner.find_nearest(records.data(), records.size(), cells.data());
+
+    std::vector<std::vector<const uint8_t*>> cell_records(coarse_count);
+    for (size_t i = 0; i < records.size(); i++) {
+        cell_records[cells[i]].push_back(records[i]);
+    }
+
+    std::vector<uint32_t> offsets(coarse_count + 1, 0);
+    for (uint32_t cell = 0; cell < coarse_count; cell++) {
+        const uint64_t count = std::min<uint64_t>(sub_count, cell_records[cell].size());
+        offsets[cell + 1] = offsets[cell] + count;
+    }
+
+    if (offsets.back() == 0) {
+        return "Failed to sample records for two-level IVF";
+    }
+
+    IvfBuilder builder(type, dim, offsets.back(), 0);
+    CHECK(builder.init())
+
+    auto train_cell = [this, &builder, &cell_records, &offsets, type, dim, recalc_count](uint32_t cell) -> Ret {
+        CHECK(build_checkpoint())
+
+        const auto& cell_sample = cell_records[cell];
+        const uint32_t count = offsets[cell + 1] - offsets[cell];
+        if (count == 0) {
+            return 0;
+        }
+
+        IvfBuilder cell_builder(type, dim, count, cell_sample.size());
+        CHECK(cell_builder.init())
+        for (size_t i = 0; i < cell_sample.size(); i++) {
+            cell_builder.set_record(i, cell_sample[i]);
+        }
+
+        CHECK(cell_builder.init_centroids_kmeans_plus_plus())
+        for (uint64_t i = 0; i < recalc_count / 2 + 1; i++) {
+            CHECK(cell_builder.recalc_centroids())
+        }
+
+        memcpy(builder.get_centroids() + offsets[cell] * builder.vector_size(), cell_builder.get_centroid(0),
+               count * builder.vector_size());
+        return 0;
+    };
+
+    if (thread_pool) {
+        std::vector<std::future<Ret>> futures;
+        futures.reserve(coarse_count);
+
+        for (uint32_t cell = 0; cell < coarse_count; cell++) {
+            futures.push_back(thread_pool->submit([&train_cell, cell] {
+                return train_cell(cell);
+            }));
+        }
+
+        Ret ret = 0;
+        for (auto& future : futures) {
+            Ret res = future.get();
+            if (res != 0) {
+                ret = res;
+            }
+        }
+        CHECK(ret)
+
+    } else {
+        for (uint32_t cell = 0; cell < coarse_count; cell++) {
+            CHECK(train_cell(cell))
+        }
+    }
+
+    const std::experimental::scope_exit remover([this, next_index_id = metadata_.index_id + 1] {
+        remove_partial_index(next_index_id);
+    });
+
+    CHECK(write_centroids(builder, thread_pool))
+    builder.uninit();
+
+    const std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id + 1);
+    CHECK(Centroids::write_coarse(index_path + "/coarse", coarse_builder, offsets))
+    coarse_builder.uninit();
+
+    CHECK(write_index_internal(thread_pool))
+
+    return update_and_write_metadata(thread_pool);
 }
 
 Ret Dataset::write_index_internal(ThreadPool* thread_pool) {
@@ -120,32 +449,38 @@ Ret Dataset::write_index_internal(ThreadPool* thread_pool) {
         return "Centroids file does not exist";
     }
 
-    auto centroids = std::make_unique<Centroids>();
-    auto ret = centroids->init(centroids_path);
+    std::unique_ptr<Centroids> centroids;
+    auto ret = load_centroids(index_path, centroids);
     if (ret != 0) {
         return ret;
     }
 
+    build_progress_.set_stage("writing index", nodes_.size());
     if (thread_pool) {
-        std::vector<std::future<Ret>> futures;
-        futures.reserve(nodes_.size());
-
+        // The nodes split their records into morsels on the same pool, the waits of the task group
+        // run pending morsels, so a small dataset still keeps every worker busy.
+        std::vector<Ret> results(nodes_.size(), Ret(0));
+        TaskGroup group(*thread_pool);
         for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
             auto node = get_node(node_index);
             if (!node) {
                 return -1;
             }
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), &centroids, next_index_id] {
-                return node_ptr->write_index(*centroids, next_index_id);
-            }));
+            group.run([this, node_ptr = node.get(), &centroids, &results, node_index, next_index_id, thread_pool] {
+                results[node_index] = build_checkpoint();
+                if (results[node_index] == 0) {
+                    results[node_index] = node_ptr->write_index(*centroids, next_index_id, thread_pool);
+                }
+                build_progress_.step_done();
+            });
         }
+        group.wait();
 
         for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
-            Ret res = futures[node_index].get();
-            if (res != 0) {
-                LOG_DEBUG << "ERROR: " << res.message();                
-                ret = res;
+            if (results[node_index] != 0) {
+                LOG_DEBUG << "ERROR: " << results[node_index].message();
+                ret = results[node_index];
             }
         }
 
@@ -156,7 +491,11 @@ Ret Dataset::write_index_internal(ThreadPool* thread_pool) {
                 return -1;
             }
 
-            Ret res = node->write_index(*centroids, next_index_id);
+            Ret res = build_checkpoint();
+            if (res == 0) {
+                res = node->write_index(*centroids, next_index_id);
+            }
+            build_progress_.step_done();
             if (res != 0) {
                 ret = res;
             }
@@ -166,105 +505,182 @@ Ret Dataset::write_index_internal(ThreadPool* thread_pool) {
     return ret;
 }
 
-Ret Dataset::update_and_write_metadata() {
-    metadata_.index_id++;
-    auto ret = write_metadata();
-    if (ret != 0) {
-        return ret;
+void Dataset::remove_partial_index(uint64_t index_id) {
+    if (metadata_.index_id >= index_id) {
+        return;
     }
 
-    for (auto& node : nodes_) {
-        node->uninit();
-        node.reset();
+    std::error_code ec;
+    std::filesystem::remove_all(path_ + "/index_" + std::to_string(index_id), ec);
+    for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        auto node = get_node(node_index);
+        if (node) {
+            node->remove_index(index_id);
+        }
     }
+}
 
-    const std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id);
-    const std::string centroids_path = index_path + "/centroids";
-    centroids_ = std::make_unique<Centroids>();
-    ret = centroids_->init(centroids_path);
+Ret Dataset::update_and_write_metadata(ThreadPool* thread_pool) {
+    build_progress_.set_stage("switching index");
+    const uint64_t next_index_id = metadata_.index_id + 1;
+    auto ret = write_cluster_stats(next_index_id);
+    CHECK(ret)
+
+    const std::string index_path = path_ + "/index_" + std::to_string(next_index_id);
+    std::unique_ptr<Centroids> centroids;
+    ret = load_centroids(index_path, centroids);
+    CHECK(ret)
+
+    std::shared_ptr<ClusterStats> cluster_stats;
+    ret = load_cluster_stats(index_path, cluster_stats);
+    CHECK(ret)
+
+    // Codebooks are trained on the residuals of their centroids, new centroids come without them.
+    const uint64_t pq_count = metadata_.pq_count;
+    const bool pq_reset = pq_count != 0 && !std::filesystem::exists(index_path + "/pq_centroids_0");
+    if (pq_reset) {
+        metadata_.pq_count = 0;
+    }
+
+    // The nodes of the new index are opened beside the current ones, queries keep running on the
+    // snapshot of the current index until its nodes, centroids and statistics are replaced at once.
+    metadata_.index_id = next_index_id;
+    std::vector<DatasetNodePtr> nodes;
+    ret = open_nodes(nodes, thread_pool);
     if (ret != 0) {
+        metadata_.index_id--;
+        metadata_.pq_count = pq_count;
         return ret;
     }
 
+    ret = write_metadata();
+    CHECK(ret)
+
+    ret = load_pq_centroids();
+    CHECK(ret)
+
+    nodes_ = std::move(nodes);
+    centroids_ = std::move(centroids);
+    cluster_stats_ = std::move(cluster_stats);
+    ret = publish_snapshot();
+    CHECK(ret)
+
     std::stringstream sstream;
     print_centroids(metadata_.type, metadata_.dim, 16, *centroids_, sstream);
+    if (pq_reset) {
+        LOG_INFO << std::format("PQ codebooks of index {} were dropped with its centroids", metadata_.index_id - 1);
+        sstream << "PQ codebooks were dropped, MAKE_PQ_CENTROIDS is required\n";
+    }
 
     return Ret(0, sstream.str(), true);
 }
 
-static void print_data(DatasetType type, uint64_t dim, uint64_t count, const uint8_t* data, std::ostream& stream) {
-    switch (type) {
-        case DatasetType::f32: {
-            const float* f = reinterpret_cast<const float*>(data);
-            for (uint64_t i = 0; i < dim && i < count; i++) {
-                stream << f[i] << ", ";
-            }
-            break;
+// Statistics of the nodes are merged into the statistics of the index, an index whose nodes did not
+// write them, e.g. a mocked one, has none.
+Ret Dataset::write_cluster_stats(uint64_t index_id) {
+    ClusterStats stats;
+    for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        auto node = get_node(node_index);
+        if (!node) {
+            return -1;
         }
-        case DatasetType::f16: {
-            const float16_t* f16 = reinterpret_cast<const float16_t*>(data);
-            for (uint64_t i = 0; i < dim && i < count; i++) {
-                stream << f16[i] << ", ";
-            }
-            break;
+
+        ClusterStats node_stats;
+        auto ret = node->read_cluster_stats(index_id, node_stats);
+        if (ret != 0) {
+            LOG_DEBUG << ret.message();
+            return 0;
         }
-        case DatasetType::u8: {
-            for (uint64_t i = 0; i < dim && i < count; i++) {
-                stream << (int)data[i] << ", ";
-            }
-            break;
+
+        ret = stats.merge(node_stats);
+        CHECK(ret)
+    }
+
+    return stats.write(path_ + "/index_" + std::to_string(index_id) + "/cluster_stats");
+}
+
+Ret Dataset::load_cluster_stats(const std::string& index_path, std::shared_ptr<ClusterStats>& stats) const {
+    const std::string path = index_path + "/cluster_stats";
+    if (!std::filesystem::exists(path)) {
+        stats.reset();
+        return 0;
+    }
+
+    auto result = std::make_shared<ClusterStats>();
+    auto ret = result->read(path);
+    CHECK(ret)
+
+    stats = std::move(result);
+    return 0;
+}
+
+uint64_t Dataset::predict_ann_records(const ClusterStats* stats, const std::vector<uint32_t>& cluster_ids) {
+    if (!stats) {
+        return 0;
+    }
+
+    uint64_t records_count = 0;
+    for (const auto cluster_id : cluster_ids) {
+        if (cluster_id < stats->clusters_count()) {
+            records_count += stats->size(cluster_id);
         }
     }
+    return records_count;
+}
+
+Ret Dataset::ivf_stats() {
+    READ_OP_HEADER
+
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
+    if (!snapshot->cluster_stats) {
+        return std::format("Cluster statistics are not available for index {}", snapshot->index_id);
+    }
+
+    std::stringstream sstream;
+    sstream << "index: " << snapshot->index_id << "\n";
+    sstream << snapshot->cluster_stats->report(StatsLargestListsCount);
+
+    return Ret(0, sstream.str());
 }
 
 Ret Dataset::dump_ivf() {
     READ_OP_HEADER
 
-    if (!centroids_) {
+    const auto snapshot = pin_snapshot();
+    if (!snapshot) {
+        return "Failed to get dataset nodes";
+    }
+
+    const auto& centroids = snapshot->centroids;
+    if (!centroids) {
         return "Centroids not initialized";
     };
 
     std::stringstream sstream;
 
     sstream << "===== Centroids: ====\n";
-    print_centroids(metadata_.type, metadata_.dim, centroids_->centroids_count(), *centroids_, sstream);
+    print_centroids(snapshot->metadata.type, snapshot->metadata.dim, centroids->centroids_count(), *centroids, sstream);
 
-    const uint64_t max_residuals_to_print = 16;
-    const std::string residuals_path = path_ + "/index_" + std::to_string(metadata_.index_id) + "/residuals";
-    if (std::filesystem::exists(residuals_path)) {
+    if (residuals_count_ != 0 && residuals_index_id_ == snapshot->metadata.index_id) {
         sstream << "\n";
-        sstream << "Residuals:\n";
-        const uint64_t record_size = metadata_.record_size();
-        std::ifstream residuals_file(residuals_path, std::ios::binary);
-        if (!residuals_file.is_open()) {
-            return std::format("Failed to open residuals file at '{}'", residuals_path);
-        }
-
-        std::vector<uint8_t> record_data(record_size);
-        uint64_t record_index = 0;
-        while (true && record_index < max_residuals_to_print) {
-            residuals_file.read(reinterpret_cast<char*>(record_data.data()), record_size);
-            if (residuals_file.eof()) {
-                break;
-            }
-
-            sstream << "  Residual " << record_index << ": ";
-            print_data(metadata_.type, metadata_.dim, 4, record_data.data(), sstream);
-            sstream << "\n";
-            record_index++;
-        }
-
+        sstream << "Residuals: " << residuals_count_ << " sampled per PQ training\n";
     }
 
     sstream << "\n";
     sstream << "PQ Centroids:\n";
-    for (size_t pq_index = 0; pq_index < pq_centroids_.size(); pq_index++) {
+    static const std::vector<std::unique_ptr<Centroids>> no_pq_centroids;
+    const auto& pq_centroids = snapshot->pq_codebooks ? snapshot->pq_codebooks->centroids : no_pq_centroids;
+    for (size_t pq_index = 0; pq_index < pq_centroids.size(); pq_index++) {
         sstream << "  PQ Chunk " << pq_index << ":\n";
         print_centroids(
-            metadata_.type,
-            metadata_.dim / pq_centroids_.size(),
-            std::min(8UL, pq_centroids_[pq_index]->centroids_count()),
-            *pq_centroids_[pq_index],
+            snapshot->metadata.type,
+            snapshot->metadata.dim / pq_centroids.size(),
+            std::min(8UL, pq_centroids[pq_index]->centroids_count()),
+            *pq_centroids[pq_index],
             sstream);
         sstream << "\n";
     }
@@ -273,48 +689,9 @@ Ret Dataset::dump_ivf() {
     return Ret(0, sstream.str(), true);
 }
 
-Ret Dataset::make_residuals(uint64_t count, ThreadPool* thread_pool) {
-    READ_OP_HEADER
-
-    if (!centroids_) {
-        return "Centroids not initialized";
-    };
-
-    if (count % centroids_->centroids_count() != 0) {
-        count = ((count / centroids_->centroids_count()) + 1) * centroids_->centroids_count();
-    }
-
-    if (count % nodes_.size() != 0) {
-        count = ((count / nodes_.size()) + 1) * nodes_.size();
-    }
-
-    const std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id);
-    if (!std::filesystem::exists(index_path)) {
-        std::filesystem::create_directory(index_path);
-    }
-    const std::string residuals_path = index_path + "/residuals";
-    const uint64_t record_size = metadata_.record_size();
-    const uint64_t residuals_file_size = record_size * count;
-
-    int fd = open(residuals_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        return std::format("Failed to create residuals file at '{}'", residuals_path);
-    }
-
-    ftruncate(fd, residuals_file_size);
-    void* mapped = mmap(nullptr, residuals_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    close(fd);
-    if (mapped == MAP_FAILED) {
-        return std::format("Failed to mmap residuals file at '{}'", residuals_path);
-    }
-
-    const std::experimental::scope_exit unmapper([&] {
-        munmap(mapped, residuals_file_size);
-    });
-
-    uint8_t* mapped_u8 = reinterpret_cast<uint8_t*>(mapped);
-    auto per_node_count = count / nodes_.size();
-    bool is_test_run = make_residuals_test_func_ != nullptr;
+Ret Dataset::compute_residuals(uint64_t count, ResidualChunks& residuals, ThreadPool* thread_pool) {
+    const auto per_node_count = count / nodes_.size();
+    const bool is_test_run = make_residuals_test_func_ != nullptr;
 
     Ret res{0};
     if (thread_pool) {
@@ -327,8 +704,9 @@ Ret Dataset::make_residuals(uint64_t count, ThreadPool* thread_pool) {
                 return -1;
             }
 
-            futures.push_back(thread_pool->submit([node_ptr = node.get(), cents = centroids_.get(), per_node_count, mapped_u8, is_test_run] {
-                return node_ptr->make_residuals(*cents, mapped_u8, per_node_count, is_test_run);
+            futures.push_back(thread_pool->submit([node_ptr = node.get(), cents = centroids_.get(), &residuals,
+                                                   offset = node_index * per_node_count, per_node_count, is_test_run] {
+                return node_ptr->make_residuals(*cents, residuals, offset, per_node_count, is_test_run);
             }));
         }
 
@@ -347,15 +725,43 @@ Ret Dataset::make_residuals(uint64_t count, ThreadPool* thread_pool) {
                 return -1;
             }
 
-            auto ret = node->make_residuals(*centroids_, mapped_u8, per_node_count, is_test_run);
+            auto ret = node->make_residuals(*centroids_, residuals, node_index * per_node_count, per_node_count, is_test_run);
             if (ret != 0) {
                 return ret;
             }
         }
     }
 
-    if (res == 0 && make_residuals_test_func_) {
-        res = make_residuals_test_func_(metadata_.type, metadata_.dim, count, mapped_u8);
+    return res;
+}
+
+Ret Dataset::make_residuals(uint64_t count, ThreadPool* thread_pool) {
+    BUILD_OP_HEADER
+
+    if (!centroids_) {
+        return "Centroids not initialized";
+    };
+
+    if (count % centroids_->centroids_count() != 0) {
+        count = ((count / centroids_->centroids_count()) + 1) * centroids_->centroids_count();
+    }
+
+    if (count % nodes_.size() != 0) {
+        count = ((count / nodes_.size()) + 1) * nodes_.size();
+    }
+
+    // Only the sample size is kept, make_pq_centroids streams the residuals into its chunk buffers.
+    residuals_count_ = count;
+    residuals_index_id_ = metadata_.index_id;
+
+    Ret res{0};
+    if (make_residuals_test_func_) {
+        ResidualChunks residuals;
+        residuals.init(metadata_.record_size(), 1, count);
+        res = compute_residuals(count, residuals, thread_pool);
+        if (res == 0) {
+            res = make_residuals_test_func_(metadata_.type, metadata_.dim, count, residuals.chunk(0));
+        }
     }
 
     return res;
@@ -365,45 +771,27 @@ class PQCentroidWorker {
 public:
     PQCentroidWorker(
         const DatasetType _type,
-        const uint64_t _record_size,
-        const uint64_t _pq_centroids_record_size,
         const uint64_t _pq_centroid_dim,
         const uint64_t _pq_centroids_count,
-        const uint64_t _records_count,
-        const uint8_t* _residuals_mapped_u8,
+        const ResidualChunks& _residuals,
         const std::string& _index_path)
     : type(_type)
-    , record_size(_record_size)
-    , pq_centroids_record_size(_pq_centroids_record_size)
     , pq_centroid_dim(_pq_centroid_dim)
     , pq_centroids_count(_pq_centroids_count)
-    , records_count(_records_count)
-    , residuals_mapped_u8(_residuals_mapped_u8)
+    , residuals(_residuals)
     , index_path(_index_path)
     {}
 
     Ret build_pq_centroids(uint64_t pq_index) const {
-        /*std::cerr << "Building PQ centroids for chunk " << pq_index << " ..." << std::endl;
-        std::cerr << "Record size: " << record_size << std::endl;
-        std::cerr << "PQ centroids record size: " << pq_centroids_record_size << std::endl;
-        std::cerr << "PQ centroid dim: " << pq_centroid_dim << std::endl;
-        std::cerr << "PQ centroids count: " << pq_centroids_count << std::endl;
-        std::cerr << "Records count: " << records_count << std::endl;
-        std::cerr << std::endl;*/
-
+        const uint64_t records_count = residuals.count();
         IvfBuilder pq_builder(type, pq_centroid_dim, pq_centroids_count, records_count);
         auto ret = pq_builder.init();
         CHECK(ret)
 
+        // The chunk buffer is sequential, KMeans reads the sub-vectors of this chunk only.
         for (uint64_t j = 0; j < records_count; j++) {
-            const uint8_t* record_ptr = residuals_mapped_u8 + j * record_size;
-            const uint8_t* chunk_ptr = record_ptr + pq_index * pq_centroids_record_size;
-
-            //const float* data = reinterpret_cast<const float*>(chunk_ptr);
-            //std::cerr << j << ") " << data[0] << ", " << data[1] << ", " << data[2] << ", " << data[3] << std::endl;
-            pq_builder.set_record(j, chunk_ptr);
+            pq_builder.set_record(j, residuals.get(pq_index, j));
         }
-        //std::cerr << std::endl;
 
         ret = pq_builder.init_centroids_kmeans_plus_plus();
         CHECK(ret)
@@ -413,27 +801,35 @@ public:
             CHECK(ret)
         }
 
+        // Written beside the codebook the published snapshot maps and renamed over it, its mapping keeps the old file.
         const std::string pq_centroids_path = index_path + "/pq_centroids_" + std::to_string(pq_index);
-        ret = Centroids::write_centroids(pq_centroids_path, pq_builder);
+        ret = Centroids::write_centroids(pq_centroids_path + ".tmp", pq_builder);
         CHECK(ret)
 
+        std::error_code ec;
+        std::filesystem::rename(pq_centroids_path + ".tmp", pq_centroids_path, ec);
+        if (ec) {
+            return std::format("Failed to rename '{}.tmp': {}", pq_centroids_path, ec.message());
+        }
+
         return 0;
     }
 
 private:
     const DatasetType type;
-    const uint64_t record_size;
-    const uint64_t pq_centroids_record_size;
     const uint64_t pq_centroid_dim;
     const uint64_t pq_centroids_count;
-    const uint64_t records_count;
-    const uint8_t* residuals_mapped_u8;
+    const ResidualChunks& residuals;
     const std::string& index_path;
 
 };
 
-Ret Dataset::make_pq_centroids(uint64_t chunk_count, uint64_t pq_centroids_count, ThreadPool* thread_pool) {
-    READ_OP_HEADER
+Ret Dataset::make_pq_centroids(uint64_t chunk_count, uint64_t pq_centroids_count, ThreadPool* thread_pool, bool opq) {
+    BUILD_OP_HEADER
+
+    if (opq && metadata_.type == DatasetType::u8) {
+        return "OPQ is not supported for u8 datasets";
+    }
 
     if (metadata_.dim % chunk_count != 0) {
         return "DIMENSION is not divisible by the number of PQ centroids";
@@ -445,50 +841,56 @@ Ret Dataset::make_pq_centroids(uint64_t chunk_count, uint64_t pq_centroids_count
 
     const std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id);
 
-    //******************************************************************************************************* */
-    const std::string residuals_path = index_path + "/residuals";
-    if (!std::filesystem::exists(residuals_path)) {
-        return "Residuals file does not exist";
+    if (residuals_count_ == 0 || residuals_index_id_ != metadata_.index_id) {
+        return "Residuals are not prepared, MAKE_RESIDUAL is required for the current index";
     }
 
-    int residuals_fd = open(residuals_path.c_str(), O_RDONLY);
-    if (residuals_fd == -1) {
-        return std::format("Failed to open residuals file at '{}'", residuals_path);
-    }
+    const uint64_t record_size = metadata_.record_size();
+    const uint64_t records_count = residuals_count_;
 
-    struct stat st;
-    if (fstat(residuals_fd, &st) == -1) {
-        close(residuals_fd);
-        return std::format("Failed to stat residuals file at '{}'", residuals_path);
-    }
+    ResidualChunks residuals;
+    residuals.init(record_size, chunk_count, records_count);
+    auto ret = compute_residuals(records_count, residuals, thread_pool);
+    CHECK(ret)
 
-    void* residuals_mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, residuals_fd, 0);
-    close(residuals_fd);
-    if (residuals_mapped == MAP_FAILED) {
-        return std::format("Failed to mmap residuals file at '{}'", residuals_path);
-    }
+    // The codebooks of OPQ are trained on the rotated residuals, the rotation is learned on a strided sample.
+    const std::string opq_path = index_path + "/opq_rotation";
+    if (opq) {
+        const uint64_t sample_count = std::min(records_count, OpqSampleSize);
+        std::vector<uint8_t> sample(sample_count * record_size);
+        for (uint64_t i = 0; i < sample_count; i++) {
+            residuals.gather(i * records_count / sample_count, sample.data() + i * record_size);
+        }
 
-    const std::experimental::scope_exit unmapper([&] {
-        munmap(residuals_mapped, st.st_size);
-    });
+        std::vector<float> matrix;
+        ret = OpqRotation::train(metadata_.type, metadata_.dim, chunk_count, pq_centroids_count,
+                                 sample.data(), record_size, sample_count, OpqParams(), matrix, nullptr, thread_pool);
+        CHECK(ret)
 
-    uint8_t* residuals_mapped_u8 = reinterpret_cast<uint8_t*>(residuals_mapped);
-    const uint64_t record_size = metadata_.record_size();
-    const uint64_t records_count = st.st_size / record_size;
+        ret = OpqRotation::write(opq_path, metadata_.dim, matrix);
+        CHECK(ret)
+
+        OpqRotation rotation;
+        ret = rotation.init(metadata_.dim, matrix);
+        CHECK(ret)
 
-    const uint64_t pq_centroids_record_size = metadata_.record_size() / chunk_count;
-    const uint64_t pq_centroid_dim = metadata_.dim / chunk_count;
+        std::vector<uint8_t> residual(record_size);
+        std::vector<uint8_t> rotated(record_size);
+        for (uint64_t n = 0; n < records_count; n++) {
+            residuals.gather(n, residual.data());
+            rotation.apply(metadata_.type, residual.data(), rotated.data());
+            residuals.scatter(n, rotated.data());
+        }
+
+    } else {
+        std::filesystem::remove(opq_path);
+    }
 
-    //******************************************************************************************************* */
-    (void)thread_pool;
     const PQCentroidWorker worker(
         metadata_.type,
-        record_size,
-        pq_centroids_record_size,
-        pq_centroid_dim,
+        metadata_.dim / chunk_count,
         pq_centroids_count,
-        records_count,
-        residuals_mapped_u8,
+        residuals,
         index_path);
 
     Ret res{0};
@@ -520,40 +922,52 @@ Ret Dataset::make_pq_centroids(uint64_t chunk_count, uint64_t pq_centroids_count
     CHECK(res)
 
     metadata_.pq_count = chunk_count;
-    auto ret = write_metadata();
+    ret = write_metadata();
     CHECK(ret)
 
     ret = load_pq_centroids();
     CHECK(ret)
 
     if (make_pq_centroids_test_func_) {
-        (void)make_pq_centroids_test_func_(pq_centroids_);
+        (void)make_pq_centroids_test_func_(pq_codebooks_->centroids);
     }
 
-    return 0;
+    // Queries running DUMP_IVF keep the codebooks of their snapshot
+    return publish_snapshot();
 }
 
 Ret Dataset::load_pq_centroids() {
     if (metadata_.pq_count == 0) {
+        pq_codebooks_.reset();
         return 0;
     }
 
     std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id);
 
-    pq_centroids_.resize(metadata_.pq_count);
+    // Loaded aside, the published codebooks may still be read by queries.
+    auto codebooks = std::make_shared<PqCodebooks>();
+    codebooks->centroids.resize(metadata_.pq_count);
 
     for (size_t pq_index = 0; pq_index < metadata_.pq_count; pq_index++) {
         const std::string pq_centroids_path = index_path + "/pq_centroids_" + std::to_string(pq_index);
-        pq_centroids_[pq_index] = std::make_unique<Centroids>();
-        auto ret = pq_centroids_[pq_index]->init(pq_centroids_path);
+        codebooks->centroids[pq_index] = std::make_unique<Centroids>();
+        auto ret = codebooks->centroids[pq_index]->init(pq_centroids_path);
         CHECK(ret)
     }
 
+    const std::string opq_path = index_path + "/opq_rotation";
+    if (std::filesystem::exists(opq_path)) {
+        codebooks->opq = std::make_unique<OpqRotation>();
+        auto ret = codebooks->opq->init(opq_path);
+        CHECK(ret)
+    }
+
+    pq_codebooks_ = std::move(codebooks);
     return 0;
 }
 
 Ret Dataset::mock_ivf(uint64_t centroids_count, uint64_t sample_count, uint64_t chunk_count, uint64_t pq_centroids_depth) {
-    READ_OP_HEADER
+    BUILD_OP_HEADER
 
     const uint64_t prev_index_id = metadata_.index_id;
 
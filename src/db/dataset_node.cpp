@@ -1,8 +1,13 @@
 #include "dataset_node.h"
+#include "binary_codes.h"
 #include "centroids.h"
+#include "cluster_stats.h"
+#include "hnsw.h"
 #include "ivf_builder.h"
 #include "lmdb2.h"
 #include "math.h"
+#include "posting_lists.h"
+#include "query_context.h"
 #include "storage.h"
 #include "string_utils.h"
 #include "input_data.h"
@@ -19,7 +24,8 @@ namespace sketch {
 DatasetNode::DatasetNode(uint64_t id, const std::string& path)
   : id_(id),
     dir_path_(path + "/node_" + std::to_string(id)),
-    path_(dir_path_ + "/data.bin")
+    path_(dir_path_ + "/data.bin"),
+    codes_path_(dir_path_ + "/codes.bin")
 {
 
 }
@@ -54,8 +60,13 @@ Ret DatasetNode::create(const DatasetMetadata& metadata, uint64_t initial_record
     }
 
     record_size_ = metadata.record_size();
-    storage_ = std::make_unique<Storage>(path_, record_size_);
-    return storage_->create(initial_records_count);
+    storage_ = std::make_shared<Storage>(path_, record_size_);
+    ret = storage_->create(initial_records_count);
+    CHECK(ret)
+
+    codes_ = std::make_shared<BinaryCodes>();
+    codes_->init(dim_);
+    return codes_->write(codes_path_);
 }
 
 Ret DatasetNode::create_lmdb(const std::string& path) {
@@ -83,9 +94,10 @@ std::unique_ptr<LmdbEnv> DatasetNode::open_lmdb(const std::string& path) {
     return lmdb;
 }
 
-Ret DatasetNode::init(const DatasetMetadata& metadata) {
+Ret DatasetNode::init(const DatasetMetadata& metadata, int numa_node) {
     type_ = metadata.type;
     dim_ = metadata.dim;
+    numa_node_ = numa_node;
 
     std::string index_path = dir_path_ + "/index_" + std::to_string(metadata.index_id);
     lmdb_ = open_lmdb(index_path);
@@ -94,8 +106,80 @@ Ret DatasetNode::init(const DatasetMetadata& metadata) {
     }
 
     record_size_ = metadata.record_size();
-    storage_ = std::make_unique<Storage>(path_, record_size_);
-    return storage_->init();
+    storage_ = std::make_shared<Storage>(path_, record_size_);
+    auto ret = storage_->init();
+    CHECK(ret)
+
+    // The records are still read from other NUMA nodes when they cannot be moved
+    if (numa_node_ >= 0) {
+        const auto bind_ret = storage_->bind_memory(numa_node_);
+        if (bind_ret != 0) {
+            LOG_WARN << "Records of node " << id_ << " are not placed on NUMA node " << numa_node_ << ": " << bind_ret.message();
+        }
+    }
+
+    ret = init_binary_codes();
+    CHECK(ret)
+
+    ret = init_postings(metadata.index_id);
+    CHECK(ret)
+
+    ret = init_hnsw(metadata.index_id);
+    CHECK(ret)
+
+    publish_snapshot();
+    return 0;
+}
+
+Ret DatasetNode::init_index(const DatasetNode& current, uint64_t index_id) {
+    type_ = current.type_;
+    dim_ = current.dim_;
+    record_size_ = current.record_size_;
+    numa_node_ = current.numa_node_;
+    storage_ = current.storage_;
+    codes_ = current.codes_;
+
+    std::string index_path = dir_path_ + "/index_" + std::to_string(index_id);
+    lmdb_ = open_lmdb(index_path);
+    if (!lmdb_) {
+        return "Failed to initialize LMDB";
+    }
+
+    auto ret = init_postings(index_id);
+    CHECK(ret)
+
+    hnsw_ = current.hnsw_;
+
+    publish_snapshot();
+    return 0;
+}
+
+void DatasetNode::publish_snapshot() {
+    snapshot_ = std::make_shared<const NodeSnapshot>(NodeSnapshot {
+        .storage = storage_->snapshot(),
+        .codes = codes_,
+    });
+}
+
+Ret DatasetNode::release_deleted() {
+    return storage_->release_deleted();
+}
+
+Ret DatasetNode::init_binary_codes() {
+    codes_ = std::make_shared<BinaryCodes>();
+    auto ret = codes_->read(codes_path_);
+    if (ret == 0 && codes_->dim() == dim_ && codes_->count() == storage_->upper_record_id()) {
+        return 0;
+    }
+
+    // Missing or stale codes, e.g. of a dataset written before the codes existed, are rebuilt from data.bin.
+    LOG_DEBUG << std::format("Rebuilding binary codes of node {}", id_);
+    codes_->init(dim_);
+    for (uint64_t record_id = 0; record_id < storage_->upper_record_id(); record_id++) {
+        codes_->set(record_id, type_, storage_->get_record_data(record_id));
+    }
+
+    return codes_->write(codes_path_);
 }
 
 Ret DatasetNode::uninit() {
@@ -143,7 +227,7 @@ Ret DatasetNode::prepare_load(const std::string& node_path, size_t nodes_count,
         }
 
         uint32_t record_id = INVALID_RECORD_ID;
-        uint16_t cluster_id = InvalidClusterId;
+        uint32_t cluster_id = InvalidClusterId;
         lmdb_reader->read_record(tag, record_id, cluster_id);
 
         fwrite(&counter, 1, sizeof(counter), f);
@@ -170,6 +254,9 @@ Ret DatasetNode::load(const std::string& node_path, const DatasetMetadata& metad
 
     DataBuffer data_buffer(record_size_, HeaderSize);
 
+    // Queries scan the codes of the published snapshot meanwhile, the copy shares their chunks until it changes them
+    auto codes = std::make_shared<BinaryCodes>(*codes_);
+
     FILE* f = fopen(node_path.c_str(), "r");
     if (!f) {
         return std::format("Failed to open load file for node {} : {}", id_, node_path);
@@ -187,7 +274,7 @@ Ret DatasetNode::load(const std::string& node_path, const DatasetMetadata& metad
 
         uint64_t tag = 0;
         uint32_t record_id = 0;
-        uint16_t cluster_id = 0;
+        uint32_t cluster_id = 0;
         uint64_t index = 0;
 
         if (n++ != counter) {
@@ -242,12 +329,20 @@ Ret DatasetNode::load(const std::string& node_path, const DatasetMetadata& metad
 
         } else {
             data_buffer.set_header(tag);
-            if (record_id != INVALID_RECORD_ID) {
-                auto ret = storage_->update_record(record_id, data_buffer);
+            const uint32_t old_record_id = record_id;
+            auto [ local_record_id, ret ] = storage_->put_record(data_buffer);
+            if (ret != 0) {
+                return ret;
+            }
+            record_id = local_record_id;
+
+            if (old_record_id != INVALID_RECORD_ID) {
+                // The new version goes to a new slot, the old one stays readable until the load is published.
+                ret = storage_->delete_record(old_record_id);
                 if (ret != 0) {
                     return ret;
                 }
-                auto iret = records_writer->delete_index(cluster_id, record_id);
+                auto iret = records_writer->delete_index(cluster_id, old_record_id);
                 if (iret != 0) {
                     return "Failed to update index in LMDB";
                 }
@@ -255,16 +350,12 @@ Ret DatasetNode::load(const std::string& node_path, const DatasetMetadata& metad
                 report.updated_count++;
 
             } else {
-                auto [ local_record_id, ret ] = storage_->put_record(data_buffer);
-                if (ret != 0) {
-                    return ret;
-                }
-
-                record_id = local_record_id;
                 report.added_count++;
             }
 
-            uint16_t cluster_id = InvalidClusterId;
+            codes->set(record_id, type_, data_buffer.record_ptr());
+
+            uint32_t cluster_id = InvalidClusterId;
             if (centroids != nullptr) {
                 cluster_id = centroids->find_nearest_centroid(data_buffer.record_ptr(), type_, dim_);
             }
@@ -287,10 +378,11 @@ Ret DatasetNode::load(const std::string& node_path, const DatasetMetadata& metad
         return std::format("Failed to read file {}", node_path);
     }
 
-    return 0;
+    codes_ = codes;
+    return codes_->write_changes(codes_path_);
 }
 
-Ret DatasetNode::dump(const std::string& dump_path, const DatasetMetadata& metadata) {
+Ret DatasetNode::dump(const NodeSnapshot& snapshot, const std::string& dump_path, const DatasetMetadata& metadata) {
     auto records_reader = lmdb_->open_db();
     if (!records_reader) {
         return std::format("Failed to open LMDB records reader");
@@ -313,7 +405,7 @@ Ret DatasetNode::dump(const std::string& dump_path, const DatasetMetadata& metad
 
     for (uint64_t index = 0; ; index++) {
         Record record;
-        auto ret = storage_->scan_record(index, record);
+        auto ret = storage_->scan_record(snapshot.storage, index, record);
         if (ret == ScanResult::Finished) {
             break;
         }
@@ -322,14 +414,17 @@ Ret DatasetNode::dump(const std::string& dump_path, const DatasetMetadata& metad
             continue;
         }
 
+        // A LOAD running meanwhile commits to LMDB before it publishes its records, the tag may already
+        // be deleted there or point to a record past the snapshot.
         uint32_t record_id = 0;
-        uint16_t cluster_id = 0;
+        uint32_t cluster_id = 0;
         int iret = records_reader->read_record(record.tag, record_id, cluster_id);
-        if (iret != 0) {
+        if (iret != 0 && iret != MDB_NOTFOUND) {
             return std::format("Failed to read from LMDB: {}   tag={}", iret, record.tag);
         }
 
-        if (index != record_id) {
+        Record newer;
+        if (iret == 0 && index != record_id && storage_->scan_record(snapshot.storage, record_id, newer) == ScanResult::Ok) {
             return "Invalid record_id in LMDB";
         }
 
@@ -359,10 +454,10 @@ Ret DatasetNode::dump(const std::string& dump_path, const DatasetMetadata& metad
     return 0;
 }
 
-Ret DatasetNode::find_tag(uint64_t tag) {
+Ret DatasetNode::find_tag(const NodeSnapshot& snapshot, uint64_t tag) {
     for (uint64_t index = 0; ; index++) {
         Record record;
-        auto ret = storage_->scan_record(index, record);
+        auto ret = storage_->scan_record(snapshot.storage, index, record);
         if (ret == ScanResult::Finished) {
             break;
         }
@@ -379,12 +474,12 @@ Ret DatasetNode::find_tag(uint64_t tag) {
     return Ret(-1, std::format("Tag {} not found", tag));
 }
 
-Ret DatasetNode::find_data(const std::vector<uint8_t>& data) {
+Ret DatasetNode::find_data(const NodeSnapshot& snapshot, const std::vector<uint8_t>& data) {
     assert(data.size() <= record_size_);
 
     for (uint64_t index = 0; ;) {
         Record record;
-        auto ret = storage_->scan_record(index, record);
+        auto ret = storage_->scan_record(snapshot.storage, index, record);
         if (ret == ScanResult::Finished) {
             break;
         }
@@ -415,12 +510,17 @@ double calc_dist(KnnType type, const T* a, const T* b, uint64_t dim) {
     return 0.0;
 }
 
-DistItems DatasetNode::knn(const DatasetMetadata& metadata, KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag) {
+DistItems DatasetNode::knn(const NodeSnapshot& snapshot, const DatasetMetadata& metadata, KnnType type, uint64_t count,
+                           const std::vector<uint8_t>& data, uint64_t skip_tag, QueryContext* context) {
     std::priority_queue<DistItem> pq;
 
     for (uint64_t index = 0; ; index++) {
+        if (context && index % QueryContext::CheckBlock == 0 && context->stop()) {
+            break;
+        }
+
         Record record;
-        auto ret = storage_->scan_record(index, record);
+        auto ret = storage_->scan_record(snapshot.storage, index, record);
         if (ret == ScanResult::Finished) {
             break;
         }
@@ -461,13 +561,152 @@ DistItems DatasetNode::knn(const DatasetMetadata& metadata, KnnType type, uint64
     return res;
 }
 
+std::vector<DistItems> DatasetNode::knn_batch(const NodeSnapshot& snapshot, const DatasetMetadata& metadata, KnnType type,
+                                              const std::vector<KnnQuery>& queries) {
+    std::vector<std::priority_queue<DistItem>> pqs(queries.size());
+    std::vector<bool> stopped(queries.size(), false);
+    size_t active_count = queries.size();
+
+    for (uint64_t index = 0; active_count > 0; index++) {
+        if (index % QueryContext::CheckBlock == 0) {
+            for (size_t i = 0; i < queries.size(); i++) {
+                if (!stopped[i] && queries[i].context && queries[i].context->stop()) {
+                    stopped[i] = true;
+                    active_count--;
+                }
+            }
+        }
+
+        Record record;
+        auto ret = storage_->scan_record(snapshot.storage, index, record);
+        if (ret == ScanResult::Finished) {
+            break;
+        }
+
+        if (ret == ScanResult::Deleted) {
+            continue;
+        }
+
+        for (size_t i = 0; i < queries.size(); i++) {
+            const KnnQuery& query = queries[i];
+            if (stopped[i] || record.tag == query.skip_tag) {
+                continue;
+            }
+
+            double dist = 0.0;
+            switch (metadata.type) {
+                case DatasetType::f32:
+                    dist = calc_dist(type, (float*)record.data, (float*)query.data->data(), metadata.dim);
+                    break;
+                case DatasetType::f16:
+                    dist = calc_dist(type, (float16_t*)record.data, (float16_t*)query.data->data(), metadata.dim);
+                    break;
+                case DatasetType::u8:
+                    dist = 0.0;
+                    break;
+            }
+
+            auto& pq = pqs[i];
+            if (!pq.empty() && pq.size() == query.count && !(dist < pq.top().dist)) {
+                continue;
+            }
+
+            pq.push(DistItem{ .dist=dist, .record_id=index, .tag=record.tag});
+            if (pq.size() > query.count) {
+                pq.pop();
+            }
+        }
+    }
+
+    std::vector<DistItems> res(queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        while (!pqs[i].empty()) {
+            res[i].push_back(pqs[i].top());
+            pqs[i].pop();
+        }
+    }
+
+    return res;
+}
+
+DistItems DatasetNode::knn_binary(const NodeSnapshot& snapshot, const DatasetMetadata& metadata, KnnType type, uint64_t count,
+                                  const std::vector<uint8_t>& data, uint64_t skip_tag, QueryContext* context) {
+    const BinaryCodes& codes = *snapshot.codes;
+    const uint64_t words = codes.words();
+    std::vector<uint64_t> query_code(words);
+    BinaryCodes::encode(metadata.type, metadata.dim, data.data(), query_code.data());
+
+    // Max-heap of (Hamming distance, record id), the farthest candidate is replaced first.
+    const uint64_t candidates_count = count * BinaryRerankFactor;
+    std::priority_queue<std::pair<uint64_t, uint32_t>> candidates;
+    const uint64_t codes_count = std::min(codes.count(), snapshot.storage.upper_record_id);
+    const auto distance = hamming_distance_func();
+    for (uint64_t record_id = 0; record_id < codes_count; record_id++) {
+        if (context && record_id % QueryContext::CheckBlock == 0 && context->stop()) {
+            break;
+        }
+
+        const uint64_t dist = distance(codes.get(record_id), query_code.data(), words);
+        if (candidates.size() == candidates_count && dist >= candidates.top().first) {
+            continue;
+        }
+
+        if (snapshot.storage.is_deleted(record_id)) {
+            continue;
+        }
+
+        candidates.emplace(dist, record_id);
+        if (candidates.size() > candidates_count) {
+            candidates.pop();
+        }
+    }
+
+    std::priority_queue<DistItem> pq;
+    while (!candidates.empty()) {
+        const uint32_t record_id = candidates.top().second;
+        candidates.pop();
+
+        Record record;
+        auto ret = storage_->scan_record(snapshot.storage, record_id, record);
+        if (ret != ScanResult::Ok || record.tag == skip_tag) {
+            continue;
+        }
+
+        double dist = 0.0;
+        switch (metadata.type) {
+            case DatasetType::f32:
+                dist = calc_dist(type, (float*)record.data, (float*)data.data(), metadata.dim);
+                break;
+            case DatasetType::f16:
+                dist = calc_dist(type, (float16_t*)record.data, (float16_t*)data.data(), metadata.dim);
+                break;
+            case DatasetType::u8:
+                dist = 0.0;
+                break;
+        }
+
+        pq.push(DistItem{ .dist=dist, .record_id=record_id, .tag=record.tag});
+        if (pq.size() > count) {
+            pq.pop();
+        }
+    }
+
+    DistItems res;
+    while (!pq.empty()) {
+        res.push_back(pq.top());
+        pq.pop();
+    }
+
+    return res;
+}
+
 Ret DatasetNode::read_record_id(const uint64_t tag, uint32_t& out_id) {
     auto records_reader = lmdb_->open_db();    
     if (!records_reader) {
         return std::format("Failed to open LMDB records reader");
     }
 
-    uint16_t cluster_id = InvalidClusterId;
+    uint32_t cluster_id = InvalidClusterId;
     int iret = records_reader->read_record(tag, out_id, cluster_id);
     if (iret != 0) {
         return std::format("Failed to read from LMDB: {}", iret);
@@ -476,8 +715,9 @@ Ret DatasetNode::read_record_id(const uint64_t tag, uint32_t& out_id) {
     return 0;
 }
 
-DistItems  DatasetNode::ann(const std::vector<uint16_t>& cluster_ids, uint64_t count,
-    const std::vector<uint8_t>& data, uint64_t skip_tag) {
+DistItems  DatasetNode::ann(const NodeSnapshot& snapshot, const std::vector<uint32_t>& cluster_ids, uint64_t count,
+    const std::vector<uint8_t>& data, uint64_t skip_tag, const std::vector<double>* centroid_dists, uint64_t* scanned_count,
+    QueryContext* context) {
     
     DistItems res;
     std::priority_queue<DistItem> pq;
@@ -487,49 +727,109 @@ DistItems  DatasetNode::ann(const std::vector<uint16_t>& cluster_ids, uint64_t c
         return res;
     }
 
-    for (const auto cluster_id : cluster_ids) {
-        int ret = cursor_reader->open_cursor(cluster_id);
-        const std::experimental::scope_exit closer([&] {
-            cursor_reader->close_cursor();
-        });
-        if (ret != 0) {
-            LOG_TRACE << "Failed to open cursor for cluster_id=" << cluster_id;
-            continue;
+    // Returns true when the record entered the current top results.
+    auto scan = [&](uint32_t record_id) {
+        Record record;
+        auto ret = storage_->scan_record(snapshot.storage, record_id, record);
+        if (ret != ScanResult::Ok) {
+            return false;
         }
 
-        uint32_t scanned_count = 0;
-        uint32_t record_id = 0;
-        while (0 == cursor_reader->next(record_id)) {
-            Record record;
-            auto ret = storage_->scan_record(record_id, record);
-            if (ret != ScanResult::Ok) {
-                continue;
-            }
+        if (record.tag == skip_tag) {
+            return false;
+        }
 
-            if (record.tag == skip_tag) {
-                continue;
+        double dist = 0.0;
+        switch (type_) {
+            case DatasetType::f32:
+                dist = calc_dist(KnnType::L2, (float*)record.data, (float*)data.data(), dim_);
+                break;
+            case DatasetType::f16:
+                dist = calc_dist(KnnType::L2, (float16_t*)record.data, (float16_t*)data.data(), dim_);
+                break;
+            case DatasetType::u8:
+                dist = 0.0;
+                break;
+        }
+
+        if (pq.size() == count && !(dist < pq.top().dist)) {
+            return false;
+        }
+
+        pq.push(DistItem{ .dist=dist, .record_id=record_id, .tag=record.tag});
+        if (pq.size() > count) {
+            pq.pop();
+        }
+        return true;
+    };
+
+    // Records loaded after the index was written are scanned first, their stale entries
+    // in the posting lists of the probed clusters are skipped below.
+    std::vector<uint32_t> delta_ids;
+    for (const auto cluster_id : cluster_ids) {
+        const size_t from = delta_ids.size();
+        read_index_delta(*cursor_reader, cluster_id, delta_ids);
+        for (size_t i = from; i < delta_ids.size(); i++) {
+            scan(delta_ids[i]);
+        }
+    }
+    std::sort(delta_ids.begin(), delta_ids.end());
+
+    // Posting lists hold the records the radii were computed on, so the bounds hold for them.
+    const bool use_bounds = centroid_dists && postings_ && stats_;
+    float max_radius = 0.0f;
+    if (use_bounds) {
+        for (const auto cluster_id : cluster_ids) {
+            if (cluster_id < stats_->clusters_count()) {
+                max_radius = std::max(max_radius, stats_->radius(cluster_id));
             }
+        }
+    }
 
-            scanned_count++;
+    uint64_t scanned = 0;
+    uint64_t misses_count = 0;
+    uint64_t records_count = 0;
+    bool stopped = false;
+    for (size_t i = 0; i < cluster_ids.size() && !stopped; i++) {
+        const auto cluster_id = cluster_ids[i];
 
-            double dist = 0.0;
-            switch (type_) {
-                case DatasetType::f32:
-                    dist = calc_dist(KnnType::L2, (float*)record.data, (float*)data.data(), dim_);
-                    break;
-                case DatasetType::f16:
-                    dist = calc_dist(KnnType::L2, (float16_t*)record.data, (float16_t*)data.data(), dim_);
-                    break;
-                case DatasetType::u8:
-                    dist = 0.0;
+        if (centroid_dists && pq.size() == count) {
+            if (misses_count >= AdaptiveProbePatience) {
+                break;
+            }
+
+            if (use_bounds && cluster_id < stats_->clusters_count()) {
+                const double kth_dist = pq.top().dist;
+                const double centroid_dist = (*centroid_dists)[i];
+                if (centroid_dist - max_radius > kth_dist) {
                     break;
+                }
+
+                if (centroid_dist - stats_->radius(cluster_id) > kth_dist) {
+                    continue;
+                }
             }
+        }
 
-            pq.push(DistItem{ .dist=dist, .record_id=record_id, .tag=record.tag});
-            if (pq.size() > count) {
-                pq.pop();
+        bool improved = false;
+        for (const auto record_id : get_posting_list(cluster_id)) {
+            if (context && records_count++ % QueryContext::CheckBlock == 0 && context->stop()) {
+                stopped = true;
+                break;
+            }
+
+            if (!delta_ids.empty() && std::binary_search(delta_ids.begin(), delta_ids.end(), record_id)) {
+                continue;
             }
+            improved |= scan(record_id);
         }
+
+        scanned++;
+        misses_count = improved ? 0 : misses_count + 1;
+    }
+
+    if (scanned_count) {
+        *scanned_count = scanned;
     }
 
     while (!pq.empty()) {
@@ -540,6 +840,11 @@ DistItems  DatasetNode::ann(const std::vector<uint16_t>& cluster_ids, uint64_t c
     return res;
 }
 
+void DatasetNode::remove_index(uint64_t index_id) {
+    std::error_code ec;
+    std::filesystem::remove_all(dir_path_ + "/index_" + std::to_string(index_id), ec);
+}
+
 Ret DatasetNode::gc(uint64_t current_index_id) {
     for (size_t i = 0; i + 1 < current_index_id; i++) {
         const std::string index_path = dir_path_ + "/index_" + std::to_string(i);
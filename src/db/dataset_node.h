@@ -3,17 +3,26 @@
 #include "ddl_command_processor.h"
 #include "data_command_processor.h"
 #include "shared_types.h"
+#include "storage.h"
 #include <atomic>
 #include <memory>
 #include <queue>
+#include <span>
 #include <vector>
 #include <unordered_map>
 
 namespace sketch {
 
+class BinaryCodes;
 class Centroids;
+class ClusterStats;
+class Hnsw;
+struct HnswParams;
 class IvfBuilder;
-class Storage;
+class Lmdb;
+class PostingLists;
+class QueryContext;
+class ResidualChunks;
 class InputData;
 class ResultCollector;
 class ThreadPool;
@@ -35,53 +44,134 @@ struct LoadReport {
 
 using DistItems = std::vector<DistItem>;
 
-using FindClusterIdResult = std::pair<uint16_t, Ret>;
+// One exact KNN request of a batch, the batch shares the metric and one pass over the records.
+struct KnnQuery {
+    uint64_t count = 0;
+    const std::vector<uint8_t>* data = nullptr;
+    uint64_t skip_tag = 0;
+    QueryContext* context = nullptr;
+};
+
+// Records and binary codes of a node seen by queries. LOAD writes beside the published snapshot and
+// publishes a new one when it is done, a query keeps the snapshot it started with.
+struct NodeSnapshot {
+    StorageSnapshot storage;
+    std::shared_ptr<const BinaryCodes> codes;
+};
+using NodeSnapshotPtr = std::shared_ptr<const NodeSnapshot>;
+
+using FindClusterIdResult = std::pair<uint32_t, Ret>;
+
+// New clusters of every old cluster when an index is rebalanced: one target keeps the cluster,
+// several targets are the parts of a split cluster, none means the cluster was merged away.
+using ClusterTargets = std::vector<std::vector<uint32_t>>;
 
 class DatasetNode {
 public:
     DatasetNode(uint64_t id, const std::string& path);
     ~DatasetNode();
     Ret create(const DatasetMetadata& metadata, uint64_t initial_records_count);
-    Ret init(const DatasetMetadata& metadata);
+    // With numa_node >= 0 the records are placed on that NUMA node and its workers scan the node.
+    Ret init(const DatasetMetadata& metadata, int numa_node = -1);
+    // Opens index index_id over the records of current, the storage and the binary codes are shared with it.
+    Ret init_index(const DatasetNode& current, uint64_t index_id);
     Ret uninit();
 
     Ret prepare_load(const std::string& node_path, size_t nodes_count, LoadReport& report, const InputData& input_data);
+    // Updated records are written to new slots and their old slots deleted, so that no record of the
+    // published snapshot is overwritten.
     Ret load(const std::string& node_path, const DatasetMetadata& metadata, 
                 LoadReport& report, const InputData& input_data, Centroids* centroids);
-    Ret dump(const std::string& dump_path, const DatasetMetadata& metadata);
+    NodeSnapshotPtr snapshot() const { return snapshot_; }
+    int numa_node() const { return numa_node_; }
+    void publish_snapshot();
+    Ret release_deleted();
+
+    Ret dump(const NodeSnapshot& snapshot, const std::string& dump_path, const DatasetMetadata& metadata);
 
-    Ret find_tag(uint64_t tag);
-    Ret find_data(const std::vector<uint8_t>& data);
+    Ret find_tag(const NodeSnapshot& snapshot, uint64_t tag);
+    Ret find_data(const NodeSnapshot& snapshot, const std::vector<uint8_t>& data);
 
-    DistItems knn(const DatasetMetadata& metadata, KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag);
+    // The scans stop early, with the results found so far, when the context is cancelled or past its deadline.
+    DistItems knn(const NodeSnapshot& snapshot, const DatasetMetadata& metadata, KnnType type, uint64_t count,
+                  const std::vector<uint8_t>& data, uint64_t skip_tag, QueryContext* context = nullptr);
+    // Scans the records once for all queries, every record is compared with each query while it is in cache.
+    // A stopped query keeps the results found so far, the others go on.
+    std::vector<DistItems> knn_batch(const NodeSnapshot& snapshot, const DatasetMetadata& metadata, KnnType type,
+                                     const std::vector<KnnQuery>& queries);
+    // Picks count x BinaryRerankFactor candidates by Hamming distance of the sign codes, then re-ranks them exactly.
+    DistItems knn_binary(const NodeSnapshot& snapshot, const DatasetMetadata& metadata, KnnType type, uint64_t count,
+                         const std::vector<uint8_t>& data, uint64_t skip_tag, QueryContext* context = nullptr);
 
     Ret sample_records(IvfBuilder& builder, uint32_t from, uint32_t count);
-    Ret write_index(const Centroids& centroids, uint64_t index_id);
-    DistItems ann(const std::vector<uint16_t>& cluster_ids, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag);
+    // Assigns the records to the centroids in parallel on thread_pool, when given.
+    Ret write_index(const Centroids& centroids, uint64_t index_id, ThreadPool* thread_pool = nullptr);
+    // With centroid_dists (distances to the centroids of cluster_ids, ascending) the lists are probed adaptively:
+    // a list is skipped when its radius bound cannot beat the current k-th result, probing stops when no list
+    // can, or when AdaptiveProbePatience lists in a row did not improve the result.
+    // Delta records past the snapshot are skipped, LOAD commits the LMDB delta before it publishes the snapshot.
+    DistItems ann(const NodeSnapshot& snapshot, const std::vector<uint32_t>& cluster_ids, uint64_t count,
+                  const std::vector<uint8_t>& data, uint64_t skip_tag, const std::vector<double>* centroid_dists = nullptr,
+                  uint64_t* scanned_count = nullptr, QueryContext* context = nullptr);
     Ret gc(uint64_t current_index_id);
-    Ret make_residuals(const Centroids& centroids, uint8_t* mapped_u8, uint64_t count, bool is_test_run = false);
+    void remove_index(uint64_t index_id);
+    // Writes count sampled residuals at rows [offset, offset + count) of the chunk buffers.
+    Ret make_residuals(const Centroids& centroids, ResidualChunks& residuals, uint64_t offset, uint64_t count,
+                       bool is_test_run = false);
     Ret mock_ivf(const IvfBuilder& builder, uint64_t index_id);
+    Ret init_postings(uint64_t index_id);
+
+    void cluster_sizes(std::vector<uint64_t>& sizes);
+    uint64_t cluster_size(uint32_t cluster_id) const { return get_posting_list(cluster_id).size(); }
+    void cluster_records(uint32_t cluster_id, uint64_t max_count, std::vector<const uint8_t*>& records);
+    Ret rebalance_index(const Centroids& centroids, const ClusterTargets& targets, uint64_t index_id);
+    Ret read_cluster_stats(uint64_t index_id, ClusterStats& stats) const;
+
+    // The graph is built over the records and kept beside the IVF indexes, an index switch keeps it.
+    Ret write_hnsw(const HnswParams& params, ThreadPool* thread_pool = nullptr);
+    Ret init_hnsw(uint64_t index_id);
+    bool has_hnsw() const { return hnsw_ != nullptr; }
+    DistItems ann_hnsw(const NodeSnapshot& snapshot, uint64_t count, uint64_t ef, const std::vector<uint8_t>& data,
+                       uint64_t skip_tag, QueryContext* context = nullptr);
 
 private:
     static constexpr uint64_t INVALID_TAG = 0xFFFFFFFFFFFFFFFF;
     static constexpr uint32_t INVALID_RECORD_ID = 0xFFFFFFFF;
+    static constexpr uint64_t AdaptiveProbePatience = 4;
+    static constexpr uint64_t BinaryRerankFactor = 10;
+    // Records of a write_index() task, and of one nearest centroids computation.
+    static constexpr uint64_t IndexMorselSize = 16 * 1024;
+    static constexpr uint64_t IndexBatchSize = 1024;
 
 private:
     const uint64_t id_;
     const std::string dir_path_;
     const std::string path_;
-    std::unique_ptr<Storage> storage_;
+    const std::string codes_path_;
+    // Shared with the node of the next index while queries finish on this one.
+    std::shared_ptr<Storage> storage_;
     std::unique_ptr<LmdbEnv> lmdb_;
+    std::unique_ptr<PostingLists> postings_;
+    // Shared with the published snapshot, LOAD writes a copy.
+    std::shared_ptr<BinaryCodes> codes_;
+    NodeSnapshotPtr snapshot_;
+    std::unique_ptr<ClusterStats> stats_;
+    // Shared with the node of the next index.
+    std::shared_ptr<const Hnsw> hnsw_;
     uint64_t record_size_ = 0;
     uint64_t markers_count_ = 0;
     DatasetType type_ = DatasetType::f32;
     uint64_t dim_ = 0;
     uint64_t index_id = 0;
+    int numa_node_ = -1;
 
 private:
     Ret read_record_id(const uint64_t tag, uint32_t& out_id);
     Ret create_lmdb(const std::string& path);
     std::unique_ptr<LmdbEnv> open_lmdb(const std::string& path);
+    void read_index_delta(Lmdb& reader, uint32_t cluster_id, std::vector<uint32_t>& record_ids);
+    std::span<const uint32_t> get_posting_list(uint32_t cluster_id) const;
+    Ret init_binary_codes();
 
 };
 using DatasetNodePtr = std::shared_ptr<DatasetNode>;
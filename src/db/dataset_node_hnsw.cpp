@@ -0,0 +1,111 @@
+#include "dataset_node.h"
+#include "hnsw.h"
+#include "query_context.h"
+#include "storage.h"
+#include "log.h"
+
+#include <cmath>
+#include <filesystem>
+#include <format>
+
+namespace sketch {
+
+static constexpr const char* HnswFileName = "hnsw";
+
+Ret DatasetNode::write_hnsw(const HnswParams& params, ThreadPool* thread_pool) {
+    assert(storage_);
+
+    std::vector<uint32_t> ids;
+    ids.reserve(storage_->records_count());
+    for (uint64_t record_id = 0; ; record_id++) {
+        Record record;
+        auto scan_ret = storage_->scan_record(record_id, record);
+        if (scan_ret == ScanResult::Finished) {
+            break;
+        }
+
+        if (scan_ret == ScanResult::Ok) {
+            ids.push_back(record_id);
+        }
+    }
+
+    const HnswVectors vectors {
+        .data = storage_->get_record_data(0),
+        .stride = storage_->full_record_size(),
+        .count = storage_->upper_record_id(),
+    };
+
+    // Written aside and renamed, so that the mapped graph is never truncated.
+    const std::string path = dir_path_ + "/" + HnswFileName;
+    const std::string temp_path = path + ".tmp";
+    auto ret = Hnsw::build(temp_path, type_, dim_, vectors, ids, params, thread_pool);
+    if (ret != 0) {
+        std::filesystem::remove(temp_path);
+        return ret;
+    }
+
+    std::filesystem::rename(temp_path, path);
+
+    LOG_DEBUG << std::format("Node {} HNSW graph built over {} records", id_, ids.size());
+
+    return 0;
+}
+
+Ret DatasetNode::init_hnsw(uint64_t index_id) {
+    // Graphs built before they were kept beside the indexes are found in the directory of their index.
+    std::string path = dir_path_ + "/" + HnswFileName;
+    if (!std::filesystem::exists(path)) {
+        path = dir_path_ + "/index_" + std::to_string(index_id) + "/" + HnswFileName;
+    }
+
+    if (!std::filesystem::exists(path)) {
+        hnsw_.reset();
+        return 0;
+    }
+
+    auto hnsw = std::make_shared<Hnsw>();
+    auto ret = hnsw->init(path);
+    CHECK(ret)
+
+    hnsw_ = std::move(hnsw);
+    return 0;
+}
+
+DistItems DatasetNode::ann_hnsw(const NodeSnapshot& snapshot, uint64_t count, uint64_t ef, const std::vector<uint8_t>& data,
+                                uint64_t skip_tag, QueryContext* context) {
+    DistItems res;
+    const auto hnsw = hnsw_;
+    if (!hnsw) {
+        return res;
+    }
+
+    // Records deleted after the graph was built are still traversed, but never returned.
+    auto filter = [this, &snapshot, skip_tag](uint32_t record_id) {
+        Record record;
+        return storage_->scan_record(snapshot.storage, record_id, record) == ScanResult::Ok && record.tag != skip_tag;
+    };
+
+    const HnswVectors vectors {
+        .data = storage_->records_data(),
+        .stride = storage_->full_record_size(),
+        .count = snapshot.storage.upper_record_id,
+    };
+
+    HnswStop stop;
+    if (context) {
+        stop = [context] { return context->stop(); };
+    }
+
+    hnsw->search(data.data(), type_, dim_, vectors, count, ef, res, filter, stop);
+
+    for (auto& item : res) {
+        Record record;
+        storage_->scan_record(snapshot.storage, item.record_id, record);
+        item.tag = record.tag;
+        item.dist = std::sqrt(item.dist);
+    }
+
+    return res;
+}
+
+} // namespace sketch
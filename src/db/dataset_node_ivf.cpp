@@ -1,24 +1,37 @@
 #include "dataset_node.h"
 #include "centroids.h"
+#include "cluster_stats.h"
 #include "ivf_builder.h"
 #include "lmdb2.h"
 #include "math.h"
+#include "posting_lists.h"
+#include "residual_chunks.h"
 #include "storage.h"
 #include "string_utils.h"
+#include "thread_pool.h"
 #include "input_data.h"
 #include "log.h"
 
 #include <algorithm>
+#include <cmath>
 #include <experimental/scope>
 #include <format>
 #include <filesystem>
+#include <limits>
 #include <random>
 
 namespace sketch {
 
+static constexpr const char* PostingListsFileName = "postings";
+static constexpr const char* ClusterStatsFileName = "cluster_stats";
+
 Ret DatasetNode::sample_records(IvfBuilder& builder, uint32_t from, uint32_t count) {
     assert(storage_);
 
+    if (storage_->records_count() == 0) {
+        return 0;
+    }
+
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(0, storage_->records_count()-1);
@@ -28,7 +41,7 @@ Ret DatasetNode::sample_records(IvfBuilder& builder, uint32_t from, uint32_t cou
     // Allow certain number of records to be skipped if they are deleted.
     uint32_t skip_count = count / 10;
     for (uint32_t i = 0; i < count; ) {
-        if (index >= storage_->records_count()) {
+        if (index >= builder.records_count()) {
             break;
         }
 
@@ -48,7 +61,7 @@ Ret DatasetNode::sample_records(IvfBuilder& builder, uint32_t from, uint32_t cou
     return 0;
 }
 
-Ret DatasetNode::write_index(const Centroids& centroids, uint64_t index_id) {
+Ret DatasetNode::write_index(const Centroids& centroids, uint64_t index_id, ThreadPool* thread_pool) {
     const std::string index_path = dir_path_ + "/index_" + std::to_string(index_id);
     if (!std::filesystem::exists(index_path)) {
         std::filesystem::create_directory(index_path);
@@ -69,35 +82,106 @@ Ret DatasetNode::write_index(const Centroids& centroids, uint64_t index_id) {
         return std::format("Failed to open LMDB records writer");
     }
 
-    std::vector<uint64_t> per_cluster_counts(centroids.centroids_count());
+    // Records are assigned to clusters in morsels of IndexMorselSize consecutive records, in parallel
+    // on the pool. A morsel holds its records in ascending order, so the morsels taken in order form
+    // the sorted run of the posting lists, the tag map is written from it by this thread alone.
+    struct Morsel {
+        std::vector<uint32_t> record_ids;
+        std::vector<uint32_t> cluster_ids;
+        std::vector<uint64_t> tags;
+        ClusterStats stats;
+    };
+
+    const uint64_t morsels_count = (storage_->upper_record_id() + IndexMorselSize - 1) / IndexMorselSize;
+    std::vector<Morsel> morsels(morsels_count);
+
+    auto assign_morsel = [this, &centroids, &morsels](uint64_t morsel_index) {
+        Morsel& morsel = morsels[morsel_index];
+        morsel.stats.init(centroids.centroids_count());
+
+        const uint64_t from = morsel_index * IndexMorselSize;
+        const uint64_t to = std::min(from + IndexMorselSize, storage_->upper_record_id());
+        std::vector<const uint8_t*> records;
+        records.reserve(to - from);
+        for (uint64_t record_id = from; record_id < to; record_id++) {
+            Record record;
+            auto scan_ret = storage_->scan_record(record_id, record);
+            if (scan_ret == ScanResult::Finished) {
+                break;
+            }
 
-    uint64_t count = 0;
-    for (uint64_t record_id = 0; ; record_id++) {
-        Record record;
-        auto scan_ret = storage_->scan_record(record_id, record);
-        if (scan_ret == ScanResult::Finished) {
-            break;
+            if (scan_ret == ScanResult::Deleted) {
+                continue;
+            }
+
+            records.push_back(record.data);
+            morsel.record_ids.push_back(record_id);
+            morsel.tags.push_back(record.tag);
         }
 
-        if (scan_ret == ScanResult::Deleted) {
-            continue;
+        // Batches keep the distance computation a blocked matrix multiplication rather than one record at a time.
+        morsel.cluster_ids.resize(records.size());
+        for (size_t i = 0; i < records.size(); i += IndexBatchSize) {
+            const size_t count = std::min<size_t>(IndexBatchSize, records.size() - i);
+            centroids.find_nearest_centroids(records.data() + i, count, morsel.cluster_ids.data() + i, type_, dim_);
         }
 
-        uint16_t cluster_id = centroids.find_nearest_centroid(record.data, type_, dim_);
-        per_cluster_counts[cluster_id]++;
+        for (size_t i = 0; i < records.size(); i++) {
+            const uint32_t cluster_id = morsel.cluster_ids[i];
+            morsel.stats.add(cluster_id, distance_L2_square(type_, records[i], centroids.get_centroid(cluster_id), dim_));
+        }
+    };
+
+    if (thread_pool && morsels_count > 1) {
+        TaskGroup group(*thread_pool);
+        for (uint64_t morsel_index = 0; morsel_index < morsels_count; morsel_index++) {
+            group.run([&assign_morsel, morsel_index] {
+                assign_morsel(morsel_index);
+            });
+        }
+        group.wait();
+    } else {
+        for (uint64_t morsel_index = 0; morsel_index < morsels_count; morsel_index++) {
+            assign_morsel(morsel_index);
+        }
+    }
 
-        auto ret = records_writer->write_record(record.tag, record_id, cluster_id);
-        if (ret != 0) {
-            return ret;
+    // The tag map stays in LMDB, the cluster lists go to the posting lists file.
+    std::vector<uint32_t> record_ids;
+    std::vector<uint32_t> cluster_ids;
+    record_ids.reserve(storage_->records_count());
+    cluster_ids.reserve(storage_->records_count());
+    ClusterStats stats;
+    stats.init(centroids.centroids_count());
+
+    for (auto& morsel : morsels) {
+        for (size_t i = 0; i < morsel.record_ids.size(); i++) {
+            ret = records_writer->write_record(morsel.tags[i], morsel.record_ids[i], morsel.cluster_ids[i], false);
+            CHECK(ret)
         }
 
-        count++;
+        record_ids.insert(record_ids.end(), morsel.record_ids.begin(), morsel.record_ids.end());
+        cluster_ids.insert(cluster_ids.end(), morsel.cluster_ids.begin(), morsel.cluster_ids.end());
+        ret = stats.merge(morsel.stats);
+        CHECK(ret)
+        morsel = Morsel();
     }
 
+    ret = PostingLists::write(index_path + "/" + PostingListsFileName, centroids.centroids_count(), cluster_ids, record_ids);
+    CHECK(ret)
+
+    ret = stats.write(index_path + "/" + ClusterStatsFileName);
+    CHECK(ret)
+
     return records_writer->commit();
 }
 
-Ret DatasetNode::make_residuals(const Centroids& centroids, uint8_t* mapped_u8, uint64_t count, bool is_test_run) {
+Ret DatasetNode::make_residuals(const Centroids& centroids, ResidualChunks& residuals, uint64_t offset, uint64_t count,
+                                bool is_test_run) {
+    if (type_ == DatasetType::u8) {
+        return "Unsupported dataset type for residuals";
+    }
+
     auto cursor_reader = lmdb_->open_db();
     if (!cursor_reader) {
         return "Failed to open LMDB records reader";
@@ -106,41 +190,36 @@ Ret DatasetNode::make_residuals(const Centroids& centroids, uint8_t* mapped_u8,
     std::random_device rd;
     std::mt19937 gen(rd());
 
-    uint64_t node_offset = id_ * count * record_size_;
-    uint8_t* node_ptr = mapped_u8 + node_offset;
-
     uint64_t per_cluster_count = count / centroids.centroids_count();
     if (count != per_cluster_count * centroids.centroids_count()) {
         per_cluster_count++;
     }
 
     std::vector<uint32_t> record_ids(per_cluster_count);
+    std::vector<uint32_t> delta_ids;
+    std::vector<uint8_t> residual(record_size_);
 
     uint32_t processed_count = 0;
     for (uint32_t cluster_id = 0; cluster_id < centroids.centroids_count(); cluster_id++) {
-        int iret = cursor_reader->open_cursor(cluster_id);
-        if (iret != 0) {
-            LOG_TRACE << "Failed to open cursor for cluster_id=" << cluster_id;
+        delta_ids.clear();
+        read_index_delta(*cursor_reader, cluster_id, delta_ids);
+
+        const auto posting_list = get_posting_list(cluster_id);
+        if (delta_ids.empty() && posting_list.empty()) {
             continue;
         }
-        const std::experimental::scope_exit closer([&] {
-            cursor_reader->close_cursor();
-        });
 
         uint32_t scanned_count = 0;
-        uint32_t record_id = 0;
-        while (0 == cursor_reader->next(record_id)) {
+        auto sample = [&](uint32_t record_id) {
             Record record;
             auto ret = storage_->scan_record(record_id, record);
             if (ret != ScanResult::Ok) {
-                continue;
+                return;
             }
 
             if (scanned_count < per_cluster_count) {
-                //std::cerr << "Selecting record " << record_id << " for cluster " << cluster_id << std::endl;
                 record_ids[scanned_count] = record_id;
             } else {
-                //std::cerr << "Replacing record " << record_id << " for cluster " << cluster_id << std::endl;
                 std::uniform_int_distribution<> distrib(0, scanned_count - 1);
                 uint32_t j = distrib(gen);
                 if (j < per_cluster_count) {
@@ -149,28 +228,31 @@ Ret DatasetNode::make_residuals(const Centroids& centroids, uint8_t* mapped_u8,
             }
 
             scanned_count++;
+        };
+
+        for (const auto record_id : delta_ids) {
+            sample(record_id);
+        }
+        for (const auto record_id : posting_list) {
+            sample(record_id);
         }
 
         if (scanned_count < per_cluster_count) {
             return "Failed to gather enough records for residuals";
         }
 
-        uint64_t cluster_offset = cluster_id * per_cluster_count * record_size_;
-        uint8_t* cluster_ptr = node_ptr + cluster_offset;
         const uint8_t* centroid = centroids.get_centroid(cluster_id);
 
+        // Residuals go straight to the chunk buffers, the row is only a staging area for the split.
         for (uint64_t j = 0; j < per_cluster_count && processed_count < count; j++, processed_count++) {
             Record record;
             storage_->scan_record(record_ids[j], record);
 
-            uint8_t* residual_data_ptr = cluster_ptr + j * record_size_;
-
-            // Calculate residual
             switch (type_) {
                 case DatasetType::f32: {
                     const float* data = reinterpret_cast<const float*>(record.data);
                     const float* cent = reinterpret_cast<const float*>(centroid);
-                    float* resid = reinterpret_cast<float*>(residual_data_ptr);
+                    float* resid = reinterpret_cast<float*>(residual.data());
                     if (is_test_run) {
                         memcpy(resid, data, dim_ * sizeof(float));
                     } else {
@@ -181,7 +263,7 @@ Ret DatasetNode::make_residuals(const Centroids& centroids, uint8_t* mapped_u8,
                 case DatasetType::f16: {
                     const float16_t* data = reinterpret_cast<const float16_t*>(record.data);
                     const float16_t* cent = reinterpret_cast<const float16_t*>(centroid);
-                    float16_t* resid = reinterpret_cast<float16_t*>(residual_data_ptr);
+                    float16_t* resid = reinterpret_cast<float16_t*>(residual.data());
                     if (is_test_run) {
                         memcpy(resid, data, dim_ * sizeof(float16_t));
                     } else {
@@ -189,10 +271,11 @@ Ret DatasetNode::make_residuals(const Centroids& centroids, uint8_t* mapped_u8,
                     }
                     break;
                 }
-                case DatasetType::u8: {
-                    return "Unsupported dataset type for residuals";
-                }
+                case DatasetType::u8:
+                    break;
             }
+
+            residuals.scatter(offset + processed_count, residual.data());
         }
     }
 
@@ -220,7 +303,7 @@ Ret DatasetNode::mock_ivf(const IvfBuilder& builder, uint64_t index_id) {
         return std::format("Failed to open LMDB records writer");
     }
 
-    uint16_t cluster_id = 0;
+    uint32_t cluster_id = 0;
 
     std::unordered_map<uint64_t, uint64_t> cluster_counts;
 
@@ -247,4 +330,204 @@ Ret DatasetNode::mock_ivf(const IvfBuilder& builder, uint64_t index_id) {
     return records_writer->commit();
 }
 
+// Sizes are taken from the posting lists and the LMDB delta without touching the records,
+// so records deleted or moved after the index was written are still counted.
+void DatasetNode::cluster_sizes(std::vector<uint64_t>& sizes) {
+    auto cursor_reader = lmdb_->open_db();
+    if (!cursor_reader) {
+        return;
+    }
+
+    std::vector<uint32_t> delta_ids;
+    for (uint32_t cluster_id = 0; cluster_id < sizes.size(); cluster_id++) {
+        delta_ids.clear();
+        read_index_delta(*cursor_reader, cluster_id, delta_ids);
+        sizes[cluster_id] += delta_ids.size() + get_posting_list(cluster_id).size();
+    }
+}
+
+void DatasetNode::cluster_records(uint32_t cluster_id, uint64_t max_count, std::vector<const uint8_t*>& records) {
+    auto cursor_reader = lmdb_->open_db();
+    if (!cursor_reader) {
+        return;
+    }
+
+    std::vector<uint32_t> record_ids;
+    read_index_delta(*cursor_reader, cluster_id, record_ids);
+    const auto posting_list = get_posting_list(cluster_id);
+    record_ids.insert(record_ids.end(), posting_list.begin(), posting_list.end());
+
+    uint64_t count = 0;
+    for (const auto record_id : record_ids) {
+        if (count == max_count) {
+            break;
+        }
+
+        Record record;
+        if (storage_->scan_record(record_id, record) != ScanResult::Ok) {
+            continue;
+        }
+
+        records.push_back(record.data);
+        count++;
+    }
+}
+
+Ret DatasetNode::rebalance_index(const Centroids& centroids, const ClusterTargets& targets, uint64_t index_id) {
+    auto records_reader = lmdb_->open_db();
+    if (!records_reader) {
+        return "Failed to open LMDB records reader";
+    }
+
+    const std::string index_path = dir_path_ + "/index_" + std::to_string(index_id);
+    if (!std::filesystem::exists(index_path)) {
+        std::filesystem::create_directory(index_path);
+    }
+
+    auto ret = create_lmdb(index_path);
+    CHECK(ret)
+
+    auto lmdb = open_lmdb(index_path);
+    if (!lmdb) {
+        return "Failed to initialize LMDB";
+    }
+
+    auto records_writer = lmdb->open_db(LmdbMode::Write);
+    if (!records_writer) {
+        return std::format("Failed to open LMDB records writer");
+    }
+
+    std::vector<uint32_t> record_ids;
+    std::vector<uint32_t> cluster_ids;
+    record_ids.reserve(storage_->records_count());
+    cluster_ids.reserve(storage_->records_count());
+    ClusterStats stats;
+    stats.init(centroids.centroids_count());
+
+    // Records of untouched clusters keep or only renumber their cluster, distances are computed
+    // for the records of split and merged clusters only.
+    uint64_t reassigned_count = 0;
+    for (uint64_t record_id = 0; ; record_id++) {
+        Record record;
+        auto scan_ret = storage_->scan_record(record_id, record);
+        if (scan_ret == ScanResult::Finished) {
+            break;
+        }
+
+        if (scan_ret == ScanResult::Deleted) {
+            continue;
+        }
+
+        uint32_t stored_record_id = INVALID_RECORD_ID;
+        uint32_t cluster_id = InvalidClusterId;
+        if (records_reader->read_record(record.tag, stored_record_id, cluster_id) != 0) {
+            cluster_id = InvalidClusterId;
+        }
+
+        uint32_t new_cluster_id = InvalidClusterId;
+        if (cluster_id >= targets.size() || targets[cluster_id].empty()) {
+            new_cluster_id = centroids.find_nearest_centroid(record.data, type_, dim_);
+            reassigned_count++;
+        } else if (targets[cluster_id].size() == 1) {
+            new_cluster_id = targets[cluster_id][0];
+        } else {
+            double min_dist = std::numeric_limits<double>::max();
+            for (const auto target : targets[cluster_id]) {
+                const double dist = distance_L2_square(type_, record.data, centroids.get_centroid(target), dim_);
+                if (dist < min_dist) {
+                    min_dist = dist;
+                    new_cluster_id = target;
+                }
+            }
+            reassigned_count++;
+        }
+
+        ret = records_writer->write_record(record.tag, record_id, new_cluster_id, false);
+        if (ret != 0) {
+            return ret;
+        }
+
+        record_ids.push_back(record_id);
+        cluster_ids.push_back(new_cluster_id);
+
+        const double dist = distance_L2_square(type_, record.data, centroids.get_centroid(new_cluster_id), dim_);
+        stats.add(new_cluster_id, dist);
+    }
+
+    ret = PostingLists::write(index_path + "/" + PostingListsFileName, centroids.centroids_count(), cluster_ids, record_ids);
+    CHECK(ret)
+
+    ret = stats.write(index_path + "/" + ClusterStatsFileName);
+    CHECK(ret)
+
+    LOG_DEBUG << std::format("Node {} rebalanced index {}: {} of {} records reassigned",
+                             id_, index_id, reassigned_count, record_ids.size());
+
+    return records_writer->commit();
+}
+
+Ret DatasetNode::read_cluster_stats(uint64_t index_id, ClusterStats& stats) const {
+    const std::string path = dir_path_ + "/index_" + std::to_string(index_id) + "/" + ClusterStatsFileName;
+    if (!std::filesystem::exists(path)) {
+        return std::format("Cluster statistics of node {} are not available for index {}", id_, index_id);
+    }
+
+    return stats.read(path);
+}
+
+Ret DatasetNode::init_postings(uint64_t index_id) {
+    // Indexes written before posting lists existed keep their cluster lists in LMDB only.
+    const std::string index_path = dir_path_ + "/index_" + std::to_string(index_id);
+    const std::string path = index_path + "/" + PostingListsFileName;
+    if (!std::filesystem::exists(path)) {
+        postings_.reset();
+        stats_.reset();
+        return 0;
+    }
+
+    auto postings = std::make_unique<PostingLists>();
+    auto ret = postings->init(path);
+    CHECK(ret)
+
+    // Indexes written before the statistics existed are probed without radius bounds.
+    std::unique_ptr<ClusterStats> stats;
+    if (std::filesystem::exists(index_path + "/" + ClusterStatsFileName)) {
+        stats = std::make_unique<ClusterStats>();
+        ret = read_cluster_stats(index_id, *stats);
+        CHECK(ret)
+
+        if (stats->clusters_count() != postings->clusters_count()) {
+            return std::format("Cluster statistics of node {} do not match the posting lists", id_);
+        }
+    }
+
+    postings_ = std::move(postings);
+    stats_ = std::move(stats);
+    return 0;
+}
+
+std::span<const uint32_t> DatasetNode::get_posting_list(uint32_t cluster_id) const {
+    if (!postings_) {
+        return {};
+    }
+
+    return postings_->get(cluster_id);
+}
+
+void DatasetNode::read_index_delta(Lmdb& reader, uint32_t cluster_id, std::vector<uint32_t>& record_ids) {
+    int ret = reader.open_cursor(cluster_id);
+    const std::experimental::scope_exit closer([&] {
+        reader.close_cursor();
+    });
+    if (ret != 0) {
+        LOG_TRACE << "Failed to open cursor for cluster_id=" << cluster_id;
+        return;
+    }
+
+    uint32_t record_id = 0;
+    while (0 == reader.next(record_id)) {
+        record_ids.push_back(record_id);
+    }
+}
+
 } // namespace sketch
@@ -0,0 +1,313 @@
+#include "dataset.h"
+#include "centroids.h"
+#include "ivf_builder.h"
+#include "thread_pool.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <experimental/scope>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Rebalancing keeps the centroids of the current index and only changes the imbalanced clusters:
+ *   - a cluster larger than RebalanceSplitRatio x the mean size is split by KMeans over its own records,
+ *     the first part keeps the cluster id, the other parts take freed ids or are appended;
+ *   - a cluster smaller than RebalanceMergeRatio x the mean size is dropped and its records go to the
+ *     nearest remaining centroid;
+ *   - ids left free are filled with the last centroids, whose records are renumbered only.
+ */
+Ret Dataset::link_pq_centroids(const std::string& next_index_path) const {
+    const std::string index_path = path_ + "/index_" + std::to_string(metadata_.index_id);
+
+    std::vector<std::string> names;
+    for (size_t pq_index = 0; pq_index < metadata_.pq_count; pq_index++) {
+        names.push_back("pq_centroids_" + std::to_string(pq_index));
+    }
+    if (std::filesystem::exists(index_path + "/opq_rotation")) {
+        names.push_back("opq_rotation");
+    }
+
+    // A codebook is never written in place, so both indexes may share its file.
+    for (const auto& name : names) {
+        std::error_code ec;
+        std::filesystem::create_hard_link(index_path + "/" + name, next_index_path + "/" + name, ec);
+        if (ec) {
+            std::filesystem::copy_file(index_path + "/" + name, next_index_path + "/" + name, ec);
+        }
+        if (ec) {
+            return std::format("Failed to carry '{}' over to {}: {}", name, next_index_path, ec.message());
+        }
+    }
+
+    return 0;
+}
+
+Ret Dataset::rebalance_ivf(ThreadPool* thread_pool) {
+    if (!centroids_) {
+        return 0;
+    }
+
+    // Fine ids of a two-level index are ranges of the coarse cells, they cannot be renumbered.
+    if (centroids_->is_two_level()) {
+        return 0;
+    }
+
+    const uint32_t clusters_count = centroids_->centroids_count();
+    std::vector<uint64_t> sizes(clusters_count, 0);
+    for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+        auto node = get_node(node_index);
+        if (!node) {
+            return -1;
+        }
+
+        node->cluster_sizes(sizes);
+    }
+
+    uint64_t total_count = 0;
+    for (const auto size : sizes) {
+        total_count += size;
+    }
+
+    if (total_count == 0 || clusters_count < 2) {
+        return 0;
+    }
+
+    const double mean_size = static_cast<double>(total_count) / clusters_count;
+
+    std::vector<uint32_t> split_ids;
+    std::vector<uint32_t> merge_ids;
+    for (uint32_t cluster_id = 0; cluster_id < clusters_count; cluster_id++) {
+        if (sizes[cluster_id] > RebalanceSplitRatio * mean_size) {
+            split_ids.push_back(cluster_id);
+        } else if (sizes[cluster_id] < RebalanceMergeRatio * mean_size) {
+            merge_ids.push_back(cluster_id);
+        }
+    }
+
+    if (split_ids.empty() && merge_ids.empty()) {
+        return 0;
+    }
+
+    if (merge_ids.size() == clusters_count) {
+        return 0;
+    }
+
+    const auto type = metadata_.type;
+    const auto dim = metadata_.dim;
+    const uint64_t vector_size = centroids_->centroid_size();
+
+    // Slot i of the new index holds the centroid data, owners[i] is the target entry pointing at it.
+    std::vector<const uint8_t*> slots(clusters_count);
+    std::vector<std::pair<uint32_t, uint32_t>> owners(clusters_count);
+    ClusterTargets targets(clusters_count);
+    for (uint32_t cluster_id = 0; cluster_id < clusters_count; cluster_id++) {
+        slots[cluster_id] = centroids_->get_centroid(cluster_id);
+        owners[cluster_id] = { cluster_id, 0 };
+        targets[cluster_id] = { cluster_id };
+    }
+
+    std::vector<uint32_t> free_ids;
+    for (const auto cluster_id : merge_ids) {
+        slots[cluster_id] = nullptr;
+        targets[cluster_id].clear();
+        free_ids.push_back(cluster_id);
+    }
+
+    auto train_split = [&, this](uint32_t cluster_id, std::vector<uint8_t>& parts_data) -> Ret {
+        std::vector<const uint8_t*> records;
+        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+            auto node = get_node(node_index);
+            if (!node) {
+                return -1;
+            }
+
+            node->cluster_records(cluster_id, RebalanceSampleSize / nodes_.size() + 1, records);
+        }
+
+        const uint64_t wanted_parts = static_cast<uint64_t>(std::ceil(sizes[cluster_id] / mean_size));
+        const uint32_t parts_count = std::min<uint64_t>({ wanted_parts, RebalanceMaxSplitParts, records.size() });
+        if (parts_count < 2) {
+            return 0;
+        }
+
+        IvfBuilder builder(type, dim, parts_count, records.size());
+        CHECK(builder.init())
+        for (size_t i = 0; i < records.size(); i++) {
+            builder.set_record(i, records[i]);
+        }
+
+        CHECK(builder.init_centroids_kmeans_plus_plus())
+        for (uint64_t i = 0; i < RebalanceRecalcCount / 2 + 1; i++) {
+            CHECK(builder.recalc_centroids())
+        }
+
+        parts_data.assign(builder.get_centroid(0), builder.get_centroid(0) + parts_count * vector_size);
+        return 0;
+    };
+
+    std::vector<std::vector<uint8_t>> split_data(split_ids.size());
+    if (thread_pool) {
+        std::vector<std::future<Ret>> futures;
+        futures.reserve(split_ids.size());
+
+        for (size_t i = 0; i < split_ids.size(); i++) {
+            futures.push_back(thread_pool->submit([&train_split, &split_data, &split_ids, i] {
+                return train_split(split_ids[i], split_data[i]);
+            }));
+        }
+
+        Ret ret = 0;
+        for (auto& future : futures) {
+            Ret res = future.get();
+            if (res != 0) {
+                ret = res;
+            }
+        }
+        CHECK(ret)
+
+    } else {
+        for (size_t i = 0; i < split_ids.size(); i++) {
+            CHECK(train_split(split_ids[i], split_data[i]))
+        }
+    }
+
+    uint64_t split_count = 0;
+    for (const auto& parts_data : split_data) {
+        split_count += parts_data.empty() ? 0 : 1;
+    }
+
+    if (split_count == 0 && merge_ids.empty()) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < split_ids.size(); i++) {
+        const uint32_t cluster_id = split_ids[i];
+        const auto& parts_data = split_data[i];
+        const uint32_t parts_count = parts_data.size() / vector_size;
+        if (parts_count < 2) {
+            continue;
+        }
+
+        slots[cluster_id] = parts_data.data();
+        for (uint32_t part = 1; part < parts_count; part++) {
+            uint32_t slot = 0;
+            if (!free_ids.empty()) {
+                slot = free_ids.front();
+                free_ids.erase(free_ids.begin());
+            } else {
+                slot = slots.size();
+                slots.push_back(nullptr);
+                owners.emplace_back();
+            }
+
+            slots[slot] = parts_data.data() + part * vector_size;
+            owners[slot] = { cluster_id, static_cast<uint32_t>(targets[cluster_id].size()) };
+            targets[cluster_id].push_back(slot);
+        }
+    }
+
+    // Ids still free are filled with the last slots, so that cluster ids stay contiguous.
+    std::sort(free_ids.begin(), free_ids.end());
+    while (!free_ids.empty()) {
+        while (!slots.empty() && slots.back() == nullptr) {
+            const uint32_t last = slots.size() - 1;
+            slots.pop_back();
+            owners.pop_back();
+            free_ids.erase(std::remove(free_ids.begin(), free_ids.end(), last), free_ids.end());
+        }
+
+        if (free_ids.empty()) {
+            break;
+        }
+
+        const uint32_t slot = free_ids.front();
+        free_ids.erase(free_ids.begin());
+
+        const uint32_t last = slots.size() - 1;
+        slots[slot] = slots[last];
+        owners[slot] = owners[last];
+        targets[owners[slot].first][owners[slot].second] = slot;
+        slots.pop_back();
+        owners.pop_back();
+    }
+
+    IvfBuilder builder(type, dim, slots.size(), 0);
+    CHECK(builder.init())
+    for (size_t slot = 0; slot < slots.size(); slot++) {
+        memcpy(builder.get_centroids() + slot * vector_size, slots[slot], vector_size);
+    }
+
+    const std::experimental::scope_exit remover([this, next_index_id = metadata_.index_id + 1] {
+        remove_partial_index(next_index_id);
+    });
+
+    auto ret = write_centroids(builder, thread_pool);
+    builder.uninit();
+    CHECK(ret)
+
+    const uint64_t next_index_id = metadata_.index_id + 1;
+    const std::string index_path = path_ + "/index_" + std::to_string(next_index_id);
+
+    std::unique_ptr<Centroids> centroids;
+    ret = load_centroids(index_path, centroids);
+    CHECK(ret)
+
+    if (thread_pool) {
+        std::vector<std::future<Ret>> futures;
+        futures.reserve(nodes_.size());
+
+        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+            auto node = get_node(node_index);
+            if (!node) {
+                return -1;
+            }
+
+            futures.push_back(thread_pool->submit([node_ptr = node.get(), &centroids, &targets, next_index_id] {
+                return node_ptr->rebalance_index(*centroids, targets, next_index_id);
+            }));
+        }
+
+        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+            Ret res = futures[node_index].get();
+            if (res != 0) {
+                LOG_DEBUG << "ERROR: " << res.message();
+                ret = res;
+            }
+        }
+
+    } else {
+        for (size_t node_index = 0; node_index < nodes_.size(); node_index++) {
+            auto node = get_node(node_index);
+            if (!node) {
+                return -1;
+            }
+
+            Ret res = node->rebalance_index(*centroids, targets, next_index_id);
+            if (res != 0) {
+                ret = res;
+            }
+        }
+    }
+
+    CHECK(ret)
+
+    LOG_DEBUG << std::format("Rebalanced IVF index {}: {} clusters split, {} merged, {} -> {} clusters",
+                             metadata_.index_id, split_count, merge_ids.size(), clusters_count, slots.size());
+
+    // The kept centroids do not move, the PQ codebooks trained on their residuals stay valid for the new index.
+    ret = link_pq_centroids(index_path);
+    CHECK(ret)
+
+    ret = update_and_write_metadata(thread_pool);
+    CHECK(ret)
+
+    return Ret(0, std::format("{} clusters split, {} merged", split_count, merge_ids.size()));
+}
+
+} // namespace sketch
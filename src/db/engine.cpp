@@ -4,9 +4,12 @@
 #include "storage.h"
 #include "string_utils.h"
 #include "input_data.h"
+#include "lmdb2.h"
+#include "numa.h"
 #include "thread_pool.h"
 #include "log.h"
 
+#include <algorithm>
 #include <format>
 #include <filesystem>
 #include <fstream>
@@ -33,15 +36,29 @@ static Ret make_error(const std::string& message) {
  */
 Engine::Engine(const Config& config)
   : config_(config)
-{}
+{
+    if (config_.query_batch_window_us > 0) {
+        query_batcher_ = std::make_unique<QueryBatcher>(std::chrono::microseconds(config_.query_batch_window_us),
+                                                        config_.query_batch_max);
+    }
+}
 
 Engine::~Engine() {
-    // no-op
+    // Background index builds run on the build pool, they finish before the pools stop
+    for (auto& [_, catalog] : catalogs_) {
+        catalog->wait_builds();
+    }
 }
 
 Ret Engine::init() {
     std::filesystem::path data_path = config_.data_path;
-   
+
+    // The pools set the LMDB reader limit, which applies to the environments opened by the catalogs.
+    if (config_.thread_pool_size > 0 || config_.query_pool.size > 0 || config_.build_pool.size > 0 ||
+        config_.load_pool.size > 0) {
+        start_tread_pool(config_.thread_pool_size);
+    }
+
     try {
         if (!std::filesystem::exists(data_path)) {
             if (std::filesystem::create_directories(data_path) != 0) {
@@ -53,7 +70,7 @@ Ret Engine::init() {
             if (entry.is_directory()) {
                 const std::string catalog_name = entry.path().filename().string();
                 auto db = std::make_shared<Catalog>(config_, catalog_name);
-                if (db->init() != 0) {
+                if (db->init(load_pool_.get()) != 0) {
                     return make_error(std::format("Failed to initialize catalog '{}'", catalog_name));
                 }
                 catalogs_[catalog_name] = db;
@@ -63,10 +80,6 @@ Ret Engine::init() {
         return make_error(std::format("Filesystem error while initializing engine: {}", e.what()));
     }
 
-    if (config_.thread_pool_size > 0) {
-        start_tread_pool(config_.thread_pool_size);
-    }
-
     return 0;
 }
 
@@ -197,11 +210,58 @@ void Engine::start_tread_pool(size_t num_threads) {
         num_threads = std::thread::hardware_concurrency();
         if (num_threads == 0) num_threads = 4;
     }
-    thread_pool_ = std::make_unique<ThreadPool>(num_threads);
+
+    query_pool_ = make_pool("query", config_.query_pool, num_threads, nullptr);
+    build_pool_ = make_pool("build", config_.build_pool, num_threads, query_pool_.get());
+    load_pool_ = make_pool("load", config_.load_pool, num_threads, query_pool_.get());
+
+    // Every worker may hold a read transaction, along with the threads submitting the work.
+    const size_t workers_count = query_pool_->size() + build_pool_->size() + load_pool_->size();
+    LmdbEnv::set_max_readers(2 * workers_count);
 }
 
-ThreadPool* Engine::thread_pool() {
-    return thread_pool_.get();
+std::unique_ptr<ThreadPool> Engine::make_pool(const char* name, const PoolConfig& pool_config, size_t num_threads,
+                                              const ThreadPool* yield_to) {
+    ThreadPoolOptions options;
+    options.name = name;
+    options.cpus = pool_config.cpus;
+    options.nice = pool_config.nice;
+    options.yield_to = yield_to;
+
+    // One worker group per NUMA node, restricted to the CPUs of the pool when they are given
+    if (config_.numa) {
+        const auto nodes = numa_nodes();
+        for (size_t i = 0; nodes.size() > 1 && i < nodes.size(); i++) {
+            WorkerGroup group { .numa_node = nodes[i].id, .cpus = {} };
+            for (const int cpu : nodes[i].cpus) {
+                if (pool_config.cpus.empty() || std::find(pool_config.cpus.begin(), pool_config.cpus.end(), cpu) != pool_config.cpus.end()) {
+                    group.cpus.push_back(cpu);
+                }
+            }
+            if (!group.cpus.empty()) {
+                options.groups.push_back(std::move(group));
+            }
+        }
+        if (options.groups.size() < 2) {
+            LOG_INFO << "NUMA mode of " << name << " thread pool is off, the CPUs are on a single NUMA node";
+            options.groups.clear();
+        }
+    }
+
+    const size_t size = pool_config.size > 0 ? pool_config.size : num_threads;
+    LOG_INFO << "Starting " << name << " thread pool of " << size << " threads"
+             << (options.groups.empty() ? "" : " over " + std::to_string(options.groups.size()) + " NUMA nodes");
+    return std::make_unique<ThreadPool>(size, std::move(options));
+}
+
+ThreadPool* Engine::thread_pool(PoolKind kind) {
+    switch (kind) {
+        case PoolKind::query: return query_pool_.get();
+        case PoolKind::build: return build_pool_.get();
+        case PoolKind::load: return load_pool_.get();
+    }
+
+    return nullptr;
 }
 
 } // namespace sketch
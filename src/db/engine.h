@@ -5,6 +5,7 @@
 #include "dataset_node.h"
 #include "dataset.h"
 #include "catalog.h"
+#include "query_batcher.h"
 #include "shared_types.h"
 #include <atomic>
 #include <memory>
@@ -14,6 +15,13 @@
 
 namespace sketch {
 
+// Named thread pools, every dataset operation runs on the pool of its kind.
+enum class PoolKind {
+    query,      // KNN, ANN, FIND: latency sensitive, the other pools yield to it
+    build,      // IVF, PQ and HNSW index builds
+    load,       // LOAD and DUMP
+};
+
 class Engine {
 public:
     Engine(const Config& config);
@@ -31,13 +39,23 @@ public:
 
     DatasetPtr find_dataset(const std::string_view& catalog_name, const std::string_view& dataset_name);
 
+    // Starts every pool with num_threads workers and the affinity and nice values of the config.
     void start_tread_pool(size_t num_threads = 0);
-    ThreadPool* thread_pool();
+    ThreadPool* thread_pool(PoolKind kind = PoolKind::query);
+    // Null unless [query] batch_window_us is set.
+    QueryBatcher* query_batcher() { return query_batcher_.get(); }
 
 private:
+    std::unique_ptr<ThreadPool> make_pool(const char* name, const PoolConfig& pool_config, size_t num_threads,
+                                          const ThreadPool* yield_to);
+
     const Config& config_;
     Catalogs catalogs_;
-    std::unique_ptr<ThreadPool> thread_pool_;
+    // The query pool is destroyed last, the other pools refer to it
+    std::unique_ptr<ThreadPool> query_pool_;
+    std::unique_ptr<ThreadPool> build_pool_;
+    std::unique_ptr<ThreadPool> load_pool_;
+    std::unique_ptr<QueryBatcher> query_batcher_;
 
 };
 
@@ -0,0 +1,543 @@
+#include "hnsw.h"
+#include "math.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <experimental/scope>
+#include <format>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sketch {
+
+static constexpr uint64_t MagicNumber = 0x484E5357;
+static constexpr uint64_t MaxLevel = 16;
+static constexpr uint64_t LockStripes = 64 * 1024;
+static constexpr uint64_t InsertRange = 1024;
+static constexpr uint64_t StopCheckInterval = 64;       // Candidates a search expands between two stop polls
+
+struct HnswHeader {
+    uint64_t magic;
+    uint64_t count;
+    uint64_t M;
+    uint64_t M0;
+    uint64_t entry;
+    uint64_t max_level;
+    uint64_t upper_size;
+};
+
+struct Candidate {
+    double dist;
+    uint32_t id;
+
+    bool operator<(const Candidate& other) const { return dist < other.dist; }
+    bool operator>(const Candidate& other) const { return dist > other.dist; }
+};
+
+using MaxHeap = std::priority_queue<Candidate>;
+using MinHeap = std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>>;
+
+// Visited marks are stamped instead of cleared, so that a search does not pay for the graph size.
+struct VisitedTable {
+    std::vector<uint32_t> marks;
+    uint32_t stamp = 0;
+
+    void reset(uint64_t count) {
+        if (marks.size() < count) {
+            marks.resize(count, 0);
+        }
+        if (++stamp == 0) {
+            std::fill(marks.begin(), marks.end(), 0);
+            stamp = 1;
+        }
+    }
+
+    bool visit(uint32_t id) {
+        if (marks[id] == stamp) {
+            return false;
+        }
+        marks[id] = stamp;
+        return true;
+    }
+};
+
+/****************************************
+ *   Tables are held by running searches only, instead of one table per thread that ever searched,
+ *   so their count follows the number of concurrent searches.
+ */
+class VisitedTablePool {
+public:
+    std::unique_ptr<VisitedTable> acquire() {
+        {
+            std::lock_guard lock(mutex_);
+            if (!free_.empty()) {
+                auto table = std::move(free_.back());
+                free_.pop_back();
+                return table;
+            }
+        }
+        return std::make_unique<VisitedTable>();
+    }
+
+    void release(std::unique_ptr<VisitedTable> table) {
+        std::lock_guard lock(mutex_);
+        if (free_.size() < MaxFreeTables) {
+            free_.push_back(std::move(table));
+        }
+    }
+
+private:
+    static constexpr size_t MaxFreeTables = 64;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<VisitedTable>> free_;
+};
+
+static VisitedTablePool visited_tables;
+
+/****************************************
+ *   Neighbors(id, level, buffer) returns links as [count, ids...], either in place or copied to buffer.
+ */
+template <typename Neighbors>
+static Candidate greedy_search(const uint8_t* query, DatasetType type, uint64_t dim, const HnswVectors& vectors,
+                               Candidate current, uint64_t level, const Neighbors& neighbors) {
+    std::vector<uint32_t> buffer;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        const uint32_t* links = neighbors(current.id, level, buffer);
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            const double dist = distance_L2_square(type, query, vectors.get(links[i]), dim);
+            if (dist < current.dist) {
+                current = Candidate{dist, links[i]};
+                changed = true;
+            }
+        }
+    }
+    return current;
+}
+
+template <typename Neighbors>
+static void search_layer(const uint8_t* query, DatasetType type, uint64_t dim, const HnswVectors& vectors,
+                         Candidate entry, uint64_t ef, uint64_t level, const Neighbors& neighbors,
+                         const HnswFilter& filter, const HnswStop& stop, MaxHeap& results) {
+    auto table = visited_tables.acquire();
+    const std::experimental::scope_exit releaser([&table] { visited_tables.release(std::move(table)); });
+    auto& visited = *table;
+    visited.reset(vectors.count);
+    visited.visit(entry.id);
+
+    MinHeap candidates;
+    candidates.push(entry);
+    if (!filter || filter(entry.id)) {
+        results.push(entry);
+    }
+
+    std::vector<uint32_t> buffer;
+    for (uint64_t expanded = 0; !candidates.empty(); expanded++) {
+        const Candidate current = candidates.top();
+        if (results.size() >= ef && current.dist > results.top().dist) {
+            break;
+        }
+        if (stop && expanded % StopCheckInterval == 0 && stop()) {
+            break;
+        }
+        candidates.pop();
+
+        const uint32_t* links = neighbors(current.id, level, buffer);
+        for (uint32_t i = 1; i <= links[0]; i++) {
+            const uint32_t id = links[i];
+            if (!visited.visit(id)) {
+                continue;
+            }
+
+            const double dist = distance_L2_square(type, query, vectors.get(id), dim);
+            if (results.size() < ef || dist < results.top().dist) {
+                candidates.push(Candidate{dist, id});
+                if (!filter || filter(id)) {
+                    results.push(Candidate{dist, id});
+                    if (results.size() > ef) {
+                        results.pop();
+                    }
+                }
+            }
+        }
+    }
+}
+
+class HnswBuilder {
+public:
+    HnswBuilder(DatasetType type, uint64_t dim, const HnswVectors& vectors, const HnswParams& params)
+        : type_(type), dim_(dim), vectors_(vectors), M_(params.M), M0_(params.M * 2),
+          ef_construction_(std::max(params.ef_construction, params.M)),
+          locks_(std::min<uint64_t>(LockStripes, std::max<uint64_t>(vectors.count, 1))) {}
+
+    Ret build(const std::vector<uint32_t>& ids, ThreadPool* thread_pool);
+    Ret write(const std::string& path) const;
+
+private:
+    const DatasetType type_;
+    const uint64_t dim_;
+    const HnswVectors vectors_;
+    const uint64_t M_;
+    const uint64_t M0_;
+    const uint64_t ef_construction_;
+
+    std::vector<uint64_t> upper_offsets_;
+    std::vector<uint32_t> level0_;
+    std::vector<uint32_t> upper_;
+    std::vector<uint8_t> levels_;
+    std::vector<std::mutex> locks_;
+
+    std::mutex entry_mutex_;
+    uint32_t entry_ = Hnsw::Empty;
+    uint64_t max_level_ = 0;
+
+private:
+    uint32_t* links(uint32_t id, uint64_t level) {
+        if (level == 0) {
+            return level0_.data() + id * (1 + M0_);
+        }
+        return upper_.data() + upper_offsets_[id] + (level - 1) * (1 + M_);
+    }
+
+    std::mutex& lock(uint32_t id) { return locks_[id % locks_.size()]; }
+
+    double distance(const uint8_t* a, uint32_t b) const {
+        return distance_L2_square(type_, a, vectors_.get(b), dim_);
+    }
+
+    void insert(uint32_t id);
+    void connect(uint32_t id, uint32_t neighbor, uint64_t level);
+    void select_neighbors(std::vector<Candidate>& candidates, uint64_t max_count) const;
+};
+
+Ret HnswBuilder::build(const std::vector<uint32_t>& ids, ThreadPool* thread_pool) {
+    if (vectors_.count >= Hnsw::Empty) {
+        return "Too many vectors for HNSW graph";
+    }
+
+    std::mt19937 gen(static_cast<uint32_t>(ids.size()));
+    std::uniform_real_distribution<double> dis(std::numeric_limits<double>::min(), 1.0);
+    const double level_mult = 1.0 / std::log(static_cast<double>(std::max<uint64_t>(M_, 2)));
+
+    levels_.assign(vectors_.count, 0);
+    upper_offsets_.assign(vectors_.count, Hnsw::EmptyOffset);
+    level0_.assign(vectors_.count * (1 + M0_), 0);
+
+    uint64_t upper_size = 0;
+    for (const auto id : ids) {
+        if (id >= vectors_.count) {
+            return std::format("Invalid HNSW vector id {}", id);
+        }
+
+        const uint64_t level = std::min<uint64_t>(MaxLevel, static_cast<uint64_t>(-std::log(dis(gen)) * level_mult));
+        levels_[id] = level;
+        if (level > 0) {
+            upper_offsets_[id] = upper_size;
+            upper_size += level * (1 + M_);
+        }
+    }
+    upper_.assign(upper_size, 0);
+
+    if (ids.empty()) {
+        return 0;
+    }
+
+    entry_ = ids[0];
+    max_level_ = levels_[ids[0]];
+
+    if (thread_pool && ids.size() > InsertRange) {
+        std::vector<std::future<void>> futures;
+        futures.reserve(ids.size() / InsertRange + 1);
+
+        for (uint64_t from = 1; from < ids.size(); from += InsertRange) {
+            const uint64_t to = std::min<uint64_t>(from + InsertRange, ids.size());
+            futures.push_back(thread_pool->submit([this, &ids, from, to] {
+                for (uint64_t i = from; i < to; i++) {
+                    insert(ids[i]);
+                }
+            }));
+        }
+
+        for (auto& future : futures) {
+            future.get();
+        }
+
+    } else {
+        for (uint64_t i = 1; i < ids.size(); i++) {
+            insert(ids[i]);
+        }
+    }
+
+    return 0;
+}
+
+void HnswBuilder::insert(uint32_t id) {
+    const uint64_t level = levels_[id];
+    const uint8_t* query = vectors_.get(id);
+
+    // A node above the current top level becomes the entry point, other inserts wait for it to be linked.
+    std::unique_lock<std::mutex> entry_lock(entry_mutex_);
+    const uint32_t entry = entry_;
+    const uint64_t max_level = max_level_;
+    if (level <= max_level) {
+        entry_lock.unlock();
+    }
+
+    auto neighbors = [this](uint32_t node, uint64_t node_level, std::vector<uint32_t>& buffer) -> const uint32_t* {
+        const uint64_t size = 1 + (node_level == 0 ? M0_ : M_);
+        buffer.resize(size);
+        std::lock_guard<std::mutex> guard(lock(node));
+        const uint32_t* node_links = links(node, node_level);
+        std::copy(node_links, node_links + 1 + node_links[0], buffer.begin());
+        return buffer.data();
+    };
+
+    Candidate current{distance(query, entry), entry};
+    for (uint64_t l = max_level; l > level; l--) {
+        current = greedy_search(query, type_, dim_, vectors_, current, l, neighbors);
+    }
+
+    for (uint64_t l = std::min(level, max_level) + 1; l-- > 0; ) {
+        MaxHeap results;
+        search_layer(query, type_, dim_, vectors_, current, ef_construction_, l, neighbors, nullptr, nullptr, results);
+
+        std::vector<Candidate> candidates;
+        candidates.reserve(results.size());
+        while (!results.empty()) {
+            candidates.push_back(results.top());
+            results.pop();
+        }
+        std::reverse(candidates.begin(), candidates.end());
+        current = candidates.front();
+
+        select_neighbors(candidates, M_);
+
+        {
+            std::lock_guard<std::mutex> guard(lock(id));
+            uint32_t* id_links = links(id, l);
+            id_links[0] = candidates.size();
+            for (size_t i = 0; i < candidates.size(); i++) {
+                id_links[i + 1] = candidates[i].id;
+            }
+        }
+
+        for (const auto& candidate : candidates) {
+            connect(candidate.id, id, l);
+        }
+    }
+
+    if (level > max_level) {
+        entry_ = id;
+        max_level_ = level;
+    }
+}
+
+void HnswBuilder::connect(uint32_t id, uint32_t neighbor, uint64_t level) {
+    const uint64_t max_count = level == 0 ? M0_ : M_;
+
+    std::lock_guard<std::mutex> guard(lock(id));
+    uint32_t* id_links = links(id, level);
+    if (id_links[0] < max_count) {
+        id_links[1 + id_links[0]] = neighbor;
+        id_links[0]++;
+        return;
+    }
+
+    const uint8_t* base = vectors_.get(id);
+    std::vector<Candidate> candidates;
+    candidates.reserve(max_count + 1);
+    candidates.push_back(Candidate{distance(base, neighbor), neighbor});
+    for (uint32_t i = 1; i <= id_links[0]; i++) {
+        candidates.push_back(Candidate{distance(base, id_links[i]), id_links[i]});
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    select_neighbors(candidates, max_count);
+
+    id_links[0] = candidates.size();
+    for (size_t i = 0; i < candidates.size(); i++) {
+        id_links[i + 1] = candidates[i].id;
+    }
+}
+
+// Keeps a candidate only if it is closer to the base than to every neighbor kept so far.
+void HnswBuilder::select_neighbors(std::vector<Candidate>& candidates, uint64_t max_count) const {
+    if (candidates.size() <= max_count) {
+        return;
+    }
+
+    std::vector<Candidate> selected;
+    selected.reserve(max_count);
+    for (const auto& candidate : candidates) {
+        if (selected.size() >= max_count) {
+            break;
+        }
+
+        const uint8_t* vector = vectors_.get(candidate.id);
+        bool keep = true;
+        for (const auto& other : selected) {
+            if (distance(vector, other.id) < candidate.dist) {
+                keep = false;
+                break;
+            }
+        }
+
+        if (keep) {
+            selected.push_back(candidate);
+        }
+    }
+
+    candidates.swap(selected);
+}
+
+Ret HnswBuilder::write(const std::string& path) const {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        return std::format("Failed to open file '{}' for writing", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    const HnswHeader header {
+        .magic = MagicNumber,
+        .count = vectors_.count,
+        .M = M_,
+        .M0 = M0_,
+        .entry = entry_,
+        .max_level = max_level_,
+        .upper_size = upper_.size(),
+    };
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(upper_offsets_.data(), sizeof(uint64_t), upper_offsets_.size(), f) != upper_offsets_.size() ||
+        fwrite(level0_.data(), sizeof(uint32_t), level0_.size(), f) != level0_.size() ||
+        fwrite(upper_.data(), sizeof(uint32_t), upper_.size(), f) != upper_.size()) {
+        return std::format("Failed to write HNSW graph to file '{}'", path);
+    }
+
+    fflush(f);
+
+    return 0;
+}
+
+//static
+Ret Hnsw::build(const std::string& path, DatasetType type, uint64_t dim, const HnswVectors& vectors,
+                const std::vector<uint32_t>& ids, const HnswParams& params, ThreadPool* thread_pool) {
+    if (params.M < 2) {
+        return "HNSW requires M of at least 2";
+    }
+
+    HnswBuilder builder(type, dim, vectors, params);
+    auto ret = builder.build(ids, thread_pool);
+    CHECK(ret)
+
+    return builder.write(path);
+}
+
+Ret Hnsw::init(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return std::format("Failed to open file '{}'", path);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return std::format("Failed to get file size '{}'", path);
+    }
+
+    if (static_cast<uint64_t>(sb.st_size) < sizeof(HnswHeader)) {
+        close(fd);
+        return std::format("Invalid HNSW file '{}'", path);
+    }
+
+    void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return std::format("Failed to map file '{}'", path);
+    }
+
+    const uint8_t* ptr = static_cast<const uint8_t*>(map);
+    const HnswHeader* header = reinterpret_cast<const HnswHeader*>(ptr);
+
+    const uint64_t required_size = sizeof(HnswHeader) + header->count * sizeof(uint64_t) +
+                                   (header->count * (1 + header->M0) + header->upper_size) * sizeof(uint32_t);
+    if (header->magic != MagicNumber || static_cast<uint64_t>(sb.st_size) < required_size ||
+        (header->count > 0 && header->entry >= header->count)) {
+        munmap(map, sb.st_size);
+        return std::format("Invalid HNSW file '{}'", path);
+    }
+
+    ptr_ = ptr;
+    memory_size_ = sb.st_size;
+    count_ = header->count;
+    M_ = header->M;
+    M0_ = header->M0;
+    entry_ = header->count > 0 ? header->entry : Empty;
+    max_level_ = header->max_level;
+    upper_offsets_ = reinterpret_cast<const uint64_t*>(ptr + sizeof(HnswHeader));
+    level0_ = reinterpret_cast<const uint32_t*>(upper_offsets_ + count_);
+    upper_ = level0_ + count_ * (1 + M0_);
+
+    return 0;
+}
+
+void Hnsw::uninit() {
+    if (ptr_) {
+        munmap(const_cast<uint8_t*>(ptr_), memory_size_);
+        ptr_ = nullptr;
+    }
+    count_ = 0;
+    entry_ = Empty;
+}
+
+const uint32_t* Hnsw::get_links(uint32_t id, uint64_t level) const {
+    if (level == 0) {
+        return level0_ + id * (1 + M0_);
+    }
+    return upper_ + upper_offsets_[id] + (level - 1) * (1 + M_);
+}
+
+void Hnsw::search(const uint8_t* query, DatasetType type, uint64_t dim, const HnswVectors& vectors,
+                  uint64_t count, uint64_t ef, std::vector<DistItem>& result, const HnswFilter& filter,
+                  const HnswStop& stop) const {
+    result.clear();
+    if (!ptr_ || entry_ == Empty || count == 0 || vectors.count < count_) {
+        return;
+    }
+
+    auto neighbors = [this](uint32_t id, uint64_t level, std::vector<uint32_t>&) {
+        return get_links(id, level);
+    };
+
+    Candidate current{distance_L2_square(type, query, vectors.get(entry_), dim), entry_};
+    for (uint64_t level = max_level_; level > 0; level--) {
+        current = greedy_search(query, type, dim, vectors, current, level, neighbors);
+    }
+
+    MaxHeap results;
+    search_layer(query, type, dim, vectors, current, std::max(ef, count), 0, neighbors, filter, stop, results);
+
+    while (results.size() > count) {
+        results.pop();
+    }
+
+    result.reserve(results.size());
+    while (!results.empty()) {
+        result.push_back(DistItem{ .dist=results.top().dist, .record_id=results.top().id, .tag=0 });
+        results.pop();
+    }
+}
+
+} // namespace sketch
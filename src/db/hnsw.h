@@ -0,0 +1,82 @@
+#pragma once
+#include "shared_types.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sketch {
+
+class ThreadPool;
+
+/****************************************
+ *
+ *   Hierarchical navigable small world graph over a set of fixed size vectors.
+ *
+ *   Vectors are not stored in the graph, they are addressed as data + id * stride, so the same
+ *   graph works over a centroids file or over a node storage.
+ *
+ *   File layout:
+ *   |--------+-----------------------+----------------------------+-------------|
+ *     header   upper offsets[count]    level 0 links[count][1+M0]   upper links
+ *
+ *   Links of a node at a level are the neighbors count followed by the neighbor ids.
+ *   A node of level L has L blocks of (1 + M) upper links for levels 1..L starting at
+ *   its upper offset (in uint32), nodes of level 0 have an Empty upper offset.
+ */
+struct HnswVectors {
+    const uint8_t* data = nullptr;
+    uint64_t stride = 0;
+    uint64_t count = 0;
+
+    const uint8_t* get(uint64_t id) const { return data + id * stride; }
+};
+
+struct HnswParams {
+    uint32_t M = 16;
+    uint32_t ef_construction = 128;
+};
+
+using HnswFilter = std::function<bool(uint32_t id)>;
+// Polled while the search expands candidates, true ends it with the results found so far.
+using HnswStop = std::function<bool()>;
+
+class Hnsw {
+public:
+    ~Hnsw() { uninit(); }
+
+    // Builds the graph over the given ids of vectors and writes it to path.
+    static Ret build(const std::string& path, DatasetType type, uint64_t dim, const HnswVectors& vectors,
+                     const std::vector<uint32_t>& ids, const HnswParams& params, ThreadPool* thread_pool = nullptr);
+
+    Ret init(const std::string& path);
+    void uninit();
+
+    uint64_t count() const { return count_; }
+
+    // Returns up to count nearest ids accepted by filter, farthest first like the other searches.
+    void search(const uint8_t* query, DatasetType type, uint64_t dim, const HnswVectors& vectors,
+                uint64_t count, uint64_t ef, std::vector<DistItem>& result, const HnswFilter& filter = nullptr,
+                const HnswStop& stop = nullptr) const;
+
+public:
+    static constexpr uint32_t Empty = 0xFFFFFFFF;
+    static constexpr uint64_t EmptyOffset = 0xFFFFFFFFFFFFFFFF;
+
+private:
+    const uint8_t* ptr_ = nullptr;
+    uint64_t memory_size_ = 0;
+    uint64_t count_ = 0;
+    uint64_t M_ = 0;
+    uint64_t M0_ = 0;
+    uint32_t entry_ = Empty;
+    uint64_t max_level_ = 0;
+    const uint64_t* upper_offsets_ = nullptr;
+    const uint32_t* level0_ = nullptr;
+    const uint32_t* upper_ = nullptr;
+
+private:
+    const uint32_t* get_links(uint32_t id, uint64_t level) const;
+};
+
+} // namespace sketch
@@ -1,10 +1,13 @@
 #include "ivf_builder.h"
+#include "assigner.h"
 #include "math.h"
+#include "thread_pool.h"
 #include <stdio.h>
 #include <sys/mman.h>
 #include <cstring>
 #include <cerrno>
 #include <format>
+#include <limits>
 #include <random>
 
 namespace sketch {
@@ -40,9 +43,9 @@ Ret IvfBuilder::init() {
     }
     ptr_ = static_cast<uint8_t*>(ptr);
 
-    counts_size_ = centroids_count_ * sizeof(uint32_t);
-    records_size_ = records_count_ * sizeof(uint8_t*);
-    sums_size_ = centroids_count_ * dim_ * sizeof(double);
+    counts_size_ = static_cast<uint64_t>(centroids_count_) * sizeof(uint32_t);
+    records_size_ = static_cast<uint64_t>(records_count_) * sizeof(uint8_t*);
+    sums_size_ = static_cast<uint64_t>(centroids_count_) * dim_ * sizeof(double);
 
     counts_ = reinterpret_cast<uint32_t*>(ptr_);
     records_ = reinterpret_cast<RecordPtr*>(ptr_ + counts_size_);
@@ -66,14 +69,18 @@ Ret IvfBuilder::uninit() {
 uint64_t IvfBuilder::calc_size(DatasetType type, uint16_t dim, uint32_t centroids_count, uint32_t records_count) {
     const uint64_t record_size = calc_record_size(type, dim);
 
-    const uint64_t counts_size = centroids_count * sizeof(uint32_t);
-    const uint32_t records_size = records_count * sizeof(uint8_t*);
-    const uint32_t sums_size = centroids_count * dim * sizeof(double);
+    const uint64_t counts_size = static_cast<uint64_t>(centroids_count) * sizeof(uint32_t);
+    const uint64_t records_size = static_cast<uint64_t>(records_count) * sizeof(uint8_t*);
+    const uint64_t sums_size = static_cast<uint64_t>(centroids_count) * dim * sizeof(double);
     const uint64_t vectors_size = centroids_count * record_size * 2;
 
     return counts_size + records_size + sums_size + vectors_size;
 }
 
+uint8_t* IvfBuilder::get_centroids() {
+    return const_cast<uint8_t*>(get_centroids(current_set_type_));
+}
+
 const uint8_t* IvfBuilder::get_centroid(size_t index) const {
     return get_centroids(current_set_type_) + index * vector_size_;
 }
@@ -86,100 +93,305 @@ const uint8_t* IvfBuilder::get_centroids(SetType setType) const {
     return nullptr;
 }
 
-Ret IvfBuilder::init_centroids_kmeans_plus_plus() {
-    if (type_ == DatasetType::u8) {
-        return "KMeans++ initialization does not support u8 dataset type";
+/****************************************
+ *   Splits [0, count) into ranges, runs func(from, to) for each of them on the thread pool
+ *   and returns the sum of the results.
+ */
+template <typename F>
+static double parallel_sum(ThreadPool* thread_pool, uint64_t count, const F& func) {
+    const uint64_t min_range_size = 4096;
+    uint64_t tasks_count = 1;
+    if (thread_pool) {
+        tasks_count = std::min<uint64_t>(thread_pool->size(), (count + min_range_size - 1) / min_range_size);
     }
 
-    // 1. Pick first center randomly
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, records_count_ - 1);    
+    if (tasks_count <= 1) {
+        return func(0, count);
+    }
+
+    const uint64_t range_size = (count + tasks_count - 1) / tasks_count;
+    std::vector<std::future<double>> futures;
+    futures.reserve(tasks_count);
+    for (uint64_t from = 0; from < count; from += range_size) {
+        const uint64_t to = std::min(count, from + range_size);
+        futures.push_back(thread_pool->submit([&func, from, to] {
+            return func(from, to);
+        }));
+    }
+
+    double sum = 0.0;
+    for (auto& future : futures) {
+        sum += future.get();
+    }
+    return sum;
+}
+
+// Returns index of the item selected with probability proportional to its weight.
+static size_t select_weighted(const std::vector<double>& weights, double sum, std::mt19937& gen) {
+    std::uniform_real_distribution<> weight_dis(0, sum);
+    const double threshold = weight_dis(gen);
+
+    size_t selected = weights.size();
+    double cumulative_sum = 0.0;
+    for (size_t i = 0; i < weights.size(); i++) {
+        if (weights[i] <= 0.0) {
+            continue;
+        }
+        selected = i;
+        cumulative_sum += weights[i];
+        if (cumulative_sum > threshold) {
+            break;
+        }
+    }
+
+    return selected;
+}
+
+IvfBuilder::RecordPtr IvfBuilder::select_random_record(std::mt19937& gen) const {
+    std::uniform_int_distribution<> dis(0, records_count_ - 1);
 
-    const uint8_t* record = nullptr;
     const size_t attempts_count = records_count_;
     for (size_t i = 0; i < attempts_count; i++) {
         size_t random_index = dis(gen);
         if (records_[random_index] != nullptr) {
-            record = records_[random_index];
-            break;
+            return records_[random_index];
+        }
+    }
+
+    return nullptr;
+}
+
+Ret IvfBuilder::init_centroids_kmeans_plus_plus(ThreadPool* thread_pool) {
+    if (type_ == DatasetType::u8) {
+        return "KMeans++ initialization does not support u8 dataset type";
+    }
+
+    if (centroids_count_ == 0 || records_count_ == 0) {
+        return "KMeans++ initialization requires centroids and records";
+    }
+
+    learning_counts_.clear();
+
+    std::random_device rd;
+    std::mt19937 gen(rd());
+
+    if (centroids_count_ >= KMeansParallelMinCentroids) {
+        bool done = false;
+        auto ret = init_centroids_kmeans_parallel(gen, thread_pool, done);
+        if (ret != 0 || done) {
+            return ret;
         }
     }
 
+    return init_centroids_kmeans_incremental(gen, thread_pool);
+}
+
+/****************************************
+ *   KMeans++ where D(x)^2 is updated against the newly added centroid only: O(n * k * d).
+ */
+Ret IvfBuilder::init_centroids_kmeans_incremental(std::mt19937& gen, ThreadPool* thread_pool) {
+    // 1. Pick first center randomly
+    const uint8_t* record = select_random_record(gen);
     if (record == nullptr) {
         return "Failed to select initial centroid for KMeans++";
     }
-    
 
     uint8_t* centroid = const_cast<uint8_t*>(get_centroid(0));
     memcpy(centroid, record, vector_size_);
     size_t centroids_count = 1;
 
-    std::vector<double> distances_sq(records_count_, 0.0);
+    std::vector<double> distances_sq(records_count_, std::numeric_limits<double>::max());
 
     while (centroids_count < centroids_count_) {
-        double sum_sq = 0.0;
+        // 2. Update D(x)^2 for all points against the last added centroid
+        const uint8_t* last_centroid = get_centroid(centroids_count - 1);
+        const double sum_sq = parallel_sum(thread_pool, records_count_, [&](uint64_t from, uint64_t to) {
+            double sum = 0.0;
+            for (uint64_t j = from; j < to; j++) {
+                RecordPtr p = records_[j];
+                if (p == nullptr) {
+                    distances_sq[j] = 0.0;
+                    continue;
+                }
+                const double dist_sq = distance_L2_square(type_, p, last_centroid, dim_);
+                distances_sq[j] = std::min(distances_sq[j], dist_sq);
+                sum += distances_sq[j];
+            }
+            return sum;
+        });
 
-        // 2. Compute D(x)^2 for all points
-        for (size_t j = 0; j < records_count_; j++) {
-            RecordPtr p = records_[j];
-            if (p == nullptr) {
-                continue;
+        // 3. Select next center based on weighted probability
+        RecordPtr next = nullptr;
+        if (sum_sq > 0.0) {
+            const size_t index = select_weighted(distances_sq, sum_sq, gen);
+            if (index < records_count_) {
+                next = records_[index];
             }
-            double min_dist_sq = std::numeric_limits<double>::max();
-
-            for (size_t i = 0; i < centroids_count_; i++) {
-                const uint8_t* c = get_centroid(i);
-                double dist_sq = 0.0;
-                switch (type_) {
-                    case DatasetType::f32:
-                        dist_sq = distance_L2_square((float*)p, (float*)c, dim_);
-                        break;
-                    case DatasetType::f16:
-                        dist_sq = distance_L2_square((float16_t*)p, (float16_t*)c, dim_);
-                        break;
-                    case DatasetType::u8:
-                        return "KMeans++ initialization does not support u8 dataset type";
+        }
+
+        // All records coincide with the centroids chosen so far.
+        if (next == nullptr) {
+            next = select_random_record(gen);
+        }
+
+        uint8_t* centroid = const_cast<uint8_t*>(get_centroid(centroids_count));
+        memcpy(centroid, next, vector_size_);
+        centroids_count++;
+    }
+
+    return 0;
+}
+
+/****************************************
+ *   Scalable KMeans++ (KMeans||).
+ *
+ *   Oversamples about KMeansParallelOversampling * k candidates per round in a few rounds,
+ *   weights every candidate by the number of records closest to it and reduces the
+ *   candidates to k centroids with weighted KMeans++. Sets done to false, if not enough
+ *   candidates were found and the caller should fall back to plain KMeans++.
+ */
+Ret IvfBuilder::init_centroids_kmeans_parallel(std::mt19937& gen, ThreadPool* thread_pool, bool& done) {
+    done = false;
+
+    const uint8_t* first = select_random_record(gen);
+    if (first == nullptr) {
+        return "Failed to select initial centroid for KMeans||";
+    }
+
+    std::vector<RecordPtr> candidates{first};
+    std::vector<double> distances_sq(records_count_, std::numeric_limits<double>::max());
+    std::vector<uint32_t> nearest(records_count_, 0);
+
+    const double oversampling = KMeansParallelOversampling * centroids_count_;
+    std::uniform_real_distribution<> dis(0.0, 1.0);
+
+    std::vector<RecordPtr> new_candidates{first};
+    for (size_t round = 0; round <= KMeansParallelRounds; round++) {
+        // Update D(x)^2 and the nearest candidate against the candidates added in the previous round.
+        std::vector<uint8_t> packed(new_candidates.size() * vector_size_);
+        for (size_t i = 0; i < new_candidates.size(); i++) {
+            memcpy(packed.data() + i * vector_size_, new_candidates[i], vector_size_);
+        }
+
+        CentroidAssigner assigner;
+        auto ret = assigner.init(type_, dim_, packed.data(), vector_size_, new_candidates.size());
+        CHECK(ret)
+
+        const uint32_t base_index = candidates.size() - new_candidates.size();
+        const double sum_sq = parallel_sum(thread_pool, records_count_, [&](uint64_t from, uint64_t to) {
+            std::vector<RecordPtr> batch;
+            std::vector<uint64_t> batch_indexes;
+            for (uint64_t j = from; j < to; j++) {
+                if (records_[j] == nullptr) {
+                    distances_sq[j] = 0.0;
+                    continue;
                 }
+                batch.push_back(records_[j]);
+                batch_indexes.push_back(j);
+            }
 
-                min_dist_sq = std::min(min_dist_sq, dist_sq);
+            std::vector<uint32_t> ids(batch.size());
+            assigner.find_nearest(batch.data(), batch.size(), ids.data());
+
+            double sum = 0.0;
+            for (size_t i = 0; i < batch.size(); i++) {
+                const uint64_t j = batch_indexes[i];
+                const uint8_t* candidate = packed.data() + ids[i] * vector_size_;
+                const double dist_sq = distance_L2_square(type_, batch[i], candidate, dim_);
+                if (dist_sq < distances_sq[j]) {
+                    distances_sq[j] = dist_sq;
+                    nearest[j] = base_index + ids[i];
+                }
+                sum += distances_sq[j];
             }
+            return sum;
+        });
 
-            distances_sq[j] = min_dist_sq;
-            sum_sq += min_dist_sq;
+        if (round == KMeansParallelRounds || sum_sq <= 0.0) {
+            break;
         }
 
-        // 3. Select next center based on weighted probability
-        std::uniform_real_distribution<> weight_dis(0, sum_sq);
-        double threshold = weight_dis(gen);
-        double cumulative_sum = 0.0;
-
-        for (size_t i = 0; i < records_count_; ++i) {
-            cumulative_sum += distances_sq[i];
-            if (cumulative_sum >= threshold) {
-                const auto& record = records_[i];
-                uint8_t* centroid = const_cast<uint8_t*>(get_centroid(centroids_count));
-                memcpy(centroid, record, vector_size_);
-                centroids_count++;
-                break;
+        // Sample each record independently with probability l * D(x)^2 / sum(D(x)^2).
+        new_candidates.clear();
+        for (size_t j = 0; j < records_count_; j++) {
+            if (distances_sq[j] > 0.0 && dis(gen) < oversampling * distances_sq[j] / sum_sq) {
+                new_candidates.push_back(records_[j]);
             }
         }
+
+        if (new_candidates.empty()) {
+            break;
+        }
+        candidates.insert(candidates.end(), new_candidates.begin(), new_candidates.end());
+    }
+
+    if (candidates.size() < centroids_count_) {
+        return 0;
+    }
+
+    // Weight candidates by the number of records closest to them.
+    std::vector<double> weights(candidates.size(), 0.0);
+    for (size_t j = 0; j < records_count_; j++) {
+        if (records_[j] != nullptr) {
+            weights[nearest[j]] += 1.0;
+        }
     }
-    
+
+    // Weighted KMeans++ over the candidates.
+    double weights_sum = 0.0;
+    for (double w : weights) {
+        weights_sum += w;
+    }
+
+    size_t index = select_weighted(weights, weights_sum, gen);
+    if (index >= candidates.size()) {
+        return 0;
+    }
+
+    memcpy(const_cast<uint8_t*>(get_centroid(0)), candidates[index], vector_size_);
+
+    std::vector<double> candidate_distances_sq(candidates.size(), std::numeric_limits<double>::max());
+    std::vector<double> scores(candidates.size());
+    for (size_t centroids_count = 1; centroids_count < centroids_count_; centroids_count++) {
+        const uint8_t* last_centroid = get_centroid(centroids_count - 1);
+        const double scores_sum = parallel_sum(thread_pool, candidates.size(), [&](uint64_t from, uint64_t to) {
+            double sum = 0.0;
+            for (uint64_t i = from; i < to; i++) {
+                const double dist_sq = distance_L2_square(type_, candidates[i], last_centroid, dim_);
+                candidate_distances_sq[i] = std::min(candidate_distances_sq[i], dist_sq);
+                scores[i] = weights[i] * candidate_distances_sq[i];
+                sum += scores[i];
+            }
+            return sum;
+        });
+
+        if (scores_sum <= 0.0) {
+            return 0;
+        }
+
+        index = select_weighted(scores, scores_sum, gen);
+        if (index >= candidates.size()) {
+            return 0;
+        }
+
+        memcpy(const_cast<uint8_t*>(get_centroid(centroids_count)), candidates[index], vector_size_);
+    }
+
+    done = true;
     return 0;
 }
 
-Ret IvfBuilder::recalc_centroids() {
+Ret IvfBuilder::recalc_centroids(ThreadPool* thread_pool) {
     assert(current_set_type_ == SetType::First);
 
-    auto ret = internal_recalc_centroids();
+    auto ret = internal_recalc_centroids(thread_pool);
     if (ret != 0) {
         return ret;
     }
 
     current_set_type_ = SetType::Second;
 
-    ret = internal_recalc_centroids();
+    ret = internal_recalc_centroids(thread_pool);
     if (ret != 0) {
         return ret;
     }
@@ -189,55 +401,64 @@ Ret IvfBuilder::recalc_centroids() {
     return 0;
 }
 
-Ret IvfBuilder::internal_recalc_centroids() {
+Ret IvfBuilder::internal_recalc_centroids(ThreadPool* thread_pool) {
     const uint8_t* current_centroids = get_centroids(current_set_type_);
     const uint8_t* next_centroids = get_centroids(current_set_type_ == SetType::First ? SetType::Second : SetType::First);
 
-    memset(counts_, 0, counts_size_);
-    memset(sums_, 0, sums_size_);
+    auto ret = accumulate_sums(current_centroids, thread_pool);
+    if (ret != 0) {
+        return ret;
+    }
 
-    uint32_t* counts = get_counts();
+    const uint32_t* counts = get_counts();
+    for (size_t j = 0; j < centroids_count_; j++) {
+        uint8_t* centroid = const_cast<uint8_t*>(next_centroids + j * vector_size_);
 
-    for (size_t i = 0; i < records_count_; i++) {
-        const auto& record = records_[i];
-        if (record == nullptr) {
+        if (counts[j] == 0) {
+            const auto& current_centroid = current_centroids + j * vector_size_;
+            memcpy(centroid, current_centroid, vector_size_);
             continue;
         }
 
-        size_t best_centroid_index = 0;
-        double min_dist = std::numeric_limits<double>::max();
-
-        for (size_t j = 0; j < centroids_count_; j++) {
-            const auto& centroid = current_centroids + j * vector_size_;
-            double dist = distance_L2_square(type_, record, centroid, dim_);
-            if (dist < min_dist) {
-                min_dist = dist;
-                best_centroid_index = j;
-            }
-        }
-
-        double* sums = sums_ + best_centroid_index * dim_;
+        const double* sums = sums_ + j * dim_;
         switch (type_) {
-            case DatasetType::f32: apply_sum(reinterpret_cast<const float*>(record), sums, dim_); break;
-            case DatasetType::f16: apply_sum(reinterpret_cast<const float16_t*>(record), sums, dim_); break;
+            case DatasetType::f32: apply_div(reinterpret_cast<float*>(centroid), sums, dim_, counts[j]); break;
+            case DatasetType::f16: apply_div(reinterpret_cast<float16_t*>(centroid), sums, dim_, counts[j]); break;
             case DatasetType::u8: return "Recalculation of centroids does not support u8 dataset type";
         }
-        counts[best_centroid_index]++;   
     }
 
-    for (size_t j = 0; j < centroids_count_; j++) {
-        uint8_t* centroid = const_cast<uint8_t*>(next_centroids + j * vector_size_);
+    return 0;
+}
 
+Ret IvfBuilder::minibatch_update(ThreadPool* thread_pool) {
+    assert(current_set_type_ == SetType::First);
+
+    if (learning_counts_.empty()) {
+        learning_counts_.assign(centroids_count_, 0);
+    }
+
+    uint8_t* centroids = const_cast<uint8_t*>(get_centroids(current_set_type_));
+
+    auto ret = accumulate_sums(centroids, thread_pool);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Per-centroid learning rate 1/v: applying the whole batch at once equals applying its records one by one.
+    const uint32_t* counts = get_counts();
+    for (size_t j = 0; j < centroids_count_; j++) {
         if (counts[j] == 0) {
-            const auto& current_centroid = current_centroids + j * vector_size_;
-            memcpy(centroid, current_centroid, vector_size_);
             continue;
         }
 
+        learning_counts_[j] += counts[j];
+
+        uint8_t* centroid = centroids + j * vector_size_;
         const double* sums = sums_ + j * dim_;
         switch (type_) {
-            case DatasetType::f32: apply_div(reinterpret_cast<float*>(centroid), sums, dim_, counts[j]); break;
-            case DatasetType::f16: apply_div(reinterpret_cast<float16_t*>(centroid), sums, dim_, counts[j]); break;
+            case DatasetType::f32: apply_step(reinterpret_cast<float*>(centroid), sums, dim_, counts[j], learning_counts_[j]); break;
+            case DatasetType::f16: apply_step(reinterpret_cast<float16_t*>(centroid), sums, dim_, counts[j], learning_counts_[j]); break;
             case DatasetType::u8: return "Recalculation of centroids does not support u8 dataset type";
         }
     }
@@ -245,4 +466,51 @@ Ret IvfBuilder::internal_recalc_centroids() {
     return 0;
 }
 
+Ret IvfBuilder::accumulate_sums(const uint8_t* centroids, ThreadPool* thread_pool) {
+    if (type_ == DatasetType::u8) {
+        return "Recalculation of centroids does not support u8 dataset type";
+    }
+
+    memset(counts_, 0, counts_size_);
+    memset(sums_, 0, sums_size_);
+
+    uint32_t* counts = get_counts();
+
+    CentroidAssigner assigner;
+    auto ret = assigner.init(type_, dim_, centroids, vector_size_, centroids_count_);
+    if (ret != 0) {
+        return ret;
+    }
+
+    std::vector<RecordPtr> records;
+    records.reserve(records_count_);
+    for (size_t i = 0; i < records_count_; i++) {
+        if (records_[i] != nullptr) {
+            records.push_back(records_[i]);
+        }
+    }
+
+    // The assignment is the bulk of an iteration, the sums are added up in record order afterwards.
+    std::vector<uint32_t> cluster_ids(records.size());
+    parallel_sum(thread_pool, records.size(), [&assigner, &records, &cluster_ids](uint64_t from, uint64_t to) {
+        assigner.find_nearest(records.data() + from, to - from, cluster_ids.data() + from);
+        return 0.0;
+    });
+
+    for (size_t i = 0; i < records.size(); i++) {
+        const auto& record = records[i];
+        const size_t best_centroid_index = cluster_ids[i];
+
+        double* sums = sums_ + best_centroid_index * dim_;
+        switch (type_) {
+            case DatasetType::f32: apply_sum(reinterpret_cast<const float*>(record), sums, dim_); break;
+            case DatasetType::f16: apply_sum(reinterpret_cast<const float16_t*>(record), sums, dim_); break;
+            case DatasetType::u8: break;
+        }
+        counts[best_centroid_index]++;   
+    }
+
+    return 0;
+}
+
 } // namespace sketch
@@ -2,6 +2,7 @@
 #include "shared_types.h"
 #include <cstdint>
 #include <mutex>
+#include <random>
 #include <string>
 #include <memory>
 #include <vector>
@@ -9,6 +10,8 @@
 
 namespace sketch {
 
+class ThreadPool;
+
 class IvfBuilder {
 public:
     IvfBuilder(DatasetType type, uint16_t dim, uint32_t centroids_count, uint32_t records_count);
@@ -16,9 +19,12 @@ public:
     Ret init();
     Ret uninit();
 
+    DatasetType type() const { return type_; }
+    uint16_t dim() const { return dim_; }
     uint32_t records_count() const { return records_count_; }
     uint32_t centroids_count() const { return centroids_count_; }
     uint32_t centroids_size() const { return centroids_size_; }
+    uint64_t vector_size() const { return vector_size_; }
 
     uint8_t* get_centroids();
     const uint8_t* get_centroid(size_t index) const;
@@ -32,12 +38,20 @@ public:
         }
     }
 
-    Ret init_centroids_kmeans_plus_plus();
-    Ret recalc_centroids();
+    Ret init_centroids_kmeans_plus_plus(ThreadPool* thread_pool = nullptr);
+    // The records are assigned to the centroids in ranges on thread_pool, which the caller must not be a worker of.
+    Ret recalc_centroids(ThreadPool* thread_pool = nullptr);
+    // Mini-batch KMeans step over the records currently set, in place.
+    Ret minibatch_update(ThreadPool* thread_pool = nullptr);
 
 private:
     enum class SetType { First, Second, };
 
+    // KMeans|| is used instead of plain KMeans++ starting from this number of centroids.
+    static constexpr uint32_t KMeansParallelMinCentroids = 1024;
+    static constexpr size_t KMeansParallelRounds = 5;
+    static constexpr double KMeansParallelOversampling = 0.5;
+
 private:
     const DatasetType type_;
     const uint32_t records_count_;
@@ -60,10 +74,16 @@ private:
     uint64_t sums_size_ = 0;
     uint64_t centroids_size_ = 0;
 
+    std::vector<uint64_t> learning_counts_;
+
 private:
     static uint64_t calc_size(DatasetType type, uint16_t dim, uint32_t centroids_count, uint32_t records_count);
     const uint8_t* get_centroids(SetType setType) const;
-    Ret internal_recalc_centroids();
+    Ret internal_recalc_centroids(ThreadPool* thread_pool);
+    Ret accumulate_sums(const uint8_t* centroids, ThreadPool* thread_pool);
+    RecordPtr select_random_record(std::mt19937& gen) const;
+    Ret init_centroids_kmeans_incremental(std::mt19937& gen, ThreadPool* thread_pool);
+    Ret init_centroids_kmeans_parallel(std::mt19937& gen, ThreadPool* thread_pool, bool& done);
 };
 
 template <typename T>
@@ -1,6 +1,8 @@
 #include "lmdb2.h"
 #include "shared_types.h"
 #include "log.h"
+#include <algorithm>
+#include <atomic>
 #include <experimental/scope>
 #include <cassert>
 
@@ -17,11 +19,34 @@ namespace sketch {
  *    LmdbEnv
  */
 
+// LMDB's own default, raised when the thread pool is larger.
+static constexpr unsigned int DefaultMaxReaders = 126;
+static std::atomic<unsigned int> max_readers_setting = DefaultMaxReaders;
+
+// Index of the read transaction slot of the calling thread, the same in every environment.
+static std::atomic<size_t> next_thread_slot{0};
+static thread_local const size_t thread_slot = next_thread_slot.fetch_add(1, std::memory_order_relaxed);
+
+//static
+void LmdbEnv::set_max_readers(unsigned int max_readers) {
+    max_readers_setting = std::max(max_readers, DefaultMaxReaders);
+}
+
 LmdbEnv::LmdbEnv(const std::string& path)
   : path_(path) 
 {}
 
 LmdbEnv::~LmdbEnv() {
+    for (auto& slot : read_txn_slots_) {
+        if (auto txn = slot.load(std::memory_order_relaxed)) {
+            mdb_txn_abort(txn);
+        }
+    }
+
+    for (auto txn : free_read_txns_) {
+        mdb_txn_abort(txn);
+    }
+
     if (env_) {
         mdb_env_close(env_);
     }
@@ -29,21 +54,22 @@ LmdbEnv::~LmdbEnv() {
 
 int LmdbEnv::init() {
     assert(env_ == nullptr);
+    max_readers_ = max_readers_setting;
     LMDB_CHECK(mdb_env_create(&env_));
     LMDB_CHECK(mdb_env_set_maxdbs(env_, max_dbs));
-    LMDB_CHECK(mdb_env_set_maxreaders(env_, max_readers));
+    LMDB_CHECK(mdb_env_set_maxreaders(env_, max_readers_));
     LMDB_CHECK(mdb_env_set_mapsize(env_, db_size));
     LMDB_CHECK(mdb_env_open(env_, path_.c_str(), env_flags, permissions));
     return 0;
 }
 
 int LmdbEnv::create_db() {
-    auto db = std::make_unique<Lmdb>(env_);
-    return db->create();
+    std::lock_guard lock(mutex_);
+    return open_dbis(MDB_CREATE);
 }
 
 LmdbPtr LmdbEnv::open_db(LmdbMode mode) {
-    auto db = std::make_unique<Lmdb>(env_);
+    auto db = std::make_unique<Lmdb>(*this);
     if (db->open(mode) != 0) {
         return nullptr;
     }
@@ -51,29 +77,13 @@ LmdbPtr LmdbEnv::open_db(LmdbMode mode) {
     return db;
 }
 
-/*********************************************************************
- *    Lmdb
- */
-
-Lmdb::Lmdb(MDB_env* env)
-  : tid_(std::this_thread::get_id()),
-    env_(env)
-{
-}
-
-Lmdb::~Lmdb() {
-    if (txn_) {
-        mdb_txn_abort(txn_);
+// Must be called under the mutex: handles are opened by a single transaction which is
+// committed, so that they are valid in every transaction of the environment afterwards.
+int LmdbEnv::open_dbis(unsigned int flags) {
+    if (dbis_opened_.load(std::memory_order_relaxed)) {
+        return 0;
     }
 
-    close_cursor();
-    mdb_dbi_close(env_, table_dbi_);
-    mdb_dbi_close(env_, index_dbi_);
-}
-
-int Lmdb::create() {
-    assert(tid_ == std::this_thread::get_id());
-
     MDB_txn *txn = nullptr;
     LMDB_CHECK(mdb_txn_begin(env_, NULL, 0, &txn));
     std::experimental::scope_exit txn_aborter([&] {
@@ -82,34 +92,125 @@ int Lmdb::create() {
         }
     });
 
-    MDB_dbi table_dbi;
-    LMDB_CHECK(mdb_dbi_open(txn, MapTableName, MDB_CREATE, &table_dbi));
-
-    MDB_dbi index_dbi;
-    LMDB_CHECK(mdb_dbi_open(txn, IndexTableName, MDB_CREATE | MDB_DUPSORT, &index_dbi));
+    LMDB_CHECK(mdb_dbi_open(txn, MapTableName, flags, &table_dbi_));
+    LMDB_CHECK(mdb_dbi_open(txn, IndexTableName, flags | MDB_DUPSORT, &index_dbi_));
 
-    mdb_txn_commit(txn);
+    MDB_txn *committed_txn = txn;
     txn = nullptr;
+    LMDB_CHECK(mdb_txn_commit(committed_txn));
 
-    mdb_dbi_close(env_, table_dbi);
-    mdb_dbi_close(env_, index_dbi);
+    // Publishes the handles to get_dbis() calls that skip the mutex
+    dbis_opened_.store(true, std::memory_order_release);
+    return 0;
+}
+
+int LmdbEnv::get_dbis(MDB_dbi& table_dbi, MDB_dbi& index_dbi) {
+    if (!dbis_opened_.load(std::memory_order_acquire)) {
+        std::lock_guard lock(mutex_);
+        int ret = open_dbis(0);
+        if (ret != 0) {
+            return ret;
+        }
+    }
 
+    table_dbi = table_dbi_;
+    index_dbi = index_dbi_;
     return 0;
 }
 
+int LmdbEnv::acquire_read_txn(MDB_txn*& txn) {
+    if (thread_slot < ReadTxnSlots) {
+        txn = read_txn_slots_[thread_slot].exchange(nullptr, std::memory_order_acquire);
+    }
+
+    if (!txn) {
+        std::lock_guard lock(mutex_);
+        if (!free_read_txns_.empty()) {
+            txn = free_read_txns_.back();
+            free_read_txns_.pop_back();
+        }
+    }
+
+    if (txn) {
+        int ret = mdb_txn_renew(txn);
+        if (ret == MDB_SUCCESS) {
+            return 0;
+        }
+
+        mdb_txn_abort(txn);
+        txn = nullptr;
+    }
+
+    LMDB_CHECK(mdb_txn_begin(env_, NULL, MDB_RDONLY, &txn));
+    return 0;
+}
+
+void LmdbEnv::release_read_txn(MDB_txn* txn) {
+    // A reset transaction keeps its reader slot, the slots and the free list together never hold
+    // more than half the limit.
+    mdb_txn_reset(txn);
+
+    if (thread_slot < ReadTxnSlots) {
+        MDB_txn* empty = nullptr;
+        if (read_txn_slots_[thread_slot].compare_exchange_strong(empty, txn, std::memory_order_release)) {
+            return;
+        }
+    }
+
+    std::lock_guard lock(mutex_);
+    if (free_read_txns_.size() + ReadTxnSlots < max_readers_ / 2) {
+        free_read_txns_.push_back(txn);
+    } else {
+        mdb_txn_abort(txn);
+    }
+}
+
+/*********************************************************************
+ *    Lmdb
+ */
+
+Lmdb::Lmdb(LmdbEnv& env)
+  : tid_(std::this_thread::get_id()),
+    env_(env)
+{
+}
+
+Lmdb::~Lmdb() {
+    close_cursor();
+    release_txn();
+}
+
+void Lmdb::release_txn() {
+    if (!txn_) {
+        return;
+    }
+
+    if (mode_ == LmdbMode::Read) {
+        env_.release_read_txn(txn_);
+    } else {
+        mdb_txn_abort(txn_);
+    }
+    txn_ = nullptr;
+}
+
 int Lmdb::open(LmdbMode mode) {
     assert(tid_ == std::this_thread::get_id());
 
     mode_ = mode;
-    int txn_flags = mode_ == LmdbMode::Read ? MDB_RDONLY : 0;
-    LMDB_CHECK(mdb_txn_begin(env_, NULL, txn_flags, &txn_));
-    LMDB_CHECK(mdb_dbi_open(txn_, MapTableName, 0, &table_dbi_));
-    LMDB_CHECK(mdb_dbi_open(txn_, IndexTableName, 0, &index_dbi_));
+    int ret = env_.get_dbis(table_dbi_, index_dbi_);
+    if (ret != 0) {
+        return ret;
+    }
 
+    if (mode_ == LmdbMode::Read) {
+        return env_.acquire_read_txn(txn_);
+    }
+
+    LMDB_CHECK(mdb_txn_begin(env_.env_, NULL, 0, &txn_));
     return 0;
 }
 
-int Lmdb::write_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id) {
+int Lmdb::write_record(uint64_t tag, uint32_t record_id, uint32_t cluster_id, bool write_index) {
     assert(tid_ == std::this_thread::get_id());
 
     if (mode_ != LmdbMode::Write) {
@@ -147,7 +248,7 @@ int Lmdb::write_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id) {
         }
     }
 
-    if (cluster_id != InvalidClusterId) {
+    if (write_index && cluster_id != InvalidClusterId) {
         MDB_val mdb_key {
             .mv_size = sizeof(cluster_id),
             .mv_data = &cluster_id
@@ -166,7 +267,7 @@ int Lmdb::write_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id) {
     return 0;
 }
 
-int Lmdb::delete_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id) {
+int Lmdb::delete_record(uint64_t tag, uint32_t record_id, uint32_t cluster_id) {
     assert(tid_ == std::this_thread::get_id());
 
     if (mode_ != LmdbMode::Write) {
@@ -195,7 +296,7 @@ int Lmdb::delete_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id) {
     return delete_index(cluster_id, record_id);
 }
 
-int Lmdb::delete_index(uint16_t cluster_id, uint32_t record_id) {
+int Lmdb::delete_index(uint32_t cluster_id, uint32_t record_id) {
     assert(tid_ == std::this_thread::get_id());
 
     if (mode_ != LmdbMode::Write) {
@@ -220,8 +321,9 @@ int Lmdb::delete_index(uint16_t cluster_id, uint32_t record_id) {
             .mv_data = &record_id
         };
 
+        // Records of the posting lists have no index table entry.
         int ret = mdb_del(txn_, index_dbi_, &mdb_key, &mdb_data);
-        if (ret != 0) {
+        if (ret != 0 && ret != MDB_NOTFOUND) {
             return ret;
         }
     }
@@ -229,7 +331,7 @@ int Lmdb::delete_index(uint16_t cluster_id, uint32_t record_id) {
     return 0;
 }
 
-int Lmdb::read_record(uint64_t tag, uint32_t& record_id, uint16_t& cluster_id) {
+int Lmdb::read_record(uint64_t tag, uint32_t& record_id, uint32_t& cluster_id) {
     assert(tid_ == std::this_thread::get_id());
 
     if (mode_ != LmdbMode::Read) {
@@ -272,6 +374,12 @@ int Lmdb::read_record(uint64_t tag, uint32_t& record_id, uint16_t& cluster_id) {
 int Lmdb::commit() {
     assert(tid_ == std::this_thread::get_id());
 
+    if (mode_ == LmdbMode::Read) {
+        close_cursor();
+        release_txn();
+        return 0;
+    }
+
     int ret = mdb_txn_commit(txn_);
     txn_ = nullptr;
     return ret;
@@ -280,11 +388,11 @@ int Lmdb::commit() {
 void Lmdb::abort() {
     assert(tid_ == std::this_thread::get_id());
 
-    mdb_txn_abort(txn_);
-    txn_ = nullptr;
+    close_cursor();
+    release_txn();
 }
 
-int Lmdb::open_cursor(uint16_t current_cluster_id) {
+int Lmdb::open_cursor(uint32_t current_cluster_id) {
     assert(tid_ == std::this_thread::get_id());
     assert(cursor_ == nullptr);
 
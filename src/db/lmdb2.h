@@ -1,9 +1,13 @@
 #pragma once
 #include "lmdb.h"
 
+#include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <string.h>
 
@@ -11,49 +15,64 @@ namespace sketch {
 
 static constexpr const char* MapTableName = "records";
 static constexpr const char* IndexTableName = "index";
-static constexpr const uint16_t InvalidClusterId = 0xFFFF;
+static constexpr const uint32_t InvalidClusterId = 0xFFFFFFFF;
 
 enum class LmdbMode {
     Read,
     Write,
 };
 
+class LmdbEnv;
+
 class Lmdb {
 public:
-    Lmdb(MDB_env* env);
+    Lmdb(LmdbEnv& env);
     ~Lmdb();
 
-    int create();
     int open(LmdbMode mode = LmdbMode::Read);
 
-    int write_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id = InvalidClusterId);
-    int read_record(uint64_t tag, uint32_t& record_id, uint16_t& cluster_id);
-    int delete_record(uint64_t tag, uint32_t record_id, uint16_t cluster_id = InvalidClusterId);
-    int delete_index(uint16_t cluster_id, uint32_t record_id);
+    // The index table entry is skipped when the cluster lists are kept in posting lists files.
+    int write_record(uint64_t tag, uint32_t record_id, uint32_t cluster_id = InvalidClusterId, bool write_index = true);
+    int read_record(uint64_t tag, uint32_t& record_id, uint32_t& cluster_id);
+    int delete_record(uint64_t tag, uint32_t record_id, uint32_t cluster_id = InvalidClusterId);
+    int delete_index(uint32_t cluster_id, uint32_t record_id);
 
-    int open_cursor(uint16_t cluster_id);
+    int open_cursor(uint32_t cluster_id);
     void close_cursor();
     int next(uint32_t& record_id);
 
     int commit();
     void abort();
 
+private:
+    void release_txn();
+
 private:
     const std::thread::id tid_;
-    MDB_env* env_ = nullptr;
+    LmdbEnv& env_;
     LmdbMode mode_ = LmdbMode::Read;
-    MDB_dbi table_dbi_;
-    MDB_dbi index_dbi_;
+    MDB_dbi table_dbi_ = 0;
+    MDB_dbi index_dbi_ = 0;
     MDB_txn *txn_ = nullptr;
     MDB_cursor *cursor_ = nullptr;
     MDB_val cursor_key_;
-    uint16_t current_cluster_id_ = 0;
+    uint32_t current_cluster_id_ = 0;
     bool cursor_positioned_ = false;
 
 };
 
 using LmdbPtr = std::unique_ptr<Lmdb>;
 
+/****************************************
+ *
+ *   The environment opens the DBI handles once and keeps reset read transactions for reuse. With
+ *   MDB_NOTLS a read transaction is not bound to the thread that began it, so a worker renews a
+ *   reset one instead of beginning a new transaction for every query.
+ *
+ *   Every thread has a slot of its own, the thread's last transaction is taken from it and put back
+ *   without a lock. Threads beyond the slots, or finding their slot taken, share a locked free list.
+ *   Once opened the DBI handles are read without the lock too.
+ */
 class LmdbEnv {
 public:
     LmdbEnv(const std::string& path);
@@ -63,16 +82,35 @@ public:
     int create_db();
     LmdbPtr open_db(LmdbMode mode = LmdbMode::Read);
 
+    // Applies to environments opened afterwards, sized from the number of worker threads.
+    static void set_max_readers(unsigned int max_readers);
+
+private:
+    friend class Lmdb;
+
+    int open_dbis(unsigned int flags);
+    int get_dbis(MDB_dbi& table_dbi, MDB_dbi& index_dbi);
+    int acquire_read_txn(MDB_txn*& txn);
+    void release_read_txn(MDB_txn* txn);
+
 private:
     const int max_dbs = 16;
-    const int max_readers = 16;
     const int db_size = 1024 * 1024 * 1024;
     const int permissions = 0664;
-    const int env_flags = 0; // MDB_NOTLS
+    const int env_flags = MDB_NOTLS;
+
+    static constexpr size_t ReadTxnSlots = 32;
 
 private:
     const std::string path_;
     MDB_env *env_ = nullptr;
+    unsigned int max_readers_ = 0;
+    std::mutex mutex_;
+    std::atomic<bool> dbis_opened_{false};
+    MDB_dbi table_dbi_ = 0;
+    MDB_dbi index_dbi_ = 0;
+    std::array<std::atomic<MDB_txn*>, ReadTxnSlots> read_txn_slots_{};
+    std::vector<MDB_txn*> free_read_txns_;
 };
 
 
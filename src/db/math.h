@@ -1,9 +1,14 @@
 #pragma once
 #include "shared_types.h"
+#include <bit>
 #include <cstdint>
 #include <cmath>
 #include <iostream>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace sketch {
 
 template <typename T>
@@ -67,6 +72,22 @@ static inline double distance_L2_square(DatasetType type, const uint8_t* a, cons
     return 0.0;
 }
 
+template <typename T>
+__attribute__((simd))
+void convert_to_float(const T* a, float* b, uint64_t dim) {
+    for (uint64_t i = 0; i < dim; i++) {
+        b[i] = static_cast<float>(a[i]);
+    }
+}
+
+static inline void convert_to_float(DatasetType type, const uint8_t* a, float* b, uint64_t dim) {
+    switch (type) {
+        case DatasetType::f32: convert_to_float(reinterpret_cast<const float*>(a), b, dim); break;
+        case DatasetType::f16: convert_to_float(reinterpret_cast<const float16_t*>(a), b, dim); break;
+        case DatasetType::u8: convert_to_float(a, b, dim); break;
+    }
+}
+
 template <typename T>
 __attribute__((simd))
 void apply_div(T* a, const double* b, uint64_t dim, uint32_t div) {
@@ -75,6 +96,15 @@ void apply_div(T* a, const double* b, uint64_t dim, uint32_t div) {
     }
 }
 
+template <typename T>
+__attribute__((simd))
+void apply_step(T* a, const double* b, uint64_t dim, uint32_t count, uint64_t total_count) {
+    for (uint64_t i = 0; i < dim; i++) {
+        const double value = a[i];
+        a[i] = static_cast<T>(value + (b[i] - count * value) / total_count);
+    }
+}
+
 template <typename T>
 __attribute__((simd))
 void apply_sum(const T* a, double* b, uint64_t dim) {
@@ -91,5 +121,92 @@ void calc_residual(const T* rec, const T* cent, T* residual, uint64_t dim) {
     }
 }
 
+// y = M x for a row-major dim x dim matrix. Every row is reduced over eight independent lanes, so that
+// the dot product vectorizes without reassociating float additions.
+__attribute__((simd))
+static inline void rotate_vector(const float* matrix, const float* x, float* y, uint64_t dim) {
+    constexpr uint64_t Lanes = 8;
+    const uint64_t tail = dim - dim % Lanes;
+    for (uint64_t i = 0; i < dim; i++) {
+        const float* row = matrix + i * dim;
+        float lanes[Lanes] = {};
+        for (uint64_t j = 0; j < tail; j += Lanes) {
+            for (uint64_t l = 0; l < Lanes; l++) {
+                lanes[l] += row[j + l] * x[j + l];
+            }
+        }
+
+        float sum = 0.0f;
+        for (uint64_t l = 0; l < Lanes; l++) {
+            sum += lanes[l];
+        }
+        for (uint64_t j = tail; j < dim; j++) {
+            sum += row[j] * x[j];
+        }
+        y[i] = sum;
+    }
+}
+
+static inline uint64_t hamming_distance_generic(const uint64_t* a, const uint64_t* b, uint64_t words) {
+    uint64_t dist = 0;
+    for (uint64_t i = 0; i < words; i++) {
+        dist += std::popcount(a[i] ^ b[i]);
+    }
+    return dist;
+}
+
+#if defined(__x86_64__)
+// The build targets baseline x86-64, these variants are compiled for the named instructions and picked at run time.
+__attribute__((target("popcnt")))
+static inline uint64_t hamming_distance_popcnt(const uint64_t* a, const uint64_t* b, uint64_t words) {
+    uint64_t dist = 0;
+    for (uint64_t i = 0; i < words; i++) {
+        dist += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return dist;
+}
+
+__attribute__((target("popcnt,avx512f,avx512vpopcntdq")))
+static inline uint64_t hamming_distance_avx512(const uint64_t* a, const uint64_t* b, uint64_t words) {
+    __m512i acc = _mm512_setzero_si512();
+    uint64_t i = 0;
+    for (; i + 8 <= words; i += 8) {
+        const __m512i va = _mm512_loadu_si512(a + i);
+        const __m512i vb = _mm512_loadu_si512(b + i);
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(va, vb)));
+    }
+
+    uint64_t dist = _mm512_reduce_add_epi64(acc);
+    for (; i < words; i++) {
+        dist += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return dist;
+}
+#endif
+
+using HammingDistanceFunc = uint64_t (*)(const uint64_t* a, const uint64_t* b, uint64_t words);
+
+// The fastest variant the CPU supports, chosen on the first call.
+inline HammingDistanceFunc hamming_distance_func() {
+    static const HammingDistanceFunc func = [] {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+            return &hamming_distance_avx512;
+        }
+        if (__builtin_cpu_supports("popcnt")) {
+            return &hamming_distance_popcnt;
+        }
+#endif
+        return &hamming_distance_generic;
+    }();
+    return func;
+}
+
+// Number of differing bits of two codes of words 64-bit words each. With AVX-512 VPOPCNTDQ eight words
+// are counted per instruction, otherwise by the scalar POPCNT when the CPU has it.
+static inline uint64_t hamming_distance(const uint64_t* a, const uint64_t* b, uint64_t words) {
+    return hamming_distance_func()(a, b, words);
+}
 
 } // namespace sketch
@@ -0,0 +1,64 @@
+#include "numa.h"
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace sketch {
+
+std::vector<NumaNode> numa_nodes() {
+    std::vector<NumaNode> nodes;
+
+    const std::filesystem::path nodes_path = "/sys/devices/system/node";
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(nodes_path, ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+            !std::all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            continue;
+        }
+
+        std::ifstream file(entry.path() / "cpulist");
+        std::string cpulist;
+        if (!std::getline(file, cpulist) || cpulist.empty()) {
+            continue;
+        }
+
+        NumaNode node { .id = std::stoi(name.substr(4)), .cpus = {} };
+        if (parse_cpu_list(cpulist.c_str(), node.cpus) != 0 || node.cpus.empty()) {
+            continue;
+        }
+        nodes.push_back(std::move(node));
+    }
+
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) {
+        return a.id < b.id;
+    });
+
+    return nodes;
+}
+
+Ret bind_memory(void* addr, size_t size, int numa_node) {
+    constexpr size_t MaskBits = sizeof(unsigned long) * 8;
+    if (numa_node < 0 || static_cast<size_t>(numa_node) >= MaskBits) {
+        return std::format("Invalid NUMA node {}", numa_node);
+    }
+
+    // The raw system call, libnuma is not needed for a single policy. The kernel reads maxnode - 1 bits.
+    const unsigned long node_mask = 1UL << numa_node;
+    if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &node_mask, MaskBits + 1, MPOL_MF_MOVE) != 0) {
+        return std::format("Failed to bind memory to NUMA node {}: {}", numa_node, strerror(errno));
+    }
+
+    return 0;
+}
+
+} // namespace sketch
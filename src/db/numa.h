@@ -0,0 +1,21 @@
+#pragma once
+#include "shared_types.h"
+#include <cstddef>
+#include <vector>
+
+namespace sketch {
+
+// NUMA node of the machine with the CPUs it holds.
+struct NumaNode {
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+// NUMA nodes with CPUs, read from /sys/devices/system/node. Empty when the system doesn't report them.
+std::vector<NumaNode> numa_nodes();
+
+// Sets the preferred NUMA node of the pages of [addr, addr + size) and moves the pages already
+// faulted in. addr must be page aligned.
+Ret bind_memory(void* addr, size_t size, int numa_node);
+
+} // namespace sketch
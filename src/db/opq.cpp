@@ -0,0 +1,294 @@
+#include "opq.h"
+#include "assigner.h"
+#include "ivf_builder.h"
+#include "math.h"
+#include "thread_pool.h"
+#include "log.h"
+
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <future>
+
+namespace sketch {
+
+static constexpr uint64_t MagicNumber = 0x4F505152;
+
+// Newton-Schulz converges quadratically once the singular values are close to 1, the small ones grow 1.5x per step.
+static constexpr uint64_t PolarMaxIterations = 100;
+static constexpr double PolarTolerance = 1e-10;
+// Keeps the polar factor orthogonal when some directions carry no variance at all.
+static constexpr double PolarRegularization = 1e-6;
+
+template <typename F>
+static Ret run_ranges(uint64_t count, ThreadPool* thread_pool, F func) {
+    if (!thread_pool || count < 2) {
+        for (uint64_t i = 0; i < count; i++) {
+            CHECK(func(i))
+        }
+        return 0;
+    }
+
+    std::vector<std::future<Ret>> futures;
+    futures.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        futures.push_back(thread_pool->submit([&func, i] {
+            return func(i);
+        }));
+    }
+
+    Ret ret = 0;
+    for (auto& future : futures) {
+        Ret res = future.get();
+        if (res != 0) {
+            ret = res;
+        }
+    }
+    return ret;
+}
+
+// c = a^T b for row-major dim x dim matrices.
+static void multiply_transposed(const std::vector<double>& a, const std::vector<double>& b, std::vector<double>& c, uint64_t dim) {
+    std::fill(c.begin(), c.end(), 0.0);
+    for (uint64_t k = 0; k < dim; k++) {
+        for (uint64_t i = 0; i < dim; i++) {
+            const double a_ki = a[k * dim + i];
+            for (uint64_t j = 0; j < dim; j++) {
+                c[i * dim + j] += a_ki * b[k * dim + j];
+            }
+        }
+    }
+}
+
+// Orthogonal polar factor U V^T of m = U S V^T.
+static void polar_factor(std::vector<double>& m, uint64_t dim) {
+    double norm = 0.0;
+    for (const auto value : m) {
+        norm += value * value;
+    }
+    norm = std::sqrt(norm);
+    if (norm == 0.0) {
+        norm = 1.0;
+    }
+
+    for (uint64_t i = 0; i < dim; i++) {
+        m[i * dim + i] += PolarRegularization * norm;
+    }
+
+    norm *= 1.0 + PolarRegularization * std::sqrt(static_cast<double>(dim));
+    for (auto& value : m) {
+        value /= norm;
+    }
+
+    std::vector<double> gram(dim * dim);
+    std::vector<double> next(dim * dim);
+    for (uint64_t iteration = 0; iteration < PolarMaxIterations; iteration++) {
+        // gram = Z^T Z, Z = Z (3I - gram) / 2
+        multiply_transposed(m, m, gram, dim);
+
+        double deviation = 0.0;
+        for (uint64_t i = 0; i < dim; i++) {
+            for (uint64_t j = 0; j < dim; j++) {
+                const double value = gram[i * dim + j] - (i == j ? 1.0 : 0.0);
+                deviation += value * value;
+                gram[i * dim + j] = (i == j ? 3.0 : 0.0) - gram[i * dim + j];
+            }
+        }
+
+        if (deviation < PolarTolerance) {
+            break;
+        }
+
+        std::fill(next.begin(), next.end(), 0.0);
+        for (uint64_t i = 0; i < dim; i++) {
+            for (uint64_t k = 0; k < dim; k++) {
+                const double z_ik = m[i * dim + k];
+                for (uint64_t j = 0; j < dim; j++) {
+                    next[i * dim + j] += z_ik * gram[k * dim + j];
+                }
+            }
+        }
+
+        for (uint64_t i = 0; i < dim * dim; i++) {
+            m[i] = 0.5 * next[i];
+        }
+    }
+}
+
+//static
+Ret OpqRotation::train(DatasetType type, uint64_t dim, uint64_t chunk_count, uint64_t pq_centroids_count,
+                       const uint8_t* records, uint64_t record_size, uint64_t records_count,
+                       const OpqParams& params, std::vector<float>& matrix, std::vector<double>* errors,
+                       ThreadPool* thread_pool) {
+    if (chunk_count == 0 || dim % chunk_count != 0) {
+        return "DIMENSION is not divisible by the number of PQ chunks";
+    }
+
+    if (records_count < pq_centroids_count) {
+        return std::format("OPQ requires at least {} records, got {}", pq_centroids_count, records_count);
+    }
+
+    const uint64_t chunk_dim = dim / chunk_count;
+
+    std::vector<float> source(records_count * dim);
+    for (uint64_t n = 0; n < records_count; n++) {
+        convert_to_float(type, records + n * record_size, source.data() + n * dim, dim);
+    }
+
+    matrix.assign(dim * dim, 0.0f);
+    for (uint64_t i = 0; i < dim; i++) {
+        matrix[i * dim + i] = 1.0f;
+    }
+
+    std::vector<float> rotated(records_count * dim);
+    std::vector<float> reconstructed(records_count * dim);
+    std::vector<double> chunk_errors(chunk_count);
+    std::vector<double> product(dim * dim);
+
+    for (uint64_t iteration = 0; iteration < params.iterations; iteration++) {
+        for (uint64_t n = 0; n < records_count; n++) {
+            rotate_vector(matrix.data(), source.data() + n * dim, rotated.data() + n * dim, dim);
+        }
+
+        auto train_chunk = [&](uint64_t chunk) -> Ret {
+            IvfBuilder builder(DatasetType::f32, chunk_dim, pq_centroids_count, records_count);
+            CHECK(builder.init())
+
+            std::vector<const uint8_t*> chunk_records(records_count);
+            for (uint64_t n = 0; n < records_count; n++) {
+                chunk_records[n] = reinterpret_cast<const uint8_t*>(rotated.data() + n * dim + chunk * chunk_dim);
+                builder.set_record(n, chunk_records[n]);
+            }
+
+            CHECK(builder.init_centroids_kmeans_plus_plus())
+            for (uint64_t i = 0; i < params.kmeans_iterations / 2 + 1; i++) {
+                CHECK(builder.recalc_centroids())
+            }
+
+            CentroidAssigner assigner;
+            CHECK(assigner.init(DatasetType::f32, chunk_dim, builder.get_centroid(0), builder.vector_size(), pq_centroids_count))
+
+            std::vector<uint32_t> codes(records_count);
+            assigner.find_nearest(chunk_records.data(), records_count, codes.data());
+
+            double error = 0.0;
+            for (uint64_t n = 0; n < records_count; n++) {
+                const uint8_t* code = builder.get_centroid(codes[n]);
+                float* target = reconstructed.data() + n * dim + chunk * chunk_dim;
+                memcpy(target, code, chunk_dim * sizeof(float));
+                error += distance_L2_square(target, reinterpret_cast<const float*>(chunk_records[n]), chunk_dim);
+            }
+            chunk_errors[chunk] = error;
+
+            return 0;
+        };
+
+        CHECK(run_ranges(chunk_count, thread_pool, train_chunk))
+
+        double error = 0.0;
+        for (const auto chunk_error : chunk_errors) {
+            error += chunk_error;
+        }
+        if (errors) {
+            errors->push_back(error / records_count);
+        }
+        LOG_DEBUG << std::format("OPQ iteration {}: quantization error {}", iteration, error / records_count);
+
+        // product = Y^T X, one row per task.
+        auto multiply_row = [&](uint64_t i) -> Ret {
+            double* row = product.data() + i * dim;
+            std::fill(row, row + dim, 0.0);
+            for (uint64_t n = 0; n < records_count; n++) {
+                const double y = reconstructed[n * dim + i];
+                const float* x = source.data() + n * dim;
+                for (uint64_t j = 0; j < dim; j++) {
+                    row[j] += y * x[j];
+                }
+            }
+            return 0;
+        };
+
+        CHECK(run_ranges(dim, thread_pool, multiply_row))
+
+        polar_factor(product, dim);
+        for (uint64_t i = 0; i < dim * dim; i++) {
+            matrix[i] = static_cast<float>(product[i]);
+        }
+    }
+
+    return 0;
+}
+
+//static
+Ret OpqRotation::write(const std::string& path, uint64_t dim, const std::vector<float>& matrix) {
+    if (matrix.size() != dim * dim) {
+        return "Invalid OPQ rotation size";
+    }
+
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    const uint64_t header[2] = { MagicNumber, dim };
+    stream.write(reinterpret_cast<const char*>(header), sizeof(header));
+    stream.write(reinterpret_cast<const char*>(matrix.data()), matrix.size() * sizeof(float));
+    if (!stream) {
+        return std::format("Failed to write OPQ rotation to file '{}'", path);
+    }
+
+    return 0;
+}
+
+Ret OpqRotation::init(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    uint64_t header[2] = { 0, 0 };
+    stream.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!stream || header[0] != MagicNumber) {
+        return std::format("Invalid OPQ rotation file '{}'", path);
+    }
+
+    std::vector<float> matrix(header[1] * header[1]);
+    stream.read(reinterpret_cast<char*>(matrix.data()), matrix.size() * sizeof(float));
+    if (!stream) {
+        return std::format("Failed to read OPQ rotation file '{}'", path);
+    }
+
+    return init(header[1], matrix);
+}
+
+Ret OpqRotation::init(uint64_t dim, const std::vector<float>& matrix) {
+    if (matrix.size() != dim * dim) {
+        return "Invalid OPQ rotation size";
+    }
+
+    dim_ = dim;
+    matrix_ = matrix;
+    return 0;
+}
+
+void OpqRotation::apply(DatasetType type, const uint8_t* in, uint8_t* out) const {
+    thread_local std::vector<float> source;
+    thread_local std::vector<float> rotated;
+    source.resize(dim_);
+    rotated.resize(dim_);
+
+    convert_to_float(type, in, source.data(), dim_);
+    rotate_vector(matrix_.data(), source.data(), rotated.data(), dim_);
+
+    switch (type) {
+        case DatasetType::f32:
+            memcpy(out, rotated.data(), dim_ * sizeof(float));
+            break;
+        case DatasetType::f16: {
+            float16_t* target = reinterpret_cast<float16_t*>(out);
+            for (uint64_t i = 0; i < dim_; i++) {
+                target[i] = static_cast<float16_t>(rotated[i]);
+            }
+            break;
+        }
+        case DatasetType::u8:
+            // Rotated vectors are not representable in u8, PQ is not built for u8 datasets.
+            memcpy(out, in, dim_);
+            break;
+    }
+}
+
+} // namespace sketch
@@ -0,0 +1,53 @@
+#pragma once
+#include "shared_types.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sketch {
+
+class ThreadPool;
+
+struct OpqParams {
+    uint64_t iterations = 8;        // Alternations between the codebooks and the rotation.
+    uint64_t kmeans_iterations = 4; // KMeans steps of the codebooks per alternation.
+};
+
+/****************************************
+ *
+ *   Optimized product quantization rotation: y = R x, where R is a dim x dim orthogonal matrix
+ *   learned so that PQ of the rotated vectors has a lower quantization error.
+ *
+ *   Training alternates two steps (non-parametric OPQ):
+ *   - codebooks of every chunk are trained on the rotated vectors Y = X R^T, Y^ is their reconstruction;
+ *   - R = argmin |X R^T - Y^| over orthogonal R, the orthogonal Procrustes problem solved by the
+ *     polar factor of Y^T X, computed with the Newton-Schulz iteration.
+ *
+ *   File layout:
+ *   |-------+-----+------------------------------|
+ *     magic   dim   matrix (row major, dim x dim, f32)
+ */
+class OpqRotation {
+public:
+    static Ret train(DatasetType type, uint64_t dim, uint64_t chunk_count, uint64_t pq_centroids_count,
+                     const uint8_t* records, uint64_t record_size, uint64_t records_count,
+                     const OpqParams& params, std::vector<float>& matrix, std::vector<double>* errors = nullptr,
+                     ThreadPool* thread_pool = nullptr);
+
+    static Ret write(const std::string& path, uint64_t dim, const std::vector<float>& matrix);
+
+    Ret init(const std::string& path);
+    Ret init(uint64_t dim, const std::vector<float>& matrix);
+
+    uint64_t dim() const { return dim_; }
+    const std::vector<float>& matrix() const { return matrix_; }
+
+    // Rotates a query or a residual of the dataset type, in and out may not overlap.
+    void apply(DatasetType type, const uint8_t* in, uint8_t* out) const;
+
+private:
+    uint64_t dim_ = 0;
+    std::vector<float> matrix_;
+};
+
+} // namespace sketch
@@ -0,0 +1,117 @@
+#include "posting_lists.h"
+#include <experimental/scope>
+#include <format>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sketch {
+
+static constexpr uint64_t MagicNumber = 0x504F5354;
+static constexpr uint64_t HeaderCount = 3;
+
+//static
+Ret PostingLists::write(const std::string& path, uint64_t clusters_count,
+                        const std::vector<uint32_t>& cluster_ids, const std::vector<uint32_t>& record_ids) {
+    if (cluster_ids.size() != record_ids.size()) {
+        return "Posting lists require a cluster for every record";
+    }
+
+    std::vector<uint64_t> offsets(clusters_count + 1, 0);
+    for (const auto cluster_id : cluster_ids) {
+        if (cluster_id >= clusters_count) {
+            return std::format("Invalid cluster id {} for posting lists", cluster_id);
+        }
+        offsets[cluster_id + 1]++;
+    }
+
+    for (uint64_t i = 0; i < clusters_count; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    // Stable placement keeps the ascending record order of the input within every list.
+    std::vector<uint32_t> lists(record_ids.size());
+    std::vector<uint64_t> positions(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < record_ids.size(); i++) {
+        lists[positions[cluster_ids[i]]++] = record_ids[i];
+    }
+
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        return std::format("Failed to open file '{}' for writing", path);
+    }
+    const std::experimental::scope_exit closer([&] {
+        fclose(f);
+    });
+
+    const uint64_t header[HeaderCount] = { MagicNumber, clusters_count, lists.size() };
+    if (fwrite(header, sizeof(uint64_t), HeaderCount, f) != HeaderCount ||
+        fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), f) != offsets.size() ||
+        fwrite(lists.data(), sizeof(uint32_t), lists.size(), f) != lists.size()) {
+        return std::format("Failed to write posting lists to file '{}'", path);
+    }
+
+    fflush(f);
+
+    return 0;
+}
+
+Ret PostingLists::init(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return std::format("Failed to open file '{}'", path);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return std::format("Failed to get file size '{}'", path);
+    }
+
+    const uint64_t file_size = sb.st_size;
+    if (file_size < sizeof(uint64_t) * (HeaderCount + 1)) {
+        close(fd);
+        return std::format("Invalid posting lists file '{}'", path);
+    }
+
+    void* map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return std::format("Failed to map file '{}'", path);
+    }
+
+    const uint8_t* ptr = static_cast<const uint8_t*>(map);
+    const uint64_t* header = reinterpret_cast<const uint64_t*>(ptr);
+    const uint64_t clusters_count = header[1];
+    const uint64_t records_count = header[2];
+    const uint64_t* offsets = header + HeaderCount;
+
+    const uint64_t required_size = sizeof(uint64_t) * (HeaderCount + clusters_count + 1) + sizeof(uint32_t) * records_count;
+    if (header[0] != MagicNumber || file_size < required_size || offsets[clusters_count] != records_count) {
+        munmap(map, file_size);
+        return std::format("Invalid posting lists file '{}'", path);
+    }
+
+    ptr_ = ptr;
+    memory_size_ = file_size;
+    clusters_count_ = clusters_count;
+    records_count_ = records_count;
+    offsets_ = offsets;
+    record_ids_ = reinterpret_cast<const uint32_t*>(offsets + clusters_count + 1);
+
+    return 0;
+}
+
+void PostingLists::uninit() {
+    if (ptr_) {
+        munmap(const_cast<uint8_t*>(ptr_), memory_size_);
+        ptr_ = nullptr;
+    }
+    clusters_count_ = 0;
+    records_count_ = 0;
+}
+
+} // namespace sketch
@@ -0,0 +1,50 @@
+#pragma once
+#include "shared_types.h"
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Immutable IVF posting lists of an index, mapped for zero-copy iteration.
+ *
+ *   File layout:
+ *   |-------+----------------+---------------+-----------------------------------+------------------------|
+ *     magic   clusters_count   records_count   offsets[clusters_count + 1] (u64)   record_ids[records_count]
+ *
+ *   Record ids of cluster i are record_ids[offsets[i] .. offsets[i+1]), in ascending order.
+ */
+class PostingLists {
+public:
+    ~PostingLists() { uninit(); }
+
+    // cluster_ids[i] is the cluster of record_ids[i], records are grouped by a counting sort.
+    static Ret write(const std::string& path, uint64_t clusters_count,
+                     const std::vector<uint32_t>& cluster_ids, const std::vector<uint32_t>& record_ids);
+
+    Ret init(const std::string& path);
+    void uninit();
+
+    uint64_t clusters_count() const { return clusters_count_; }
+    uint64_t records_count() const { return records_count_; }
+
+    std::span<const uint32_t> get(uint32_t cluster_id) const {
+        if (cluster_id >= clusters_count_) {
+            return {};
+        }
+        return std::span<const uint32_t>(record_ids_ + offsets_[cluster_id], offsets_[cluster_id + 1] - offsets_[cluster_id]);
+    }
+
+private:
+    const uint8_t* ptr_ = nullptr;
+    uint64_t memory_size_ = 0;
+    uint64_t clusters_count_ = 0;
+    uint64_t records_count_ = 0;
+    const uint64_t* offsets_ = nullptr;
+    const uint32_t* record_ids_ = nullptr;
+};
+
+} // namespace sketch
@@ -0,0 +1,96 @@
+#include "query_batcher.h"
+#include "dataset.h"
+#include "dataset_node.h"
+#include "query_context.h"
+
+#include <algorithm>
+#include <condition_variable>
+
+namespace sketch {
+
+struct QueryBatcher::Batch {
+    std::vector<KnnQuery> queries;
+    std::vector<Ret> results;
+    Ret ret = 0;
+    bool done = false;
+    std::condition_variable full;
+    std::condition_variable finished;
+};
+
+QueryBatcher::QueryBatcher(std::chrono::microseconds window, size_t max_queries)
+  : window_(window), max_queries_(std::max<size_t>(max_queries, 1))
+{}
+
+QueryBatcher::~QueryBatcher() = default;
+
+void QueryBatcher::leave(const BatchKey& key) {
+    auto it = in_flight_counts_.find(key);
+    if (--it->second == 0) {
+        in_flight_counts_.erase(it);
+    }
+}
+
+Ret QueryBatcher::knn(Dataset& dataset, KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag,
+                      ThreadPool* thread_pool, QueryContext* context) {
+    const KnnQuery query{ .count = count, .data = &data, .skip_tag = skip_tag, .context = context };
+    const BatchKey key{&dataset, type};
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t in_flight_count = ++in_flight_counts_[key];
+
+    auto it = open_batches_.find(key);
+    if (it != open_batches_.end()) {
+        // Joins the open batch, its leader runs it.
+        auto batch = it->second;
+        const size_t index = batch->queries.size();
+        batch->queries.push_back(query);
+        if (batch->queries.size() >= max_queries_) {
+            open_batches_.erase(it);
+            batch->full.notify_one();
+        }
+
+        batch->finished.wait(lock, [&batch] { return batch->done; });
+        leave(key);
+        return batch->ret != 0 ? batch->ret : batch->results[index];
+    }
+
+    auto batch = std::make_shared<Batch>();
+    batch->queries.push_back(query);
+    if (max_queries_ > 1 && in_flight_count > 1 && !(context && context->cancelled())) {
+        auto wait_end = QueryContext::Clock::now() + window_;
+        if (context) {
+            wait_end = std::min(wait_end, context->deadline());
+        }
+
+        open_batches_.emplace(key, batch);
+        batch->full.wait_until(lock, wait_end, [this, &batch] { return batch->queries.size() >= max_queries_; });
+
+        // A batch filled up by the last request that joined is closed already.
+        it = open_batches_.find(key);
+        if (it != open_batches_.end() && it->second == batch) {
+            open_batches_.erase(it);
+        }
+    }
+    lock.unlock();
+
+    // No request joins a closed batch, its queries are read without the lock.
+    Ret ret = 0;
+    if (batch->queries.size() == 1) {
+        ret = dataset.knn(type, count, data, skip_tag, thread_pool, false, context);
+    } else {
+        batch->ret = dataset.knn_batch(type, batch->queries, batch->results, thread_pool);
+        ret = batch->ret != 0 ? batch->ret : batch->results[0];
+    }
+
+    batches_count_.fetch_add(1, std::memory_order_relaxed);
+    queries_count_.fetch_add(batch->queries.size(), std::memory_order_relaxed);
+
+    lock.lock();
+    batch->done = true;
+    leave(key);
+    batch->finished.notify_all();
+
+    return ret;
+}
+
+} // namespace sketch
@@ -0,0 +1,66 @@
+#pragma once
+#include "shared_types.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace sketch {
+
+class Dataset;
+class QueryContext;
+class ThreadPool;
+
+/****************************************
+ *
+ *   Coalesces the exact KNN requests of concurrent connections into shared scans.
+ *
+ *   The first request for a dataset and metric opens a batch and leads it: it waits up to the batch
+ *   window, and no longer than the deadline of its own request, for the requests of other connections
+ *   to join, closes the batch and runs all of them in one pass over the records with Dataset::knn_batch().
+ *   The requests that joined wait for their results. A batch closes early when it holds max_queries
+ *   requests.
+ *
+ *   A leader only waits when other requests for the same dataset and metric are in flight, a lone
+ *   client gets no added latency and the requests for other keys do not hold it back.
+ */
+class QueryBatcher {
+public:
+    QueryBatcher(std::chrono::microseconds window, size_t max_queries);
+    ~QueryBatcher();
+
+    QueryBatcher(const QueryBatcher&) = delete;
+    QueryBatcher& operator=(const QueryBatcher&) = delete;
+
+    // Returns what Dataset::knn() returns for the request.
+    Ret knn(Dataset& dataset, KnnType type, uint64_t count, const std::vector<uint8_t>& data, uint64_t skip_tag,
+            ThreadPool* thread_pool = nullptr, QueryContext* context = nullptr);
+
+    // Scans run and the requests they served, a batch of one is run by Dataset::knn().
+    uint64_t batches_count() const { return batches_count_.load(std::memory_order_relaxed); }
+    uint64_t queries_count() const { return queries_count_.load(std::memory_order_relaxed); }
+
+private:
+    struct Batch;
+    using BatchKey = std::pair<const Dataset*, KnnType>;
+
+    // Called under mutex_ when a request returns.
+    void leave(const BatchKey& key);
+
+    const std::chrono::microseconds window_;
+    const size_t max_queries_;
+
+    std::mutex mutex_;
+    std::map<BatchKey, std::shared_ptr<Batch>> open_batches_;
+    std::map<BatchKey, uint64_t> in_flight_counts_;
+
+    std::atomic<uint64_t> batches_count_{0};
+    std::atomic<uint64_t> queries_count_{0};
+};
+
+} // namespace sketch
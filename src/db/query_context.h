@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Context of one query request: a deadline and a cancel flag. The node scans of KNN and ANN poll
+ *   stop() every CheckBlock records and return what they found so far, the results of the request
+ *   are then flagged partial. cancel() may be called from any thread, e.g. when the client hangs up.
+ */
+class QueryContext {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint64_t CheckBlock = 1024;
+
+    QueryContext() = default;
+    // A zero timeout means no deadline.
+    explicit QueryContext(Clock::duration timeout)
+        : deadline_(timeout > Clock::duration::zero() ? Clock::now() + timeout : Clock::time_point::max()) {}
+
+    QueryContext(const QueryContext&) = delete;
+    QueryContext& operator=(const QueryContext&) = delete;
+
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+    bool expired() const { return deadline_ != Clock::time_point::max() && Clock::now() >= deadline_; }
+    // Clock::time_point::max() when there is no deadline.
+    Clock::time_point deadline() const { return deadline_; }
+
+    // Called by the scans, true when they are to stop. Their results are then partial.
+    bool stop() {
+        if (cancelled() || expired()) {
+            partial_.store(true, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    bool partial() const { return partial_.load(std::memory_order_relaxed); }
+    const char* stop_reason() const { return cancelled() ? "cancelled" : "deadline exceeded"; }
+
+private:
+    const Clock::time_point deadline_ = Clock::time_point::max();
+    std::atomic<bool> cancelled_{false};
+    std::atomic<bool> partial_{false};
+};
+
+} // namespace sketch
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Residuals split by PQ chunk: chunk c holds the c-th sub-vector of every residual back to back,
+ *   so that the codebook of a chunk is trained over its own sequential buffer.
+ *
+ *   Chunk layout:
+ *   |-----------------+-----------------+-----+-----------------------------|
+ *     residual 0 [c]    residual 1 [c]          residual count - 1 [c]
+ */
+class ResidualChunks {
+public:
+    // record_size must be divisible by chunk_count.
+    void init(uint64_t record_size, uint64_t chunk_count, uint64_t count) {
+        chunk_size_ = record_size / chunk_count;
+        count_ = count;
+        chunks_.assign(chunk_count, std::vector<uint8_t>(chunk_size_ * count, 0));
+    }
+
+    uint64_t chunk_count() const { return chunks_.size(); }
+    uint64_t chunk_size() const { return chunk_size_; }
+    uint64_t count() const { return count_; }
+
+    uint8_t* chunk(uint64_t chunk_index) { return chunks_[chunk_index].data(); }
+    const uint8_t* chunk(uint64_t chunk_index) const { return chunks_[chunk_index].data(); }
+
+    const uint8_t* get(uint64_t chunk_index, uint64_t index) const {
+        return chunks_[chunk_index].data() + index * chunk_size_;
+    }
+
+    // Residual rows are written by different nodes at disjoint indexes, without locking.
+    void scatter(uint64_t index, const uint8_t* record) {
+        for (uint64_t c = 0; c < chunks_.size(); c++) {
+            memcpy(chunks_[c].data() + index * chunk_size_, record + c * chunk_size_, chunk_size_);
+        }
+    }
+
+    void gather(uint64_t index, uint8_t* record) const {
+        for (uint64_t c = 0; c < chunks_.size(); c++) {
+            memcpy(record + c * chunk_size_, chunks_[c].data() + index * chunk_size_, chunk_size_);
+        }
+    }
+
+private:
+    uint64_t chunk_size_ = 0;
+    uint64_t count_ = 0;
+    std::vector<std::vector<uint8_t>> chunks_;
+};
+
+} // namespace sketch
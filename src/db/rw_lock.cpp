@@ -0,0 +1,98 @@
+#include "rw_lock.h"
+
+#include <algorithm>
+#include <bit>
+#include <thread>
+
+namespace sketch {
+
+// Threads are spread over the shards in the order they first take a lock.
+static std::atomic<std::size_t> next_shard_index{0};
+static thread_local const std::size_t shard_index = next_shard_index.fetch_add(1, std::memory_order_relaxed);
+
+ShardedRWLock::ShardedRWLock() :
+    shards_count_(std::bit_ceil(std::max<std::size_t>(MinShardsCount, std::thread::hardware_concurrency()))),
+    shards_(std::make_unique<Shard[]>(shards_count_)) {
+}
+
+ShardedRWLock::Shard& ShardedRWLock::own_shard() {
+    return shards_[shard_index & (shards_count_ - 1)];
+}
+
+uint32_t ShardedRWLock::lock_shared() {
+    Shard& own = own_shard();
+    for (;;) {
+        const uint32_t epoch = epoch_.load(std::memory_order_seq_cst);
+        if (epoch_read_hook_) {
+            epoch_read_hook_();
+        }
+
+        own.counts[epoch & 1].fetch_add(1, std::memory_order_seq_cst);
+
+        // A synchronize() that flipped the epoch after it was read may have seen the count without
+        // this reader already, the reader counts itself again under the current epoch.
+        if (epoch_.load(std::memory_order_seq_cst) != epoch) {
+            own.counts[epoch & 1].fetch_sub(1, std::memory_order_seq_cst);
+            continue;
+        }
+
+        if (writer_.load(std::memory_order_seq_cst) == 0) {
+            return epoch & 1;
+        }
+
+        // Back off while a writer waits for the readers to drain
+        own.counts[epoch & 1].fetch_sub(1, std::memory_order_seq_cst);
+        writer_.wait(1, std::memory_order_seq_cst);
+    }
+}
+
+void ShardedRWLock::unlock_shared(uint32_t epoch) {
+    own_shard().counts[epoch].fetch_sub(1, std::memory_order_release);
+}
+
+void ShardedRWLock::lock() {
+    writer_mutex_.lock();
+    writer_.store(1, std::memory_order_seq_cst);
+    wait_until([this] {
+        return readers_count(0) + readers_count(1) == 0;
+    });
+}
+
+void ShardedRWLock::unlock() {
+    writer_.store(0, std::memory_order_seq_cst);
+    writer_.notify_all();
+    writer_mutex_.unlock();
+}
+
+void ShardedRWLock::synchronize() {
+    const std::lock_guard<std::mutex> lock(sync_mutex_);
+
+    // A reader counted under the old epoch read the epoch before the flip and saw it unchanged after
+    // counting itself, so the flip comes after its count and the wait below sees it. A reader that
+    // counts itself later reads what is published now.
+    const uint32_t old_epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) & 1;
+    wait_until([this, old_epoch] {
+        return readers_count(old_epoch) == 0;
+    });
+}
+
+int64_t ShardedRWLock::readers_count(uint32_t epoch) const {
+    int64_t count = 0;
+    for (std::size_t i = 0; i < shards_count_; i++) {
+        count += shards_[i].counts[epoch].load(std::memory_order_seq_cst);
+    }
+    return count;
+}
+
+template <typename Pred>
+void ShardedRWLock::wait_until(Pred pred) {
+    for (uint64_t i = 0; !pred(); i++) {
+        if (i < SpinCount) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(WaitInterval);
+        }
+    }
+}
+
+} // namespace sketch
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <pthread.h>
 #include <system_error>
+#include <utility>
 
 namespace sketch {
 
@@ -45,6 +53,66 @@ private:
     pthread_rwlock_t _rwlock;
 };
 
+/****************************************
+ *
+ *   Reader-writer lock of the query path. A reader counts itself in the shard of its thread, a cache
+ *   line of its own, and only reads the shared state, so concurrent readers never write a shared cache
+ *   line. Writers are rare: a writer raises a flag that turns new readers away and waits for the counts
+ *   of all shards to drop to 0.
+ *
+ *   Readers count themselves under one of two epochs. synchronize() flips the epoch and waits for the
+ *   count of the old one (an SRCU grace period): an object unpublished before the call is no longer
+ *   seen by any reader when it returns. A reader re-reads the epoch after counting itself and counts
+ *   itself again when it changed in between, otherwise the flip could miss it.
+ */
+class ShardedRWLock {
+public:
+    ShardedRWLock();
+
+    // Disable copying
+    ShardedRWLock(const ShardedRWLock&) = delete;
+    ShardedRWLock& operator=(const ShardedRWLock&) = delete;
+
+    // Returns the epoch to pass to unlock_shared().
+    uint32_t lock_shared();
+    void unlock_shared(uint32_t epoch);
+    void lock();
+    void unlock();
+
+    // Waits for the readers that took the lock before the call. Must not be called by a reader.
+    void synchronize();
+
+    // For testing purposes: called by lock_shared() between reading the epoch and counting the reader.
+    void set_epoch_read_hook(std::function<void()> hook) { epoch_read_hook_ = std::move(hook); }
+    std::size_t shards_count() const { return shards_count_; }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<int64_t> counts[2] = { 0, 0 };
+    };
+
+    // Threads take the shards in turn and share them past shards_count_ threads, e.g. the connections
+    // of a busy server. There are as many shards as CPUs, at least MinShardsCount, rounded up to a power
+    // of two, so the readers running at once still count mostly in shards of their own.
+    static constexpr std::size_t MinShardsCount = 64;
+    static constexpr uint64_t SpinCount = 64;
+    static constexpr auto WaitInterval = std::chrono::microseconds(50);
+
+    const std::size_t shards_count_;
+    std::unique_ptr<Shard[]> shards_;
+    alignas(64) std::atomic<uint32_t> epoch_{0};
+    std::atomic<uint32_t> writer_{0};
+    std::mutex writer_mutex_;
+    std::mutex sync_mutex_;
+    std::function<void()> epoch_read_hook_;
+
+private:
+    Shard& own_shard();
+    int64_t readers_count(uint32_t epoch) const;
+    template <typename Pred>
+    static void wait_until(Pred pred);
+};
+
 // RAII Guard for Reading
 class ReadGuard {
 public:
@@ -58,17 +126,32 @@ private:
     RWLock& _lock;
 };
 
-// RAII Guard for Writing
+// RAII Guard for Reading with ShardedRWLock
+class ShardedReadGuard {
+public:
+    explicit ShardedReadGuard(ShardedRWLock& lock) : _lock(lock), _epoch(lock.lock_shared()) {}
+    ~ShardedReadGuard() { _lock.unlock_shared(_epoch); }
+
+    // Non-copyable
+    ShardedReadGuard(const ShardedReadGuard&) = delete;
+    ShardedReadGuard& operator=(const ShardedReadGuard&) = delete;
+private:
+    ShardedRWLock& _lock;
+    const uint32_t _epoch;
+};
+
+// RAII Guard for Writing, with RWLock or ShardedRWLock
+template <typename Lock>
 class WriteGuard {
 public:
-    explicit WriteGuard(RWLock& lock) : _lock(lock) { _lock.lock(); }
+    explicit WriteGuard(Lock& lock) : _lock(lock) { _lock.lock(); }
     ~WriteGuard() { _lock.unlock(); }
 
     // Non-copyable
     WriteGuard(const WriteGuard&) = delete;
     WriteGuard& operator=(const WriteGuard&) = delete;
 private:
-    RWLock& _lock;
+    Lock& _lock;
 };
 
 } // namespace sketch
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "storage.h"
 #include "log.h"
+#include "numa.h"
 #include <format>
 #include <experimental/scope>
 #include <iostream>
@@ -101,13 +102,33 @@ Ret Storage::Storage::init() {
         }
     }
 
+    free_records_ = deleted_records_;
+
+    deleted_bits_ = std::make_shared<std::vector<uint64_t>>((records_limit_ + 63) / 64, 0);
+    for (const auto record_id : deleted_records_) {
+        set_deleted_bit(record_id, true);
+    }
+
     return 0;
 }
 
 Ret Storage::uninit() {
+    auto ret = release_deleted();
+    if (ret != 0) {
+        return ret;
+    }
+
     return write_info();
 }
 
+Ret Storage::bind_memory(int numa_node) {
+    if (!memmap_) {
+        return std::format("Data file at '{}' is not mapped", path_);
+    }
+
+    return sketch::bind_memory(memmap_, mem_size_, numa_node);
+}
+
 Ret Storage::open_write_file() {
     fd_ = open(path_.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
     if (fd_ < 0) {
@@ -345,19 +366,68 @@ ScanResult Storage::scan_record(uint64_t record_id, Record& record) {
     return ScanResult::Ok;
 }
 
+ScanResult Storage::scan_record(const StorageSnapshot& snapshot, uint64_t record_id, Record& record) const {
+    if (record_id >= snapshot.upper_record_id) {
+        return ScanResult::Finished;
+    }
+
+    if (snapshot.is_deleted(record_id)) {
+        return ScanResult::Deleted;
+    }
+
+    const uint64_t offset = record_id * full_record_size_;
+    record.tag = *reinterpret_cast<const uint64_t*>(memmap_ + offset);
+    record.data = reinterpret_cast<uint8_t*>(memmap_ + offset + header_size_);
+
+    return ScanResult::Ok;
+}
+
 Ret Storage::delete_record(uint64_t record_id) {
     if (record_id >= upper_record_id_) {
         return std::format("Record ID {} out of range in storage at '{}'", record_id, path_);
     }
 
-    uint64_t deleted_tag = DELETED_TAG;
-    auto ret = write_data(record_id, reinterpret_cast<const uint8_t*>(&deleted_tag), sizeof(deleted_tag));
-    if (ret != 0) {
-        return ret;
+    if (deleted_records_.insert(record_id).second) {
+        pending_deletes_.push_back(record_id);
+        set_deleted_bit(record_id, true);
     }
 
-    deleted_records_.insert(record_id);
+    return 0;
+}
+
+StorageSnapshot Storage::snapshot() const {
+    return StorageSnapshot {
+        .upper_record_id = upper_record_id_,
+        .deleted_bits = deleted_bits_,
+    };
+}
+
+void Storage::set_deleted_bit(uint32_t record_id, bool deleted) {
+    // Snapshots hold the bitmap they were taken with, a shared one is changed in a copy.
+    if (deleted_bits_.use_count() > 1) {
+        deleted_bits_ = std::make_shared<std::vector<uint64_t>>(*deleted_bits_);
+    }
+
+    const uint64_t mask = uint64_t(1) << (record_id & 63);
+    if (deleted) {
+        (*deleted_bits_)[record_id >> 6] |= mask;
+    } else {
+        (*deleted_bits_)[record_id >> 6] &= ~mask;
+    }
+}
+
+Ret Storage::release_deleted() {
+    const uint64_t deleted_tag = DELETED_TAG;
+    for (const auto record_id : pending_deletes_) {
+        auto ret = write_data(record_id, reinterpret_cast<const uint8_t*>(&deleted_tag), sizeof(deleted_tag));
+        if (ret != 0) {
+            return ret;
+        }
+
+        free_records_.insert(record_id);
+    }
 
+    pending_deletes_.clear();
     return 0;
 }
 
@@ -368,8 +438,8 @@ PutResult Storage::put_record(DataBuffer& data) {
         return std::make_pair<>(UINT64_MAX, std::format("Invalid data size {} for record in storage at '{}'", data.record_size(), path_));
     }
 
-    if (!deleted_records_.empty()) {
-        const auto iter = deleted_records_.begin();
+    if (!free_records_.empty()) {
+        const auto iter = free_records_.begin();
         record_id = *iter;
 
         // No need to write the following record header to mark end of recrods.
@@ -378,7 +448,9 @@ PutResult Storage::put_record(DataBuffer& data) {
             return std::make_pair<>(UINT64_MAX, ret);
         }
 
-        deleted_records_.erase(iter);
+        deleted_records_.erase(record_id);
+        set_deleted_bit(record_id, false);
+        free_records_.erase(iter);
         return std::make_pair<>(record_id, 0);
     }
 
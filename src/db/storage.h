@@ -3,9 +3,11 @@
 
 #include <atomic>
 #include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 namespace sketch {
 
@@ -18,6 +20,16 @@ enum class ScanResult {
     Ok,
 };
 
+// Records seen by readers while a LOAD writes the storage: the ids below upper_record_id whose bit is
+// clear in deleted_bits. The writer only writes slots past upper_record_id and slots deleted in every
+// snapshot still in use, so the records of a snapshot never change under its readers.
+struct StorageSnapshot {
+    uint64_t upper_record_id = 0;
+    std::shared_ptr<const std::vector<uint64_t>> deleted_bits;
+
+    bool is_deleted(uint32_t record_id) const { return ((*deleted_bits)[record_id >> 6] >> (record_id & 63)) & 1; }
+};
+
 class Storage {
 public:
     Storage(const std::string& path, uint64_t record_size);
@@ -28,13 +40,23 @@ public:
 
     GetResult get_record(uint64_t record_id);
     ScanResult scan_record(uint64_t record_id, Record& record);
+    ScanResult scan_record(const StorageSnapshot& snapshot, uint64_t record_id, Record& record) const;
     PutResult put_record(DataBuffer& data);
     Ret update_record(uint64_t record_id, const DataBuffer& data);
+    // The slot keeps its record until release_deleted(), readers of older snapshots may still scan it.
     Ret delete_record(uint64_t record_id);
 
+    StorageSnapshot snapshot() const;
+    // Marks the records deleted since the last call in the file and lets put_record() reuse their slots.
+    // Called once no reader holds a snapshot taken before the deletes.
+    Ret release_deleted();
+    // Prefers numa_node for the pages of the mapped records.
+    Ret bind_memory(int numa_node);
+
     uint64_t records_count() const { return upper_record_id_ - deleted_records_.size(); }
     uint64_t upper_record_id() const { return upper_record_id_; }
     uint64_t records_limit() const { return records_limit_; }
+    uint64_t full_record_size() const { return full_record_size_; }
     uint64_t deleted_count() const { return deleted_records_.size(); }
 
     bool is_deleted(uint32_t record_id) const {
@@ -48,6 +70,11 @@ public:
         return reinterpret_cast<uint8_t*>(memmap_ + header_size_ + record_id * full_record_size_);
     }
 
+    // Data of record 0, the records follow every full_record_size() bytes.
+    const uint8_t* records_data() const {
+        return reinterpret_cast<const uint8_t*>(memmap_ + header_size_);
+    }
+
 private:
     std::string path_;
     const uint64_t record_size_;
@@ -61,6 +88,11 @@ private:
     uint64_t upper_record_id_ = 0;
     uint64_t records_limit_ = 0;
     std::unordered_set<uint32_t> deleted_records_;
+    // Bitmap of deleted_records_ shared with the snapshots, copied on the first change after a snapshot took it.
+    std::shared_ptr<std::vector<uint64_t>> deleted_bits_;
+    // Deleted records whose slots put_record() may reuse, and the ones deleted since release_deleted().
+    std::unordered_set<uint32_t> free_records_;
+    std::vector<uint32_t> pending_deletes_;
 
 private:
     Ret open_write_file();
@@ -70,6 +102,7 @@ private:
     Ret read_info(bool& need_scan);
     Ret write_info();
     Ret scan();
+    void set_deleted_bit(uint32_t record_id, bool deleted);
 };
 
 } // namespace sketch
\ No newline at end of file
@@ -118,7 +118,7 @@ static int convert_vector(const std::string_view& str, std::vector<uint8_t>& vec
             }
 
             const char* ptr = current_view.data();
-            while (!isalnum(*ptr) && len > 0) {
+            while (len > 0 && !isalnum(*ptr) && *ptr != '-') {
                 ptr++;
                 len--;
             }
@@ -178,7 +178,7 @@ static int convert_ptr(const std::string_view& str, uint8_t* ptr, size_t count,
         {
             size_t len = delim_offset;
             const char* ptr = current_view.data();
-            while (!isalnum(*ptr) && len > 0) {
+            while (len > 0 && !isalnum(*ptr) && *ptr != '-') {
                 ptr++;
                 len--;
             }
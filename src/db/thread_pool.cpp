@@ -0,0 +1,459 @@
+#include "thread_pool.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <experimental/scope>
+
+namespace sketch {
+
+/****************************************
+ *
+ *   Per-thread cache of deque slots. A slot is taken by the thread that pushes a task and returned by
+ *   the thread that runs it, mostly the same worker.
+ */
+class SlotCache {
+public:
+    ~SlotCache() {
+        for (auto* slot : slots_) {
+            delete slot;
+        }
+    }
+
+    Task* acquire(Task&& task) {
+        if (slots_.empty()) {
+            return new Task(std::move(task));
+        }
+
+        Task* slot = slots_.back();
+        slots_.pop_back();
+        *slot = std::move(task);
+        return slot;
+    }
+
+    void release(Task* slot) {
+        slot->reset();
+        if (slots_.size() < MaxCount) {
+            slots_.push_back(slot);
+        } else {
+            delete slot;
+        }
+    }
+
+private:
+    static constexpr std::size_t MaxCount = 1024;
+
+    std::vector<Task*> slots_;
+};
+
+static thread_local SlotCache slot_cache;
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local std::size_t current_index = 0;
+
+/****************************************
+ *
+ *   WorkDeque
+ */
+WorkDeque::WorkDeque() {
+    arrays_.push_back(std::make_unique<Array>(InitialCapacity));
+    array_.store(arrays_.back().get(), std::memory_order_relaxed);
+}
+
+WorkDeque::~WorkDeque() {
+    const int64_t top = top_.load(std::memory_order_relaxed);
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    Array* array = array_.load(std::memory_order_relaxed);
+    for (int64_t i = top; i < bottom; i++) {
+        delete array->get(i);
+    }
+}
+
+void WorkDeque::push(Task* task) {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    const int64_t top = top_.load(std::memory_order_acquire);
+    Array* array = array_.load(std::memory_order_relaxed);
+
+    if (bottom - top > array->capacity - 1) {
+        arrays_.push_back(std::make_unique<Array>(array->capacity * 2));
+        Array* grown = arrays_.back().get();
+        for (int64_t i = top; i < bottom; i++) {
+            grown->put(i, array->get(i));
+        }
+        array_.store(grown, std::memory_order_release);
+        array = grown;
+    }
+
+    array->put(bottom, task);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+}
+
+Task* WorkDeque::pop() {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* array = array_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Task* task = array->get(bottom);
+    if (top == bottom) {
+        // The last task, race the thieves for it
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            task = nullptr;
+        }
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return task;
+}
+
+Task* WorkDeque::steal() {
+    for (;;) {
+        int64_t top = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t bottom = bottom_.load(std::memory_order_acquire);
+        if (top >= bottom) {
+            return nullptr;
+        }
+
+        Array* array = array_.load(std::memory_order_acquire);
+        Task* task = array->get(top);
+        if (top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return task;
+        }
+    }
+}
+
+bool WorkDeque::empty() const {
+    return top_.load(std::memory_order_relaxed) >= bottom_.load(std::memory_order_relaxed);
+}
+
+/****************************************
+ *
+ *   InjectionQueue
+ */
+InjectionQueue::InjectionQueue(std::size_t capacity)
+    : cells_(new Cell[capacity]), mask_(capacity - 1)
+{
+    for (std::size_t i = 0; i < capacity; i++) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool InjectionQueue::push(Task& task) {
+    std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.task = std::move(task);
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool InjectionQueue::pop(Task& task) {
+    std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                task = std::move(cell.task);
+                cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = dequeue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/****************************************
+ *
+ *   ThreadPool
+ */
+ThreadPool::Group::Group(const WorkerGroup& worker_group)
+    : numa_node(worker_group.numa_node), cpus(worker_group.cpus)
+{
+}
+
+ThreadPool::ThreadPool(std::size_t numThreads, ThreadPoolOptions options)
+    : options_(std::move(options))
+{
+    if (options_.groups.empty()) {
+        groups_.push_back(std::make_unique<Group>(WorkerGroup { .numa_node = -1, .cpus = options_.cpus }));
+    } else {
+        for (const auto& worker_group : options_.groups) {
+            groups_.push_back(std::make_unique<Group>(worker_group));
+        }
+    }
+
+    if (numThreads < groups_.size()) {
+        numThreads = groups_.size();
+    }
+
+    for (std::size_t group_index = 0; group_index < groups_.size(); group_index++) {
+        Group& group = *groups_[group_index];
+        group.first_worker = workers_.size();
+        group.workers_count = numThreads / groups_.size() + (group_index < numThreads % groups_.size() ? 1 : 0);
+        for (std::size_t i = 0; i < group.workers_count; i++) {
+            workers_.push_back(std::make_unique<Worker>());
+            workers_.back()->group = group_index;
+        }
+    }
+
+    // All deques exist before any worker may steal from them
+    for (std::size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->thread = std::thread([this, i] {
+            workerLoop(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stop_.store(true, std::memory_order_seq_cst);
+    for (auto& group : groups_) {
+        group->epoch.fetch_add(1, std::memory_order_seq_cst);
+        group->epoch.notify_all();
+    }
+
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+std::size_t ThreadPool::numa_node_group(int numa_node) const {
+    for (std::size_t group = 0; numa_node >= 0 && group < groups_.size(); group++) {
+        if (groups_[group]->numa_node == numa_node) {
+            return group;
+        }
+    }
+
+    return AnyGroup;
+}
+
+void ThreadPool::post(Task&& task, std::size_t group_index) {
+    if (current_pool == this && (group_index == AnyGroup || group_index == workers_[current_index]->group)) {
+        workers_[current_index]->deque.push(slot_cache.acquire(std::move(task)));
+        notify(*groups_[workers_[current_index]->group]);
+        return;
+    }
+
+    if (current_pool != this && stop_.load(std::memory_order_relaxed)) {
+        throw std::runtime_error("ThreadPool::submit on stopped pool");
+    }
+
+    if (group_index == AnyGroup) {
+        const std::size_t spread = groups_.size() == 1 ? 0 : next_group_.fetch_add(1, std::memory_order_relaxed) % groups_.size();
+        Group& group = *groups_[spread];
+        inject(group.any, std::move(task));
+        notify(group);
+        return;
+    }
+
+    Group& group = *groups_[group_index];
+    inject(group.pinned, std::move(task));
+    notify(group);
+}
+
+void ThreadPool::inject(Injected& injected, Task&& task) {
+    if (!injected.queue.push(task)) {
+        std::lock_guard<std::mutex> lock(injected.overflow_mutex);
+        injected.overflow.push_back(std::move(task));
+        injected.overflow_count.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void ThreadPool::notify(Group& group) {
+    group.epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (group.sleeping_count.load(std::memory_order_seq_cst) > 0) {
+        group.epoch.notify_one();
+    }
+}
+
+void ThreadPool::notify_join() {
+    joins_.fetch_add(1, std::memory_order_seq_cst);
+    joins_.notify_all();
+}
+
+bool ThreadPool::take_injected(Injected& injected, Task& task) {
+    if (injected.queue.pop(task)) {
+        return true;
+    }
+
+    if (injected.overflow_count.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(injected.overflow_mutex);
+    if (injected.overflow.empty()) {
+        return false;
+    }
+
+    task = std::move(injected.overflow.front());
+    injected.overflow.pop_front();
+    injected.overflow_count.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Steals from workers [first, first + count) starting next to index.
+bool ThreadPool::steal(std::size_t index, std::size_t first, std::size_t count) {
+    for (std::size_t i = 1; i <= count; i++) {
+        const std::size_t victim = first + (index - first + i) % count;
+        if (victim == index) {
+            continue;
+        }
+
+        if (Task* slot = workers_[victim]->deque.steal()) {
+            run_task(*slot);
+            slot_cache.release(slot);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::run_task(Task& task) {
+    active_count_.fetch_add(1, std::memory_order_relaxed);
+    const std::experimental::scope_exit done([this] {
+        active_count_.fetch_sub(1, std::memory_order_relaxed);
+    });
+    task();
+}
+
+// Own deque first, then the tasks submitted to the group from outside, then steal from the other
+// workers of the group starting next to index. index is workers_.size() for a thread outside of
+// the pool, it takes the tasks submitted to AnyGroup only, unless the pool has a single group.
+bool ThreadPool::run_one(std::size_t index) {
+    Task task;
+    if (index < workers_.size()) {
+        if (Task* slot = workers_[index]->deque.pop()) {
+            run_task(*slot);
+            slot_cache.release(slot);
+            return true;
+        }
+
+        Group& group = *groups_[workers_[index]->group];
+        if (take_injected(group.pinned, task) || take_injected(group.any, task)) {
+            run_task(task);
+            return true;
+        }
+
+        return steal(index, group.first_worker, group.workers_count);
+    }
+
+    for (auto& group : groups_) {
+        if (take_injected(group->any, task)) {
+            run_task(task);
+            return true;
+        }
+    }
+
+    if (groups_.size() > 1) {
+        return false;
+    }
+
+    if (take_injected(groups_[0]->pinned, task)) {
+        run_task(task);
+        return true;
+    }
+
+    return steal(index, 0, workers_.size());
+}
+
+bool ThreadPool::run_pending_task() {
+    return run_one(current_pool == this ? current_index : workers_.size());
+}
+
+void ThreadPool::setup_worker(std::size_t index) {
+    if (!options_.name.empty()) {
+        // Thread names are limited to 15 characters
+        const std::string thread_name = (options_.name + "-" + std::to_string(index)).substr(0, 15);
+        pthread_setname_np(pthread_self(), thread_name.c_str());
+    }
+
+    const auto& cpus = groups_[workers_[index]->group]->cpus;
+    if (!cpus.empty()) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (const int cpu : cpus) {
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+            LOG_WARN << "Failed to set CPU affinity of pool '" << options_.name << "' worker " << index;
+        }
+    }
+
+    if (options_.nice != 0) {
+        // The nice value is per thread on Linux
+        const id_t tid = static_cast<id_t>(gettid());
+        if (setpriority(PRIO_PROCESS, tid, getpriority(PRIO_PROCESS, tid) + options_.nice) != 0) {
+            LOG_WARN << "Failed to set nice value of pool '" << options_.name << "' worker " << index;
+        }
+    }
+}
+
+void ThreadPool::workerLoop(std::size_t index) {
+    current_pool = this;
+    current_index = index;
+    setup_worker(index);
+
+    uint64_t idle_count = 0;
+    for (;;) {
+        if (options_.yield_to && options_.yield_to->saturated() && !stop_.load(std::memory_order_relaxed)) {
+            std::this_thread::sleep_for(AdmissionPause);
+            continue;
+        }
+
+        if (run_one(index)) {
+            idle_count = 0;
+            continue;
+        }
+
+        if (++idle_count < SpinCount) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Announce the sleep before the last look for work, a submit after it changes the epoch
+        Group& group = *groups_[workers_[index]->group];
+        const uint32_t epoch = group.epoch.load(std::memory_order_seq_cst);
+        group.sleeping_count.fetch_add(1, std::memory_order_seq_cst);
+        const bool found = run_one(index);
+        if (!found) {
+            if (stop_.load(std::memory_order_seq_cst)) {
+                group.sleeping_count.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            group.epoch.wait(epoch, std::memory_order_seq_cst);
+        }
+        group.sleeping_count.fetch_sub(1, std::memory_order_relaxed);
+        idle_count = 0;
+    }
+}
+
+} // namespace sketch
@@ -1,31 +1,213 @@
 #pragma once
-#include <vector>
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <future>
-#include <queue>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
-#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace sketch {
 
-class ThreadPool {
+/****************************************
+ *
+ *   Type-erased move-only closure. Closures up to InlineSize bytes, which covers the lambdas of
+ *   the dataset fan-outs and a packaged_task, are stored in place, larger ones on the heap.
+ */
+class Task {
 public:
-    explicit ThreadPool(std::size_t numThreads)
-        : stop_(false)
-    {
-        if (numThreads == 0) {
-            numThreads = 1;
+    static constexpr std::size_t InlineSize = 64;
+
+    Task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= InlineSize && alignof(Fn) <= alignof(std::max_align_t) &&
+                      std::is_nothrow_move_constructible_v<Fn>) {
+            new (storage_) Fn(std::forward<F>(f));
+            ops_ = &inline_ops<Fn>;
+        } else {
+            *reinterpret_cast<Fn**>(storage_) = new Fn(std::forward<F>(f));
+            ops_ = &heap_ops<Fn>;
+        }
+    }
+
+    Task(Task&& other) noexcept { move_from(other); }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            move_from(other);
         }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    void operator()() { ops_->invoke(storage_); }
+
+    void reset() {
+        if (ops_) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
 
-        for (std::size_t i = 0; i < numThreads; ++i) {
-            workers_.emplace_back([this] {
-                workerLoop();
-            });
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename Fn>
+    static constexpr Ops inline_ops = {
+        [](void* storage) { (*static_cast<Fn*>(storage))(); },
+        [](void* dst, void* src) {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        },
+        [](void* storage) { static_cast<Fn*>(storage)->~Fn(); },
+    };
+
+    template <typename Fn>
+    static constexpr Ops heap_ops = {
+        [](void* storage) { (**static_cast<Fn**>(storage))(); },
+        [](void* dst, void* src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); },
+        [](void* storage) { delete *static_cast<Fn**>(storage); },
+    };
+
+    void move_from(Task& other) {
+        ops_ = other.ops_;
+        if (ops_) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
         }
     }
 
+    alignas(std::max_align_t) unsigned char storage_[InlineSize];
+    const Ops* ops_ = nullptr;
+};
+
+/****************************************
+ *
+ *   Chase-Lev work-stealing deque of task slots (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ *   The owner worker pushes and pops at the bottom, other threads steal from the top.
+ *   Arrays outgrown by push stay allocated until the deque is destroyed, a thief may still read them.
+ */
+class WorkDeque {
+public:
+    WorkDeque();
+    ~WorkDeque();
+
+    void push(Task* task);
+    Task* pop();
+    Task* steal();
+    bool empty() const;
+
+private:
+    struct Array {
+        explicit Array(int64_t capacity) : capacity(capacity), slots(capacity) {}
+        Task* get(int64_t index) const { return slots[index & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t index, Task* task) { slots[index & (capacity - 1)].store(task, std::memory_order_relaxed); }
+
+        const int64_t capacity;
+        std::vector<std::atomic<Task*>> slots;
+    };
+
+    static constexpr int64_t InitialCapacity = 256;
+
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    std::atomic<Array*> array_;
+    std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+/****************************************
+ *
+ *   Bounded lock-free MPMC queue (D. Vyukov), tasks submitted from outside the pool enter the workers
+ *   through it. Tasks are moved into the cells, a push does not allocate.
+ */
+class InjectionQueue {
+public:
+    explicit InjectionQueue(std::size_t capacity);
+
+    bool push(Task& task);
+    bool pop(Task& task);
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        Task task;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    const std::size_t mask_;
+    alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<std::size_t> dequeue_pos_{0};
+};
+
+class ThreadPool;
+
+// Workers of a pool that run on the CPUs of one NUMA node.
+struct WorkerGroup {
+    int numa_node = -1;                     // -1 when the CPUs are not tied to a NUMA node
+    std::vector<int> cpus;                  // CPUs the workers of the group may run on, empty for all
+};
+
+struct ThreadPoolOptions {
+    std::string name;                       // Workers are named <name>-<index>
+    std::vector<int> cpus;                  // CPUs the workers may run on, empty for all
+    int nice = 0;                           // Added to the nice value of the workers
+    const ThreadPool* yield_to = nullptr;   // No new task is started while this pool is saturated
+    std::vector<WorkerGroup> groups;        // Workers are split evenly over the groups, cpus is then ignored
+};
+
+/****************************************
+ *
+ *   Work-stealing thread pool.
+ *
+ *   Every worker owns a WorkDeque: tasks submitted by a worker go to the bottom of its own deque and
+ *   are run LIFO, idle workers steal the oldest tasks of the others. Tasks submitted by other threads
+ *   go to the InjectionQueue, or to a locked overflow list when it is full.
+ *
+ *   Deque slots are recycled through a per-thread cache, so a small closure is submitted without
+ *   an allocation. Idle workers sleep on an epoch counter that every submit bumps.
+ *
+ *   submit() returns a std::future. TaskGroup forks tasks and joins them by running pending tasks
+ *   of the pool while it waits, it never blocks a worker that could run the tasks it waits for.
+ *
+ *   A background pool yields to a latency sensitive one through ThreadPoolOptions::yield_to: its
+ *   workers don't take new tasks while every worker of the other pool is busy. Tasks already running
+ *   and the threads waiting on a TaskGroup are not held back.
+ *
+ *   With several worker groups, e.g. one per NUMA node, every group is a sub-pool with an injection
+ *   queue of its own. A task submitted to a group runs on the workers of that group only, its workers
+ *   steal from each other and not from the other groups. Tasks submitted to AnyGroup from outside are
+ *   spread over the groups through a second injection queue of every group. A thread outside the pool
+ *   waiting on a TaskGroup runs only those, it cannot tell the tasks of a worker deque apart and leaves
+ *   them to the workers. With a single group it runs any pending task.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t numThreads, ThreadPoolOptions options = {});
+
     // Non-copyable
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
@@ -34,18 +216,19 @@ public:
     ThreadPool(ThreadPool&&) = delete;
     ThreadPool& operator=(ThreadPool&&) = delete;
 
-    ~ThreadPool() {
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            stop_ = true;
-        }
-        cv_.notify_all();
-        for (auto& t : workers_) {
-            if (t.joinable()) {
-                t.join();
-            }
-        }
-    }
+    ~ThreadPool();
+
+    static constexpr std::size_t AnyGroup = SIZE_MAX;
+
+    std::size_t size() const { return workers_.size(); }
+    const std::string& name() const { return options_.name; }
+    std::size_t active_count() const { return active_count_.load(std::memory_order_relaxed); }
+    bool saturated() const { return active_count() >= size(); }
+
+    std::size_t groups_count() const { return groups_.size(); }
+    int group_numa_node(std::size_t group) const { return groups_[group]->numa_node; }
+    // The group running on numa_node, AnyGroup if there is none.
+    std::size_t numa_node_group(int numa_node) const;
 
     template <typename F, typename... Args>
     auto submit(F&& f, Args&&... args)
@@ -53,56 +236,150 @@ public:
     {
         using R = std::invoke_result_t<F, Args...>;
 
-        auto task = std::make_shared<std::packaged_task<R()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+        std::packaged_task<R()> task(
+            [f = std::forward<F>(f), ... args = std::forward<Args>(args)]() mutable {
+                return std::invoke(f, args...);
+            }
         );
 
-        std::future<R> fut = task->get_future();
+        std::future<R> fut = task.get_future();
+        post(std::move(task), AnyGroup);
 
-        {
-            std::unique_lock<std::mutex> lock(mutex_);
-            if (stop_) {
-                throw std::runtime_error("ThreadPool::submit on stopped pool");
-            }
+        return fut;
+    }
 
-            tasks_.emplace([task]() {
-                (*task)();
-            });
-        }
-        cv_.notify_one();
+    // Runs f on the workers of group.
+    template <typename F>
+    auto submit_to(std::size_t group, F&& f) -> std::future<std::invoke_result_t<F>> {
+        using R = std::invoke_result_t<F>;
+
+        std::packaged_task<R()> task(std::forward<F>(f));
+        std::future<R> fut = task.get_future();
+        post(std::move(task), group);
 
         return fut;
     }
 
+    // Runs one pending task on the calling thread, returns false when none was found.
+    bool run_pending_task();
+
 private:
-    std::vector<std::thread>        workers_;
-    std::queue<std::function<void()>> tasks_;
-    std::mutex                      mutex_;
-    std::condition_variable         cv_;
-    bool                            stop_;
+    friend class TaskGroup;
+
+    struct Worker {
+        WorkDeque deque;
+        std::thread thread;
+        std::size_t group = 0;
+    };
+
+    // Tasks submitted from outside, a locked overflow list takes them when the queue is full.
+    struct Injected {
+        Injected() : queue(InjectionCapacity) {}
+
+        InjectionQueue              queue;
+        std::mutex                  overflow_mutex;
+        std::deque<Task>            overflow;
+        std::atomic<uint64_t>       overflow_count{0};
+    };
+
+    // Workers [first_worker, first_worker + workers_count) sleep on the epoch of their group.
+    struct Group {
+        explicit Group(const WorkerGroup& worker_group);
+
+        const int                   numa_node;
+        const std::vector<int>      cpus;
+        Injected                    pinned;     // Submitted to this group
+        Injected                    any;        // Submitted to AnyGroup and spread to this group
+        std::atomic<uint32_t>       epoch{0};
+        std::atomic<uint32_t>       sleeping_count{0};
+        std::size_t                 first_worker = 0;
+        std::size_t                 workers_count = 0;
+    };
+
+    static constexpr std::size_t InjectionCapacity = 4096;
+    static constexpr uint64_t SpinCount = 64;
+    static constexpr auto AdmissionPause = std::chrono::milliseconds(1);
+
+    const ThreadPoolOptions options_;
+    std::vector<std::unique_ptr<Group>> groups_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<std::size_t>        next_group_{0};
+    std::atomic<uint32_t>           joins_{0};
+    std::atomic<std::size_t>        active_count_{0};
+    std::atomic<bool>               stop_{false};
 
 private:
-    void workerLoop() {
-        for (;;) {
-            std::function<void()> task;
+    void post(Task&& task, std::size_t group);
+    bool run_one(std::size_t index);
+    void inject(Injected& injected, Task&& task);
+    bool take_injected(Injected& injected, Task& task);
+    bool steal(std::size_t index, std::size_t first, std::size_t count);
+    void run_task(Task& task);
+    void setup_worker(std::size_t index);
+    void notify(Group& group);
+    void notify_join();
+    void workerLoop(std::size_t index);
+};
+
+/****************************************
+ *
+ *   Fork-join helper: run() forks a task on the pool, wait() joins all of them while running pending
+ *   tasks itself. The first exception thrown by a task is rethrown by wait().
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool_(pool) {}
+    ~TaskGroup() { wait_no_throw(); }
 
-            {
-                std::unique_lock<std::mutex> lock(mutex_);
-                cv_.wait(lock, [this] {
-                    return stop_ || !tasks_.empty();
-                });
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
 
-                if (stop_ && tasks_.empty()) {
-                    return;
+    // Runs f on the workers of group, by default on any worker.
+    template <typename F>
+    void run(F&& f, std::size_t group = ThreadPool::AnyGroup) {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        pool_.post([this, pool = &pool_, f = std::forward<F>(f)]() mutable {
+            try {
+                f();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex_);
+                if (!error_) {
+                    error_ = std::current_exception();
                 }
+            }
 
-                task = std::move(tasks_.front());
-                tasks_.pop();
+            // The group may be destroyed as soon as pending_ drops to 0, the waiter is woken through the pool.
+            if (pending_.fetch_sub(1, std::memory_order_seq_cst) == 1) {
+                pool->notify_join();
             }
+        }, group);
+    }
 
-            task();
+    void wait() {
+        wait_no_throw();
+        if (error_) {
+            std::rethrow_exception(std::exchange(error_, nullptr));
         }
     }
+
+private:
+    void wait_no_throw() {
+        for (;;) {
+            const uint32_t joins = pool_.joins_.load(std::memory_order_seq_cst);
+            if (pending_.load(std::memory_order_seq_cst) == 0) {
+                return;
+            }
+
+            if (!pool_.run_pending_task()) {
+                pool_.joins_.wait(joins, std::memory_order_seq_cst);
+            }
+        }
+    }
+
+    ThreadPool& pool_;
+    std::atomic<uint32_t> pending_{0};
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
 };
 
-} // namespace sketch
\ No newline at end of file
+} // namespace sketch
@@ -1,16 +1,24 @@
 #include "engine.h"
 #include "command_router.h"
+#include "dataset.h"
+#include "query_batcher.h"
+#include "thread_pool.h"
+#include "query_context.h"
 #include "string_utils.h"
 #include "log.h"
 #include "gtest/gtest.h"
 
 #include <unistd.h>
+#include <cstring>
 #include <filesystem>
 #include <memory>
 #include <iostream>
 #include <fstream>
 #include <format>
 #include <experimental/scope>
+#include <latch>
+#include <random>
+#include <thread>
 
 using namespace sketch;
 
@@ -327,3 +335,350 @@ TEST(DML, RouterLoadLarge) {
         //std::cerr << "RESULT: " << ret.message() << std::endl;
     }
 }
+
+TEST(DML, KnnBinaryPrefilter) {
+    const uint64_t dim = 64;
+    const uint64_t nodes = 4;
+    const uint64_t clusters_count = 100;
+    const uint64_t cluster_size = 20;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    // Tight clusters around random signed centers: neighbours share almost every sign bit.
+    std::mt19937 gen(7);
+    std::normal_distribution<float> center_dist(0.0f, 1.0f);
+    std::normal_distribution<float> noise_dist(0.0f, 0.02f);
+    std::vector<std::string> lines;
+    for (uint64_t c = 0; c < clusters_count; c++) {
+        std::vector<float> center(dim);
+        for (auto& value : center) {
+            value = center_dist(gen);
+        }
+
+        for (uint64_t i = 0; i < cluster_size; i++) {
+            std::string line = std::format("{} : [ ", lines.size() + 1);
+            for (uint64_t j = 0; j < dim; j++) {
+                line += std::to_string(center[j] + noise_dist(gen)) + (j + 1 < dim ? ", " : " ]");
+            }
+            lines.push_back(line);
+        }
+    }
+
+    write_text(GeneratedFile, lines.data(), lines.size());
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+
+    auto ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    for (uint64_t index = 0; index < lines.size(); index += 97) {
+        auto expected = router.process_command(std::format("KNN L2 5 #{} {}", index, GeneratedFile));
+        ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+        auto actual = router.process_command(std::format("KNN L2 5 #{} {} BQ", index, GeneratedFile));
+        ASSERT_EQ(0, actual) << "ERROR: " << actual.message();
+        ASSERT_EQ(expected.message(), actual.message());
+    }
+
+    ret = router.process_command(std::format("KNN L2 5 #0 {} XX", GeneratedFile));
+    ASSERT_NE(0, ret);
+}
+
+TEST(DML, QueryCancellation) {
+    const uint64_t dim = 16;
+    DmlTestSettings dts(dim, 4);
+    CommandRouter& router = dts.router();
+
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<float> value_dist(-1.0f, 1.0f);
+    std::vector<std::string> lines;
+    for (uint64_t i = 0; i < 4000; i++) {
+        std::string line = std::format("{} : [ ", i + 1);
+        for (uint64_t j = 0; j < dim; j++) {
+            line += std::to_string(value_dist(gen)) + (j + 1 < dim ? ", " : " ]");
+        }
+        lines.push_back(line);
+    }
+
+    write_text(GeneratedFile, lines.data(), lines.size());
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+
+    auto ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    const std::string knn = std::format("KNN L2 5 #0 {}", GeneratedFile);
+    const std::string knn_binary = std::format("KNN L2 5 #0 {} BQ", GeneratedFile);
+    auto expected = router.process_command(knn);
+    ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+    ASSERT_EQ(std::string::npos, expected.message().find("partial"));
+
+    // A request within its deadline is complete
+    QueryContext in_time(std::chrono::hours(1));
+    ret = router.process_command(knn, &in_time);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(expected.message(), ret.message());
+    ASSERT_FALSE(in_time.partial());
+
+    // Stopped requests still succeed, their results are flagged
+    QueryContext cancelled;
+    cancelled.cancel();
+    ret = router.process_command(knn, &cancelled);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_NE(std::string::npos, ret.message().find("partial: cancelled")) << ret.message();
+    ASSERT_TRUE(cancelled.partial());
+
+    QueryContext expired(std::chrono::nanoseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ret = router.process_command(knn_binary, &expired);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_NE(std::string::npos, ret.message().find("partial: deadline exceeded")) << ret.message();
+
+    ret = router.process_command("MAKE_HNSW 8 32");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    QueryContext hnsw_cancelled;
+    hnsw_cancelled.cancel();
+    ret = router.process_command(std::format("ANN_HNSW 5 64 #0 {}", GeneratedFile), &hnsw_cancelled);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_NE(std::string::npos, ret.message().find("partial: cancelled")) << ret.message();
+}
+
+TEST(DML, KnnBatching) {
+    const uint64_t dim = 16;
+    const uint64_t queries_count = 8;
+    DmlTestSettings dts(dim, 4);
+    CommandRouter& router = dts.router();
+    dts.engine().start_tread_pool(4);
+
+    std::mt19937 gen(17);
+    std::uniform_real_distribution<float> value_dist(-1.0f, 1.0f);
+    std::vector<std::string> lines;
+    for (uint64_t i = 0; i < 4000; i++) {
+        std::string line = std::format("{} : [ ", i + 1);
+        for (uint64_t j = 0; j < dim; j++) {
+            line += std::to_string(value_dist(gen)) + (j + 1 < dim ? ", " : " ]");
+        }
+        lines.push_back(line);
+    }
+
+    write_text(GeneratedFile, lines.data(), lines.size());
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+
+    auto ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    auto dataset = router.dcp().current_dataset();
+    ThreadPool* pool = dts.engine().thread_pool();
+
+    std::vector<std::vector<uint8_t>> data(queries_count);
+    std::vector<std::string> expected;
+    for (uint64_t i = 0; i < queries_count; i++) {
+        std::vector<float> values(dim);
+        for (auto& value : values) {
+            value = value_dist(gen);
+        }
+        data[i].resize(dim * sizeof(float));
+        memcpy(data[i].data(), values.data(), data[i].size());
+
+        ret = dataset->knn(KnnType::L2, 3 + i, data[i], 0, pool);
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+        expected.push_back(ret.message());
+    }
+
+    // One pass gives every query the result of its own scan, a stopped query doesn't stop the others.
+    QueryContext cancelled;
+    cancelled.cancel();
+    std::vector<KnnQuery> queries;
+    for (uint64_t i = 0; i < queries_count; i++) {
+        queries.push_back(KnnQuery{ .count = 3 + i, .data = &data[i], .skip_tag = 0, .context = i == 1 ? &cancelled : nullptr });
+    }
+
+    std::vector<Ret> results;
+    ret = dataset->knn_batch(KnnType::L2, queries, results, pool);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(queries_count, results.size());
+    for (uint64_t i = 0; i < queries_count; i++) {
+        ASSERT_EQ(0, results[i]) << "ERROR: " << results[i].message();
+        if (i == 1) {
+            ASSERT_NE(std::string::npos, results[i].message().find("partial: cancelled")) << results[i].message();
+        } else {
+            ASSERT_EQ(expected[i], results[i].message());
+        }
+    }
+
+    // Requests of concurrent threads are coalesced and get their own results back.
+    QueryBatcher batcher(std::chrono::milliseconds(20), queries_count);
+    const uint64_t rounds = 10;
+    for (uint64_t round = 0; round < rounds; round++) {
+        std::latch start(queries_count);
+        std::vector<Ret> responses(queries_count, Ret(0));
+        std::vector<std::thread> threads;
+        for (uint64_t i = 0; i < queries_count; i++) {
+            threads.emplace_back([&, i] {
+                start.arrive_and_wait();
+                responses[i] = batcher.knn(*dataset, KnnType::L2, 3 + i, data[i], 0, pool);
+            });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (uint64_t i = 0; i < queries_count; i++) {
+            ASSERT_EQ(0, responses[i]) << "ERROR: " << responses[i].message();
+            ASSERT_EQ(expected[i], responses[i].message());
+        }
+    }
+
+    ASSERT_EQ(rounds * queries_count, batcher.queries_count());
+    ASSERT_LT(batcher.batches_count(), batcher.queries_count());
+
+    // A leader waits no longer than its deadline, and not at all for the requests of other metrics.
+    QueryBatcher slow_batcher(std::chrono::seconds(10), queries_count);
+    std::latch started(2);
+    std::vector<Ret> slow_responses(2, Ret(0));
+    std::vector<std::thread> slow_threads;
+    for (uint64_t i = 0; i < 2; i++) {
+        slow_threads.emplace_back([&, i] {
+            QueryContext context(std::chrono::milliseconds(200));
+            started.arrive_and_wait();
+            slow_responses[i] = slow_batcher.knn(*dataset, i == 0 ? KnnType::L2 : KnnType::L1, 3, data[i], 0, pool, &context);
+        });
+    }
+
+    const auto start_time = std::chrono::steady_clock::now();
+    for (auto& thread : slow_threads) {
+        thread.join();
+    }
+    ASSERT_LT(std::chrono::steady_clock::now() - start_time, std::chrono::seconds(5));
+    ASSERT_EQ(0, slow_responses[0]) << "ERROR: " << slow_responses[0].message();
+    ASSERT_EQ(0, slow_responses[1]) << "ERROR: " << slow_responses[1].message();
+    ASSERT_EQ(2, slow_batcher.batches_count());
+}
+
+TEST(DML, LoadAlongWithQueries) {
+    const uint64_t dim = 8;
+    const uint64_t count = 2000;
+
+    DmlTestSettings dts(dim, /*count=*/4);
+    CommandRouter& router = dts.router();
+
+    // Tag t is at (t, ...) in the first file, the second file moves it to (-t, ...) and adds as many new tags.
+    const std::string first_file = std::string(Path) + "/first.data";
+    const std::string second_file = std::string(Path) + "/second.data";
+    std::vector<std::string> first_lines;
+    std::vector<std::string> second_lines;
+    for (uint64_t tag = 1; tag <= 2 * count; tag++) {
+        std::string coords = std::to_string(tag);
+        std::string moved_coords = "-" + std::to_string(tag);
+        for (uint64_t j = 1; j < dim; j++) {
+            coords += ", 0.0";
+            moved_coords += ", 0.0";
+        }
+
+        if (tag <= count) {
+            first_lines.push_back(std::to_string(tag) + " : [ " + coords + " ]");
+        }
+        second_lines.push_back(std::to_string(tag) + " : [ " + (tag <= count ? moved_coords : coords) + " ]");
+    }
+    write_text(first_file, first_lines.data(), first_lines.size());
+    write_text(second_file, second_lines.data(), second_lines.size());
+
+    auto ret = router.process_command(std::format("LOAD {}", first_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // Queries of another client run while the second file is loaded, they see either file, never a mix.
+    CommandRouter query_router(dts.engine());
+    ASSERT_EQ(0, query_router.init());
+    ret = query_router.process_command("USE test.ds;");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    std::atomic<bool> loaded{false};
+    Ret load_ret{0};
+    std::thread loader([&] {
+        load_ret = router.process_command(std::format("LOAD {}", second_file));
+        loaded = true;
+    });
+
+    // Tag count is queried: its neighbours are count - 2, count - 1 in the first file and the new tags in the second.
+    const std::string before = std::to_string(count - 2) + ", " + std::to_string(count - 1) + ", ";
+    const std::string after = std::to_string(count + 1) + ", " + std::to_string(count + 2) + ", ";
+    uint64_t queries_count = 0;
+    do {
+        auto knn_ret = query_router.process_command(std::format("KNN L2 2 #{} {}", count - 1, first_file));
+        EXPECT_EQ(0, knn_ret) << "ERROR: " << knn_ret.message();
+        EXPECT_TRUE(knn_ret.message() == before || knn_ret.message() == after) << knn_ret.message();
+        queries_count++;
+    } while (!loaded);
+    loader.join();
+    ASSERT_EQ(0, load_ret) << "ERROR: " << load_ret.message();
+    ASSERT_LT(0, queries_count);
+
+    ret = query_router.process_command(std::format("KNN L2 2 #{} {}", count - 1, first_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(after, ret.message());
+
+    ret = query_router.process_command(std::format("FIND TAG {} {}", 2 * count, second_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+}
+
+TEST(DML, LoadOnLoadPool) {
+    const uint64_t dim = 8;
+    const uint64_t count = 1000;
+
+    DmlTestSettings dts(dim, /*count=*/4);
+    dts.engine().start_tread_pool(4);
+    CommandRouter& router = dts.router();
+
+    // Tag t is at (t, ...) in the first file. The second file removes tags [1, 100], moves tags [101, 200]
+    // to (-t, ...) and adds tags [count + 1, count + 100].
+    const std::string first_file = std::string(Path) + "/first.data";
+    const std::string second_file = std::string(Path) + "/second.data";
+    std::vector<std::string> first_lines;
+    std::vector<std::string> second_lines;
+    for (uint64_t tag = 1; tag <= count + 100; tag++) {
+        std::string coords = std::to_string(tag);
+        std::string moved_coords = "-" + std::to_string(tag);
+        for (uint64_t j = 1; j < dim; j++) {
+            coords += ", 0.0";
+            moved_coords += ", 0.0";
+        }
+
+        if (tag <= count) {
+            first_lines.push_back(std::to_string(tag) + " : [ " + coords + " ]");
+        }
+        if (tag <= 100) {
+            second_lines.push_back(std::to_string(tag) + " : []");
+        } else if (tag <= 200) {
+            second_lines.push_back(std::to_string(tag) + " : [ " + moved_coords + " ]");
+        } else if (tag > count) {
+            second_lines.push_back(std::to_string(tag) + " : [ " + coords + " ]");
+        }
+    }
+    write_text(first_file, first_lines.data(), first_lines.size());
+    write_text(second_file, second_lines.data(), second_lines.size());
+
+    // The nodes load their records on the load pool
+    ASSERT_NE(nullptr, dts.engine().thread_pool(PoolKind::load));
+    auto ret = router.process_command(std::format("LOAD {}", first_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("Loaded 1000 / 1000 items into dataset\n - added: 1000\n - removed: 0\n - updated: 0\n", ret.message());
+
+    ret = router.process_command(std::format("LOAD {}", second_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("Loaded 300 / 300 items into dataset\n - added: 100\n - removed: 100\n - updated: 100\n", ret.message());
+
+    ret = router.process_command(std::format("KNN L2 2 #{} {}", 149, first_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("201, 202, ", ret.message());
+
+    ret = router.process_command(std::format("KNN L2 2 #{} {}", 299, second_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("1098, 1099, ", ret.message());
+}
@@ -1,5 +1,14 @@
 #include "engine.h"
 #include "command_router.h"
+#include "centroids.h"
+#include "cluster_stats.h"
+#include "ivf_builder.h"
+#include "math.h"
+#include "opq.h"
+#include "posting_lists.h"
+#include "query_context.h"
+#include "residual_chunks.h"
+#include "thread_pool.h"
 #include "string_utils.h"
 #include "log.h"
 #include "gtest/gtest.h"
@@ -10,6 +19,11 @@
 #include <iostream>
 #include <fstream>
 #include <format>
+#include <cmath>
+#include <random>
+#include <map>
+#include <set>
+#include <thread>
 #include <experimental/scope>
 
 using namespace sketch;
@@ -206,7 +220,7 @@ TEST(IVF, PqTest) {
 
     TempLogLevel temp_level(LL_DEBUG);
 
-    auto test_func0 = [&] (const std::unique_ptr<Centroids>& centroids) -> Ret {
+    auto test_func0 = [&] (const std::shared_ptr<Centroids>& centroids) -> Ret {
         (void)centroids;
         /*for (size_t i = 0; i < centroids->centroids_count(); i++) {
             print_data(DatasetType::f32, dim, dim, centroids->get_centroid(i), std::cerr);
@@ -249,4 +263,1002 @@ TEST(IVF, PqTest) {
     ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
 
     ASSERT_EQ(chunk_count, result_pq_centroids_count);
+
+    result_pq_centroids_count = 0;
+    ret = ds->make_pq_centroids(chunk_count, pq_centroids_depth, nullptr, true);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ASSERT_EQ(chunk_count, result_pq_centroids_count);
+
+    // DUMP_IVF reads the codebooks of its snapshot while new ones are switched in.
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> dumps_count{0};
+    std::thread reader([&] {
+        while (!stop) {
+            auto dump = ds->dump_ivf();
+            if (dump == 0 && dump.message().find("PQ Chunk 1:") != std::string::npos) {
+                dumps_count++;
+            }
+        }
+    });
+
+    for (uint64_t i = 0; i < 2; i++) {
+        ret = ds->make_pq_centroids(chunk_count, pq_centroids_depth, nullptr, i % 2 == 0);
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    }
+
+    stop = true;
+    reader.join();
+    ASSERT_LT(0, dumps_count);
+}
+
+TEST(IVF, KMeansParallelInit) {
+    const uint64_t dim = 16;
+    const uint64_t centroids_count = 1024;
+    const uint64_t records_count = 16 * 1024;
+
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> dis(-1000.0f, 1000.0f);
+    std::vector<float> records(records_count * dim);
+    for (auto& v : records) v = dis(gen);
+
+    IvfBuilder builder(DatasetType::f32, dim, centroids_count, records_count);
+    ASSERT_EQ(0, builder.init());
+    for (uint64_t i = 0; i < records_count; i++) {
+        builder.set_record(i, reinterpret_cast<const uint8_t*>(records.data() + i * dim));
+    }
+
+    ThreadPool thread_pool(4);
+    auto ret = builder.init_centroids_kmeans_plus_plus(&thread_pool);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // Every centroid is one of the records and no record is selected twice.
+    // Keyed by the whole record, records may share their first value.
+    std::map<std::vector<float>, uint64_t> record_ids;
+    for (uint64_t j = 0; j < records_count; j++) {
+        record_ids[std::vector<float>(records.data() + j * dim, records.data() + (j + 1) * dim)] = j;
+    }
+
+    std::set<uint64_t> selected;
+    for (uint64_t i = 0; i < centroids_count; i++) {
+        const float* centroid = reinterpret_cast<const float*>(builder.get_centroid(i));
+        auto iter = record_ids.find(std::vector<float>(centroid, centroid + dim));
+        ASSERT_TRUE(iter != record_ids.end());
+        ASSERT_TRUE(selected.insert(iter->second).second);
+    }
+
+    ret = builder.recalc_centroids();
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+}
+
+TEST(IVF, MiniBatchKMeans) {
+    const uint64_t dim = 8;
+    const uint64_t centroids_count = 4;
+    const uint64_t per_cluster_count = 4096;
+    const uint64_t batch_size = 256;
+    const uint64_t batches_count = 64;
+
+    std::mt19937 gen(11);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::vector<float> records(centroids_count * per_cluster_count * dim);
+    for (uint64_t c = 0; c < centroids_count; c++) {
+        for (uint64_t i = 0; i < per_cluster_count; i++) {
+            float* record = records.data() + (c * per_cluster_count + i) * dim;
+            for (uint64_t d = 0; d < dim; d++) {
+                record[d] = 1000.0f * c + noise(gen);
+            }
+        }
+    }
+
+    IvfBuilder builder(DatasetType::f32, dim, centroids_count, batch_size);
+    ASSERT_EQ(0, builder.init());
+
+    std::uniform_int_distribution<uint64_t> dis(0, centroids_count * per_cluster_count - 1);
+    auto sample = [&] {
+        for (uint64_t i = 0; i < batch_size; i++) {
+            builder.set_record(i, reinterpret_cast<const uint8_t*>(records.data() + dis(gen) * dim));
+        }
+    };
+
+    sample();
+    auto ret = builder.init_centroids_kmeans_plus_plus();
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    for (uint64_t i = 0; i < batches_count; i++) {
+        sample();
+        ret = builder.minibatch_update();
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    }
+
+    // Every centroid converges to the mean of its own cluster.
+    std::set<uint64_t> clusters;
+    for (uint64_t i = 0; i < centroids_count; i++) {
+        const float* centroid = reinterpret_cast<const float*>(builder.get_centroid(i));
+        const uint64_t cluster = static_cast<uint64_t>(std::lround(centroid[0] / 1000.0f));
+        ASSERT_TRUE(clusters.insert(cluster).second);
+        for (uint64_t d = 0; d < dim; d++) {
+            ASSERT_NEAR(1000.0f * cluster, centroid[d], 0.5f);
+        }
+    }
+}
+
+TEST(IVF, MakeIvfMiniBatch) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 10'000;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto cmd = std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from);
+    auto ret = router.process_command(cmd);
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command("MAKE_IVF 16 8 4 MINIBATCH");
+    ASSERT_NE(0, ret);
+
+    ret = router.process_command("MAKE_IVF 16 1024 8 MINIBATCH");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("ANN 10 4 #{} {}", 0, GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+}
+
+TEST(IVF, TwoLevelIvf) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 20'000;
+    const uint64_t coarse_count = 8;
+    const uint64_t sub_count = 32;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto cmd = std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from);
+    auto ret = router.process_command(cmd);
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    cmd = std::format("MAKE_IVF_2L {} {} {} {}", coarse_count, sub_count, 8'000, 8);
+    ret = router.process_command(cmd);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    for (uint64_t index = 0; index < 16; index++) {
+        ret = router.process_command(std::format("ANN 10 8 #{} {}", index * 1000, GeneratedFile));
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    }
+
+    const std::string index_path = std::string(Path) + "/test/ds/index_1";
+    Centroids centroids;
+    ret = centroids.init(index_path + "/centroids");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = centroids.init_coarse(index_path + "/coarse");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = centroids.init_assigner(DatasetType::f32, dim);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ASSERT_TRUE(centroids.is_two_level());
+    ASSERT_EQ(coarse_count, centroids.coarse_count());
+    ASSERT_EQ(coarse_count * sub_count, centroids.centroids_count());
+
+    // Fine centroids lie in the Voronoi cell of their coarse centroid, so each one is found through its own cell.
+    for (uint64_t i = 0; i < centroids.centroids_count(); i++) {
+        const uint8_t* centroid = centroids.get_centroid(i);
+        const uint32_t nearest = centroids.find_nearest_centroid(centroid, DatasetType::f32, dim);
+        ASSERT_EQ(0.0, distance_L2_square(DatasetType::f32, centroid, centroids.get_centroid(nearest), dim));
+
+        std::vector<uint32_t> cluster_ids;
+        centroids.find_nearest_clusters(centroid, DatasetType::f32, dim, cluster_ids, 4);
+        ASSERT_EQ(4, cluster_ids.size());
+        ASSERT_EQ(0.0, distance_L2_square(DatasetType::f32, centroid, centroids.get_centroid(cluster_ids.back()), dim));
+    }
+}
+
+TEST(IVF, CentroidsHnsw) {
+    const uint64_t dim = 16;
+    const uint64_t centroids_count = Centroids::HnswMinCentroids;
+    const uint64_t queries_count = 200;
+    const uint64_t nprobes = 10;
+
+    std::filesystem::remove_all(Path);
+    std::filesystem::create_directories(Path);
+    std::experimental::scope_exit cleaner([&] {
+        std::filesystem::remove_all(Path);
+    });
+
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<float> dis(-100.0f, 100.0f);
+
+    IvfBuilder builder(DatasetType::f32, dim, centroids_count, 0);
+    ASSERT_EQ(0, builder.init());
+    float* values = reinterpret_cast<float*>(builder.get_centroids());
+    for (uint64_t i = 0; i < centroids_count * dim; i++) {
+        values[i] = dis(gen);
+    }
+
+    const std::string centroids_path = std::string(Path) + "/centroids";
+    const std::string hnsw_path = std::string(Path) + "/centroids.hnsw";
+    ASSERT_EQ(0, Centroids::write_centroids(centroids_path, builder));
+
+    ThreadPool thread_pool(4);
+    auto ret = Centroids::write_hnsw(hnsw_path, builder, &thread_pool);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    Centroids exact;
+    ASSERT_EQ(0, exact.init(centroids_path));
+
+    Centroids graph;
+    ASSERT_EQ(0, graph.init(centroids_path));
+    ret = graph.init_hnsw(hnsw_path);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_TRUE(graph.has_hnsw());
+
+    uint64_t found = 0;
+    std::vector<float> query(dim);
+    for (uint64_t q = 0; q < queries_count; q++) {
+        for (auto& v : query) v = dis(gen);
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(query.data());
+
+        std::vector<uint32_t> expected;
+        exact.find_nearest_clusters(data, DatasetType::f32, dim, expected, nprobes);
+        std::vector<uint32_t> actual;
+        graph.find_nearest_clusters(data, DatasetType::f32, dim, actual, nprobes);
+        ASSERT_EQ(nprobes, actual.size());
+
+        std::set<uint32_t> expected_set(expected.begin(), expected.end());
+        for (const auto id : actual) {
+            found += expected_set.count(id);
+        }
+    }
+
+    const double recall = static_cast<double>(found) / (queries_count * nprobes);
+    ASSERT_GT(recall, 0.95) << "Recall: " << recall;
+}
+
+TEST(IVF, HnswIndex) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 20'000;
+    const uint64_t queries_count = 20;
+    const uint64_t count = 10;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto cmd = std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from);
+    auto ret = router.process_command(cmd);
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("ANN_HNSW {} 64 #0 {}", count, GeneratedFile));
+    ASSERT_NE(0, ret);
+
+    ret = router.process_command("MAKE_HNSW 16 100");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // The graph outlives the switch to a new IVF index.
+    ret = router.process_command("MAKE_IVF 16 1024 8");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    auto split = [](const std::string& message) {
+        std::set<std::string> tags;
+        std::stringstream stream(message);
+        std::string tag;
+        while (std::getline(stream, tag, ',')) {
+            const auto pos = tag.find_first_not_of(' ');
+            if (pos != std::string::npos) {
+                tags.insert(tag.substr(pos));
+            }
+        }
+        return tags;
+    };
+
+    uint64_t found = 0;
+    for (uint64_t q = 0; q < queries_count; q++) {
+        const uint64_t index = q * 997;
+        auto expected = router.process_command(std::format("KNN L2 {} #{} {}", count, index, GeneratedFile));
+        ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+        auto actual = router.process_command(std::format("ANN_HNSW {} 64 #{} {}", count, index, GeneratedFile));
+        ASSERT_EQ(0, actual) << "ERROR: " << actual.message();
+
+        const auto expected_tags = split(expected.message());
+        const auto actual_tags = split(actual.message());
+        ASSERT_EQ(count, actual_tags.size());
+        for (const auto& tag : actual_tags) {
+            found += expected_tags.count(tag);
+        }
+    }
+
+    const double recall = static_cast<double>(found) / (queries_count * count);
+    ASSERT_GT(recall, 0.95) << "Recall: " << recall;
+}
+
+TEST(IVF, PostingLists) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 10'000;
+    const uint64_t clusters_count = 16;
+    const uint64_t delta_start_from = 50'001;
+    const uint64_t delta_count = 100;
+    const std::string delta_file = std::string(GeneratedFile) + ".delta";
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+        unlink(delta_file.c_str());
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("MAKE_IVF {} 4096 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // Every record lands in exactly one list, ascending within the list.
+    uint64_t total_count = 0;
+    for (uint64_t node = 0; node < nodes; node++) {
+        PostingLists postings;
+        ret = postings.init(std::format("{}/test/ds/node_{}/index_1/postings", Path, node));
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+        ASSERT_EQ(clusters_count, postings.clusters_count());
+
+        for (uint32_t cluster_id = 0; cluster_id < clusters_count; cluster_id++) {
+            const auto list = postings.get(cluster_id);
+            ASSERT_TRUE(std::is_sorted(list.begin(), list.end()));
+            total_count += list.size();
+        }
+        ASSERT_TRUE(postings.get(clusters_count).empty());
+    }
+    ASSERT_EQ(data_count, total_count);
+
+    ret = router.process_command(std::format("ANN 4 4 #{} {}", 500, GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("499, 500, 502, 503, ", ret.message());
+
+    // Records loaded after the index was written are found through the LMDB delta.
+    ret = router.process_command(std::format("GENERATE {} {} {} {}", delta_file, delta_count, dim, delta_start_from));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = router.process_command(std::format("LOAD {}", delta_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("ANN 4 {} #{} {}", clusters_count, 10, delta_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("50009, 50010, 50012, 50013, ", ret.message());
+}
+
+TEST(IVF, RebalanceOnLoad) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 10'000;
+    const uint64_t clusters_count = 16;
+    const uint64_t delta_start_from = 50'001;
+    const uint64_t delta_count = 5'000;
+    const std::string delta_file = std::string(GeneratedFile) + ".delta";
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+        unlink(delta_file.c_str());
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("MAKE_IVF {} 4096 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command("MAKE_RESIDUAL 4096");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = router.process_command("MAKE_PQ_CENTROIDS 2");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    const std::string knn = std::format("KNN L2 4 #{} {}", 500, GeneratedFile);
+    const auto expected = router.process_command(knn);
+    ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+    // Queries keep running while LOAD rebalances and switches the index.
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> errors_count{0};
+    std::atomic<uint64_t> queries_count{0};
+    std::thread reader([&] {
+        CommandRouter reader_router(dts.engine());
+        auto _ = reader_router.init();
+        _ = reader_router.process_command("USE test.ds;");
+        while (!stop) {
+            auto res = reader_router.process_command(knn);
+            auto ann = reader_router.process_command(std::format("ANN 4 4 #{} {}", 500, GeneratedFile));
+            if (res != 0 || res.message() != expected.message() || ann != 0) {
+                errors_count++;
+            }
+            queries_count++;
+        }
+    });
+
+    // All the new records fall into the cluster at the end of the line, LOAD splits it into a new index.
+    ret = router.process_command(std::format("GENERATE {} {} {} {}", delta_file, delta_count, dim, delta_start_from));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = router.process_command(std::format("LOAD {}", delta_file));
+    stop = true;
+    reader.join();
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(0, errors_count);
+    ASSERT_LT(0, queries_count);
+
+    const std::string index_path = std::string(Path) + "/test/ds/index_2";
+    Centroids centroids;
+    ret = centroids.init(index_path + "/centroids");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_GT(centroids.centroids_count(), clusters_count);
+
+    std::vector<uint64_t> sizes(centroids.centroids_count(), 0);
+    uint64_t total_count = 0;
+    for (uint64_t node = 0; node < nodes; node++) {
+        PostingLists postings;
+        ret = postings.init(std::format("{}/test/ds/node_{}/index_2/postings", Path, node));
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+        ASSERT_EQ(centroids.centroids_count(), postings.clusters_count());
+
+        for (uint32_t cluster_id = 0; cluster_id < postings.clusters_count(); cluster_id++) {
+            sizes[cluster_id] += postings.get(cluster_id).size();
+            total_count += postings.get(cluster_id).size();
+        }
+    }
+    ASSERT_EQ(data_count + delta_count, total_count);
+
+    const double mean_size = static_cast<double>(total_count) / centroids.centroids_count();
+    for (const auto size : sizes) {
+        ASSERT_LT(size, 3.0 * mean_size);
+    }
+
+    ret = router.process_command(std::format("ANN 4 4 #{} {}", 10, delta_file));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("50009, 50010, 50012, 50013, ", ret.message());
+
+    ret = router.process_command(std::format("ANN 4 4 #{} {}", 500, GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("499, 500, 502, 503, ", ret.message());
+
+    // The PQ codebooks are carried over to the rebalanced index and dropped with the centroids by MAKE_IVF.
+    auto ds = router.dcp().current_dataset();
+    ASSERT_EQ(2, ds->metadata().pq_count);
+    ASSERT_TRUE(std::filesystem::exists(index_path + "/pq_centroids_1"));
+    ret = router.process_command("DUMP_IVF");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("MAKE_IVF {} 4096 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(0, ds->metadata().pq_count);
+    ret = router.process_command("DUMP_IVF");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+}
+
+TEST(IVF, AdaptiveProbes) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 20'000;
+    const uint64_t clusters_count = 64;
+    const uint64_t nprobes = 32;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("MAKE_IVF {} 8192 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("ANN 4 {} #{} {} EXHAUSTIVE", nprobes, 500, GeneratedFile));
+    ASSERT_NE(0, ret);
+
+    // Same results as the fixed nprobes, from a fraction of the lists.
+    for (uint64_t index = 500; index < data_count; index += 1500) {
+        auto expected = router.process_command(std::format("ANN 4 {} #{} {}", nprobes, index, GeneratedFile));
+        ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+        auto actual = router.process_command(std::format("ANN 4 {} #{} {} ADAPTIVE", nprobes, index, GeneratedFile));
+        ASSERT_EQ(0, actual) << "ERROR: " << actual.message();
+
+        const auto& message = actual.message();
+        const auto pos = message.find("\nlists scanned: ");
+        ASSERT_NE(std::string::npos, pos) << message;
+        ASSERT_EQ(expected.message(), message.substr(0, pos));
+
+        uint64_t scanned_count = 0;
+        uint64_t total_count = 0;
+        ASSERT_EQ(2, sscanf(message.c_str() + pos, "\nlists scanned: %lu of %lu", &scanned_count, &total_count));
+        ASSERT_EQ(nprobes * nodes, total_count);
+        ASSERT_LT(scanned_count, total_count / 4);
+    }
+
+    // A cancelled query stops probing, with or without adaptive probes
+    for (const char* mode : { "", "ADAPTIVE" }) {
+        QueryContext cancelled;
+        cancelled.cancel();
+        ret = router.process_command(std::format("ANN 4 {} #{} {} {}", nprobes, 500, GeneratedFile, mode), &cancelled);
+        ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+        ASSERT_NE(std::string::npos, ret.message().find("partial: cancelled")) << ret.message();
+    }
+}
+
+TEST(IVF, QueryParallelAnn) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 2;
+    const uint64_t data_count = 10'000;
+    const uint64_t clusters_count = 32;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("MAKE_IVF {} 4096 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // Probing every cluster over work units of both nodes gives the exact neighbours.
+    dts.engine().start_tread_pool(8);
+    for (uint64_t index = 0; index < data_count; index += 999) {
+        auto expected = router.process_command(std::format("KNN L2 4 #{} {}", index, GeneratedFile));
+        ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+        auto actual = router.process_command(std::format("ANN 4 {} #{} {}", clusters_count, index, GeneratedFile));
+        ASSERT_EQ(0, actual) << "ERROR: " << actual.message();
+        ASSERT_EQ(expected.message(), actual.message());
+    }
+}
+
+TEST(IVF, ParallelIndexWrite) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t data_count = 40'000;
+    const uint64_t clusters_count = 32;
+
+    // A single node, its records are assigned in several morsels on the pool.
+    DmlTestSettings dts(dim, 1);
+    CommandRouter& router = dts.router();
+    dts.engine().start_tread_pool(8);
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("MAKE_IVF {} 4096 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // The merged morsels give ascending lists, and statistics that match them.
+    PostingLists postings;
+    ret = postings.init(std::format("{}/test/ds/node_0/index_1/postings", Path));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ClusterStats stats;
+    ret = stats.read(std::format("{}/test/ds/node_0/index_1/cluster_stats", Path));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(clusters_count, stats.clusters_count());
+
+    std::set<uint32_t> record_ids;
+    for (uint32_t cluster_id = 0; cluster_id < clusters_count; cluster_id++) {
+        const auto list = postings.get(cluster_id);
+        ASSERT_TRUE(std::is_sorted(list.begin(), list.end()));
+        ASSERT_EQ(stats.size(cluster_id), list.size());
+        record_ids.insert(list.begin(), list.end());
+    }
+    ASSERT_EQ(data_count, record_ids.size());
+    ASSERT_EQ(data_count - 1, *record_ids.rbegin());
+
+    for (uint64_t index = 0; index < data_count; index += 4999) {
+        auto expected = router.process_command(std::format("KNN L2 4 #{} {}", index, GeneratedFile));
+        ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+        auto actual = router.process_command(std::format("ANN 4 {} #{} {}", clusters_count, index, GeneratedFile));
+        ASSERT_EQ(0, actual) << "ERROR: " << actual.message();
+        ASSERT_EQ(expected.message(), actual.message());
+    }
+}
+
+TEST(IVF, IndexSwitchAlongWithQueries) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 10'000;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    dts.engine().start_tread_pool(4);
+    const auto expected = router.process_command(std::format("KNN L2 4 #{} {}", 500, GeneratedFile));
+    ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+    // Queries of another client run on the nodes of one index or the other while the indexes are switched.
+    CommandRouter query_router(dts.engine());
+    ASSERT_EQ(0, query_router.init());
+    ret = query_router.process_command("USE test.ds;");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    std::atomic<bool> built{false};
+    uint64_t queries_count = 0;
+    std::thread querier([&] {
+        while (!built) {
+            auto actual = query_router.process_command(std::format("KNN L2 4 #{} {}", 500, GeneratedFile));
+            EXPECT_EQ(0, actual) << "ERROR: " << actual.message();
+            EXPECT_EQ(expected.message(), actual.message());
+            queries_count++;
+        }
+    });
+
+    for (uint64_t i = 0; i < 3; i++) {
+        ret = router.process_command("MAKE_IVF 16 4096 8");
+        EXPECT_EQ(0, ret) << "ERROR: " << ret.message();
+    }
+    built = true;
+    querier.join();
+    ASSERT_LT(0, queries_count);
+
+    ret = router.process_command(std::format("ANN 4 16 #{} {}", 500, GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(expected.message(), ret.message());
+}
+
+TEST(IVF, BackgroundIndexBuild) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 10'000;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    dts.engine().start_tread_pool(4);
+    ret = router.process_command("BUILD_STATUS");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ("No index build has run", ret.message());
+
+    ret = router.process_command("MAKE_IVF 16 4096 8");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    const auto expected = router.process_command(std::format("KNN L2 4 #{} {}", 500, GeneratedFile));
+    ASSERT_EQ(0, expected) << "ERROR: " << expected.message();
+
+    // Another client keeps querying index 1 while index 2 is built, then index 2
+    CommandRouter query_router(dts.engine());
+    ASSERT_EQ(0, query_router.init());
+    ret = query_router.process_command("USE test.ds;");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    std::atomic<bool> built{false};
+    uint64_t queries_count = 0;
+    std::thread querier([&] {
+        while (!built) {
+            auto actual = query_router.process_command(std::format("ANN 4 8 #{} {}", 500, GeneratedFile));
+            EXPECT_EQ(0, actual) << "ERROR: " << actual.message();
+            actual = query_router.process_command(std::format("KNN L2 4 #{} {}", 500, GeneratedFile));
+            EXPECT_EQ(expected.message(), actual.message());
+            queries_count++;
+        }
+    });
+
+    ret = router.process_command("MAKE_IVF 32 4096 8 FULL ASYNC");
+    EXPECT_EQ(0, ret) << "ERROR: " << ret.message();
+    EXPECT_EQ("Index build MAKE_IVF started", ret.message());
+
+    ret = router.process_command("BUILD_STATUS");
+    EXPECT_EQ(0, ret) << "ERROR: " << ret.message();
+    EXPECT_EQ(0, ret.message().find("build: MAKE_IVF\n")) << ret.message();
+
+    ret = router.process_command("BUILD_STATUS WAIT");
+    EXPECT_EQ(0, ret) << "ERROR: " << ret.message();
+    EXPECT_EQ("build: MAKE_IVF\nfinished", ret.message());
+
+    built = true;
+    querier.join();
+    ASSERT_LT(0, queries_count);
+
+    ret = router.process_command("IVF_STATS");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(0, ret.message().find("index: 2\nclusters: 32\n")) << ret.message();
+
+    // A failed background build is reported, the index stays in place
+    ret = router.process_command("MAKE_IVF 0 4096 8 ASYNC");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = router.process_command("BUILD_STATUS WAIT");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(0, ret.message().find("build: MAKE_IVF\nfailed")) << ret.message();
+
+    ret = router.process_command(std::format("ANN 4 32 #{} {}", 500, GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(expected.message(), ret.message());
+
+    // A cancelled build stops between its k-means iterations, the index stays in place
+    ret = router.process_command("MAKE_IVF 32 4096 1000000 FULL ASYNC");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    // The other builds are refused while it runs
+    for (const auto* command : {"MAKE_PQ_CENTROIDS 2", "MAKE_RESIDUAL 4096", "MAKE_HNSW", "MAKE_IVF_2L 4 4 4096 2"}) {
+        ret = router.process_command(command);
+        ASSERT_NE(0, ret) << command;
+        ASSERT_EQ("Another index build is running", ret.message()) << command;
+    }
+    ret = router.dcp().current_dataset()->make_pq_centroids(2, 256);
+    ASSERT_NE(0, ret);
+    ASSERT_EQ("Another index build is running", ret.message());
+
+    router.dcp().current_dataset()->cancel_build();
+    ret = router.process_command("BUILD_STATUS WAIT");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_NE(std::string::npos, ret.message().find("Index build cancelled")) << ret.message();
+
+    ret = router.process_command("IVF_STATS");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(0, ret.message().find("index: 2\n")) << ret.message();
+
+    // A build cancelled while it writes the index leaves no partial index 3 behind, the next build writes it
+    const std::string next_index_path = std::string(Path) + "/test/ds/index_3";
+    auto ds = router.dcp().current_dataset();
+    IvfBuilder builder(ds->metadata().type, dim, 32, 4096);
+    ASSERT_EQ(0, builder.init());
+    ASSERT_EQ(0, ds->sample_records(builder));
+    ASSERT_EQ(0, ds->init_centroids_kmeans_plus_plus(builder));
+    ds->cancel_build();
+    ret = ds->write_index(builder, dts.engine().thread_pool(PoolKind::build));
+    ASSERT_NE(0, ret);
+    ASSERT_EQ("Index build cancelled", ret.message());
+    ASSERT_FALSE(std::filesystem::exists(next_index_path));
+
+    ret = router.process_command("MAKE_IVF 32 4096 8");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ret = router.process_command("IVF_STATS");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(0, ret.message().find("index: 3\n")) << ret.message();
+
+    ret = router.process_command("MAKE_IVF 32 4096 8 LATER");
+    ASSERT_NE(0, ret);
+}
+
+TEST(IVF, OpqRotation) {
+    const uint64_t dim = 8;
+    const uint64_t chunk_count = 2;
+    const uint64_t pq_centroids_count = 16;
+    const uint64_t records_count = 4'000;
+
+    // Correlated data: independent components of decreasing variance mixed by a random orthogonal matrix,
+    // so the high variance directions are spread over both PQ chunks.
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    std::vector<double> mixing(dim * dim);
+    for (auto& value : mixing) {
+        value = normal(gen);
+    }
+    for (uint64_t i = 0; i < dim; i++) {
+        for (uint64_t k = 0; k < i; k++) {
+            double dot = 0.0;
+            for (uint64_t j = 0; j < dim; j++) {
+                dot += mixing[i * dim + j] * mixing[k * dim + j];
+            }
+            for (uint64_t j = 0; j < dim; j++) {
+                mixing[i * dim + j] -= dot * mixing[k * dim + j];
+            }
+        }
+        double norm = 0.0;
+        for (uint64_t j = 0; j < dim; j++) {
+            norm += mixing[i * dim + j] * mixing[i * dim + j];
+        }
+        for (uint64_t j = 0; j < dim; j++) {
+            mixing[i * dim + j] /= std::sqrt(norm);
+        }
+    }
+
+    std::vector<float> records(records_count * dim, 0.0f);
+    for (uint64_t n = 0; n < records_count; n++) {
+        for (uint64_t i = 0; i < dim; i++) {
+            const float component = normal(gen) * 8.0f / (i + 1);
+            for (uint64_t j = 0; j < dim; j++) {
+                records[n * dim + j] += component * mixing[i * dim + j];
+            }
+        }
+    }
+
+    ThreadPool pool(4);
+    std::vector<float> matrix;
+    std::vector<double> errors;
+    auto ret = OpqRotation::train(DatasetType::f32, dim, chunk_count, pq_centroids_count,
+                                  reinterpret_cast<const uint8_t*>(records.data()), dim * sizeof(float), records_count,
+                                  OpqParams(), matrix, &errors, &pool);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(OpqParams().iterations, errors.size());
+    ASSERT_LT(errors.back(), errors.front());
+
+    // R R^T = I
+    for (uint64_t i = 0; i < dim; i++) {
+        for (uint64_t k = 0; k < dim; k++) {
+            double dot = 0.0;
+            for (uint64_t j = 0; j < dim; j++) {
+                dot += matrix[i * dim + j] * matrix[k * dim + j];
+            }
+            ASSERT_NEAR(i == k ? 1.0 : 0.0, dot, 1e-4);
+        }
+    }
+
+    const std::string path = "/tmp/opq_rotation_test";
+    ret = OpqRotation::write(path, dim, matrix);
+    std::experimental::scope_exit remover([&] {
+        unlink(path.c_str());
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    OpqRotation rotation;
+    ret = rotation.init(path);
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+    ASSERT_EQ(dim, rotation.dim());
+    ASSERT_EQ(matrix, rotation.matrix());
+
+    // The rotation keeps distances, so it applies to both residuals and queries.
+    std::vector<float> rotated(dim);
+    for (uint64_t n = 0; n < records_count; n += 97) {
+        const float* record = records.data() + n * dim;
+        rotation.apply(DatasetType::f32, reinterpret_cast<const uint8_t*>(record), reinterpret_cast<uint8_t*>(rotated.data()));
+
+        double norm = 0.0;
+        double rotated_norm = 0.0;
+        for (uint64_t j = 0; j < dim; j++) {
+            norm += record[j] * record[j];
+            rotated_norm += rotated[j] * rotated[j];
+        }
+        ASSERT_NEAR(norm, rotated_norm, 1e-3 * norm + 1e-6);
+    }
+}
+
+TEST(IVF, ResidualChunks) {
+    const uint64_t dim = 8;
+    const uint64_t chunk_count = 4;
+    const uint64_t count = 100;
+    const uint64_t record_size = dim * sizeof(float);
+
+    ResidualChunks residuals;
+    residuals.init(record_size, chunk_count, count);
+    ASSERT_EQ(chunk_count, residuals.chunk_count());
+    ASSERT_EQ(record_size / chunk_count, residuals.chunk_size());
+
+    std::vector<float> record(dim);
+    for (uint64_t n = 0; n < count; n++) {
+        for (uint64_t j = 0; j < dim; j++) {
+            record[j] = n * dim + j;
+        }
+        residuals.scatter(n, reinterpret_cast<const uint8_t*>(record.data()));
+    }
+
+    // Every chunk holds its own dimensions of all residuals back to back.
+    const uint64_t chunk_dim = dim / chunk_count;
+    for (uint64_t c = 0; c < chunk_count; c++) {
+        const float* chunk = reinterpret_cast<const float*>(residuals.chunk(c));
+        for (uint64_t n = 0; n < count; n++) {
+            for (uint64_t j = 0; j < chunk_dim; j++) {
+                ASSERT_EQ(n * dim + c * chunk_dim + j, chunk[n * chunk_dim + j]);
+            }
+        }
+    }
+
+    residuals.gather(42, reinterpret_cast<uint8_t*>(record.data()));
+    for (uint64_t j = 0; j < dim; j++) {
+        ASSERT_EQ(42 * dim + j, record[j]);
+    }
+}
+
+TEST(IVF, ClusterStats) {
+    const uint64_t test_data_start_from = 1;
+    const uint64_t dim = 8;
+    const uint64_t nodes = 4;
+    const uint64_t data_count = 20'000;
+    const uint64_t clusters_count = 64;
+
+    DmlTestSettings dts(dim, nodes);
+    CommandRouter& router = dts.router();
+
+    auto ret = router.process_command(std::format("GENERATE {} {} {} {}", GeneratedFile, data_count, dim, test_data_start_from));
+    std::experimental::scope_exit closer([&] {
+        unlink(GeneratedFile);
+    });
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command(std::format("LOAD {}", GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command("IVF_STATS");
+    ASSERT_NE(0, ret);
+
+    ret = router.process_command(std::format("MAKE_IVF {} 8192 8", clusters_count));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    ret = router.process_command("IVF_STATS");
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    const auto& message = ret.message();
+    uint64_t index_id = 0;
+    uint64_t stats_clusters_count = 0;
+    uint64_t records_count = 0;
+    double imbalance_factor = 0.0;
+    double mse = -1.0;
+    ASSERT_EQ(5, sscanf(message.c_str(), "index: %lu\nclusters: %lu\nrecords: %lu\nimbalance factor: %lf\nquantization mse: %lf",
+                        &index_id, &stats_clusters_count, &records_count, &imbalance_factor, &mse)) << message;
+    ASSERT_EQ(1u, index_id);
+    ASSERT_EQ(clusters_count, stats_clusters_count);
+    ASSERT_EQ(data_count, records_count);
+    ASSERT_GE(imbalance_factor, 1.0);
+    ASSERT_GE(mse, 0.0);
+    ASSERT_NE(std::string::npos, message.find("largest lists:")) << message;
+
+    // The planner predicts the records of the probed lists from the statistics.
+    ret = router.process_command(std::format("ANN 4 {} #{} {} ADAPTIVE", clusters_count, 500, GeneratedFile));
+    ASSERT_EQ(0, ret) << "ERROR: " << ret.message();
+
+    uint64_t predicted_records = 0;
+    const auto pos = ret.message().find("\npredicted records: ");
+    ASSERT_NE(std::string::npos, pos) << ret.message();
+    ASSERT_EQ(1, sscanf(ret.message().c_str() + pos, "\npredicted records: %lu", &predicted_records));
+    ASSERT_EQ(data_count, predicted_records);
 }
@@ -4,9 +4,11 @@
 #include "log.h"
 #include "gtest/gtest.h"
 
+#include <atomic>
 #include <experimental/scope>
 #include <filesystem>
 #include <thread>
+#include <vector>
 
 #include <sys/stat.h>
 
@@ -808,7 +810,7 @@ TEST(LMDB, Lmdb) {
         uint32_t record_id_check = 0;
         for (uint64_t tag = 1; tag <= 12; tag++, record_id_check++) {
             uint32_t record_id = 0;
-            uint16_t cluster_id = 0;
+            uint32_t cluster_id = 0;
             
             iret = reader->read_record(tag, record_id, cluster_id);
             ASSERT_EQ(0, iret);
@@ -840,7 +842,7 @@ TEST(LMDB, LmdbExt) {
 
         uint32_t record_id = 0;
         for (uint64_t tag = 1; tag <= 12; tag++, record_id++) {
-            uint16_t cluster_id = (uint16_t)(tag <= 6 ? 0 : 1);
+            uint32_t cluster_id = (uint32_t)(tag <= 6 ? 0 : 1);
             iret = writer->write_record(tag, record_id, cluster_id);
             ASSERT_EQ(0, iret);
         }
@@ -856,8 +858,8 @@ TEST(LMDB, LmdbExt) {
         uint32_t record_id_check = 0;
         for (uint64_t tag = 1; tag <= 12; tag++, record_id_check++) {
             uint32_t record_id = 0;
-            uint16_t cluster_id = 0;
-            uint16_t cluster_id_check = tag <= 6 ? 0 : 1;
+            uint32_t cluster_id = 0;
+            uint32_t cluster_id_check = tag <= 6 ? 0 : 1;
             
             iret = reader->read_record(tag, record_id, cluster_id);
             ASSERT_EQ(0, iret);
@@ -871,7 +873,7 @@ TEST(LMDB, LmdbExt) {
         ASSERT_TRUE(reader);
 
         uint32_t record_id_check = 0;
-        for (uint16_t cluster_id = 0; cluster_id <= 1; cluster_id++) {
+        for (uint32_t cluster_id = 0; cluster_id <= 1; cluster_id++) {
             iret = reader->open_cursor(cluster_id);
             ASSERT_EQ(0, iret);
 
@@ -887,4 +889,71 @@ TEST(LMDB, LmdbExt) {
             reader->close_cursor();
         }
     }
-}
\ No newline at end of file
+}
+TEST(LMDB, ReadTxnReuse) {
+    const char* dir = "/tmp/lmdb_ex_test";
+    std::filesystem::remove_all(dir);
+    mkdir(dir, 0755);
+    std::experimental::scope_exit dir_deleter([&] {
+        std::filesystem::remove_all(dir);
+    });
+
+    LmdbEnv lmdb_env(dir);
+    ASSERT_EQ(0, lmdb_env.init());
+    ASSERT_EQ(0, lmdb_env.create_db());
+
+    auto write = [&](uint64_t tag) {
+        auto writer = lmdb_env.open_db(LmdbMode::Write);
+        ASSERT_TRUE(writer);
+        ASSERT_EQ(0, writer->write_record(tag, static_cast<uint32_t>(tag), 0));
+        ASSERT_EQ(0, writer->commit());
+    };
+
+    // A renewed transaction sees the records committed after it was reset.
+    for (uint64_t tag = 1; tag <= 4; tag++) {
+        write(tag);
+
+        auto reader = lmdb_env.open_db(LmdbMode::Read);
+        ASSERT_TRUE(reader);
+        uint32_t record_id = 0;
+        uint32_t cluster_id = InvalidClusterId;
+        ASSERT_EQ(0, reader->read_record(tag, record_id, cluster_id));
+        ASSERT_EQ(tag, record_id);
+        ASSERT_EQ(0, cluster_id);
+    }
+
+    // More concurrent readers than the former limit of 16. Every thread opens several readers in turn,
+    // renewing the transactions put back to the thread slots and to the free list.
+    const size_t threads_count = 32;
+    const uint64_t rounds_count = 4;
+    std::atomic<size_t> opened_count = 0;
+    std::atomic<size_t> found_count = 0;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threads_count; i++) {
+        threads.emplace_back([&] {
+            for (uint64_t round = 0; round < rounds_count; round++) {
+                auto reader = lmdb_env.open_db(LmdbMode::Read);
+                opened_count++;
+                while (opened_count < threads_count * (round + 1)) {
+                    std::this_thread::yield();
+                }
+
+                if (!reader) {
+                    continue;
+                }
+
+                uint32_t record_id = 0;
+                uint32_t cluster_id = InvalidClusterId;
+                if (reader->read_record(4, record_id, cluster_id) == 0 && record_id == 4) {
+                    found_count++;
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ASSERT_EQ(threads_count * rounds_count, found_count);
+}
@@ -1,8 +1,15 @@
 #include "math.h"
+#include "assigner.h"
+#include "binary_codes.h"
 #include "vector"
 #include "log.h"
 #include "gtest/gtest.h"
 
+#include <experimental/scope>
+#include <filesystem>
+#include <random>
+#include <unistd.h>
+
 using namespace sketch;
 
 TEST(MATH, L1) {
@@ -88,3 +95,135 @@ TEST(MATH, Cosine) {
         ASSERT_NEAR(1.0, dist, 0.001);
     }
 }
+
+TEST(MATH, CentroidAssigner) {
+    const size_t dim = 300;
+    const size_t centroids_count = 37;
+    const size_t records_count = 150;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dis(-100.0f, 100.0f);
+
+    std::vector<float> centroids(centroids_count * dim);
+    for (auto& v : centroids) v = dis(gen);
+
+    std::vector<float> records(records_count * dim);
+    for (auto& v : records) v = dis(gen);
+
+    CentroidAssigner assigner;
+    ASSERT_EQ(0, assigner.init(DatasetType::f32, dim, reinterpret_cast<const uint8_t*>(centroids.data()),
+                               dim * sizeof(float), centroids_count));
+
+    std::vector<const uint8_t*> record_ptrs(records_count);
+    for (size_t i = 0; i < records_count; i++) {
+        record_ptrs[i] = reinterpret_cast<const uint8_t*>(records.data() + i * dim);
+    }
+
+    std::vector<uint32_t> cluster_ids(records_count);
+    assigner.find_nearest(record_ptrs.data(), records_count, cluster_ids.data());
+
+    for (size_t i = 0; i < records_count; i++) {
+        uint32_t expected = 0;
+        double min_dist = std::numeric_limits<double>::max();
+        for (size_t j = 0; j < centroids_count; j++) {
+            double dist = distance_L2_square(records.data() + i * dim, centroids.data() + j * dim, dim);
+            if (dist < min_dist) {
+                min_dist = dist;
+                expected = j;
+            }
+        }
+
+        ASSERT_EQ(expected, cluster_ids[i]);
+        ASSERT_EQ(expected, assigner.find_nearest(record_ptrs[i]));
+    }
+}
+
+TEST(MATH, HammingBinaryCodes) {
+    const size_t dim = 1000;
+    const uint64_t words = BinaryCodes::words_count(dim);
+    ASSERT_EQ(16u, words);
+
+    std::vector<float> a(dim);
+    std::vector<float> b(dim);
+    uint64_t expected = 0;
+    for (size_t i = 0; i < dim; i++) {
+        a[i] = (i % 3 == 0) ? -1.0f : 1.0f;
+        b[i] = (i % 5 == 0) ? -1.0f : 1.0f;
+        expected += (a[i] > 0) != (b[i] > 0) ? 1 : 0;
+    }
+
+    std::vector<uint64_t> code_a(words);
+    std::vector<uint64_t> code_b(words);
+    BinaryCodes::encode(DatasetType::f32, dim, reinterpret_cast<const uint8_t*>(a.data()), code_a.data());
+    BinaryCodes::encode(DatasetType::f32, dim, reinterpret_cast<const uint8_t*>(b.data()), code_b.data());
+
+    ASSERT_EQ(expected, hamming_distance(code_a.data(), code_b.data(), words));
+    ASSERT_EQ(0u, hamming_distance(code_a.data(), code_a.data(), words));
+
+    // Every variant the CPU runs counts the same, including a tail shorter than a vector.
+    std::mt19937_64 gen(7);
+    std::vector<uint64_t> x(19);
+    std::vector<uint64_t> y(19);
+    for (size_t i = 0; i < x.size(); i++) {
+        x[i] = gen();
+        y[i] = gen();
+    }
+
+    const uint64_t generic = hamming_distance_generic(x.data(), y.data(), x.size());
+    ASSERT_EQ(generic, hamming_distance(x.data(), y.data(), x.size()));
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("popcnt")) {
+        ASSERT_EQ(generic, hamming_distance_popcnt(x.data(), y.data(), x.size()));
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        ASSERT_EQ(generic, hamming_distance_avx512(x.data(), y.data(), x.size()));
+    }
+#endif
+}
+
+TEST(MATH, BinaryCodesCopyOnWrite) {
+    const uint64_t dim = 96;
+    const uint64_t count = 3 * BinaryCodes::ChunkRecords + 100;
+    const std::string path = "/tmp/utest_codes.bin";
+    std::experimental::scope_exit remover([&] {
+        unlink(path.c_str());
+    });
+
+    // Record i has its first i % dim dimensions positive
+    auto record = [](uint64_t i, float sign) {
+        std::vector<float> data(dim, -1.0f);
+        for (uint64_t j = 0; j < i % dim; j++) {
+            data[j] = sign;
+        }
+        return data;
+    };
+
+    BinaryCodes codes;
+    codes.init(dim);
+    for (uint64_t i = 0; i < count; i++) {
+        codes.set(i, DatasetType::f32, reinterpret_cast<const uint8_t*>(record(i, 1.0f).data()));
+    }
+    ASSERT_EQ(0, codes.write(path));
+
+    // The copy shares the chunks it does not change: one record of chunk 1 and a new tail record
+    BinaryCodes copy(codes);
+    const uint64_t changed_id = BinaryCodes::ChunkRecords + 5;
+    copy.set(changed_id, DatasetType::f32, reinterpret_cast<const uint8_t*>(record(changed_id + 1, 1.0f).data()));
+    copy.set(count, DatasetType::f32, reinterpret_cast<const uint8_t*>(record(count, 1.0f).data()));
+    ASSERT_EQ(count + 1, copy.count());
+    ASSERT_EQ(count, codes.count());
+    ASSERT_EQ(codes.get(0), copy.get(0));
+    ASSERT_EQ(codes.get(2 * BinaryCodes::ChunkRecords), copy.get(2 * BinaryCodes::ChunkRecords));
+    ASSERT_NE(codes.get(changed_id), copy.get(changed_id));
+    ASSERT_NE(0, memcmp(codes.get(changed_id), copy.get(changed_id), copy.words() * sizeof(uint64_t)));
+
+    ASSERT_EQ(0, copy.write_changes(path));
+    ASSERT_EQ((3 + (count + 1) * copy.words()) * sizeof(uint64_t), std::filesystem::file_size(path));
+
+    BinaryCodes read_codes;
+    ASSERT_EQ(0, read_codes.read(path));
+    ASSERT_EQ(copy.count(), read_codes.count());
+    for (uint64_t i = 0; i < copy.count(); i++) {
+        ASSERT_EQ(0, memcmp(copy.get(i), read_codes.get(i), copy.words() * sizeof(uint64_t))) << i;
+    }
+}
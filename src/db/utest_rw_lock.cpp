@@ -0,0 +1,175 @@
+#include "rw_lock.h"
+#include "log.h"
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace sketch;
+
+TEST(RW_LOCK, ShardedExclusiveWriter) {
+    ShardedRWLock lock;
+    std::atomic<int64_t> readers_inside{0};
+    std::atomic<bool> writer_inside{false};
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> violations{0};
+    std::atomic<uint64_t> reads_count{0};
+
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < 8; i++) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                const ShardedReadGuard guard(lock);
+                readers_inside.fetch_add(1);
+                if (writer_inside) {
+                    violations++;
+                }
+                readers_inside.fetch_sub(1);
+                reads_count++;
+            }
+        });
+    }
+
+    for (size_t i = 0; i < 200; i++) {
+        const WriteGuard guard(lock);
+        writer_inside = true;
+        if (readers_inside != 0) {
+            violations++;
+        }
+        std::this_thread::yield();
+        writer_inside = false;
+    }
+
+    stop = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    ASSERT_EQ(0, violations);
+    ASSERT_LT(0, reads_count);
+}
+
+TEST(RW_LOCK, ShardedSynchronize) {
+    struct Object {
+        std::atomic<uint64_t> value;
+    };
+
+    ShardedRWLock lock;
+    std::atomic<Object*> published{new Object{1}};
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> violations{0};
+
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < 8; i++) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                const ShardedReadGuard guard(lock);
+                const Object* object = published.load(std::memory_order_seq_cst);
+                for (size_t j = 0; j < 16; j++) {
+                    if (object->value == 0) {
+                        violations++;
+                    }
+                }
+            }
+        });
+    }
+
+    // A replaced object is retired after the grace period, no reader may still see it.
+    std::vector<std::unique_ptr<Object>> retired;
+    for (uint64_t i = 2; i < 500; i++) {
+        Object* previous = published.exchange(new Object{i}, std::memory_order_seq_cst);
+        lock.synchronize();
+        previous->value = 0;
+        retired.emplace_back(previous);
+    }
+
+    stop = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    delete published.load();
+
+    ASSERT_EQ(0, violations);
+}
+
+TEST(RW_LOCK, ShardedSynchronizeSlowReader) {
+    ShardedRWLock lock;
+    std::atomic<int> published{1};
+
+    // The reader is held between reading the epoch and counting itself while the first grace period ends.
+    std::promise<void> epoch_read;
+    std::promise<void> first_synchronized;
+    std::atomic<bool> hooked{false};
+    lock.set_epoch_read_hook([&] {
+        if (!hooked.exchange(true)) {
+            epoch_read.set_value();
+            first_synchronized.get_future().wait();
+        }
+    });
+
+    std::promise<int> read_value;
+    std::promise<void> reader_done;
+    auto reader_release = reader_done.get_future();
+    std::thread reader([&] {
+        const ShardedReadGuard guard(lock);
+        read_value.set_value(published.load());
+        reader_release.wait();
+    });
+
+    epoch_read.get_future().wait();
+    lock.synchronize();
+    published = 2;
+    first_synchronized.set_value();
+
+    auto value = read_value.get_future();
+    ASSERT_EQ(2, value.get());
+
+    // The object the reader holds is unpublished, the second grace period waits for the reader.
+    published = 3;
+    auto synchronized = std::async(std::launch::async, [&] {
+        lock.synchronize();
+    });
+    ASSERT_EQ(std::future_status::timeout, synchronized.wait_for(std::chrono::milliseconds(100)));
+
+    reader_done.set_value();
+    synchronized.wait();
+    reader.join();
+}
+
+TEST(RW_LOCK, ShardedReadersShareShards) {
+    ShardedRWLock lock;
+    ASSERT_LE(64u, lock.shards_count());
+
+    // More readers than shards, each holds the lock until it is released
+    const size_t readers_count = 2 * lock.shards_count() + 3;
+    std::atomic<size_t> inside_count{0};
+    std::vector<std::atomic<bool>> released(readers_count);
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < readers_count; i++) {
+        readers.emplace_back([&, i] {
+            const ShardedReadGuard guard(lock);
+            inside_count++;
+            while (!released[i]) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    while (inside_count != readers_count) {
+        std::this_thread::yield();
+    }
+
+    // The writer waits for every reader, also for the ones counted in a shared shard
+    auto writer = std::async(std::launch::async, [&] {
+        const WriteGuard guard(lock);
+    });
+    for (size_t i = 0; i < readers_count; i++) {
+        ASSERT_EQ(std::future_status::timeout, writer.wait_for(std::chrono::milliseconds(i + 1 < readers_count ? 0 : 20)));
+        released[i] = true;
+        readers[i].join();
+    }
+    ASSERT_EQ(std::future_status::ready, writer.wait_for(std::chrono::seconds(10)));
+}
@@ -272,4 +272,76 @@ TEST(STORAGE, HitUpperLimit) {
 
     unlink(path.c_str());
     unlink(path_info.c_str());
-}
\ No newline at end of file
+}
+
+TEST(STORAGE, Snapshot) {
+    const std::string path = "/tmp/test_storage.dat";
+    const std::string path_info = "/tmp/test_storage.dat.info";
+    unlink(path.c_str());
+    unlink(path_info.c_str());
+
+    const uint64_t header_size = HeaderSize;
+    const uint64_t record_size = 128;
+
+    {
+        Storage storage(path, record_size);
+        auto ret = storage.create(1000);
+        ASSERT_EQ(0, ret) << "Failed to create storage: " << ret.message();
+    }
+
+    {
+        Storage storage(path, record_size);
+        ASSERT_EQ(0, storage.init());
+
+        DataBuffer buf(record_size, header_size);
+        for (uint64_t i = 0; i < 2; i++) {
+            buf.set_header(i + 1);
+            memset(buf.record_ptr(), 'A' + i, record_size);
+            auto [record_id, ret] = storage.put_record(buf);
+            ASSERT_EQ(0, ret) << "Failed to put record: " << ret.message();
+            ASSERT_EQ(i, record_id);
+        }
+
+        const auto snapshot = storage.snapshot();
+        ASSERT_EQ(2, snapshot.upper_record_id);
+
+        //-------- DELETE, PUT ---------------
+        ASSERT_EQ(0, storage.delete_record(0));
+        buf.set_header(3);
+        memset(buf.record_ptr(), 'C', record_size);
+        auto [record_id, ret] = storage.put_record(buf);
+        ASSERT_EQ(0, ret) << "Failed to put record: " << ret.message();
+        ASSERT_EQ(2, record_id) << "Slot reused before release";
+
+        // The old snapshot still sees the deleted record and not the new one.
+        Record record;
+        ASSERT_EQ(ScanResult::Ok, storage.scan_record(snapshot, 0, record));
+        ASSERT_EQ(1, record.tag);
+        ASSERT_EQ('A', record.data[0]);
+        ASSERT_EQ(ScanResult::Finished, storage.scan_record(snapshot, 2, record));
+
+        const auto new_snapshot = storage.snapshot();
+        ASSERT_EQ(ScanResult::Deleted, storage.scan_record(new_snapshot, 0, record));
+        ASSERT_EQ(ScanResult::Ok, storage.scan_record(new_snapshot, 2, record));
+        ASSERT_EQ(3, record.tag);
+
+        //-------- RELEASE, PUT --------------
+        ASSERT_EQ(0, storage.release_deleted());
+        buf.set_header(4);
+        std::tie(record_id, ret) = storage.put_record(buf);
+        ASSERT_EQ(0, ret) << "Failed to put record: " << ret.message();
+        ASSERT_EQ(0, record_id);
+        ASSERT_EQ(3, storage.upper_record_id());
+        ASSERT_EQ(3, storage.records_count());
+
+        // The reused slot stays deleted in the snapshot taken before, the next one sees the new record.
+        ASSERT_EQ(ScanResult::Deleted, storage.scan_record(new_snapshot, 0, record));
+        ASSERT_EQ(ScanResult::Ok, storage.scan_record(storage.snapshot(), 0, record));
+        ASSERT_EQ(4, record.tag);
+
+        ASSERT_EQ(0, storage.uninit());
+    }
+
+    unlink(path.c_str());
+    unlink(path_info.c_str());
+}
@@ -1,7 +1,13 @@
 #include "thread_pool.h"
+#include "config.h"
+#include "engine.h"
 #include "log.h"
 #include "gtest/gtest.h"
 
+#include <filesystem>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 using namespace sketch;
@@ -46,3 +52,272 @@ TEST(THREAD_POOL, Basics) {
 
     ASSERT_EQ(check_count, total_count);
 }
+
+static uint64_t fork_join_sum(ThreadPool& pool, uint64_t begin, uint64_t end) {
+    if (end - begin <= 64) {
+        uint64_t sum = 0;
+        for (uint64_t i = begin; i < end; i++) {
+            sum += i;
+        }
+        return sum;
+    }
+
+    const uint64_t middle = begin + (end - begin) / 2;
+    uint64_t left = 0;
+    uint64_t right = 0;
+    TaskGroup group(pool);
+    group.run([&] { left = fork_join_sum(pool, begin, middle); });
+    group.run([&] { right = fork_join_sum(pool, middle, end); });
+    group.wait();
+    return left + right;
+}
+
+TEST(THREAD_POOL, NestedForkJoin) {
+    // Every level waits inside a worker, a pool of two workers only completes if waiting helps.
+    ThreadPool pool(2);
+    const uint64_t count = 100000;
+    ASSERT_EQ(fork_join_sum(pool, 0, count), count * (count - 1) / 2);
+
+    // Nested submit from a task lands in the worker's own deque
+    auto outer = pool.submit([&pool] {
+        auto inner = pool.submit([] { return 42; });
+        while (inner.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            pool.run_pending_task();
+        }
+        return inner.get() + 1;
+    });
+    ASSERT_EQ(outer.get(), 43);
+}
+
+TEST(THREAD_POOL, TaskGroupException) {
+    ThreadPool pool(4);
+    std::atomic<uint64_t> done_count = 0;
+
+    TaskGroup group(pool);
+    for (uint64_t i = 0; i < 100; i++) {
+        group.run([i, &done_count] {
+            if (i == 50) {
+                throw std::runtime_error("task 50");
+            }
+            done_count++;
+        });
+    }
+
+    ASSERT_THROW(group.wait(), std::runtime_error);
+    ASSERT_EQ(done_count.load(), 99);
+
+    // The group is reusable once the error is reported
+    group.run([&done_count] { done_count++; });
+    group.wait();
+    ASSERT_EQ(done_count.load(), 100);
+
+    auto future = pool.submit([]() -> int { throw std::logic_error("submit"); });
+    ASSERT_THROW(future.get(), std::logic_error);
+}
+
+TEST(THREAD_POOL, ConcurrentSubmitters) {
+    // More tasks than the injection queue holds, from several threads at once
+    ThreadPool pool(4);
+    const uint64_t threads_count = 8;
+    const uint64_t tasks_count = 5000;
+    std::atomic<uint64_t> sum = 0;
+
+    std::vector<std::thread> submitters;
+    for (uint64_t t = 0; t < threads_count; t++) {
+        submitters.emplace_back([&pool, &sum, t] {
+            TaskGroup group(pool);
+            for (uint64_t i = 0; i < tasks_count; i++) {
+                group.run([&sum, value = t * tasks_count + i] {
+                    sum.fetch_add(value, std::memory_order_relaxed);
+                });
+            }
+            group.wait();
+        });
+    }
+
+    for (auto& submitter : submitters) {
+        submitter.join();
+    }
+
+    const uint64_t total = threads_count * tasks_count;
+    ASSERT_EQ(sum.load(), total * (total - 1) / 2);
+}
+
+TEST(THREAD_POOL, Stealing) {
+    // One task forks the work into its own deque and blocks, the other workers must steal it.
+    ThreadPool pool(4);
+    const uint64_t tasks_count = 64;
+    std::vector<std::thread::id> ids(tasks_count);
+    std::atomic<uint64_t> done_count = 0;
+
+    auto future = pool.submit([&] {
+        for (uint64_t i = 0; i < tasks_count; i++) {
+            pool.submit([&, i] {
+                ids[i] = std::this_thread::get_id();
+                done_count++;
+            });
+        }
+
+        while (done_count.load() < tasks_count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return std::this_thread::get_id();
+    });
+
+    const auto owner_id = future.get();
+    for (const auto& id : ids) {
+        ASSERT_NE(id, owner_id);
+    }
+}
+
+TEST(THREAD_POOL, DrainOnDestroy) {
+    std::atomic<uint64_t> done_count = 0;
+    {
+        ThreadPool pool(2);
+        for (uint64_t i = 0; i < 1000; i++) {
+            pool.submit([&done_count] { done_count++; });
+        }
+    }
+    ASSERT_EQ(done_count.load(), 1000);
+}
+
+TEST(THREAD_POOL, Options) {
+    ThreadPoolOptions options;
+    options.name = "test";
+    options.cpus = { 0 };
+    ThreadPool pool(2, options);
+
+    auto future = pool.submit([] {
+        char name[16] = {};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        sched_getaffinity(0, sizeof(cpu_set), &cpu_set);
+        return std::make_pair(std::string(name), CPU_COUNT(&cpu_set) == 1 && CPU_ISSET(0, &cpu_set));
+    });
+    const auto [name, pinned] = future.get();
+    ASSERT_EQ(name.substr(0, 5), "test-");
+    ASSERT_TRUE(pinned);
+    ASSERT_EQ(pool.name(), "test");
+}
+
+TEST(THREAD_POOL, WorkerGroups) {
+    ThreadPoolOptions options;
+    options.name = "test";
+    options.groups = { WorkerGroup { .numa_node = 0, .cpus = {} }, WorkerGroup { .numa_node = 1, .cpus = {} } };
+    ThreadPool pool(4, options);
+    ASSERT_EQ(pool.groups_count(), 2);
+    ASSERT_EQ(pool.group_numa_node(1), 1);
+    ASSERT_EQ(pool.numa_node_group(1), 1);
+    ASSERT_EQ(pool.numa_node_group(2), ThreadPool::AnyGroup);
+    ASSERT_EQ(pool.numa_node_group(-1), ThreadPool::AnyGroup);
+
+    auto thread_name = [] {
+        char name[16] = {};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        return std::string(name);
+    };
+
+    // Workers 0 and 1 form group 0, workers 2 and 3 group 1. Neither the waiting thread outside the pool
+    // nor a worker of group 0 forking tasks on group 1 may run them.
+    std::atomic<uint64_t> misplaced{0};
+    std::atomic<uint64_t> done{0};
+    auto fork_on_group_1 = [&] {
+        TaskGroup group(pool);
+        for (size_t i = 0; i < 200; i++) {
+            group.run([&] {
+                const auto name = thread_name();
+                if (name != "test-2" && name != "test-3") {
+                    misplaced++;
+                }
+                done++;
+            }, 1);
+        }
+        group.wait();
+    };
+
+    fork_on_group_1();
+    pool.submit_to(0, fork_on_group_1).get();
+    ASSERT_EQ(done, 400);
+    ASSERT_EQ(misplaced, 0);
+
+    const auto name = pool.submit_to(0, thread_name).get();
+    ASSERT_TRUE(name == "test-0" || name == "test-1") << name;
+
+    std::vector<std::future<size_t>> futures;
+    for (size_t i = 0; i < 100; i++) {
+        futures.push_back(pool.submit([i] {
+            return i;
+        }));
+    }
+    for (size_t i = 0; i < futures.size(); i++) {
+        ASSERT_EQ(futures[i].get(), i);
+    }
+}
+
+TEST(THREAD_POOL, YieldToQueryPool) {
+    ThreadPool query_pool(1);
+    ThreadPoolOptions options;
+    options.yield_to = &query_pool;
+    ThreadPool build_pool(2, options);
+
+    // Saturate the query pool, the build pool must not start new tasks meanwhile
+    std::atomic<bool> release = false;
+    auto query = query_pool.submit([&release] {
+        while (!release.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    while (!query_pool.saturated()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::atomic<bool> build_started = false;
+    auto build = build_pool.submit([&build_started] {
+        build_started = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_FALSE(build_started.load());
+
+    release = true;
+    query.get();
+    build.get();
+    ASSERT_TRUE(build_started.load());
+}
+
+TEST(THREAD_POOL, NamedPools) {
+    const std::string data_path = "/tmp/sketch_test_pools";
+    const std::string config_path = data_path + ".ini";
+    std::filesystem::remove_all(data_path);
+    mkdir(data_path.c_str(), 0755);
+    {
+        std::ofstream config(config_path);
+        config << "[data]\npath=" << data_path << "\n"
+               << "[threading]\nthread_pool_size=3\nquery_pool_size=2\nbuild_pool_cpus=0-1, 3\nload_pool_nice=5\nnuma=on\n";
+    }
+
+    Config cfg;
+    ASSERT_EQ(parse_config(config_path, cfg), 0);
+    ASSERT_EQ(cfg.thread_pool_size, 3);
+    ASSERT_EQ(cfg.query_pool.size, 2);
+    ASSERT_EQ(cfg.build_pool.cpus, std::vector<int>({ 0, 1, 3 }));
+    ASSERT_EQ(cfg.load_pool.nice, 5);
+    ASSERT_TRUE(cfg.numa);
+
+    std::vector<int> cpus;
+    ASSERT_NE(parse_cpu_list("3-1", cpus), 0);
+    ASSERT_NE(parse_cpu_list("x", cpus), 0);
+
+    // The config starts the pools, a pool without a size of its own gets thread_pool_size threads
+    Engine engine(cfg);
+    auto ret = engine.init();
+    ASSERT_EQ(ret, 0) << ret.message();
+    ASSERT_EQ(engine.thread_pool(PoolKind::query)->size(), 2);
+    ASSERT_EQ(engine.thread_pool(PoolKind::build)->size(), 3);
+    ASSERT_EQ(engine.thread_pool(PoolKind::load)->size(), 3);
+    ASSERT_EQ(engine.thread_pool(PoolKind::load)->name(), "load");
+    ASSERT_NE(engine.thread_pool(PoolKind::query), engine.thread_pool(PoolKind::build));
+
+    std::filesystem::remove(config_path);
+    std::filesystem::remove_all(data_path);
+}
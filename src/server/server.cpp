@@ -1,6 +1,8 @@
 #include "cmd_line_args.h"
+#include "db/config.h"
 #include "db/core.h"
 #include "db/log.h"
+#include "db/query_context.h"
 #include "db/shared_types.h"
 #include "db/string_utils.h"
 
@@ -10,8 +12,11 @@
 #include <cstring>
 #include <csignal>
 #include <atomic>
+#include <chrono>
+#include <mutex>
 #include <sstream>
 
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -42,10 +47,59 @@ void signal_handler(int signal) {
     }
 }
 
-std::string process_command(CommandRouter& router, const std::string& cmd) {
+// Cancels the request in flight when the client hangs up, its node scans stop at their next block.
+// A client that only shuts down its writing side still waits for the response, it is not a hang up.
+class DisconnectWatcher {
+public:
+    explicit DisconnectWatcher(int client_fd) : client_fd_(client_fd), thread_([this] { run(); }) {}
+
+    ~DisconnectWatcher() {
+        stop_ = true;
+        thread_.join();
+    }
+
+    void watch(QueryContext* context) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        context_ = context;
+        if (context_ && disconnected_) {
+            context_->cancel();
+        }
+    }
+
+private:
+    static constexpr int PollTimeoutMs = 100;
+
+    void run() {
+        while (!stop_) {
+            // POLLHUP and POLLERR are reported without being asked for
+            struct pollfd fd = { .fd = client_fd_, .events = 0, .revents = 0 };
+            if (poll(&fd, 1, PollTimeoutMs) > 0 && (fd.revents & (POLLHUP | POLLERR))) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                disconnected_ = true;
+                if (context_) {
+                    context_->cancel();
+                }
+                return;
+            }
+        }
+    }
+
+    const int client_fd_;
+    std::mutex mutex_;
+    QueryContext* context_ = nullptr;
+    bool disconnected_ = false;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+std::string process_command(CommandRouter& router, const std::string& cmd, DisconnectWatcher& watcher) {
     Commands commands;
     parse_command(cmd, commands);
-    Ret ret = router.process_command(commands);
+
+    QueryContext context(std::chrono::milliseconds(get_global_config().query_timeout_ms));
+    watcher.watch(&context);
+    Ret ret = router.process_command(commands, &context);
+    watcher.watch(nullptr);
 
     std::stringstream sstream;
     sstream << "0\n"; // Marker for no more data
@@ -65,13 +119,14 @@ std::string process_command(CommandRouter& router, const std::string& cmd) {
     return sstream.str();
 }
 
-void handle_client(int client_fd) {
+void serve_client(int client_fd) {
     auto router = get_command_router();
 
     const int BUFFER_SIZE = 1024;
     char buffer[BUFFER_SIZE];
 
     std::string message;
+    DisconnectWatcher watcher(client_fd);
 
     while (keep_running) {
         memset(buffer, 0, BUFFER_SIZE);
@@ -90,16 +145,21 @@ void handle_client(int client_fd) {
             std::string line = message.substr(0, pos + 1);
             message.erase(0, pos + 1);
 
-            std::string response = process_command(router, line);
+            std::string response = process_command(router, line, watcher);
 
-            ssize_t bytes_sent = send(client_fd, response.c_str(), response.length(), 0);
+            // A client gone while its request ran fails the send, it is served no further
+            ssize_t bytes_sent = send(client_fd, response.c_str(), response.length(), MSG_NOSIGNAL);
             if (bytes_sent <= 0) {
                 report_error("send");
-                break;
+                return;
             }
         }
     }
+}
 
+void handle_client(int client_fd) {
+    // The disconnect watcher stops polling the socket before it is closed
+    serve_client(client_fd);
     close(client_fd);
 }
 